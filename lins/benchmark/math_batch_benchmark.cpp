@@ -0,0 +1,127 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// Cost per element of the batched SO(3) operations of math_utils.h against
+// loops over the scalar functions, for batches of small and of large angles.
+
+#include <math_utils.h>
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+using namespace math_utils;
+
+namespace {
+
+const int kSize = 2000;
+const int kRepeats = 2000;
+
+double sink = 0.0;
+
+template <typename Run>
+double nanosecondsPerElement(Run run) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRepeats; ++i) run();
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / (double(kRepeats) * kSize);
+}
+
+void report(const char* name, double scalar, double batch) {
+  std::printf("%-22s scalar %6.1f ns  batch %6.1f ns  (x%.1f)\n", name,
+              scalar, batch, scalar / batch);
+}
+
+void run(const char* label, double maxAngle) {
+  Vectors3d phi(kSize, 3), points(kSize, 3);
+  Eigen::ArrayXd s(kSize);
+  for (int i = 0; i < kSize; ++i) {
+    Eigen::Vector3d axis(std::sin(i), std::cos(3.0 * i), 0.5);
+    phi.row(i) = maxAngle * (i % 97) / 96.0 * axis.normalized().transpose();
+    points.row(i) << 10.0 * std::sin(0.1 * i), 0.01 * i, std::cos(i);
+    s(i) = double(i) / kSize;
+  }
+  Quaternions q;
+  Vectors3d log, out;
+  Matrices3d J;
+  // The scalar loops store every result too, or the compiler drops the work
+  // of the entries nobody reads
+  std::vector<Eigen::Quaterniond, Eigen::aligned_allocator<Eigen::Quaterniond>>
+      qScalar(kSize);
+  std::vector<Eigen::Vector3d> logScalar(kSize), outScalar(kSize);
+  std::vector<Eigen::Matrix3d> JScalar(kSize);
+  expBatch(phi, q);
+  std::printf("%s (angles up to %g rad, %d elements)\n", label, maxAngle,
+              kSize);
+
+  report("exp / axis2Quat", nanosecondsPerElement([&]() {
+           for (int i = 0; i < kSize; ++i)
+             qScalar[i] = axis2Quat(Eigen::Vector3d(phi.row(i)));
+           sink += qScalar[0].w();
+         }),
+         nanosecondsPerElement([&]() {
+           expBatch(phi, q);
+           sink += q(0, 3);
+         }));
+  report("log / Quat2axis", nanosecondsPerElement([&]() {
+           for (int i = 0; i < kSize; ++i) {
+             Eigen::Quaterniond qi(q(i, 3), q(i, 0), q(i, 1), q(i, 2));
+             logScalar[i] = Quat2axis(qi);
+           }
+           sink += logScalar[0].x();
+         }),
+         nanosecondsPerElement([&]() {
+           logBatch(q, log);
+           sink += log(0, 0);
+         }));
+  report("Jl^-1 / Rinvleft", nanosecondsPerElement([&]() {
+           for (int i = 0; i < kSize; ++i)
+             JScalar[i] = Rinvleft(Eigen::Vector3d(phi.row(i)));
+           sink += JScalar[0](0, 1);
+         }),
+         nanosecondsPerElement([&]() {
+           leftJacobianInverseBatch(phi, J);
+           sink += J(0, 3);
+         }));
+
+  // One scan motion, as StateEstimator::transformToStart undistorts it
+  const Eigen::Vector3d motion = phi.row(kSize / 2).transpose();
+  const Eigen::Vector3d t(0.4, -0.2, 0.05);
+  report("transformToStart", nanosecondsPerElement([&]() {
+           const Eigen::Vector3d axis = Quat2axis(axis2Quat(motion));
+           for (int i = 0; i < kSize; ++i) {
+             Eigen::Quaterniond r = axis2Quat(s(i) * axis);
+             outScalar[i] = r * Eigen::Vector3d(points.row(i)) + s(i) * t;
+           }
+           sink += outScalar[0].x();
+         }),
+         nanosecondsPerElement([&]() {
+           interpolateTransformBatch(Quat2axis(axis2Quat(motion)), t, s,
+                                     points, out);
+           sink += out(0, 0);
+         }));
+}
+
+}  // namespace
+
+int main() {
+  run("Small angles", 0.5 * SMALL_ANGLE);
+  run("Large angles", 3.0);
+  std::printf("(checksum %g)\n", sink);
+  return 0;
+}
@@ -0,0 +1,81 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// Cost of updating metrics on a hot path through references resolved once,
+// on one thread and with several threads sharing the same metrics.
+
+#include <metrics.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const int kUpdates = 10000000;
+
+template <typename Update>
+double nanosecondsPerUpdate(Update update) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kUpdates; ++i) update(i);
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / kUpdates;
+}
+
+}  // namespace
+
+int main() {
+  metrics::Registry& registry = metrics::Registry::instance();
+  metrics::Counter& counter =
+      registry.counter("benchmark_counter_total", "Benchmark counter");
+  metrics::Gauge& gauge = registry.gauge("benchmark_gauge", "Benchmark gauge");
+  metrics::Histogram& histogram =
+      registry.histogram("benchmark_histogram_ms", "Benchmark histogram");
+
+  std::printf("counter:   %6.1f ns\n",
+              nanosecondsPerUpdate([&](int) { counter.inc(); }));
+  std::printf("gauge:     %6.1f ns\n",
+              nanosecondsPerUpdate([&](int i) { gauge.set(i); }));
+  std::printf("histogram: %6.1f ns\n", nanosecondsPerUpdate([&](int i) {
+                histogram.observe((i & 1023) * 0.5);
+              }));
+  std::printf("lookup:    %6.1f ns (registration call per update)\n",
+              nanosecondsPerUpdate([&](int) {
+                registry.counter("benchmark_counter_total",
+                                 "Benchmark counter").inc();
+              }));
+
+  unsigned numThreads = std::max(2u, std::thread::hardware_concurrency());
+  std::vector<double> perThread(numThreads);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < numThreads; ++t)
+    threads.emplace_back([&, t] {
+      perThread[t] = nanosecondsPerUpdate([&](int i) {
+        counter.inc();
+        histogram.observe((i & 1023) * 0.5);
+      });
+    });
+  for (std::thread& thread : threads) thread.join();
+  double mean = 0;
+  for (double ns : perThread) mean += ns / numThreads;
+  std::printf("counter + histogram on %u threads: %6.1f ns\n", numThreads,
+              mean);
+  return 0;
+}
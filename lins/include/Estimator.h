@@ -19,6 +19,7 @@
 #define INCLUDE_ESTIMATOR_H_
 
 #include <MapRingBuffer.h>
+#include <imu_aggregation.h>
 #include <math_utils.h>
 #include <nav_msgs/Odometry.h>
 #include <parameters.h>
@@ -33,6 +34,8 @@
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl_ros/point_cloud.h>
 #include <ros/ros.h>
+#include <scan_log.h>
+#include <scan_trace.h>
 #include <sensor_msgs/Imu.h>
 #include <sensor_msgs/NavSatFix.h>
 #include <sensor_msgs/PointCloud2.h>
@@ -85,7 +88,7 @@ class LinsFusion {
   void performStateEstimation();
   void processFirstPointCloud();
   bool processPointClouds();
-  void performImuBiasEstimation();
+  void performImuBiasEstimation(const Imu& imu);
   void alignIMUtoVehicle(const V3D& rpy, const V3D& acc_in, const V3D& gyr_in,
                          V3D& acc_out, V3D& gyr_out);
 
@@ -133,15 +136,22 @@ class LinsFusion {
   nav_msgs::Odometry gpsOdometry;
 
   // !@Buffers
-  MapRingBuffer<Imu> imuBuf_;
+  MapRingBuffer<Imu> imuBuf_;  // raw samples or aggregated mean rates
+  imu_aggregation::Aggregator imuAggregator_;
   MapRingBuffer<sensor_msgs::PointCloud2::ConstPtr> pclBuf_;
   MapRingBuffer<sensor_msgs::PointCloud2::ConstPtr> outlierBuf_;
   MapRingBuffer<cloud_msgs::cloud_info> cloudInfoBuf_;
   MapRingBuffer<Gps> gpsBuf_;
 
+  // !@Scans sent to lidar_mapping_node, kept for replay
+  scan_log::Writer scanLog_;
+
   // !@Time
   int scan_counter_;
   double duration_;
+  double duration_imu_;
+  double first_imu_time_;
+  bool hasFirstValidPose_;
 
   // !@Measurements
   V3D acc_raw_;
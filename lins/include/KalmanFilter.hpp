@@ -28,26 +28,79 @@ using namespace std;
 using namespace math_utils;
 using namespace parameter;
 
+// Size of the error state of the filter, chosen at build time by the CMake
+// variable LINS_ERROR_STATE_DIM: 18, or 15 and 12 for reduced filters
+#ifndef LINS_ERROR_STATE_DIM
+#define LINS_ERROR_STATE_DIM 18
+#endif
+
 namespace filter {
 
-// GlobalState Class contains state variables including position, velocity,
-// attitude, acceleration bias, gyroscope bias, and gravity
-class GlobalState {
+// !@Error-state layouts
+// Offsets of the 3-vector blocks of an error state. Position, velocity,
+// attitude and gyroscope bias are always estimated. The accelerometer bias and
+// gravity may be left out, offset -1, and then keep the value they were
+// initialized with.
+struct StateLayout18 {
+  static constexpr int DIM = 18;
+  static constexpr int pos_ = 0;
+  static constexpr int vel_ = 3;
+  static constexpr int att_ = 6;
+  static constexpr int acc_ = 9;
+  static constexpr int gyr_ = 12;
+  static constexpr int gra_ = 15;
+};
+
+// Gravity known in the world frame
+struct StateLayout15 {
+  static constexpr int DIM = 15;
+  static constexpr int pos_ = 0;
+  static constexpr int vel_ = 3;
+  static constexpr int att_ = 6;
+  static constexpr int acc_ = 9;
+  static constexpr int gyr_ = 12;
+  static constexpr int gra_ = -1;
+};
+
+// Gravity and accelerometer bias known
+struct StateLayout12 {
+  static constexpr int DIM = 12;
+  static constexpr int pos_ = 0;
+  static constexpr int vel_ = 3;
+  static constexpr int att_ = 6;
+  static constexpr int acc_ = -1;
+  static constexpr int gyr_ = 9;
+  static constexpr int gra_ = -1;
+};
+
+// GlobalStateT Class contains state variables including position, velocity,
+// attitude, acceleration bias, gyroscope bias, and gravity, of which Layout
+// selects the estimated ones
+template <typename Layout>
+class GlobalStateT {
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-  static constexpr unsigned int DIM_OF_STATE_ = 18;
-  static constexpr unsigned int DIM_OF_NOISE_ = 12;
-  static constexpr unsigned int pos_ = 0;
-  static constexpr unsigned int vel_ = 3;
-  static constexpr unsigned int att_ = 6;
-  static constexpr unsigned int acc_ = 9;
-  static constexpr unsigned int gyr_ = 12;
-  static constexpr unsigned int gra_ = 15;
-
-  GlobalState() { setIdentity(); }
-
-  GlobalState(const V3D& rn, const V3D& vn, const Q4D& qbn, const V3D& ba,
-              const V3D& bw) {
+  static constexpr int DIM_OF_STATE_ = Layout::DIM;
+  static constexpr int DIM_OF_NOISE_ = 12;
+  static constexpr int pos_ = Layout::pos_;
+  static constexpr int vel_ = Layout::vel_;
+  static constexpr int att_ = Layout::att_;
+  static constexpr int acc_ = Layout::acc_;
+  static constexpr int gyr_ = Layout::gyr_;
+  static constexpr int gra_ = Layout::gra_;
+  static constexpr bool ESTIMATES_ACC_BIAS = acc_ >= 0;
+  static constexpr bool ESTIMATES_GRAVITY = gra_ >= 0;
+  // The IMU propagation relies on these rows leading the state
+  static_assert(pos_ == 0 && vel_ == 3 && att_ == 6,
+                "position, velocity and attitude come first");
+
+  typedef Eigen::Matrix<double, DIM_OF_STATE_, 1> Vector;
+  typedef Eigen::Matrix<double, DIM_OF_STATE_, DIM_OF_STATE_> Matrix;
+
+  GlobalStateT() { setIdentity(); }
+
+  GlobalStateT(const V3D& rn, const V3D& vn, const Q4D& qbn, const V3D& ba,
+               const V3D& bw) {
     setIdentity();
     rn_ = rn;
     vn_ = vn;
@@ -56,7 +109,7 @@ class GlobalState {
     bw_ = bw;
   }
 
-  ~GlobalState() {}
+  ~GlobalStateT() {}
 
   void setIdentity() {
     rn_.setZero();
@@ -68,32 +121,36 @@ class GlobalState {
   }
 
   // boxPlus operator
-  void boxPlus(const Eigen::Matrix<double, DIM_OF_STATE_, 1>& xk,
-               GlobalState& stateOut) {
+  void boxPlus(const Vector& xk, GlobalStateT& stateOut) {
     stateOut.rn_ = rn_ + xk.template segment<3>(pos_);
     stateOut.vn_ = vn_ + xk.template segment<3>(vel_);
-    stateOut.ba_ = ba_ + xk.template segment<3>(acc_);
+    if (ESTIMATES_ACC_BIAS)
+      stateOut.ba_ = ba_ + xk.template segment<3>(acc_);
+    else
+      stateOut.ba_ = ba_;
     stateOut.bw_ = bw_ + xk.template segment<3>(gyr_);
     Q4D dq = axis2Quat(xk.template segment<3>(att_));
     stateOut.qbn_ = (qbn_ * dq).normalized();
 
-    stateOut.gn_ = gn_ + xk.template segment<3>(gra_);
+    if (ESTIMATES_GRAVITY)
+      stateOut.gn_ = gn_ + xk.template segment<3>(gra_);
+    else
+      stateOut.gn_ = gn_;
   }
 
   // boxMinus operator
-  void boxMinus(const GlobalState& stateIn,
-                Eigen::Matrix<double, DIM_OF_STATE_, 1>& xk) {
+  void boxMinus(const GlobalStateT& stateIn, Vector& xk) {
     xk.template segment<3>(pos_) = rn_ - stateIn.rn_;
     xk.template segment<3>(vel_) = vn_ - stateIn.vn_;
-    xk.template segment<3>(acc_) = ba_ - stateIn.ba_;
+    if (ESTIMATES_ACC_BIAS) xk.template segment<3>(acc_) = ba_ - stateIn.ba_;
     xk.template segment<3>(gyr_) = bw_ - stateIn.bw_;
     V3D da = Quat2axis(stateIn.qbn_.inverse() * qbn_);
     xk.template segment<3>(att_) = da;
 
-    xk.template segment<3>(gra_) = gn_ - stateIn.gn_;
+    if (ESTIMATES_GRAVITY) xk.template segment<3>(gra_) = gn_ - stateIn.gn_;
   }
 
-  GlobalState& operator=(const GlobalState& other) {
+  GlobalStateT& operator=(const GlobalStateT& other) {
     if (this == &other) return *this;
 
     this->rn_ = other.rn_;
@@ -115,12 +172,19 @@ class GlobalState {
   V3D gn_;   // gravity
 };
 
-class StatePredictor {
+template <typename Layout>
+class StatePredictorT {
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-  StatePredictor() { reset(); }
+  typedef GlobalStateT<Layout> GlobalState;
+  typedef typename GlobalState::Matrix StateMatrix;
+  typedef Eigen::Matrix<double, GlobalState::DIM_OF_STATE_,
+                        GlobalState::DIM_OF_NOISE_>
+      NoiseJacobian;
+
+  StatePredictorT() { reset(); }
 
-  ~StatePredictor() {}
+  ~StatePredictorT() {}
 
   bool predict(double dt, const V3D& acc, const V3D& gyr,
                bool update_jacobian_ = true) {
@@ -145,44 +209,130 @@ class StatePredictor {
     state_tmp.rn_ = state_tmp.rn_ + dt * state_tmp.vn_ + 0.5 * dt * dt * un_acc;
     state_tmp.vn_ = state_tmp.vn_ + dt * un_acc;
 
-    if (update_jacobian_) {
-      MXD Ft =
-          MXD::Zero(GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_STATE_);
-      Ft.block<3, 3>(GlobalState::pos_, GlobalState::vel_) = M3D::Identity();
-
-      Ft.block<3, 3>(GlobalState::vel_, GlobalState::att_) =
-          -state_tmp.qbn_.toRotationMatrix() * skew(acc - state_tmp.ba_);
-      Ft.block<3, 3>(GlobalState::vel_, GlobalState::acc_) =
-          -state_tmp.qbn_.toRotationMatrix();
-      Ft.block<3, 3>(GlobalState::vel_, GlobalState::gra_) = M3D::Identity();
-
-      Ft.block<3, 3>(GlobalState::att_, GlobalState::att_) =
-          - skew(gyr - state_tmp.bw_);
-      Ft.block<3, 3>(GlobalState::att_, GlobalState::gyr_) = -M3D::Identity();
-
-      MXD Gt =
-          MXD::Zero(GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_NOISE_);
-      Gt.block<3, 3>(GlobalState::vel_, 0) = -state_tmp.qbn_.toRotationMatrix();
-      Gt.block<3, 3>(GlobalState::att_, 3) = -M3D::Identity();
-      Gt.block<3, 3>(GlobalState::acc_, 6) = M3D::Identity();
-      Gt.block<3, 3>(GlobalState::gyr_, 9) = M3D::Identity();
-      Gt = Gt * dt;
-
-      const MXD I =
-          MXD::Identity(GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_STATE_);
-      F_ = I + Ft * dt + 0.5 * Ft * Ft * dt * dt;
+    if (update_jacobian_)
+      propagateError(dt, state_tmp.qbn_.toRotationMatrix(), acc, gyr);
+
+    state_ = state_tmp;
+    time_ += dt;
+    acc_last = acc;
+    gyr_last = gyr;
+    return true;
+  }
+
+  // Propagate the state over an interval dt by the rotation, velocity and
+  // position increments of an imu_aggregation::Aggregator, in the body frame
+  // at its start. The biases are removed at first order and the covariance is
+  // propagated with the mean rates of the interval at the mid-interval
+  // attitude.
+  bool predictIncrement(double dt, const V3D& dTheta, const V3D& dVel,
+                        const V3D& dPos) {
+    if (!isInitialized()) return false;
+
+    const V3D meanAcc = dVel / dt;
+    const V3D meanGyr = dTheta / dt;
+    const M3D R0 = state_.qbn_.toRotationMatrix();
+    const V3D dTheta_c = dTheta - state_.bw_ * dt;
+    propagateError(dt, R0 * axis2Quat(0.5 * dTheta_c).toRotationMatrix(),
+                   meanAcc, meanGyr);
+
+    state_.rn_ += dt * state_.vn_ +
+                  R0 * (dPos - 0.5 * dt * dt * state_.ba_) +
+                  0.5 * dt * dt * state_.gn_;
+    state_.vn_ += R0 * (dVel - dt * state_.ba_) + dt * state_.gn_;
+    state_.qbn_ = (state_.qbn_ * axis2Quat(dTheta_c)).normalized();
+    time_ += dt;
+    acc_last = meanAcc;
+    gyr_last = meanGyr;
+    flag_init_imu_ = true;
+    return true;
+  }
+
+  // Propagate the covariance over dt with the attitude Rbn and the
+  // measurements acc and gyr
+  void propagateError(double dt, const M3D& Rbn, const V3D& acc,
+                      const V3D& gyr) {
+    StateMatrix Ft = StateMatrix::Zero();
+    Ft.template block<3, 3>(GlobalState::pos_, GlobalState::vel_) =
+        M3D::Identity();
+
+    Ft.template block<3, 3>(GlobalState::vel_, GlobalState::att_) =
+        -Rbn * skew(acc - state_.ba_);
+    if (GlobalState::ESTIMATES_ACC_BIAS)
+      Ft.template block<3, 3>(GlobalState::vel_, GlobalState::acc_) = -Rbn;
+    if (GlobalState::ESTIMATES_GRAVITY)
+      Ft.template block<3, 3>(GlobalState::vel_, GlobalState::gra_) =
+          M3D::Identity();
+
+    Ft.template block<3, 3>(GlobalState::att_, GlobalState::att_) =
+        - skew(gyr - state_.bw_);
+    Ft.template block<3, 3>(GlobalState::att_, GlobalState::gyr_) =
+        -M3D::Identity();
+
+    NoiseJacobian Gt = NoiseJacobian::Zero();
+    Gt.template block<3, 3>(GlobalState::vel_, 0) = -Rbn;
+    Gt.template block<3, 3>(GlobalState::att_, 3) = -M3D::Identity();
+    if (GlobalState::ESTIMATES_ACC_BIAS)
+      Gt.template block<3, 3>(GlobalState::acc_, 6) = M3D::Identity();
+    Gt.template block<3, 3>(GlobalState::gyr_, 9) = M3D::Identity();
+    Gt = Gt * dt;
+
+    if (BATCH_IMU_PROPAGATION) {
+      // Only the pos, vel and att rows of Ft are non-zero, so the transition
+      // increment F - I and its product with Phi_ reduce to 9-row updates
+      Eigen::Matrix<double, 9, GlobalState::DIM_OF_STATE_> dF =
+          Ft.template topRows<9>() * dt +
+          0.5 * Ft.template topRows<9>() * Ft * dt * dt;
+      Phi_.template topRows<9>() += dF * Phi_;
+      // noise_ is block diagonal, so G * Q * G^T only fills the diagonal
+      // blocks of vel, att, ba and bw
+      const M3D Gv = Gt.template block<3, 3>(GlobalState::vel_, 0);
+      noiseSum_.template block<3, 3>(GlobalState::vel_, GlobalState::vel_) +=
+          Gv * noise_.template block<3, 3>(0, 0) * Gv.transpose();
+      noiseSum_.template block<3, 3>(GlobalState::att_, GlobalState::att_) +=
+          noise_.template block<3, 3>(3, 3) * dt * dt;
+      if (GlobalState::ESTIMATES_ACC_BIAS)
+        noiseSum_.template block<3, 3>(GlobalState::acc_,
+                                       GlobalState::acc_) +=
+            noise_.template block<3, 3>(6, 6) * dt * dt;
+      noiseSum_.template block<3, 3>(GlobalState::gyr_, GlobalState::gyr_) +=
+          noise_.template block<3, 3>(9, 9) * dt * dt;
+      sumDt_ += dt;
+      hasPendingCov_ = true;
+    } else {
+      F_ = StateMatrix::Identity() + Ft * dt + 0.5 * Ft * Ft * dt * dt;
 
       // jacobian_ = F * jacobian_;
       covariance_ =
           F_ * covariance_ * F_.transpose() + Gt * noise_ * Gt.transpose();
       covariance_ = 0.5 * (covariance_ + covariance_.transpose()).eval();
     }
+  }
 
-    state_ = state_tmp;
-    time_ += dt;
-    acc_last = acc;
-    gyr_last = gyr;
-    return true;
+  // Apply the transition product and the process noise accumulated since the
+  // last call to the covariance matrix. The noise injected along the interval
+  // is propagated by a trapezoidal rule between the first (Phi_) and the last
+  // (identity) sample, which agrees with per-sample propagation up to terms
+  // of second order in the accumulated interval sumDt_.
+  void propagateCovariance() {
+    if (!hasPendingCov_) return;
+
+    covariance_ = Phi_ * covariance_ * Phi_.transpose() +
+                  0.5 * (Phi_ * noiseSum_ * Phi_.transpose() + noiseSum_);
+    covariance_ = 0.5 * (covariance_ + covariance_.transpose()).eval();
+    resetPropagation();
+  }
+
+  void resetPropagation() {
+    Phi_.setIdentity();
+    noiseSum_.setZero();
+    sumDt_ = 0.0;
+    hasPendingCov_ = false;
+  }
+
+  // Covariance matrix including all IMU samples propagated so far
+  const StateMatrix& getCovariance() {
+    propagateCovariance();
+    return covariance_;
   }
 
   static void calculateRPfromIMU(const V3D& acc, double& roll, double& pitch) {
@@ -192,11 +342,10 @@ class StatePredictor {
 
   void set(const GlobalState& state) { state_ = state; }
 
-  void update(const GlobalState& state,
-              const Eigen::Matrix<double, GlobalState::DIM_OF_STATE_,
-                                  GlobalState::DIM_OF_STATE_>& covariance) {
+  void update(const GlobalState& state, const StateMatrix& covariance) {
     state_ = state;
     covariance_ = covariance;
+    resetPropagation();
   }
 
   void initialization(double time, const V3D& rn, const V3D& vn, const Q4D& qbn,
@@ -269,46 +418,43 @@ class StatePredictor {
     if (type == 0) {
       // Initialize using offline parameters
       covariance_.setZero();
-      covariance_.block<3, 3>(GlobalState::pos_, GlobalState::pos_) =
+      covariance_.template block<3, 3>(GlobalState::pos_, GlobalState::pos_) =
           covPos.asDiagonal();  // pos
-      covariance_.block<3, 3>(GlobalState::vel_, GlobalState::vel_) =
+      covariance_.template block<3, 3>(GlobalState::vel_, GlobalState::vel_) =
           covVel.asDiagonal();  // vel
-      covariance_.block<3, 3>(GlobalState::att_, GlobalState::att_) =
+      covariance_.template block<3, 3>(GlobalState::att_, GlobalState::att_) =
           V3D(covRoll, covPitch, covYaw).asDiagonal();  // att
-      covariance_.block<3, 3>(GlobalState::acc_, GlobalState::acc_) =
-          covAcc.asDiagonal();  // ba
-      covariance_.block<3, 3>(GlobalState::gyr_, GlobalState::gyr_) =
+      if (GlobalState::ESTIMATES_ACC_BIAS)
+        covariance_.template block<3, 3>(GlobalState::acc_,
+                                         GlobalState::acc_) =
+            covAcc.asDiagonal();  // ba
+      covariance_.template block<3, 3>(GlobalState::gyr_, GlobalState::gyr_) =
           covGyr.asDiagonal();  // bg
-      covariance_.block<3, 3>(GlobalState::gra_, GlobalState::gra_) =
-          gra_cov.asDiagonal();  // gravity
+      if (GlobalState::ESTIMATES_GRAVITY)
+        covariance_.template block<3, 3>(GlobalState::gra_,
+                                         GlobalState::gra_) =
+            gra_cov.asDiagonal();  // gravity
     } else if (type == 1) {
       // Inheritage previous covariance
-      M3D vel_cov =
-          covariance_.block<3, 3>(GlobalState::vel_, GlobalState::vel_);
-      M3D acc_cov =
-          covariance_.block<3, 3>(GlobalState::acc_, GlobalState::acc_);
-      M3D gyr_cov =
-          covariance_.block<3, 3>(GlobalState::gyr_, GlobalState::gyr_);
-      M3D gra_cov =
-          covariance_.block<3, 3>(GlobalState::gra_, GlobalState::gra_);
-
+      StateMatrix previous = covariance_;
       covariance_.setZero();
-      covariance_.block<3, 3>(GlobalState::pos_, GlobalState::pos_) =
+      covariance_.template block<3, 3>(GlobalState::pos_, GlobalState::pos_) =
           covPos.asDiagonal();  // pos
-      covariance_.block<3, 3>(GlobalState::vel_, GlobalState::vel_) =
-          vel_cov;  // vel
-      covariance_.block<3, 3>(GlobalState::att_, GlobalState::att_) =
+      covariance_.template block<3, 3>(GlobalState::vel_, GlobalState::vel_) =
+          previous.template block<3, 3>(GlobalState::vel_,
+                                        GlobalState::vel_);  // vel
+      covariance_.template block<3, 3>(GlobalState::att_, GlobalState::att_) =
           V3D(covRoll, covPitch, covYaw).asDiagonal();  // att
-      covariance_.block<3, 3>(GlobalState::acc_, GlobalState::acc_) = acc_cov;
-      covariance_.block<3, 3>(GlobalState::gyr_, GlobalState::gyr_) = gyr_cov;
-      covariance_.block<3, 3>(GlobalState::gra_, GlobalState::gra_) = gra_cov;
+      copyBiasAndGravityCovariance(previous, M3D::Identity());
     }
 
     noise_.setZero();
-    noise_.block<3, 3>(0, 0) = V3D(peba, peba, peba).asDiagonal();
-    noise_.block<3, 3>(3, 3) = V3D(pebg, pebg, pebg).asDiagonal();
-    noise_.block<3, 3>(6, 6) = V3D(pweba, pweba, pweba).asDiagonal();
-    noise_.block<3, 3>(9, 9) = V3D(pwebg, pwebg, pwebg).asDiagonal();
+    noise_.template block<3, 3>(0, 0) = V3D(peba, peba, peba).asDiagonal();
+    noise_.template block<3, 3>(3, 3) = V3D(pebg, pebg, pebg).asDiagonal();
+    noise_.template block<3, 3>(6, 6) = V3D(pweba, pweba, pweba).asDiagonal();
+    noise_.template block<3, 3>(9, 9) = V3D(pwebg, pwebg, pwebg).asDiagonal();
+
+    resetPropagation();
   }
 
   void reset(int type = 0) {
@@ -318,31 +464,25 @@ class StatePredictor {
       state_.qbn_.setIdentity();
       initializeCovariance();
     } else if (type == 1) {
+      propagateCovariance();
+
       V3D covPos = INIT_POS_STD.array().square();
       double covRoll = pow(deg2rad(INIT_ATT_STD(0)), 2);
       double covPitch = pow(deg2rad(INIT_ATT_STD(1)), 2);
       double covYaw = pow(deg2rad(INIT_ATT_STD(2)), 2);
 
+      StateMatrix previous = covariance_;
       M3D vel_cov =
-          covariance_.block<3, 3>(GlobalState::vel_, GlobalState::vel_);
-      M3D acc_cov =
-          covariance_.block<3, 3>(GlobalState::acc_, GlobalState::acc_);
-      M3D gyr_cov =
-          covariance_.block<3, 3>(GlobalState::gyr_, GlobalState::gyr_);
-      M3D gra_cov =
-          covariance_.block<3, 3>(GlobalState::gra_, GlobalState::gra_);
+          previous.template block<3, 3>(GlobalState::vel_, GlobalState::vel_);
 
       covariance_.setZero();
-      covariance_.block<3, 3>(GlobalState::pos_, GlobalState::pos_) =
+      covariance_.template block<3, 3>(GlobalState::pos_, GlobalState::pos_) =
           covPos.asDiagonal();  // pos
-      covariance_.block<3, 3>(GlobalState::vel_, GlobalState::vel_) =
+      covariance_.template block<3, 3>(GlobalState::vel_, GlobalState::vel_) =
           state_.qbn_.inverse() * vel_cov * state_.qbn_;  // vel
-      covariance_.block<3, 3>(GlobalState::att_, GlobalState::att_) =
+      covariance_.template block<3, 3>(GlobalState::att_, GlobalState::att_) =
           V3D(covRoll, covPitch, covYaw).asDiagonal();  // att
-      covariance_.block<3, 3>(GlobalState::acc_, GlobalState::acc_) = acc_cov;
-      covariance_.block<3, 3>(GlobalState::gyr_, GlobalState::gyr_) = gyr_cov;
-      covariance_.block<3, 3>(GlobalState::gra_, GlobalState::gra_) =
-          state_.qbn_.inverse() * gra_cov * state_.qbn_;
+      copyBiasAndGravityCovariance(previous, state_.qbn_.toRotationMatrix());
 
       state_.rn_.setZero();
       state_.vn_ = state_.qbn_.inverse() * state_.vn_;
@@ -363,15 +503,35 @@ class StatePredictor {
 
   inline bool isInitialized() { return flag_init_state_; }
 
+  // Carry the bias and gravity blocks of a previous covariance over, with
+  // gravity rotated by qbn^-1
+  void copyBiasAndGravityCovariance(const StateMatrix& previous,
+                                    const M3D& qbn) {
+    if (GlobalState::ESTIMATES_ACC_BIAS)
+      covariance_.template block<3, 3>(GlobalState::acc_, GlobalState::acc_) =
+          previous.template block<3, 3>(GlobalState::acc_, GlobalState::acc_);
+    covariance_.template block<3, 3>(GlobalState::gyr_, GlobalState::gyr_) =
+        previous.template block<3, 3>(GlobalState::gyr_, GlobalState::gyr_);
+    if (GlobalState::ESTIMATES_GRAVITY)
+      covariance_.template block<3, 3>(GlobalState::gra_, GlobalState::gra_) =
+          qbn.transpose() *
+          previous.template block<3, 3>(GlobalState::gra_,
+                                        GlobalState::gra_) *
+          qbn;
+  }
+
   GlobalState state_;
   double time_;
-  Eigen::Matrix<double, GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_STATE_>
-      F_;
-  Eigen::Matrix<double, GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_STATE_>
-      jacobian_, covariance_;
+  StateMatrix F_;
+  StateMatrix jacobian_, covariance_;
   Eigen::Matrix<double, GlobalState::DIM_OF_NOISE_, GlobalState::DIM_OF_NOISE_>
       noise_;
 
+  // !@Batched covariance propagation
+  StateMatrix Phi_, noiseSum_;  // transition product and accumulated noise
+  double sumDt_;
+  bool hasPendingCov_;
+
   V3D acc_last;  // last acceleration measurement
   V3D gyr_last;  // last gyroscope measurement
 
@@ -379,6 +539,19 @@ class StatePredictor {
   bool flag_init_imu_;
 };
 
+// !@Layout of the filter built into LINS
+#if LINS_ERROR_STATE_DIM == 18
+typedef StateLayout18 FilterLayout;
+#elif LINS_ERROR_STATE_DIM == 15
+typedef StateLayout15 FilterLayout;
+#elif LINS_ERROR_STATE_DIM == 12
+typedef StateLayout12 FilterLayout;
+#else
+#error "LINS_ERROR_STATE_DIM must be 18, 15 or 12"
+#endif
+typedef GlobalStateT<FilterLayout> GlobalState;
+typedef StatePredictorT<FilterLayout> StatePredictor;
+
 };  // namespace filter
 
 #endif  // INCLUDE_KALMANFILTER_HPP_
@@ -29,6 +29,8 @@
 #ifndef INCLUDE_MAPRINGBUFFER_H_
 #define INCLUDE_MAPRINGBUFFER_H_
 
+#include <metrics.h>
+
 #include <iostream>
 #include <map>
 
@@ -45,6 +47,7 @@ class MapRingBuffer {
   MapRingBuffer() {
     maxWaitTime_ = 0.1;
     minWaitTime_ = 0.0;
+    evictions_ = nullptr;
   }
 
   virtual ~MapRingBuffer() {}
@@ -58,6 +61,11 @@ class MapRingBuffer {
     }
   }
 
+  // Count measurements dropped because the buffer was full
+  void setEvictionCounter(metrics::Counter* evictions) {
+    evictions_ = evictions;
+  }
+
   int getSize() { return measMap_.size(); }
 
   void addMeas(const Meas& meas, const double& t) {
@@ -66,6 +74,7 @@ class MapRingBuffer {
     // ensure the size of the map, and remove the last element
     if (measMap_.size() > size) {
       measMap_.erase(measMap_.begin());
+      if (evictions_ != nullptr) evictions_->inc();
     }
   }
 
@@ -154,6 +163,9 @@ class MapRingBuffer {
       itMeas_++;
     }
   }
+
+ private:
+  metrics::Counter* evictions_;
 };
 
 #endif  // INCLUDE_MAPRINGBUFFER_H_
@@ -20,13 +20,17 @@
 
 #include <integrationBase.h>
 #include <math_utils.h>
+#include <metrics.h>
 #include <parameters.h>
 #include <pcl/filters/filter.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/kdtree/kdtree_flann.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
+#include <scan_arena.h>
 #include <sensor_msgs/Imu.h>
+#include <sensor_profiles.h>
+#include <static_initialization.h>
 #include <tf/transform_broadcaster.h>
 #include <tic_toc.h>
 
@@ -34,8 +38,10 @@
 #include <algorithm>
 #include <boost/shared_ptr.hpp>
 #include <cmath>
+#include <deque>
 #include <eigen3/Eigen/Dense>
 #include <iostream>
+#include <new>
 #include <sensor_utils.hpp>
 #include <vector>
 
@@ -51,9 +57,6 @@ using namespace filter;
 
 namespace fusion {
 
-const int LINE_NUM_ = 16;
-const int SCAN_NUM_ = 1800;
-
 struct Smooth {
   Smooth() {
     value = 0.0;
@@ -89,9 +92,6 @@ class Scan {
     surfPointsLessFlatYZX_.reset(new pcl::PointCloud<PointType>());
     outlierPointCloudYZX_.reset(new pcl::PointCloud<PointType>());
 
-    cloudCurvature_.resize(LINE_NUM * SCAN_NUM);
-    cloudSmoothness_.resize(LINE_NUM * SCAN_NUM);
-
     reset();
   }
 
@@ -124,9 +124,6 @@ class Scan {
     cornerPointsLessSharpYZX_->clear();
     surfPointsLessFlatYZX_->clear();
     outlierPointCloudYZX_->clear();
-
-    cloudCurvature_.assign(LINE_NUM * SCAN_NUM, 0.0);
-    cloudSmoothness_.assign(LINE_NUM * SCAN_NUM, Smooth());
   }
 
   void setPointCloud(double time,
@@ -152,12 +149,6 @@ class Scan {
   cloud_msgs::cloud_info::Ptr cloudInfo_;
 
   // !@PclFeatures
-  std::vector<double> cloudCurvature_;
-  std::vector<Smooth> cloudSmoothness_;
-
-  int cloudNeighborPicked_[LINE_NUM_ * SCAN_NUM_];
-  int cloudLabel_[LINE_NUM_ * SCAN_NUM_];
-
   pcl::PointCloud<PointType>::Ptr cornerPointsSharp_;
   pcl::PointCloud<PointType>::Ptr cornerPointsLessSharp_;
   pcl::PointCloud<PointType>::Ptr surfPointsFlat_;
@@ -202,6 +193,14 @@ class StateEstimator {
     surfPointsLessFlatScan.reset(new pcl::PointCloud<PointType>());
     surfPointsLessFlatScanDS.reset(new pcl::PointCloud<PointType>());
 
+    // Initialize the local map used by the tightly coupled mode
+    localCornerMap_.reset(new pcl::PointCloud<PointType>());
+    localSurfMap_.reset(new pcl::PointCloud<PointType>());
+    kdtreeCornerMap_.reset(new pcl::KdTreeFLANN<PointType>());
+    kdtreeSurfMap_.reset(new pcl::KdTreeFLANN<PointType>());
+    downSizeFilterCornerMap_.setLeafSize(0.2, 0.2, 0.2);
+    downSizeFilterSurfMap_.setLeafSize(0.4, 0.4, 0.4);
+
     pointSelCornerInd.resize(LINE_NUM * SCAN_NUM);
     pointSearchCornerInd1.resize(LINE_NUM * SCAN_NUM);
     pointSearchCornerInd2.resize(LINE_NUM * SCAN_NUM);
@@ -210,6 +209,9 @@ class StateEstimator {
     pointSearchSurfInd2.resize(LINE_NUM * SCAN_NUM);
     pointSearchSurfInd3.resize(LINE_NUM * SCAN_NUM);
 
+    FeatureExtractorSelector selector(this);
+    sensor::dispatch(LIDAR_MODEL, selector);
+
     globalState_.setIdentity();
     globalStateYZX_.setIdentity();
 
@@ -221,6 +223,10 @@ class StateEstimator {
 
     // gravity_feedback << 0, 0, -G0;
 
+    hasStaticInit_ = false;
+    staticBa_ = INIT_BA;
+    staticBw_ = INIT_BW;
+
     status_ = STATUS_INIT;
   }
 
@@ -231,6 +237,20 @@ class StateEstimator {
 
   inline const double getTime() const { return filter_->time_; }
   inline bool isInitialized() const { return status_ != STATUS_INIT; }
+  inline bool isRunning() const { return status_ == STATUS_RUNNING; }
+
+  // Seed the initialization with IMU biases and the mean specific force
+  // estimated from a stationary IMU window. Only takes effect if the second
+  // scan has not been processed yet.
+  bool setStaticInitialization(const V3D& ba, const V3D& bw,
+                               const V3D& accMean) {
+    if (status_ == STATUS_RUNNING) return false;
+    staticBa_ = ba;
+    staticBw_ = bw;
+    staticAccMean_ = accMean;
+    hasStaticInit_ = true;
+    return true;
+  }
 
   /********Relative Variables*********/
   V3D pos_;
@@ -269,6 +289,19 @@ class StateEstimator {
     gyr_0_ = gyr;
   }
 
+  // Propagate an aggregated IMU increment, see imu_aggregation.h. Until the
+  // filter runs, the increment is passed on as its mean rates.
+  void processImuIncrement(double dt, const V3D& dTheta, const V3D& dVel,
+                           const V3D& dPos) {
+    if (status_ == STATUS_RUNNING) {
+      filter_->predictIncrement(dt, dTheta, dVel, dPos);
+      acc_0_ = dVel / dt;
+      gyr_0_ = dTheta / dt;
+    } else {
+      processImu(dt, dVel / dt, dTheta / dt);
+    }
+  }
+
   /********Relative Variables*********/
   double duration_fea_ = 0;
   double duration_opt_ = 0;
@@ -281,12 +314,20 @@ class StateEstimator {
                   cloud_msgs::cloud_info cloudInfo,
                   pcl::PointCloud<PointType>::Ptr outlierPointCloud) {
     TicToc ts_fea;  // Calculate the time used in feature extraction
+    // Everything allocated from the arena for the previous scan is dead now
+    scanArena_.reset();
+    const int numPoints = LINE_NUM * SCAN_NUM;
+    cloudCurvature_ = arena::makeVector<double>(scanArena_, numPoints);
+    cloudSmoothness_ = arena::makeVector<Smooth>(scanArena_, numPoints);
+    cloudNeighborPicked_ = arena::makeVector<int>(scanArena_, numPoints);
+    cloudLabel_ = arena::makeVector<int>(scanArena_, numPoints);
+
     scan_new_->setPointCloud(time, distortedPointCloud, cloudInfo,
                              outlierPointCloud);
     undistortPcl(scan_new_);
     calculateSmoothness(scan_new_);
     markOccludedPoints(scan_new_);
-    extractFeatures(scan_new_);
+    (this->*featureExtractor_)(scan_new_);
     imu_last_ = imu;
     double time_fea = ts_fea.toc();
 
@@ -307,6 +348,24 @@ class StateEstimator {
     }
     double time_opt = ts_opt.toc();
 
+    static metrics::Registry& registry = metrics::Registry::instance();
+    static metrics::Histogram& featureTime = registry.histogram(
+        "lins_feature_extraction_time_ms", "Time to extract scan features");
+    static metrics::Histogram& estimationTime = registry.histogram(
+        "lins_state_estimation_time_ms", "Time of the IESKF update per scan");
+    static metrics::Gauge& cornerFeatures = registry.gauge(
+        "lins_scan_features", "Features extracted from the latest scan",
+        "type=\"corner\"");
+    static metrics::Gauge& surfFeatures = registry.gauge(
+        "lins_scan_features", "Features extracted from the latest scan",
+        "type=\"surf\"");
+    featureTime.observe(time_fea);
+    estimationTime.observe(time_opt);
+    static arena::UsageReporter arenaUsage("estimator");
+    arenaUsage.report(scanArena_);
+    cornerFeatures.set(scan_last_->cornerPointsLessSharp_->points.size());
+    surfFeatures.set(scan_last_->surfPointsLessFlat_->points.size());
+
     // if (VERBOSE) {
     //   duration_fea_ =
     //       (duration_fea_ * lidar_counter_ + time_fea) / (lidar_counter_ + 1);
@@ -339,9 +398,7 @@ class StateEstimator {
     // Initialize the Kalman filter
     Fk_.resize(GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_STATE_);
     Gk_.resize(GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_NOISE_);
-    Pk_.resize(GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_STATE_);
     Qk_.resize(GlobalState::DIM_OF_NOISE_, GlobalState::DIM_OF_NOISE_);
-    IKH_.resize(GlobalState::DIM_OF_STATE_, GlobalState::DIM_OF_STATE_);
 
     Fk_.setIdentity();
     Gk_.setZero();
@@ -352,8 +409,9 @@ class StateEstimator {
     linState_.setIdentity();
 
     // Initialize IMU preintegration variable
+    delete preintegration_;
     preintegration_ = new integration::IntegrationBase(
-        imu_last_.acc, imu_last_.gyr, INIT_BA, INIT_BW);
+        imu_last_.acc, imu_last_.gyr, staticBa_, staticBw_);
 
     // Initialize position, velocity, acceleration bias, gyroscope bias by zeros
     filter_->initialization(scan_new_->time_, V3D(0, 0, 0), V3D(0, 0, 0),
@@ -362,6 +420,7 @@ class StateEstimator {
 
     kdtreeCorner_->setInputCloud(scan_new_->cornerPointsLessSharp_);
     kdtreeSurf_->setInputCloud(scan_new_->surfPointsLessFlat_);
+    clearLocalMap();
 
     pos_.setZero();
     vel_.setZero();
@@ -377,13 +436,20 @@ class StateEstimator {
   // Calculate initial velocity and IMU biases using two consecutive frames and
   // IMU preintegration results
   bool processSecondScan() {
-    if (scan_new_->cornerPointsLessSharp_->points.size() < 10 ||
-        scan_new_->surfPointsLessFlat_->points.size() < 100) {
+    bool hasFeatures = scan_new_->cornerPointsLessSharp_->points.size() >= 10 &&
+                       scan_new_->surfPointsLessFlat_->points.size() >= 100;
+    if (!hasFeatures && !hasStaticInit_) {
       ROS_WARN("Wait for more features for initialization...");
       scan_new_.reset(new Scan());
       return false;
     }
 
+    // The static biases may have become available after the first scan
+    if (hasStaticInit_ && (preintegration_->linearized_ba != staticBa_ ||
+                           preintegration_->linearized_bg != staticBw_)) {
+      preintegration_->repropagate(staticBa_, staticBw_);
+    }
+
     // Calculate relative transform, linState_, using ICP method
     V3D pl;
     Q4D ql;
@@ -394,11 +460,31 @@ class StateEstimator {
          0.5 * linState_.gn_ * preintegration_->sum_dt *
              preintegration_->sum_dt -
          0.5 * ba0 * preintegration_->sum_dt * preintegration_->sum_dt;
-    estimateTransform(scan_last_, scan_new_, pl, ql);
 
-    // Calculate initial state using relative transform calculated by point
-    // clouds and that by IMU preintegration
-    estimateInitialState(pl, ql, v0, v1, ba0, bw0);
+    if (hasFeatures) {
+      estimateTransform(scan_last_, scan_new_, pl, ql);
+
+      // Calculate initial state using relative transform calculated by point
+      // clouds and that by IMU preintegration
+      estimateInitialState(pl, ql, v0, v1, ba0, bw0);
+    } else {
+      // The vehicle has just been stationary, so rely on the preintegrated
+      // motion instead of waiting for a feature-rich scan. The attitude is not
+      // aligned with gravity yet, so gravity is taken in the body frame from
+      // the static window, which keeps a tilted start from turning part of it
+      // into velocity.
+      ROS_WARN("Initialize from the static IMU window...");
+      static_initialization::integrateGravity(
+          static_initialization::bodyGravity(staticAccMean_, staticBa_),
+          preintegration_->sum_dt, preintegration_->delta_p,
+          preintegration_->delta_v, pl, v1);
+      linState_.rn_ = pl;
+      linState_.qbn_ = ql;
+    }
+    if (hasStaticInit_) {
+      ba0 = staticBa_;
+      bw0 = staticBw_;
+    }
 
     // Initialize the Kalman filter by estimated values
     V3D r1 = pl;
@@ -406,17 +492,23 @@ class StateEstimator {
                             imu_last_.gyr);
 
     double roll_init, pitch_init, yaw_init = deg2rad(0.0);
-    // Calculate rough roll and pitch angles using IMU measurements
-    calculateRPfromGravity(imu_last_.acc - ba0, roll_init, pitch_init);
+    // Calculate rough roll and pitch angles using IMU measurements, or the
+    // averaged ones of the static window if available
+    if (hasStaticInit_)
+      calculateRPfromGravity(staticAccMean_ - ba0, roll_init, pitch_init);
+    else
+      calculateRPfromGravity(imu_last_.acc - ba0, roll_init, pitch_init);
 
     // Initialize the global state, e.g., position, velocity, and orientation
     // represented in the original frame (the first-scan-frame)
     globalState_ = GlobalState(
         r1, v1, rpy2Quat(V3D(roll_init, pitch_init, yaw_init)), ba0, bw0);
+    if (!GlobalState::ESTIMATES_GRAVITY) updateKnownGravity();
 
     // Use relative transorm linState_ to undistort point cloud (under the
     // constant-speed assumption)
     updatePointCloud();
+    if (TIGHTLY_COUPLED_MAPPING) updateLocalMap();
 
     scan_last_.swap(scan_new_);
     scan_new_.reset(new Scan());
@@ -432,6 +524,12 @@ class StateEstimator {
 
   void correctOrientation(const Q4D& quad) { globalState_.qbn_ = quad; }
 
+  // Filters that do not estimate gravity take it from the global attitude,
+  // expressed in the b-frame the filter was reset to
+  void updateKnownGravity() {
+    filter_->state_.gn_ = globalState_.qbn_.inverse() * V3D(0.0, 0.0, -G0);
+  }
+
   bool processScan() {
     if (scan_new_->cornerPointsLessSharp_->points.size() <= 5 ||
         scan_new_->surfPointsLessFlat_->points.size() <= 10) {
@@ -445,16 +543,23 @@ class StateEstimator {
     integrateTransformation();
     filter_->reset(1);
 
-    double roll, pitch;
-    // Because the estimated gravity is represented in the b-frame, we can
-    // directly solve more accurate roll and pitch angles to correct the global
-    // state
-    calculateRPfromGravity(filter_->state_.gn_, roll, pitch);
-    correctRollPitch(roll, pitch);
+    if (GlobalState::ESTIMATES_GRAVITY) {
+      double roll, pitch;
+      // Because the estimated gravity is represented in the b-frame, we can
+      // directly solve more accurate roll and pitch angles to correct the
+      // global state
+      calculateRPfromGravity(filter_->state_.gn_, roll, pitch);
+      correctRollPitch(roll, pitch);
+    } else {
+      updateKnownGravity();
+    }
 
     // Undistort point cloud using estimated relative transform
     updatePointCloud();
 
+    // Insert the undistorted features into the local map
+    if (TIGHTLY_COUPLED_MAPPING) updateLocalMap();
+
     // Slide the new scan to last scan
     scan_last_.swap(scan_new_);
     scan_new_.reset(new Scan());
@@ -464,89 +569,122 @@ class StateEstimator {
 
   void performIESKF() {
     // Store current state and perform initialization
-    Pk_ = filter_->covariance_;
+    Pk_ = filter_->getCovariance();
     GlobalState filterState = filter_->state_;
     linState_ = filterState;
 
     double residualNorm = 1e6;
     bool hasConverged = false;
     bool hasDiverged = false;
-    const unsigned int DIM_OF_STATE = GlobalState::DIM_OF_STATE_;
+    int numIterations = 0;
+    const int DIM_OF_STATE = GlobalState::DIM_OF_STATE_;
+    // Register the new scan directly against the local map once it holds
+    // enough features; otherwise fall back to scan-to-scan matching
+    bool useLocalMap = TIGHTLY_COUPLED_MAPPING &&
+                       localCornerMap_->points.size() > 10 &&
+                       localSurfMap_->points.size() > 100;
+    // Views of the measurement buffers of the latest iteration, placed into
+    // the scan arena by every iteration
+    MapVXD residual(nullptr, 0), innovation(nullptr, 0);
+    MapMeasurementJacobian Hk(nullptr, 0, DIM_OF_STATE),
+        KkT(nullptr, 0, DIM_OF_STATE);
+    MapMXD Py(nullptr, 0, 0);
+    const arena::MonotonicArena::Marker iterationMark = scanArena_.mark();
     for (int iter = 0; iter < NUM_ITER && !hasConverged && !hasDiverged;
          iter++) {
       keypointSurfs_->clear();
       jacobianCoffSurfs->clear();
       keypointCorns_->clear();
       jacobianCoffCorns->clear();
+      numIterations++;
 
       // Find corresponding features
-      findCorrespondingSurfFeatures(scan_last_, scan_new_, keypointSurfs_,
-                                    jacobianCoffSurfs, iter);
+      if (useLocalMap) {
+        findCorrespondingSurfMapFeatures(scan_new_, keypointSurfs_,
+                                         jacobianCoffSurfs);
+      } else {
+        findCorrespondingSurfFeatures(scan_last_, scan_new_, keypointSurfs_,
+                                      jacobianCoffSurfs, iter);
+      }
       if (keypointSurfs_->points.size() < 10) {
         if (VERBOSE) {
           ROS_WARN("Insufficient matched surfs...");
         }
       }
-      findCorrespondingCornerFeatures(scan_last_, scan_new_, keypointCorns_,
-                                      jacobianCoffCorns, iter);
+      if (useLocalMap) {
+        findCorrespondingCornerMapFeatures(scan_new_, keypointCorns_,
+                                           jacobianCoffCorns);
+      } else {
+        findCorrespondingCornerFeatures(scan_last_, scan_new_, keypointCorns_,
+                                        jacobianCoffCorns, iter);
+      }
       if (keypointCorns_->points.size() < 5) {
         if (VERBOSE) {
           ROS_WARN("Insufficient matched corners...");
         }
       }
 
-      // Sum up jocobians and residuals
-      keypoints_->clear();
-      jacobians_->clear();
-      (*keypoints_) += (*keypointSurfs_);
-      (*keypoints_) += (*keypointCorns_);
-      (*jacobians_) += (*jacobianCoffSurfs);
-      (*jacobians_) += (*jacobianCoffCorns);
-
-      // Memery allocation
-      const unsigned int DIM_OF_MEAS = keypoints_->points.size();
-      residual_.resize(DIM_OF_MEAS);
-      Hk_.resize(DIM_OF_MEAS, DIM_OF_STATE);
-      Rk_.resize(DIM_OF_MEAS, DIM_OF_MEAS);
-      Kk_.resize(DIM_OF_STATE, DIM_OF_MEAS);
-      Py_.resize(DIM_OF_MEAS, DIM_OF_MEAS);
-      Pyinv_.resize(DIM_OF_MEAS, DIM_OF_MEAS);
-
-      Hk_.setZero();
+      // Measurement buffers of this iteration live in the scan arena. The
+      // surf matches come first, then the corner matches.
+      scanArena_.rewind(iterationMark);
+      const int numSurfs = keypointSurfs_->points.size();
+      const int DIM_OF_MEAS = numSurfs + keypointCorns_->points.size();
+      new (&residual) MapVXD(scanArena_.allocate<double>(DIM_OF_MEAS),
+                             DIM_OF_MEAS);
+      new (&Hk) MapMeasurementJacobian(
+          scanArena_.allocate<double>(DIM_OF_MEAS * DIM_OF_STATE),
+          DIM_OF_MEAS, DIM_OF_STATE);
+      new (&KkT) MapMeasurementJacobian(
+          scanArena_.allocate<double>(DIM_OF_MEAS * DIM_OF_STATE),
+          DIM_OF_MEAS, DIM_OF_STATE);
+      new (&Py) MapMXD(scanArena_.allocate<double>(DIM_OF_MEAS * DIM_OF_MEAS),
+                       DIM_OF_MEAS, DIM_OF_MEAS);
+      new (&innovation) MapVXD(scanArena_.allocate<double>(DIM_OF_MEAS),
+                               DIM_OF_MEAS);
+
+      Hk.setZero();
       V3D axis = Quat2axis(linState_.qbn_);
+      batchPoints_.resize(DIM_OF_MEAS, 3);
+      batchCoeffs_.resize(DIM_OF_MEAS, 3);
       for (int i = 0; i < DIM_OF_MEAS; ++i) {
+        const PointType& keypoint =
+            i < numSurfs ? keypointSurfs_->points[i]
+                         : keypointCorns_->points[i - numSurfs];
+        const PointType& jacobian =
+            i < numSurfs ? jacobianCoffSurfs->points[i]
+                         : jacobianCoffCorns->points[i - numSurfs];
         // Point represented in 2-frame (e.g., the end frame) in a
         // xyz-convention
-        V3D P2xyz(keypoints_->points[i].x, keypoints_->points[i].y,
-                  keypoints_->points[i].z);
-        V3D coff_xyz(jacobians_->points[i].x, jacobians_->points[i].y,
-                     jacobians_->points[i].z);
-        residual_(i) = LIDAR_SCALE * jacobians_->points[i].intensity;
-
-        Hk_.block<1, 3>(i, GlobalState::att_) =
-            coff_xyz.transpose() *
-            (-linState_.qbn_.toRotationMatrix() * skew(P2xyz)) *
-            Rinvleft(-axis);
-        Hk_.block<1, 3>(i, GlobalState::pos_) =
-            coff_xyz.transpose() * M3D::Identity();
+        batchPoints_.row(i) << keypoint.x, keypoint.y, keypoint.z;
+        batchCoeffs_.row(i) << jacobian.x, jacobian.y, jacobian.z;
+        residual(i) = LIDAR_SCALE * jacobian.intensity;
       }
-
-      // Set the measurement covariance matrix
-      VXD cov = VXD::Zero(DIM_OF_MEAS);
-      for (int i = 0; i < DIM_OF_MEAS; ++i) {
-        cov[i] = LIDAR_STD * LIDAR_STD;
-      }
-      Rk_ = cov.asDiagonal();
-
-      // Kalman filter update. Details can be referred to ROVIO
-      Py_ =
-          Hk_ * Pk_ * Hk_.transpose() + Rk_;  // S = H * P * H.transpose() + R;
-      Pyinv_.setIdentity();                   // solve Ax=B
-      Py_.llt().solveInPlace(Pyinv_);
-      Kk_ = Pk_ * Hk_.transpose() * Pyinv_;  // K = P*H.transpose()*S.inverse()
+      // Row i of the attitude block is
+      // coff^T * (-R * skew(P2)) * Rinvleft(-axis)
+      // = (P2 x (R^T * coff))^T * Rinvleft(-axis)
+      rotateBatch(linState_.qbn_.toRotationMatrix().transpose(), batchCoeffs_,
+                  batchResult_);
+      crossBatch(batchPoints_, batchResult_, batchCross_);
+      rotateBatch(Rinvleft(-axis).transpose(), batchCross_, batchResult_);
+      Hk.middleCols<3>(GlobalState::att_) = batchResult_;
+      Hk.middleCols<3>(GlobalState::pos_) = batchCoeffs_;
+
+      // Kalman filter update. Details can be referred to ROVIO.
+      // S = H * P * H.transpose() + R with R = LIDAR_STD^2 * I, and
+      // K = P * H.transpose() * S.inverse() is solved as
+      // K.transpose() = S.inverse() * H * P.transpose()
+      KkT.noalias() = Hk * Pk_;
+      Py.noalias() = KkT * Hk.transpose();
+      Py.diagonal().array() += LIDAR_STD * LIDAR_STD;
+      measurementLlt_.compute(Py);
+      KkT.noalias() = Hk * Pk_.transpose();
+      measurementLlt_.solveInPlace(KkT);
 
       filterState.boxMinus(linState_, difVecLinInv_);
-      updateVec_ = -Kk_ * (residual_ + Hk_ * difVecLinInv_) + difVecLinInv_;
+      innovation = residual;
+      innovation.noalias() += Hk * difVecLinInv_;
+      updateVec_.noalias() = KkT.transpose() * innovation;
+      updateVec_ = difVecLinInv_ - updateVec_;
 
       // Divergence determination
       bool hasNaN = false;
@@ -563,7 +701,7 @@ class StateEstimator {
       }
 
       // Check whether the filter converges
-      if (residual_.norm() > residualNorm * 10) {
+      if (residual.norm() > residualNorm * 10) {
         ROS_WARN("System diverges...");
         hasDiverged = true;
         break;
@@ -577,12 +715,21 @@ class StateEstimator {
         hasConverged = true;
       }
 
-      residualNorm = residual_.norm();
+      residualNorm = residual.norm();
     }
 
+    static metrics::Registry& registry = metrics::Registry::instance();
+    static metrics::Histogram& iterations =
+        registry.histogram("lins_ieskf_iterations", "IESKF iterations per scan",
+                           "", {1, 2, 3, 5, 10, 20, 30});
+    static metrics::Counter& divergences = registry.counter(
+        "lins_ieskf_divergences_total", "Scans where the IESKF diverged");
+    iterations.observe(numIterations);
+
     // If diverges, swtich to traditional ICP method to get a rough relative
     // transformation. Otherwise, update the error-state covariance matrix
     if (hasDiverged == true) {
+      divergences.inc();
       ROS_WARN("======Using ICP Method======");
       V3D t = filterState.rn_;
       Q4D q = filterState.qbn_;
@@ -592,8 +739,10 @@ class StateEstimator {
       filter_->update(filterState, Pk_);
     } else {
       // Update only one time
-      IKH_ = Eigen::Matrix<double, 18, 18>::Identity() - Kk_ * Hk_;
-      Pk_ = IKH_ * Pk_ * IKH_.transpose() + Kk_ * Rk_ * Kk_.transpose();
+      IKH_.noalias() = -KkT.transpose() * Hk;
+      IKH_.diagonal().array() += 1;
+      Pk_ = IKH_ * Pk_ * IKH_.transpose() +
+            LIDAR_STD * LIDAR_STD * KkT.transpose() * KkT;
       enforceSymmetry(Pk_);
       filter_->update(linState_, Pk_);
     }
@@ -622,11 +771,17 @@ class StateEstimator {
     pcl::PointCloud<PointType>::Ptr distPointCloud = scan->distPointCloud_;
     cloud_msgs::cloud_info::Ptr segInfo = scan->cloudInfo_;
     int size = distPointCloud->points.size();
+    // If LiDAR frame does not align with Vehic frame, we transform the point
+    // cloud to the vehicle frame
+    V3D rpy;
+    rpy << deg2rad(0.0), deg2rad(0.0), deg2rad(IMU_LIDAR_EXTRINSIC_ANGLE);
+    gatherPoints(*distPointCloud, batchPoints_);
+    rotateBatch(rpy2R(rpy), batchPoints_, batchResult_);
     PointType point;
     for (int i = 0; i < size; i++) {
-      // If LiDAR frame does not align with Vehic frame, we transform the point
-      // cloud to the vehicle frame
-      rotatePoint(&distPointCloud->points[i], &point);
+      point.x = batchResult_(i, 0);
+      point.y = batchResult_(i, 1);
+      point.z = batchResult_(i, 2);
 
       double ori = -atan2(point.y, point.x);
       if (!halfPassed) {
@@ -668,12 +823,12 @@ class StateEstimator {
                          segInfo->segmentedCloudRange[i + 3] +
                          segInfo->segmentedCloudRange[i + 4] +
                          segInfo->segmentedCloudRange[i + 5];
-      scan->cloudCurvature_[i] = diffRange * diffRange;
+      cloudCurvature_[i] = diffRange * diffRange;
 
-      scan->cloudNeighborPicked_[i] = 0;
-      scan->cloudLabel_[i] = 0;
-      scan->cloudSmoothness_[i].value = scan->cloudCurvature_[i];
-      scan->cloudSmoothness_[i].ind = i;
+      cloudNeighborPicked_[i] = 0;
+      cloudLabel_[i] = 0;
+      cloudSmoothness_[i].value = cloudCurvature_[i];
+      cloudSmoothness_[i].ind = i;
     }
   }
 
@@ -687,19 +842,19 @@ class StateEstimator {
                                     segInfo->segmentedCloudColInd[i]));
       if (columnDiff < 10) {
         if (depth1 - depth2 > 0.3) {
-          scan->cloudNeighborPicked_[i - 5] = 1;
-          scan->cloudNeighborPicked_[i - 4] = 1;
-          scan->cloudNeighborPicked_[i - 3] = 1;
-          scan->cloudNeighborPicked_[i - 2] = 1;
-          scan->cloudNeighborPicked_[i - 1] = 1;
-          scan->cloudNeighborPicked_[i] = 1;
+          cloudNeighborPicked_[i - 5] = 1;
+          cloudNeighborPicked_[i - 4] = 1;
+          cloudNeighborPicked_[i - 3] = 1;
+          cloudNeighborPicked_[i - 2] = 1;
+          cloudNeighborPicked_[i - 1] = 1;
+          cloudNeighborPicked_[i] = 1;
         } else if (depth2 - depth1 > 0.3) {
-          scan->cloudNeighborPicked_[i + 1] = 1;
-          scan->cloudNeighborPicked_[i + 2] = 1;
-          scan->cloudNeighborPicked_[i + 3] = 1;
-          scan->cloudNeighborPicked_[i + 4] = 1;
-          scan->cloudNeighborPicked_[i + 5] = 1;
-          scan->cloudNeighborPicked_[i + 6] = 1;
+          cloudNeighborPicked_[i + 1] = 1;
+          cloudNeighborPicked_[i + 2] = 1;
+          cloudNeighborPicked_[i + 3] = 1;
+          cloudNeighborPicked_[i + 4] = 1;
+          cloudNeighborPicked_[i + 5] = 1;
+          cloudNeighborPicked_[i + 6] = 1;
         }
       }
       float diff1 = std::abs(segInfo->segmentedCloudRange[i - 1] -
@@ -708,7 +863,7 @@ class StateEstimator {
                              segInfo->segmentedCloudRange[i]);
       if (diff1 > 0.02 * segInfo->segmentedCloudRange[i] &&
           diff2 > 0.02 * segInfo->segmentedCloudRange[i])
-        scan->cloudNeighborPicked_[i] = 1;
+        cloudNeighborPicked_[i] = 1;
     }
   }
 
@@ -716,6 +871,7 @@ class StateEstimator {
   pcl::PointCloud<PointType>::Ptr surfPointsLessFlatScan;
   pcl::PointCloud<PointType>::Ptr surfPointsLessFlatScanDS;
   /***********************************/
+  template <typename Profile>
   void extractFeatures(ScanPtr scan) {
     cloud_msgs::cloud_info::Ptr segInfo = scan->cloudInfo_;
 
@@ -724,7 +880,7 @@ class StateEstimator {
     scan->surfPointsFlat_->clear();
     scan->surfPointsLessFlat_->clear();
 
-    for (int i = 0; i < LINE_NUM; i++) {
+    for (int i = 0; i < Profile::lines(); i++) {
       surfPointsLessFlatScan->clear();
 
       for (int j = 0; j < 6; j++) {
@@ -736,55 +892,55 @@ class StateEstimator {
 
         if (sp >= ep) continue;
 
-        std::sort(scan->cloudSmoothness_.begin() + sp,
-                  scan->cloudSmoothness_.begin() + ep, byValue());
+        std::sort(cloudSmoothness_.begin() + sp,
+                  cloudSmoothness_.begin() + ep, byValue());
 
         int largestPickedNum = 0;
         for (int k = ep; k >= sp; k--) {
-          int ind = scan->cloudSmoothness_[k].ind;
-          if (scan->cloudNeighborPicked_[ind] == 0 &&
-              scan->cloudCurvature_[ind] > EDGE_THRESHOLD &&
+          int ind = cloudSmoothness_[k].ind;
+          if (cloudNeighborPicked_[ind] == 0 &&
+              cloudCurvature_[ind] > EDGE_THRESHOLD &&
               segInfo->segmentedCloudGroundFlag[ind] == false) {
             largestPickedNum++;
             if (largestPickedNum <= 2) {
-              scan->cloudLabel_[ind] = 2;
+              cloudLabel_[ind] = 2;
               scan->cornerPointsSharp_->push_back(
                   scan->undistPointCloud_->points[ind]);
               scan->cornerPointsLessSharp_->push_back(
                   scan->undistPointCloud_->points[ind]);
             } else if (largestPickedNum <= 20) {
-              scan->cloudLabel_[ind] = 1;
+              cloudLabel_[ind] = 1;
               scan->cornerPointsLessSharp_->push_back(
                   scan->undistPointCloud_->points[ind]);
             } else {
               break;
             }
 
-            scan->cloudNeighborPicked_[ind] = 1;
+            cloudNeighborPicked_[ind] = 1;
             for (int l = 1; l <= 5; l++) {
               int columnDiff =
                   std::abs(int(segInfo->segmentedCloudColInd[ind + l] -
                                segInfo->segmentedCloudColInd[ind + l - 1]));
               if (columnDiff > 10) break;
-              scan->cloudNeighborPicked_[ind + l] = 1;
+              cloudNeighborPicked_[ind + l] = 1;
             }
             for (int l = -1; l >= -5; l--) {
               int columnDiff =
                   std::abs(int(segInfo->segmentedCloudColInd[ind + l] -
                                segInfo->segmentedCloudColInd[ind + l + 1]));
               if (columnDiff > 10) break;
-              scan->cloudNeighborPicked_[ind + l] = 1;
+              cloudNeighborPicked_[ind + l] = 1;
             }
           }
         }
 
         int smallestPickedNum = 0;
         for (int k = sp; k <= ep; k++) {
-          int ind = scan->cloudSmoothness_[k].ind;
-          if (scan->cloudNeighborPicked_[ind] == 0 &&
-              scan->cloudCurvature_[ind] < SURF_THRESHOLD &&
+          int ind = cloudSmoothness_[k].ind;
+          if (cloudNeighborPicked_[ind] == 0 &&
+              cloudCurvature_[ind] < SURF_THRESHOLD &&
               segInfo->segmentedCloudGroundFlag[ind] == true) {
-            scan->cloudLabel_[ind] = -1;
+            cloudLabel_[ind] = -1;
             scan->surfPointsFlat_->push_back(
                 scan->undistPointCloud_->points[ind]);
             smallestPickedNum++;
@@ -792,14 +948,14 @@ class StateEstimator {
               break;
             }
 
-            scan->cloudNeighborPicked_[ind] = 1;
+            cloudNeighborPicked_[ind] = 1;
             for (int l = 1; l <= 5; l++) {
               int columnDiff =
                   std::abs(int(segInfo->segmentedCloudColInd[ind + l] -
                                segInfo->segmentedCloudColInd[ind + l - 1]));
               if (columnDiff > 10) break;
 
-              scan->cloudNeighborPicked_[ind + l] = 1;
+              cloudNeighborPicked_[ind + l] = 1;
             }
             for (int l = -1; l >= -5; l--) {
               int columnDiff =
@@ -807,13 +963,13 @@ class StateEstimator {
                                segInfo->segmentedCloudColInd[ind + l + 1]));
               if (columnDiff > 10) break;
 
-              scan->cloudNeighborPicked_[ind + l] = 1;
+              cloudNeighborPicked_[ind + l] = 1;
             }
           }
         }
 
         for (int k = sp; k <= ep; k++) {
-          if (scan->cloudLabel_[k] <= 0) {
+          if (cloudLabel_[k] <= 0) {
             surfPointsLessFlatScan->push_back(
                 scan->undistPointCloud_->points[k]);
           }
@@ -832,18 +988,18 @@ class StateEstimator {
       pcl::PointCloud<PointType>::Ptr jacobianCoff, int iterCount) {
     int surfPointsFlatNum = newScan->surfPointsFlat_->points.size();
 
+    // Reused by every point instead of being allocated per search
+    std::vector<int> pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+    transformToStart(*newScan->surfPointsFlat_, startPoints_);
     for (int i = 0; i < surfPointsFlatNum; i++) {
-      PointType pointSel;
+      PointType pointSel = startPoints_.points[i];
       PointType coeff, tripod1, tripod2, tripod3;
 
-      transformToStart(&newScan->surfPointsFlat_->points[i], &pointSel);
-
       pcl::PointCloud<PointType>::Ptr laserCloudSurfLast =
           lastScan->surfPointsLessFlat_;
 
       if (iterCount % ICP_FREQ == 0) {
-        std::vector<int> pointSearchInd;
-        std::vector<float> pointSearchSqDis;
         kdtreeSurf_->nearestKSearch(pointSel, 1, pointSearchInd,
                                     pointSearchSqDis);
         int closestPointInd = -1, minPointInd2 = -1, minPointInd3 = -1;
@@ -958,18 +1114,17 @@ class StateEstimator {
       pcl::PointCloud<PointType>::Ptr jacobianCoff, int iterCount) {
     int cornerPointsSharpNum = newScan->cornerPointsSharp_->points.size();
 
+    std::vector<int> pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+    transformToStart(*newScan->cornerPointsSharp_, startPoints_);
     for (int i = 0; i < cornerPointsSharpNum; i++) {
-      PointType pointSel;
+      PointType pointSel = startPoints_.points[i];
       PointType coeff, tripod1, tripod2;
 
-      transformToStart(&newScan->cornerPointsSharp_->points[i], &pointSel);
-
       pcl::PointCloud<PointType>::Ptr laserCloudCornerLast =
           lastScan->cornerPointsLessSharp_;
 
       if (iterCount % ICP_FREQ == 0) {
-        std::vector<int> pointSearchInd;
-        std::vector<float> pointSearchSqDis;
         kdtreeCorner_->nearestKSearch(pointSel, 1, pointSearchInd,
                                       pointSearchSqDis);
         int closestPointInd = -1, minPointInd2 = -1;
@@ -1062,6 +1217,199 @@ class StateEstimator {
     }
   }
 
+  // Transform a point represented in the last scan-frame to the local map
+  // (the original scan-frame)
+  void transformToMap(PointType const* const pi, PointType* const po) {
+    V3D P1xyz(pi->x, pi->y, pi->z);
+    V3D Pnxyz = globalState_.qbn_ * P1xyz + globalState_.rn_;
+    po->x = Pnxyz.x();
+    po->y = Pnxyz.y();
+    po->z = Pnxyz.z();
+    po->intensity = pi->intensity;
+  }
+
+  // Point-to-plane residuals against the local map. The residual is formed in
+  // the map frame and its gradient is rotated back to the last scan-frame, so
+  // the measurement Jacobians of performIESKF apply unchanged.
+  void findCorrespondingSurfMapFeatures(
+      ScanPtr newScan, pcl::PointCloud<PointType>::Ptr keypoints,
+      pcl::PointCloud<PointType>::Ptr jacobianCoff) {
+    int surfPointsFlatNum = newScan->surfPointsFlat_->points.size();
+    M3D Rn1 = globalState_.qbn_.toRotationMatrix();
+    std::vector<int> pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+    Eigen::Matrix<double, 5, 3> matA0;
+    Eigen::Matrix<double, 5, 1> matB0 = -Eigen::Matrix<double, 5, 1>::Ones();
+
+    transformToStart(*newScan->surfPointsFlat_, startPoints_);
+    for (int i = 0; i < surfPointsFlatNum; i++) {
+      const PointType& pointSel = startPoints_.points[i];
+      PointType pointMap, coeff;
+      transformToMap(&pointSel, &pointMap);
+
+      kdtreeSurfMap_->nearestKSearch(pointMap, 5, pointSearchInd,
+                                     pointSearchSqDis);
+      if (pointSearchSqDis[4] >= 1.0) continue;
+
+      for (int j = 0; j < 5; j++) {
+        const PointType& pt = localSurfMap_->points[pointSearchInd[j]];
+        matA0.row(j) << pt.x, pt.y, pt.z;
+      }
+      V3D norm = matA0.colPivHouseholderQr().solve(matB0);
+      double pd = 1.0 / norm.norm();
+      norm *= pd;
+
+      bool planeValid = true;
+      for (int j = 0; j < 5; j++) {
+        if (fabs(matA0.row(j).dot(norm) + pd) > 0.2) {
+          planeValid = false;
+          break;
+        }
+      }
+      if (!planeValid) continue;
+
+      V3D P0xyz(pointMap.x, pointMap.y, pointMap.z);
+      double res = norm.dot(P0xyz) + pd;
+      float s = 1 - 0.9 * fabs(res) /
+                        sqrt(sqrt(pointSel.x * pointSel.x +
+                                  pointSel.y * pointSel.y +
+                                  pointSel.z * pointSel.z));
+
+      if (s > 0.1 && res != 0) {
+        V3D jacxyz = Rn1.transpose() * norm;
+        coeff.x = s * jacxyz(0);
+        coeff.y = s * jacxyz(1);
+        coeff.z = s * jacxyz(2);
+        coeff.intensity = s * res;
+
+        keypoints->push_back(newScan->surfPointsFlat_->points[i]);
+        jacobianCoff->push_back(coeff);
+      }
+    }
+  }
+
+  // Point-to-line residuals against the local map, see
+  // findCorrespondingSurfMapFeatures
+  void findCorrespondingCornerMapFeatures(
+      ScanPtr newScan, pcl::PointCloud<PointType>::Ptr keypoints,
+      pcl::PointCloud<PointType>::Ptr jacobianCoff) {
+    int cornerPointsSharpNum = newScan->cornerPointsSharp_->points.size();
+    M3D Rn1 = globalState_.qbn_.toRotationMatrix();
+    std::vector<int> pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+
+    transformToStart(*newScan->cornerPointsSharp_, startPoints_);
+    for (int i = 0; i < cornerPointsSharpNum; i++) {
+      const PointType& pointSel = startPoints_.points[i];
+      PointType pointMap, coeff;
+      transformToMap(&pointSel, &pointMap);
+
+      kdtreeCornerMap_->nearestKSearch(pointMap, 5, pointSearchInd,
+                                       pointSearchSqDis);
+      if (pointSearchSqDis[4] >= 1.0) continue;
+
+      V3D center(0, 0, 0);
+      for (int j = 0; j < 5; j++) {
+        const PointType& pt = localCornerMap_->points[pointSearchInd[j]];
+        center += V3D(pt.x, pt.y, pt.z);
+      }
+      center /= 5;
+      M3D cov = M3D::Zero();
+      for (int j = 0; j < 5; j++) {
+        const PointType& pt = localCornerMap_->points[pointSearchInd[j]];
+        V3D d = V3D(pt.x, pt.y, pt.z) - center;
+        cov += d * d.transpose();
+      }
+      cov /= 5;
+
+      // The neighbours have to be distributed along a dominant direction
+      Eigen::SelfAdjointEigenSolver<M3D> saes(cov);
+      if (saes.eigenvalues()[2] <= 3 * saes.eigenvalues()[1]) continue;
+      V3D dir = saes.eigenvectors().col(2);
+
+      V3D P0xyz(pointMap.x, pointMap.y, pointMap.z);
+      V3D perp = (P0xyz - center) - dir * dir.dot(P0xyz - center);
+      double res = perp.norm();
+      float s = 1 - 0.9 * res;
+
+      if (s > 0.1 && res != 0) {
+        V3D jacxyz = Rn1.transpose() * perp / res;
+        coeff.x = s * jacxyz(0);
+        coeff.y = s * jacxyz(1);
+        coeff.z = s * jacxyz(2);
+        coeff.intensity = s * res;
+
+        keypoints->push_back(newScan->cornerPointsSharp_->points[i]);
+        jacobianCoff->push_back(coeff);
+      }
+    }
+  }
+
+  void clearLocalMap() {
+    localCornerFrames_.clear();
+    localSurfFrames_.clear();
+    localCornerMap_->clear();
+    localSurfMap_->clear();
+  }
+
+  // Insert the features of scan_new_, already undistorted to its end frame,
+  // into the sliding window of local map frames. A frame is only added after
+  // the vehicle moved by localMapKeyframeDist, which bounds the number of KD
+  // tree rebuilds.
+  void updateLocalMap() {
+    if (!localCornerFrames_.empty() &&
+        (globalState_.rn_ - lastLocalMapPos_).norm() < localMapKeyframeDist)
+      return;
+    TicToc ts_map;
+    lastLocalMapPos_ = globalState_.rn_;
+
+    pcl::PointCloud<PointType>::Ptr cornerFrame(
+        new pcl::PointCloud<PointType>());
+    pcl::PointCloud<PointType>::Ptr surfFrame(new pcl::PointCloud<PointType>());
+    PointType point;
+    for (const PointType& pt : scan_new_->cornerPointsLessSharp_->points) {
+      transformToMap(&pt, &point);
+      cornerFrame->push_back(point);
+    }
+    for (const PointType& pt : scan_new_->surfPointsLessFlat_->points) {
+      transformToMap(&pt, &point);
+      surfFrame->push_back(point);
+    }
+    localCornerFrames_.push_back(cornerFrame);
+    localSurfFrames_.push_back(surfFrame);
+    if (localCornerFrames_.size() > localMapKeyframeNum) {
+      localCornerFrames_.pop_front();
+      localSurfFrames_.pop_front();
+    }
+
+    pcl::PointCloud<PointType>::Ptr cornerMap(new pcl::PointCloud<PointType>());
+    pcl::PointCloud<PointType>::Ptr surfMap(new pcl::PointCloud<PointType>());
+    for (int i = 0; i < localCornerFrames_.size(); ++i) {
+      *cornerMap += *localCornerFrames_[i];
+      *surfMap += *localSurfFrames_[i];
+    }
+    localCornerMap_->clear();
+    downSizeFilterCornerMap_.setInputCloud(cornerMap);
+    downSizeFilterCornerMap_.filter(*localCornerMap_);
+    localSurfMap_->clear();
+    downSizeFilterSurfMap_.setInputCloud(surfMap);
+    downSizeFilterSurfMap_.filter(*localSurfMap_);
+
+    if (localCornerMap_->points.size() > 10 &&
+        localSurfMap_->points.size() > 100) {
+      kdtreeCornerMap_->setInputCloud(localCornerMap_);
+      kdtreeSurfMap_->setInputCloud(localSurfMap_);
+    }
+
+    if (VERBOSE) {
+      ROS_INFO_STREAM("Local map: corners: " << localCornerMap_->points.size()
+                                             << ", surfs: "
+                                             << localSurfMap_->points.size()
+                                             << ", time: " << ts_map.toc()
+                                             << " ms");
+    }
+  }
+
   // Undistort point cloud to the start frame
   void transformToStart(PointType const* const pi, PointType* const po) {
     double s = (1.f / SCAN_PERIOD) * (pi->intensity - int(pi->intensity));
@@ -1079,6 +1427,40 @@ class StateEstimator {
     po->intensity = pi->intensity;
   }
 
+  // Undistort a whole cloud to the start frame, as transformToStart does
+  // point by point
+  void transformToStart(const pcl::PointCloud<PointType>& in,
+                        pcl::PointCloud<PointType>& out) {
+    const int size = in.points.size();
+    gatherPoints(in, batchPoints_);
+    batchFractions_.resize(size);
+    for (int i = 0; i < size; ++i) {
+      const float intensity = in.points[i].intensity;
+      batchFractions_(i) =
+          (1.f / SCAN_PERIOD) * (intensity - int(intensity));
+    }
+    interpolateTransformBatch(Quat2axis(linState_.qbn_), linState_.rn_,
+                              batchFractions_, batchPoints_, batchResult_);
+    out.points.resize(size);
+    for (int i = 0; i < size; ++i) {
+      out.points[i].x = batchResult_(i, 0);
+      out.points[i].y = batchResult_(i, 1);
+      out.points[i].z = batchResult_(i, 2);
+      out.points[i].intensity = in.points[i].intensity;
+    }
+  }
+
+  static void gatherPoints(const pcl::PointCloud<PointType>& cloud,
+                           Vectors3d& rows) {
+    const int size = cloud.points.size();
+    rows.resize(size, 3);
+    for (int i = 0; i < size; ++i) {
+      rows(i, 0) = cloud.points[i].x;
+      rows(i, 1) = cloud.points[i].y;
+      rows(i, 2) = cloud.points[i].z;
+    }
+  }
+
   // Undistort point cloud to the end frame
   void transformToEnd(PointType const* const pi, PointType* const po) {
     double s = (1.f / SCAN_PERIOD) * (pi->intensity - int(pi->intensity));
@@ -1431,8 +1813,9 @@ class StateEstimator {
     VectorXd tmp_b(3);
     tmp_b.setZero();
     Eigen::Quaterniond q_ij = q;
-    tmp_A = preintegration_->jacobian.template block<3, 3>(GlobalState::att_,
-                                                           GlobalState::gyr_);
+    tmp_A = preintegration_->jacobian.template block<3, 3>(
+        integration::PreintegrationLayout::att_,
+        integration::PreintegrationLayout::gyr_);
     tmp_b = 2 * (preintegration_->delta_q.inverse() * q_ij).vec();
     A += tmp_A.transpose() * tmp_A;
     b += tmp_A.transpose() * tmp_b;
@@ -1450,11 +1833,35 @@ class StateEstimator {
   ScanPtr scan_new_;        // current scan information
   ScanPtr scan_last_;       // last scan information
 
+  // !@Feature extraction instantiated for the configured sensor profile
+  struct FeatureExtractorSelector {
+    explicit FeatureExtractorSelector(StateEstimator* estimator)
+        : estimator(estimator) {}
+    template <typename Profile>
+    void apply() {
+      estimator->featureExtractor_ =
+          &StateEstimator::extractFeatures<Profile>;
+    }
+    StateEstimator* estimator;
+  };
+  void (StateEstimator::*featureExtractor_)(ScanPtr);
+
   // !@KD tree relatives
   pcl::VoxelGrid<PointType> downSizeFilter_;
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeCorner_;
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurf_;
 
+  // !@Local map relatives
+  std::deque<pcl::PointCloud<PointType>::Ptr> localCornerFrames_;
+  std::deque<pcl::PointCloud<PointType>::Ptr> localSurfFrames_;
+  pcl::PointCloud<PointType>::Ptr localCornerMap_;
+  pcl::PointCloud<PointType>::Ptr localSurfMap_;
+  pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerMap_;
+  pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfMap_;
+  pcl::VoxelGrid<PointType> downSizeFilterCornerMap_;
+  pcl::VoxelGrid<PointType> downSizeFilterSurfMap_;
+  V3D lastLocalMapPos_;
+
   // !@Feature matching relatives
   std::vector<int> pointSelCornerInd;
   std::vector<double> pointSearchCornerInd1;
@@ -1476,26 +1883,47 @@ class StateEstimator {
   GlobalState globalState_;
   // !@Relative transformation from scan0-frame t0 scan1-frame
   GlobalState linState_;
-  Eigen::Matrix<double, GlobalState::DIM_OF_STATE_, 1> difVecLinInv_;
-  Eigen::Matrix<double, GlobalState::DIM_OF_STATE_, 1> updateVec_;
+  GlobalState::Vector difVecLinInv_;
+  GlobalState::Vector updateVec_;
   double updateVecNorm_ = 0.0;
 
   // !@Kalman filter relatives
-  VXD residual_;
+  typedef Eigen::Map<VXD> MapVXD;
+  typedef Eigen::Map<MXD> MapMXD;
+  typedef Eigen::Map<
+      Eigen::Matrix<double, Eigen::Dynamic, GlobalState::DIM_OF_STATE_>>
+      MapMeasurementJacobian;
   MXD Fk_;
   MXD Gk_;
-  MXD Pk_;
+  GlobalState::Matrix Pk_;
   MXD Qk_;
-  MXD Rk_;
-  MXD Hk_;
   MXD Jk_;
-  MXD Kk_;
-  MXD IKH_;
-  MXD Py_;
-  MXD Pyinv_;
+  GlobalState::Matrix IKH_;
+  Eigen::LLT<MXD> measurementLlt_;
+
+  // !@Batched point operations, one point per row
+  Vectors3d batchPoints_;
+  Vectors3d batchCoeffs_;
+  Vectors3d batchCross_;
+  Vectors3d batchResult_;
+  Eigen::ArrayXd batchFractions_;
+  pcl::PointCloud<PointType> startPoints_;  // scan undistorted to its start
+
+  // !@Per-scan buffers, released at the start of the next scan
+  arena::MonotonicArena scanArena_;
+  arena::ArenaVector<double> cloudCurvature_;
+  arena::ArenaVector<Smooth> cloudSmoothness_;
+  arena::ArenaVector<int> cloudNeighborPicked_;
+  arena::ArenaVector<int> cloudLabel_;
 
   // !@ IMU preintegration
-  integration::IntegrationBase* preintegration_;
+  integration::IntegrationBase* preintegration_ = nullptr;
+
+  // !@Static initialization
+  bool hasStaticInit_;
+  V3D staticBa_;
+  V3D staticBw_;
+  V3D staticAccMean_;
   Imu imu_last_;
 
   // !@Rotation matrices between XYZ-convention and YZX-convention
@@ -20,6 +20,10 @@ using namespace Eigen;
 using namespace filter;
 
 namespace integration {
+// The preintegrated error state uses the first five blocks of the full filter
+// layout, whatever layout the filter is built with
+typedef filter::StateLayout18 PreintegrationLayout;
+
 enum StateOrder { O_R = 0, O_P = 3, O_V = 6, O_BA = 9, O_BG = 12 };
 
 enum NoiseOrder { O_AN = 0, O_GN = 3, O_AW = 6, O_GW = 9 };
@@ -97,43 +101,43 @@ class IntegrationBase {
 
       // the order of a and theta is exchanged. and F = I + F*dt + 0.5*F^2*dt^2
       MatrixXd F = MatrixXd::Zero(15, 15);
-      F.block<3, 3>(GlobalState::pos_, GlobalState::pos_) =
+      F.block<3, 3>(PreintegrationLayout::pos_, PreintegrationLayout::pos_) =
           Matrix3d::Identity();
-      F.block<3, 3>(GlobalState::pos_, GlobalState::att_) =
+      F.block<3, 3>(PreintegrationLayout::pos_, PreintegrationLayout::att_) =
           -0.25 * delta_q.toRotationMatrix() * R_a_0_x * _dt * _dt +
           -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x *
               (Matrix3d::Identity() - R_w_x * _dt) * _dt * _dt;
-      F.block<3, 3>(GlobalState::pos_, GlobalState::vel_) =
+      F.block<3, 3>(PreintegrationLayout::pos_, PreintegrationLayout::vel_) =
           MatrixXd::Identity(3, 3) * _dt;
-      F.block<3, 3>(GlobalState::pos_, GlobalState::acc_) =
+      F.block<3, 3>(PreintegrationLayout::pos_, PreintegrationLayout::acc_) =
           -0.25 *
           (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) *
           _dt * _dt;
-      F.block<3, 3>(GlobalState::pos_, GlobalState::gyr_) =
+      F.block<3, 3>(PreintegrationLayout::pos_, PreintegrationLayout::gyr_) =
           -0.25 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * _dt *
           -_dt;
 
-      F.block<3, 3>(GlobalState::att_, GlobalState::att_) =
+      F.block<3, 3>(PreintegrationLayout::att_, PreintegrationLayout::att_) =
           Matrix3d::Identity() - R_w_x * _dt;
-      F.block<3, 3>(GlobalState::att_, GlobalState::gyr_) =
+      F.block<3, 3>(PreintegrationLayout::att_, PreintegrationLayout::gyr_) =
           -1.0 * MatrixXd::Identity(3, 3) * _dt;
 
-      F.block<3, 3>(GlobalState::vel_, GlobalState::att_) =
+      F.block<3, 3>(PreintegrationLayout::vel_, PreintegrationLayout::att_) =
           -0.5 * delta_q.toRotationMatrix() * R_a_0_x * _dt +
           -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x *
               (Matrix3d::Identity() - R_w_x * _dt) * _dt;
-      F.block<3, 3>(GlobalState::vel_, GlobalState::vel_) =
+      F.block<3, 3>(PreintegrationLayout::vel_, PreintegrationLayout::vel_) =
           Matrix3d::Identity();
-      F.block<3, 3>(GlobalState::vel_, GlobalState::acc_) =
+      F.block<3, 3>(PreintegrationLayout::vel_, PreintegrationLayout::acc_) =
           -0.5 *
           (delta_q.toRotationMatrix() + result_delta_q.toRotationMatrix()) *
           _dt;
-      F.block<3, 3>(GlobalState::vel_, GlobalState::gyr_) =
+      F.block<3, 3>(PreintegrationLayout::vel_, PreintegrationLayout::gyr_) =
           -0.5 * result_delta_q.toRotationMatrix() * R_a_1_x * _dt * -_dt;
 
-      F.block<3, 3>(GlobalState::acc_, GlobalState::acc_) =
+      F.block<3, 3>(PreintegrationLayout::acc_, PreintegrationLayout::acc_) =
           Matrix3d::Identity();
-      F.block<3, 3>(GlobalState::gyr_, GlobalState::gyr_) =
+      F.block<3, 3>(PreintegrationLayout::gyr_, PreintegrationLayout::gyr_) =
           Matrix3d::Identity();
 
       jacobian = F * jacobian;
@@ -187,6 +191,23 @@ class IntegrationBase {
     gyr_0 = gyr_1;
   }
 
+  // Integrate the buffered measurements again with new linearized biases
+  void repropagate(const Eigen::Vector3d &_linearized_ba,
+                   const Eigen::Vector3d &_linearized_bg) {
+    sum_dt = 0.0;
+    acc_0 = linearized_acc;
+    gyr_0 = linearized_gyr;
+    delta_p.setZero();
+    delta_q.setIdentity();
+    delta_v.setZero();
+    linearized_ba = _linearized_ba;
+    linearized_bg = _linearized_bg;
+    jacobian.setIdentity();
+    covariance.setZero();
+    for (int i = 0; i < static_cast<int>(dt_buf.size()); i++)
+      propagate(dt_buf[i], acc_buf[i], gyr_buf[i]);
+  }
+
   void setBa(const Eigen::Vector3d &ba) { linearized_ba = ba; }
 
   void setBg(const Eigen::Vector3d &bg) { linearized_bg = bg; }
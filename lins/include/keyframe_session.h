@@ -0,0 +1,218 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_KEYFRAME_SESSION_H_
+#define INCLUDE_KEYFRAME_SESSION_H_
+
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+#include <gtsam/slam/PriorFactor.h>
+#include <gtsam/slam/dataset.h>
+#include <parameters.h>
+#include <pcl/io/pcd_io.h>
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct PointXYZIRPYT {
+  PCL_ADD_POINT4D
+  PCL_ADD_INTENSITY;
+  float roll;
+  float pitch;
+  float yaw;
+  double time;
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+} EIGEN_ALIGN16;
+
+POINT_CLOUD_REGISTER_POINT_STRUCT(
+    PointXYZIRPYT,
+    (float, x, x)(float, y, y)(float, z, z)(float, intensity, intensity)(
+        float, roll, roll)(float, pitch, pitch)(float, yaw, yaw)(double, time,
+                                                                 time))
+
+typedef PointXYZIRPYT PointTypePose;
+
+namespace session {
+
+// Keyframes and pose graph of a finished mapping session. Poses and clouds are
+// in the camera-style frame of lidar_mapping_node, the graph and estimate in
+// its gtsam convention.
+//
+// On disk a session directory holds poses.pcd, graph.g2o and one
+// keyframes/<index>_{corner,surf,outlier}.pcd file per non-empty cloud.
+struct KeyframeSession {
+  KeyframeSession() : poses(new pcl::PointCloud<PointTypePose>()) {}
+
+  pcl::PointCloud<PointTypePose>::Ptr poses;
+  std::vector<pcl::PointCloud<PointType>::Ptr> cornerClouds;
+  std::vector<pcl::PointCloud<PointType>::Ptr> surfClouds;
+  std::vector<pcl::PointCloud<PointType>::Ptr> outlierClouds;
+  gtsam::NonlinearFactorGraph graph;
+  gtsam::Values estimate;
+};
+
+// Transform a keyframe cloud into the world frame with its keyframe pose
+inline pcl::PointCloud<PointType>::Ptr transformPointCloud(
+    const pcl::PointCloud<PointType>::Ptr& cloudIn,
+    const PointTypePose& transformIn) {
+  pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
+  int cloudSize = cloudIn->points.size();
+  cloudOut->resize(cloudSize);
+
+  float ctRoll = cos(transformIn.roll), stRoll = sin(transformIn.roll);
+  float ctPitch = cos(transformIn.pitch), stPitch = sin(transformIn.pitch);
+  float ctYaw = cos(transformIn.yaw), stYaw = sin(transformIn.yaw);
+
+  for (int i = 0; i < cloudSize; ++i) {
+    const PointType& pointFrom = cloudIn->points[i];
+    float x1 = ctYaw * pointFrom.x - stYaw * pointFrom.y;
+    float y1 = stYaw * pointFrom.x + ctYaw * pointFrom.y;
+    float z1 = pointFrom.z;
+
+    float x2 = x1;
+    float y2 = ctRoll * y1 - stRoll * z1;
+    float z2 = stRoll * y1 + ctRoll * z1;
+
+    PointType& pointTo = cloudOut->points[i];
+    pointTo.x = ctPitch * x2 + stPitch * z2 + transformIn.x;
+    pointTo.y = y2 + transformIn.y;
+    pointTo.z = -stPitch * x2 + ctPitch * z2 + transformIn.z;
+    pointTo.intensity = pointFrom.intensity;
+  }
+  return cloudOut;
+}
+
+inline std::string keyframePath(const std::string& directory, int index,
+                                const char* type) {
+  char name[64];
+  snprintf(name, sizeof(name), "/keyframes/%06d_%s.pcd", index, type);
+  return directory + name;
+}
+
+inline bool fileExists(const std::string& path) {
+  struct stat buffer;
+  return stat(path.c_str(), &buffer) == 0;
+}
+
+// PCL refuses to write empty clouds, so empty clouds are simply not written
+inline bool saveCloud(const std::string& path,
+                      const pcl::PointCloud<PointType>& cloud) {
+  if (cloud.empty()) return true;
+  return pcl::io::savePCDFileBinary(path, cloud) >= 0;
+}
+
+inline pcl::PointCloud<PointType>::Ptr loadCloud(const std::string& path) {
+  pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>());
+  if (fileExists(path)) pcl::io::loadPCDFile(path, *cloud);
+  return cloud;
+}
+
+inline bool saveSession(const std::string& directory,
+                        const KeyframeSession& session) {
+  mkdir(directory.c_str(), 0755);
+  mkdir((directory + "/keyframes").c_str(), 0755);
+
+  if (session.poses->empty() ||
+      pcl::io::savePCDFileBinary(directory + "/poses.pcd", *session.poses) < 0)
+    return false;
+
+  for (size_t i = 0; i < session.poses->size(); ++i) {
+    if (!saveCloud(keyframePath(directory, i, "corner"),
+                   *session.cornerClouds[i]) ||
+        !saveCloud(keyframePath(directory, i, "surf"),
+                   *session.surfClouds[i]) ||
+        !saveCloud(keyframePath(directory, i, "outlier"),
+                   *session.outlierClouds[i]))
+      return false;
+  }
+
+  gtsam::writeG2o(session.graph, session.estimate, directory + "/graph.g2o");
+  return true;
+}
+
+// g2o files hold no priors, so a loaded graph is anchored at its first pose
+// again, with the prior lidar_mapping_node puts there
+inline void anchorGraph(KeyframeSession& session) {
+  if (session.estimate.empty()) return;
+  gtsam::Vector Vector6(6);
+  Vector6 << 1e-6, 1e-6, 1e-6, 1e-8, 1e-8, 1e-6;
+  session.graph.add(gtsam::PriorFactor<gtsam::Pose3>(
+      0, session.estimate.at<gtsam::Pose3>(0),
+      gtsam::noiseModel::Diagonal::Variances(Vector6)));
+}
+
+// Load only the keyframe poses. The cloud slots are sized but left empty
+// until loadKeyframeClouds fetches them.
+inline bool loadSessionPoses(const std::string& directory,
+                             KeyframeSession& session) {
+  std::string posesPath = directory + "/poses.pcd";
+  if (!fileExists(posesPath)) return false;
+
+  session.poses->clear();
+  if (pcl::io::loadPCDFile(posesPath, *session.poses) < 0) return false;
+
+  int numKeyframes = session.poses->size();
+  session.cornerClouds.assign(numKeyframes, nullptr);
+  session.surfClouds.assign(numKeyframes, nullptr);
+  session.outlierClouds.assign(numKeyframes, nullptr);
+  return true;
+}
+
+// Load the clouds of keyframe index from the disk unless they are loaded
+// already. Different keyframes may be loaded concurrently.
+inline void loadKeyframeClouds(const std::string& directory,
+                               KeyframeSession& session, int index) {
+  if (session.cornerClouds[index]) return;
+  session.surfClouds[index] = loadCloud(keyframePath(directory, index, "surf"));
+  session.outlierClouds[index] =
+      loadCloud(keyframePath(directory, index, "outlier"));
+  session.cornerClouds[index] =
+      loadCloud(keyframePath(directory, index, "corner"));
+}
+
+// Free the clouds of all keyframes, keeping the poses
+inline void releaseKeyframeClouds(KeyframeSession& session) {
+  int numKeyframes = session.poses->size();
+  session.cornerClouds.assign(numKeyframes, nullptr);
+  session.surfClouds.assign(numKeyframes, nullptr);
+  session.outlierClouds.assign(numKeyframes, nullptr);
+}
+
+// Load the whole session: poses, all keyframe clouds and the pose graph
+inline bool loadSession(const std::string& directory,
+                        KeyframeSession& session) {
+  std::string graphPath = directory + "/graph.g2o";
+  if (!fileExists(graphPath) || !loadSessionPoses(directory, session))
+    return false;
+
+  int numKeyframes = session.poses->size();
+  for (int i = 0; i < numKeyframes; ++i)
+    loadKeyframeClouds(directory, session, i);
+
+  gtsam::GraphAndValues graphAndValues = gtsam::readG2o(graphPath, true);
+  session.graph = *graphAndValues.first;
+  session.estimate = *graphAndValues.second;
+  if (session.estimate.size() != session.poses->size()) return false;
+  anchorGraph(session);
+  return true;
+}
+
+}  // namespace session
+
+#endif  // INCLUDE_KEYFRAME_SESSION_H_
@@ -36,8 +36,9 @@ static Type wrap_pi(Type x) {
   return x;
 }
 
-static void enforceSymmetry(Eigen::MatrixXd &mat) {
-  mat = 0.5 * (mat + mat.transpose()).eval();
+template <typename Derived>
+static void enforceSymmetry(Eigen::MatrixBase<Derived> &mat) {
+  mat.derived() = 0.5 * (mat + mat.transpose()).eval();
 }
 
 static Eigen::Quaterniond axis2Quat(const Eigen::Vector3d &axis, double theta) {
@@ -320,6 +321,244 @@ static Eigen::Matrix<double, 3, 3> Rinvleft(
   return ans;
 }
 
+// !@Batched SO(3)/SE(3) operations
+// The functions below work on N vectors or rotations at once. They are stored
+// one per row, so that every component is a contiguous column and Eigen
+// vectorizes each step across the batch. Angles under SMALL_ANGLE use Taylor
+// expansions, and batches without larger angles skip the trigonometry.
+typedef Eigen::Matrix<double, Eigen::Dynamic, 3> Vectors3d;
+typedef Eigen::Matrix<double, Eigen::Dynamic, 4> Quaternions;  // x, y, z, w
+// Row i holds a 3x3 matrix, column r + 3 * c being its entry (r, c)
+typedef Eigen::Matrix<double, Eigen::Dynamic, 9> Matrices3d;
+typedef Eigen::Map<const Eigen::Matrix3d, 0, Eigen::InnerStride<> >
+    Matrix3dView;
+
+static const double SMALL_ANGLE = 1e-2;
+
+static Eigen::ArrayXd squaredNorms(const Vectors3d &v) {
+  return v.col(0).array().square() + v.col(1).array().square() +
+         v.col(2).array().square();
+}
+
+static bool allSmall(const Eigen::ArrayXd &angle) {
+  return angle.size() == 0 || angle.abs().maxCoeff() < SMALL_ANGLE;
+}
+
+// Matrix i of a batch
+static Matrix3dView matrixAt(const Matrices3d &m, int i) {
+  return Matrix3dView(m.data() + i, Eigen::InnerStride<>(m.rows()));
+}
+
+// sin(angle) and 1 - cos(angle)
+static void sinVersine(const Eigen::ArrayXd &angle, Eigen::ArrayXd &sine,
+                       Eigen::ArrayXd &versine) {
+  const Eigen::ArrayXd a2 = angle.square();
+  if (allSmall(angle)) {
+    sine = angle * (1.0 - a2 / 6.0 * (1.0 - a2 / 20.0));
+    versine = 0.5 * a2 * (1.0 - a2 / 12.0 * (1.0 - a2 / 30.0));
+  } else {
+    sine = angle.sin();
+    versine = 1.0 - angle.cos();
+  }
+}
+
+// out.row(i) = (R * in.row(i)^T)^T
+static void rotateBatch(const Eigen::Matrix3d &R, const Vectors3d &in,
+                        Vectors3d &out) {
+  out.resize(in.rows(), 3);
+  for (int r = 0; r < 3; ++r)
+    out.col(r) = R(r, 0) * in.col(0) + R(r, 1) * in.col(1) +
+                 R(r, 2) * in.col(2);
+}
+
+// out.row(i) = (R * in.row(i)^T + t)^T
+static void transformBatch(const Eigen::Matrix3d &R, const Eigen::Vector3d &t,
+                           const Vectors3d &in, Vectors3d &out) {
+  out.resize(in.rows(), 3);
+  for (int r = 0; r < 3; ++r)
+    out.col(r) = (R(r, 0) * in.col(0) + R(r, 1) * in.col(1) +
+                  R(r, 2) * in.col(2)).array() + t(r);
+}
+
+// out.row(i) = a.row(i) x b.row(i)
+static void crossBatch(const Vectors3d &a, const Vectors3d &b,
+                       Vectors3d &out) {
+  out.resize(a.rows(), 3);
+  for (int r = 0; r < 3; ++r) {
+    const int j = (r + 1) % 3, k = (r + 2) % 3;
+    out.col(r) = (a.col(j).array() * b.col(k).array() -
+                  a.col(k).array() * b.col(j).array()).matrix();
+  }
+}
+
+// Exponential map, q.row(i) = axis2Quat(phi.row(i))
+static void expBatch(const Vectors3d &phi, Quaternions &q) {
+  const int n = phi.rows();
+  const Eigen::ArrayXd angle2 = squaredNorms(phi);
+  // q = (w, k * phi)
+  Eigen::ArrayXd w(n), k(n);
+  if (allSmall(angle2.sqrt())) {
+    w = 1.0 - angle2 / 8.0 * (1.0 - angle2 / 48.0);
+    k = 0.5 - angle2 / 48.0 * (1.0 - angle2 / 80.0);
+  } else {
+    // Both branches for every element cost more than the scalar functions,
+    // so each element takes the one of its angle
+    for (int i = 0; i < n; ++i) {
+      const double angle = std::sqrt(angle2(i));
+      if (angle < SMALL_ANGLE) {
+        w(i) = 1.0 - angle2(i) / 8.0 * (1.0 - angle2(i) / 48.0);
+        k(i) = 0.5 - angle2(i) / 48.0 * (1.0 - angle2(i) / 80.0);
+      } else {
+        w(i) = std::cos(0.5 * angle);
+        k(i) = std::sin(0.5 * angle) / angle;
+      }
+    }
+  }
+  q.resize(n, 4);
+  for (int r = 0; r < 3; ++r) q.col(r) = (k * phi.col(r).array()).matrix();
+  q.col(3) = w.matrix();
+}
+
+// Logarithmic map, phi.row(i) = Quat2axis(q.row(i)), angles wrapped to
+// [-pi, pi)
+static void logBatch(const Quaternions &q, Vectors3d &phi) {
+  const int n = q.rows();
+  const Eigen::ArrayXd sin2 = q.col(0).array().square() +
+                              q.col(1).array().square() +
+                              q.col(2).array().square();
+  const Eigen::ArrayXd w = q.col(3).array();
+  // phi = k * (x, y, z) with k = wrap_pi(2 * atan2(|v|, w)) / |v|
+  Eigen::ArrayXd k(n);
+  if (n == 0 || sin2.maxCoeff() < SMALL_ANGLE * SMALL_ANGLE) {
+    // 2 * atan(r) / |v| with r = |v| / w, valid for either sign of w
+    const Eigen::ArrayXd r2 = sin2 / w.square();
+    k = 2.0 / w * (1.0 - r2 / 3.0 + r2.square() / 5.0 - r2.cube() / 7.0);
+  } else {
+    const Eigen::ArrayXd sine = sin2.sqrt();
+    for (int i = 0; i < n; ++i)
+      k(i) = sine(i) < 1e-10
+                 ? 2.0 / w(i)
+                 : wrap_pi(2.0 * atan2(sine(i), w(i))) / sine(i);
+  }
+  phi.resize(n, 3);
+  for (int r = 0; r < 3; ++r) phi.col(r) = (k * q.col(r).array()).matrix();
+}
+
+// J.row(i) = I + a(i) * [phi]x + b(i) * [phi]x^2, where
+// [phi]x^2 = phi * phi^T - |phi|^2 * I
+static void so3JacobianBatch(const Vectors3d &phi, const Eigen::ArrayXd &a,
+                             const Eigen::ArrayXd &b,
+                             const Eigen::ArrayXd &angle2, Matrices3d &J) {
+  J.resize(phi.rows(), 9);
+  const Eigen::ArrayXd diagonal = 1.0 - b * angle2;
+  for (int c = 0; c < 3; ++c) {
+    for (int r = 0; r < 3; ++r) {
+      Eigen::ArrayXd entry = b * phi.col(r).array() * phi.col(c).array();
+      if (r == c) {
+        entry += diagonal;
+      } else {
+        // [phi]x(r, c) = +-phi(3 - r - c)
+        const double sign = (c - r == 1 || c - r == -2) ? -1.0 : 1.0;
+        entry += sign * a * phi.col(3 - r - c).array();
+      }
+      J.col(r + 3 * c) = entry.matrix();
+    }
+  }
+}
+
+// (1 - cos(angle)) / angle^2 and (angle - sin(angle)) / angle^3
+static void so3JacobianCoefficients(const Eigen::ArrayXd &angle2,
+                                    Eigen::ArrayXd &a, Eigen::ArrayXd &b) {
+  const Eigen::ArrayXd angle = angle2.sqrt();
+  const Eigen::ArrayXd aSmall =
+      0.5 - angle2 / 24.0 * (1.0 - angle2 / 30.0);
+  const Eigen::ArrayXd bSmall =
+      1.0 / 6.0 - angle2 / 120.0 * (1.0 - angle2 / 42.0);
+  if (allSmall(angle)) {
+    a = aSmall;
+    b = bSmall;
+  } else {
+    a = (angle < SMALL_ANGLE).select(aSmall, (1.0 - angle.cos()) / angle2);
+    b = (angle < SMALL_ANGLE)
+            .select(bSmall, (angle - angle.sin()) / (angle2 * angle));
+  }
+}
+
+// 1 / angle^2 - (1 + cos(angle)) / (2 * angle * sin(angle)), one branch per
+// element as in expBatch
+static Eigen::ArrayXd so3InverseJacobianCoefficient(
+    const Eigen::ArrayXd &angle2) {
+  if (allSmall(angle2.sqrt()))
+    return 1.0 / 12.0 + angle2 / 720.0 * (1.0 + angle2 / 42.0);
+  Eigen::ArrayXd b(angle2.size());
+  for (int i = 0; i < angle2.size(); ++i) {
+    const double angle = std::sqrt(angle2(i));
+    b(i) = angle < SMALL_ANGLE
+               ? 1.0 / 12.0 + angle2(i) / 720.0 * (1.0 + angle2(i) / 42.0)
+               : 1.0 / angle2(i) - (1.0 + std::cos(angle)) /
+                                       (2.0 * angle * std::sin(angle));
+  }
+  return b;
+}
+
+// Left Jacobians, J.row(i) = Rleft(phi.row(i))
+static void leftJacobianBatch(const Vectors3d &phi, Matrices3d &J) {
+  const Eigen::ArrayXd angle2 = squaredNorms(phi);
+  Eigen::ArrayXd a, b;
+  so3JacobianCoefficients(angle2, a, b);
+  so3JacobianBatch(phi, a, b, angle2, J);
+}
+
+// Right Jacobians, Jr(phi) = Jl(-phi)
+static void rightJacobianBatch(const Vectors3d &phi, Matrices3d &J) {
+  const Eigen::ArrayXd angle2 = squaredNorms(phi);
+  Eigen::ArrayXd a, b;
+  so3JacobianCoefficients(angle2, a, b);
+  so3JacobianBatch(phi, -a, b, angle2, J);
+}
+
+// Inverse left Jacobians, J.row(i) = Rinvleft(phi.row(i))
+static void leftJacobianInverseBatch(const Vectors3d &phi, Matrices3d &J) {
+  const Eigen::ArrayXd angle2 = squaredNorms(phi);
+  so3JacobianBatch(phi, Eigen::ArrayXd::Constant(phi.rows(), -0.5),
+                   so3InverseJacobianCoefficient(angle2), angle2, J);
+}
+
+// Inverse right Jacobians
+static void rightJacobianInverseBatch(const Vectors3d &phi, Matrices3d &J) {
+  const Eigen::ArrayXd angle2 = squaredNorms(phi);
+  so3JacobianBatch(phi, Eigen::ArrayXd::Constant(phi.rows(), 0.5),
+                   so3InverseJacobianCoefficient(angle2), angle2, J);
+}
+
+// Fractions of one motion: out.row(i) = axis2Quat(s(i) * phi) * in.row(i) +
+// s(i) * t, used to undistort a scan by Rodrigues' formula
+static void interpolateTransformBatch(const Eigen::Vector3d &phi,
+                                      const Eigen::Vector3d &t,
+                                      const Eigen::ArrayXd &s,
+                                      const Vectors3d &in, Vectors3d &out) {
+  out.resize(in.rows(), 3);
+  const double angle = phi.norm();
+  if (angle < 1e-10) {
+    for (int r = 0; r < 3; ++r)
+      out.col(r) = (in.col(r).array() + s * t(r)).matrix();
+    return;
+  }
+  const Eigen::Vector3d axis = phi / angle;
+  Eigen::ArrayXd sine, versine;
+  sinVersine(s * angle, sine, versine);
+  const Eigen::ArrayXd x = in.col(0).array(), y = in.col(1).array(),
+                       z = in.col(2).array();
+  const Eigen::ArrayXd along = axis(0) * x + axis(1) * y + axis(2) * z;
+  // R p = p + sin * (axis x p) + (1 - cos) * (axis (axis . p) - p)
+  out.col(0) = (x + sine * (axis(1) * z - axis(2) * y) +
+                versine * (axis(0) * along - x) + s * t(0)).matrix();
+  out.col(1) = (y + sine * (axis(2) * x - axis(0) * z) +
+                versine * (axis(1) * along - y) + s * t(1)).matrix();
+  out.col(2) = (z + sine * (axis(0) * y - axis(1) * x) +
+                versine * (axis(2) * along - z) + s * t(2)).matrix();
+}
+
 }  // namespace math_utils
 
 #endif  // INCLUDE_MATH_UTILS_H_
@@ -0,0 +1,265 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_METRICS_H_
+#define INCLUDE_METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace metrics {
+
+// Metrics are registered once (under a mutex) and then updated lock-free by
+// the owner through the returned reference. Registered metrics live as long as
+// the process.
+class Metric {
+ public:
+  virtual ~Metric() {}
+  virtual const char* type() const = 0;
+  // Append the samples in Prometheus text format
+  virtual void render(std::ostream& os, const std::string& name,
+                      const std::string& labels) const = 0;
+  // Short summary for the diagnostics topic
+  virtual std::string summary() const = 0;
+
+ protected:
+  static void atomicAdd(std::atomic<double>& target, double value) {
+    double old = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(old, old + value,
+                                         std::memory_order_relaxed)) {
+    }
+  }
+
+  static std::string withLabels(const std::string& labels,
+                                const std::string& extra) {
+    if (labels.empty() && extra.empty()) return "";
+    if (labels.empty()) return "{" + extra + "}";
+    if (extra.empty()) return "{" + labels + "}";
+    return "{" + labels + "," + extra + "}";
+  }
+};
+
+// Monotonically increasing count of events
+class Counter : public Metric {
+ public:
+  Counter() : value_(0) {}
+
+  inline void inc(uint64_t n = 1) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+  inline uint64_t value() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+  const char* type() const { return "counter"; }
+  void render(std::ostream& os, const std::string& name,
+              const std::string& labels) const {
+    os << name << withLabels(labels, "") << " " << value() << "\n";
+  }
+  std::string summary() const { return std::to_string(value()); }
+
+ private:
+  std::atomic<uint64_t> value_;
+};
+
+// Instantaneous value, e.g. a feature count or a buffer size
+class Gauge : public Metric {
+ public:
+  Gauge() : value_(0.0) {}
+
+  inline void set(double value) {
+    value_.store(value, std::memory_order_relaxed);
+  }
+  inline void add(double value) { atomicAdd(value_, value); }
+  inline double value() const { return value_.load(std::memory_order_relaxed); }
+
+  const char* type() const { return "gauge"; }
+  void render(std::ostream& os, const std::string& name,
+              const std::string& labels) const {
+    os << name << withLabels(labels, "") << " " << value() << "\n";
+  }
+  std::string summary() const { return std::to_string(value()); }
+
+ private:
+  std::atomic<double> value_;
+};
+
+// Distribution of observations over fixed upper bounds
+class Histogram : public Metric {
+ public:
+  explicit Histogram(const std::vector<double>& bounds)
+      : bounds_(bounds),
+        buckets_(new std::atomic<uint64_t>[bounds.size() + 1]),
+        count_(0),
+        sum_(0.0) {
+    for (size_t i = 0; i <= bounds_.size(); ++i) buckets_[i].store(0);
+  }
+
+  inline void observe(double value) {
+    size_t i = 0;
+    while (i < bounds_.size() && value > bounds_[i]) ++i;
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    atomicAdd(sum_, value);
+  }
+  inline uint64_t count() const {
+    return count_.load(std::memory_order_relaxed);
+  }
+  inline double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+  const char* type() const { return "histogram"; }
+  void render(std::ostream& os, const std::string& name,
+              const std::string& labels) const {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= bounds_.size(); ++i) {
+      cumulative += buckets_[i].load(std::memory_order_relaxed);
+      std::ostringstream le;
+      if (i < bounds_.size())
+        le << "le=\"" << bounds_[i] << "\"";
+      else
+        le << "le=\"+Inf\"";
+      os << name << "_bucket" << withLabels(labels, le.str()) << " "
+         << cumulative << "\n";
+    }
+    os << name << "_sum" << withLabels(labels, "") << " " << sum() << "\n";
+    os << name << "_count" << withLabels(labels, "") << " " << count()
+       << "\n";
+  }
+  std::string summary() const {
+    uint64_t n = count();
+    std::ostringstream ss;
+    ss << "count " << n << ", mean " << (n > 0 ? sum() / n : 0.0);
+    return ss.str();
+  }
+
+  // Upper bounds in milliseconds suitable for per-scan processing times
+  static std::vector<double> latencyBounds() {
+    return {0.1, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000};
+  }
+
+ private:
+  const std::vector<double> bounds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+  std::atomic<uint64_t> count_;
+  std::atomic<double> sum_;
+};
+
+class Registry {
+ public:
+  static Registry& instance() {
+    static Registry registry;
+    return registry;
+  }
+
+  // Labels are given in Prometheus syntax without braces, e.g.
+  // buffer="imu". Registering an existing name and label set returns the
+  // already registered metric.
+  Counter& counter(const std::string& name, const std::string& help,
+                   const std::string& labels = "") {
+    return *getOrCreate<Counter>(name, help, labels,
+                                 [] { return new Counter(); });
+  }
+
+  Gauge& gauge(const std::string& name, const std::string& help,
+               const std::string& labels = "") {
+    return *getOrCreate<Gauge>(name, help, labels, [] { return new Gauge(); });
+  }
+
+  Histogram& histogram(
+      const std::string& name, const std::string& help,
+      const std::string& labels = "",
+      const std::vector<double>& bounds = Histogram::latencyBounds()) {
+    return *getOrCreate<Histogram>(name, help, labels, [&bounds] {
+      return new Histogram(bounds);
+    });
+  }
+
+  std::string renderPrometheus() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::ostringstream os;
+    for (const auto& family : families_) {
+      if (family.second.metrics.empty()) continue;
+      os << "# HELP " << family.first << " " << family.second.help << "\n";
+      os << "# TYPE " << family.first << " "
+         << family.second.metrics.begin()->second->type() << "\n";
+      for (const auto& metric : family.second.metrics)
+        metric.second->render(os, family.first, metric.first);
+    }
+    return os.str();
+  }
+
+  std::vector<std::pair<std::string, std::string>> summaries() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::vector<std::pair<std::string, std::string>> values;
+    for (const auto& family : families_) {
+      for (const auto& metric : family.second.metrics) {
+        std::string key = family.first;
+        if (!metric.first.empty()) key += "{" + metric.first + "}";
+        values.push_back(std::make_pair(key, metric.second->summary()));
+      }
+    }
+    return values;
+  }
+
+ private:
+  struct Family {
+    std::string help;
+    std::map<std::string, std::unique_ptr<Metric>> metrics;
+  };
+
+  Registry() {}
+  Registry(const Registry&) = delete;
+  Registry& operator=(const Registry&) = delete;
+
+  template <typename T, typename Factory>
+  T* getOrCreate(const std::string& name, const std::string& help,
+                 const std::string& labels, Factory factory) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    Family& family = families_[name];
+    if (family.help.empty()) family.help = help;
+    std::unique_ptr<Metric>& metric = family.metrics[labels];
+    if (!metric) metric.reset(factory());
+    // A name registered with another metric type is a programming error
+    T* typed = dynamic_cast<T*>(metric.get());
+    if (typed == nullptr) std::terminate();
+    return typed;
+  }
+
+  std::mutex mtx_;
+  std::map<std::string, Family> families_;
+};
+
+// Publish the registry of this process on the ROS diagnostics topic and, if
+// port > 0, serve it in Prometheus text format on 127.0.0.1:port. Both run in
+// a background thread until the node shuts down or stopExporter is called.
+void startExporter(const std::string& nodeName, int port);
+
+// Stop and join the exporter thread. Runs at exit, before the registry is
+// destroyed; nodes may call it earlier.
+void stopExporter();
+
+}  // namespace metrics
+
+#endif  // INCLUDE_METRICS_H_
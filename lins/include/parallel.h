@@ -0,0 +1,437 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_PARALLEL_H_
+#define INCLUDE_PARALLEL_H_
+
+#include <metrics.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+// Number of elements per block of a deterministic reduction. Partial results
+// depend only on this constant, never on the number of threads.
+const int REDUCE_BLOCK_SIZE = 256;
+
+// Priority classes of tasks, most urgent first
+enum Priority {
+  REALTIME = 0,   // odometry
+  MAPPING,        // scan-to-map registration
+  LOOP_CLOSURE,   // loop detection and verification
+  VISUALIZATION,  // map publishing and export
+  NUM_PRIORITIES
+};
+
+inline const char* priorityName(Priority priority) {
+  static const char* names[] = {"realtime", "mapping", "loop_closure",
+                                "visualization"};
+  return names[priority];
+}
+
+// Priority of the task running on the calling thread. Threads outside the
+// scheduler count as MAPPING unless they set otherwise.
+inline Priority& currentPriority() {
+  static thread_local Priority priority = MAPPING;
+  return priority;
+}
+
+// Kind of task, identified by priority and name, with the histograms its
+// tasks are recorded in. Obtained once per call site from
+// Scheduler::taskKind, so that submitting a task never looks up metrics.
+struct TaskKind {
+  Priority priority;
+  metrics::Histogram* wait;
+  metrics::Histogram* run;
+};
+
+// Tasks whose completion is waited for together
+class TaskGroup {
+ public:
+  TaskGroup() : pending_(0) {}
+  bool done() const { return pending_ == 0; }
+
+ private:
+  friend class Scheduler;
+  std::atomic<int> pending_;
+};
+
+// Work-stealing task scheduler shared by all parallel stages of a node, so
+// that they neither oversubscribe the cores nor spawn threads per call.
+//
+// Every worker has a deque per priority. Tasks submitted from a worker go to
+// the back of its own deque and are taken from there, most recent first;
+// tasks submitted from other threads go to a shared queue. An idle worker
+// takes the most urgent task it finds, looking at its own deque, the shared
+// queue and the deques of the others, from which it steals the oldest task.
+// Tasks are not preempted, so LOOP_CLOSURE and VISUALIZATION tasks together
+// occupy at most all but one worker, which is left for the urgent classes.
+//
+// Every task is counted under its kind: the time it waited in a queue and
+// the time it ran are exported as lins_task_wait_ms and lins_task_run_ms.
+//
+// The tail latencies and utilisation given for this design were measured
+// with simulated workloads on a single-core machine only, not on the
+// multi-core targets.
+class Scheduler {
+ public:
+  static Scheduler& instance() {
+    static Scheduler scheduler;
+    return scheduler;
+  }
+
+  // Start numThreads workers, or one per core if numThreads <= 0. Only the
+  // first call has an effect; submitting a task starts the default.
+  void start(int numThreads) {
+    std::lock_guard<std::mutex> lock(startMtx_);
+    if (started_) return;
+    if (numThreads <= 0)
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+    backgroundLimit_ = std::max(1, numThreads - 1);
+    for (int i = 0; i < numThreads; ++i)
+      workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+    for (int i = 0; i < numThreads; ++i)
+      threads_.emplace_back(&Scheduler::workerLoop, this, i);
+    started_ = true;
+  }
+
+  int numThreads() {
+    if (!started_) start(0);
+    return workers_.size();
+  }
+
+  // Kind of the tasks of the given priority and name. Registers the metrics
+  // of the kind under a lock on the first call, so call sites keep the
+  // result, e.g. in a function-local static.
+  TaskKind& taskKind(Priority priority, const char* name) {
+    std::lock_guard<std::mutex> lock(kindsMtx_);
+    std::string labels = std::string("priority=\"") + priorityName(priority) +
+                         "\",task=\"" + name + "\"";
+    std::unique_ptr<TaskKind>& kind = kinds_[labels];
+    if (!kind) {
+      metrics::Registry& registry = metrics::Registry::instance();
+      kind.reset(new TaskKind());
+      kind->priority = priority;
+      kind->wait = &registry.histogram(
+          "lins_task_wait_ms", "Time tasks waited for a worker", labels);
+      kind->run =
+          &registry.histogram("lins_task_run_ms", "Time tasks ran", labels);
+    }
+    return *kind;
+  }
+
+  // Queue fn as a task of the given kind. If group is given, the task is
+  // counted in it until it has run.
+  void submit(TaskKind& kind, std::function<void()> fn,
+              TaskGroup* group = nullptr) {
+    if (!started_) start(0);
+    Priority priority = kind.priority;
+    Task task;
+    task.fn = std::move(fn);
+    task.priority = priority;
+    task.group = group;
+    task.kind = &kind;
+    task.queued = std::chrono::steady_clock::now();
+    if (group != nullptr) ++group->pending_;
+
+    int index = workerIndex();
+    if (index >= 0 && workerOwner() == this) {
+      Worker& worker = *workers_[index];
+      std::lock_guard<std::mutex> lock(worker.mtx);
+      worker.tasks[priority].push_back(std::move(task));
+    } else {
+      std::lock_guard<std::mutex> lock(sharedMtx_);
+      shared_[priority].push_back(std::move(task));
+    }
+    ++queued_[priority];
+    wake();
+  }
+
+  // Block until all tasks of group have run. Meanwhile the calling thread
+  // runs queued tasks at least as urgent as its own priority, which keeps
+  // nested parallel loops from deadlocking.
+  void wait(TaskGroup& group) {
+    Priority own = currentPriority();
+    while (!group.done()) {
+      Task task;
+      if (take(own, false, task)) {
+        run(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMtx_);
+      sleepCond_.wait_for(lock, std::chrono::milliseconds(1),
+                          [&group] { return group.done(); });
+    }
+  }
+
+  ~Scheduler() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMtx_);
+      stop_ = true;
+    }
+    sleepCond_.notify_all();
+    for (std::thread& thread : threads_) thread.join();
+  }
+
+ private:
+  struct Task {
+    std::function<void()> fn;
+    Priority priority;
+    TaskGroup* group;
+    TaskKind* kind;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  struct Worker {
+    std::mutex mtx;
+    std::deque<Task> tasks[NUM_PRIORITIES];
+  };
+
+  Scheduler()
+      : started_(false),
+        backgroundLimit_(1),
+        backgroundRunning_(0),
+        wakeups_(0),
+        stop_(false) {
+    for (int p = 0; p < NUM_PRIORITIES; ++p) queued_[p] = 0;
+    // The registry has to outlive the workers, which record into it
+    metrics::Registry::instance();
+  }
+
+  // Index of the calling thread among the workers of its scheduler, or -1
+  static int& workerIndex() {
+    static thread_local int index = -1;
+    return index;
+  }
+  static Scheduler*& workerOwner() {
+    static thread_local Scheduler* owner = nullptr;
+    return owner;
+  }
+
+  void wake() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMtx_);
+      ++wakeups_;
+    }
+    sleepCond_.notify_all();
+  }
+
+  void workerLoop(int index) {
+    workerIndex() = index;
+    workerOwner() = this;
+    while (true) {
+      uint64_t wakeups;
+      {
+        std::lock_guard<std::mutex> lock(sleepMtx_);
+        if (stop_) return;
+        wakeups = wakeups_;
+      }
+      Task task;
+      if (take(VISUALIZATION, true, task)) {
+        bool background = task.priority >= LOOP_CLOSURE;
+        run(task);
+        if (background) {
+          --backgroundRunning_;
+          wake();
+        }
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMtx_);
+      sleepCond_.wait(lock, [&] { return stop_ || wakeups_ != wakeups; });
+    }
+  }
+
+  // Take the most urgent queued task of at most the given priority. Workers
+  // reserve a background slot before taking a LOOP_CLOSURE or VISUALIZATION
+  // task.
+  bool take(Priority lowest, bool reserve, Task& task) {
+    int index = workerOwner() == this ? workerIndex() : -1;
+    for (int p = 0; p <= lowest; ++p) {
+      if (queued_[p] == 0) continue;
+      bool background = reserve && p >= LOOP_CLOSURE;
+      if (background && ++backgroundRunning_ > backgroundLimit_) {
+        --backgroundRunning_;
+        return false;
+      }
+      if (takeAt(Priority(p), index, task)) {
+        --queued_[p];
+        return true;
+      }
+      if (background) --backgroundRunning_;
+    }
+    return false;
+  }
+
+  bool takeAt(Priority priority, int index, Task& task) {
+    if (index >= 0 && popBack(*workers_[index], priority, task)) return true;
+    {
+      std::lock_guard<std::mutex> lock(sharedMtx_);
+      if (!shared_[priority].empty()) {
+        task = std::move(shared_[priority].front());
+        shared_[priority].pop_front();
+        return true;
+      }
+    }
+    int numWorkers = workers_.size();
+    for (int i = 1; i <= numWorkers; ++i) {
+      int victim = (std::max(index, 0) + i) % numWorkers;
+      if (victim == index) continue;
+      Worker& worker = *workers_[victim];
+      std::lock_guard<std::mutex> lock(worker.mtx);
+      if (worker.tasks[priority].empty()) continue;
+      task = std::move(worker.tasks[priority].front());
+      worker.tasks[priority].pop_front();
+      static metrics::Counter& steals = metrics::Registry::instance().counter(
+          "lins_task_steals_total", "Tasks taken from another worker");
+      steals.inc();
+      return true;
+    }
+    return false;
+  }
+
+  static bool popBack(Worker& worker, Priority priority, Task& task) {
+    std::lock_guard<std::mutex> lock(worker.mtx);
+    if (worker.tasks[priority].empty()) return false;
+    task = std::move(worker.tasks[priority].back());
+    worker.tasks[priority].pop_back();
+    return true;
+  }
+
+  void run(Task& task) {
+    typedef std::chrono::duration<double, std::milli> Milliseconds;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    task.kind->wait->observe(Milliseconds(start - task.queued).count());
+
+    Priority outer = currentPriority();
+    currentPriority() = task.priority;
+    task.fn();
+    currentPriority() = outer;
+
+    task.kind->run->observe(
+        Milliseconds(std::chrono::steady_clock::now() - start).count());
+    if (task.group != nullptr && --task.group->pending_ == 0) wake();
+  }
+
+  std::mutex startMtx_;
+  std::atomic<bool> started_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::mutex sharedMtx_;
+  std::deque<Task> shared_[NUM_PRIORITIES];
+  std::atomic<int> queued_[NUM_PRIORITIES];
+
+  int backgroundLimit_;
+  std::atomic<int> backgroundRunning_;
+
+  std::mutex sleepMtx_;
+  std::condition_variable sleepCond_;
+  uint64_t wakeups_;  // bumped whenever there may be new work
+  bool stop_;
+
+  std::mutex kindsMtx_;
+  std::map<std::string, std::unique_ptr<TaskKind>> kinds_;
+};
+
+// Kind of the ranges of parallelFor at the given priority, resolved once per
+// priority since parallelFor runs on the hot paths
+inline TaskKind& parallelForKind(Priority priority) {
+  static TaskKind* kinds[NUM_PRIORITIES] = {
+      &Scheduler::instance().taskKind(REALTIME, "parallel_for"),
+      &Scheduler::instance().taskKind(MAPPING, "parallel_for"),
+      &Scheduler::instance().taskKind(LOOP_CLOSURE, "parallel_for"),
+      &Scheduler::instance().taskKind(VISUALIZATION, "parallel_for")};
+  return *kinds[priority];
+}
+
+// Run fn(begin, end) over [0, n) as numThreads tasks on the scheduler, each
+// handling one contiguous range, at the priority of the calling thread. The
+// calling thread processes the first range and helps with the others.
+template <typename Fn>
+void parallelFor(int n, int numThreads, Fn fn) {
+  numThreads = std::max(1, std::min(numThreads, n));
+  if (numThreads == 1) {
+    if (n > 0) fn(0, n);
+    return;
+  }
+
+  Scheduler& scheduler = Scheduler::instance();
+  TaskKind& kind = parallelForKind(currentPriority());
+  TaskGroup group;
+  int chunk = (n + numThreads - 1) / numThreads;
+  for (int t = 1; t < numThreads; ++t) {
+    int begin = std::min(n, t * chunk);
+    int end = std::min(n, begin + chunk);
+    if (begin < end)
+      scheduler.submit(kind, [&fn, begin, end] { fn(begin, end); }, &group);
+  }
+  fn(0, std::min(n, chunk));
+  scheduler.wait(group);
+}
+
+// Sum fn(begin, end, partial) over [0, n), where fn accumulates the elements
+// of its range into partial (initialized to zero).
+//
+// In deterministic mode the range is cut into blocks of REDUCE_BLOCK_SIZE and
+// the block sums are added in block order, so the floating-point result is
+// bit-identical for any numThreads. Otherwise every thread reduces one range
+// and the thread sums are added in completion order, which is slightly cheaper
+// but depends on the thread count and on scheduling.
+template <typename T, typename Fn>
+T parallelReduce(int n, int numThreads, bool deterministic, const T& zero,
+                 Fn fn) {
+  if (deterministic) {
+    int numBlocks = (n + REDUCE_BLOCK_SIZE - 1) / REDUCE_BLOCK_SIZE;
+    std::vector<T> partials(numBlocks, zero);
+    parallelFor(numBlocks, numThreads, [&](int blockBegin, int blockEnd) {
+      for (int b = blockBegin; b < blockEnd; ++b) {
+        T partial = zero;
+        fn(b * REDUCE_BLOCK_SIZE, std::min(n, (b + 1) * REDUCE_BLOCK_SIZE),
+           partial);
+        partials[b] = partial;
+      }
+    });
+    T sum = zero;
+    for (int b = 0; b < numBlocks; ++b) sum += partials[b];
+    return sum;
+  }
+
+  T sum = zero;
+  std::mutex mtx;
+  parallelFor(n, numThreads, [&](int begin, int end) {
+    T partial = zero;
+    fn(begin, end, partial);
+    std::lock_guard<std::mutex> lock(mtx);
+    sum += partial;
+  });
+  return sum;
+}
+
+}  // namespace parallel
+
+#endif  // INCLUDE_PARALLEL_H_
@@ -98,7 +98,17 @@ const int surroundingKeyframeSearchNum = 50;
 const float historyKeyframeSearchRadius = 5.0;
 const int historyKeyframeSearchNum = 25;
 const float historyKeyframeFitnessScore = 0.3;
+const int loopClosureCandidateNum = 4;
+const float loopRetryDistance = 2.0;     // m
+const float loopRetryCorrection = 0.05;  // m, rad
 const float globalMapVisualizationSearchRadius = 500.0;
+const int localMapKeyframeNum = 20;
+const float localMapKeyframeDist = 0.5;
+const double staticGyrThreshold = 0.02;  // rad/s
+const double staticAccThreshold = 0.3;   // m/s^2
+const int relocalizationScanNum = 5;
+const int relocalizationCandidateNum = 4;
+const float mapOriginRebaseDistance = 500.0;  // m
 
 // !@ENABLE_CALIBRATION
 extern int CALIBARTE_IMU;
@@ -110,6 +120,7 @@ extern double IMU_LIDAR_EXTRINSIC_ANGLE;
 extern double IMU_MISALIGN_ANGLE;
 
 // !@LIDAR_PARAMETERS
+extern std::string LIDAR_MODEL;
 extern int LINE_NUM;
 extern int SCAN_NUM;
 extern double SCAN_PERIOD;
@@ -124,6 +135,30 @@ extern int MAX_LIDAR_NUMS;
 extern int NUM_ITER;
 extern double LIDAR_SCALE;
 extern double LIDAR_STD;
+extern int DETERMINISTIC_MODE;
+
+// !@MAPPING
+extern int MAPPING_PYRAMID_LEVELS;
+extern int TIGHTLY_COUPLED_MAPPING;
+extern double MAPPING_REQUERY_RATIO;
+extern int MAPPING_REQUERY_ITERATIONS;
+extern int MAPPING_VOXEL_MAP;
+extern int MAPPING_PROJECTIVE_ASSOCIATION;
+extern int MAPPING_CORNER_BUDGET;
+extern int MAPPING_SURF_BUDGET;
+extern int MAPPING_THREADS;
+extern int LOOP_CLOSURE_THREADS;
+extern std::string SESSION_DIRECTORY;
+extern std::string RELOCALIZATION_MAP;
+extern std::string SHARED_MAP;
+extern std::string SCAN_LOG;
+extern std::string REPLAY_SCAN_LOG;
+extern int BATCH_THREADS;
+extern int SCHEDULER_THREADS;
+
+// !@METRICS
+extern int METRICS_PORT;
+extern int SCAN_TRACE;
 
 // !@SUB_TOPIC_NAME
 extern std::string IMU_TOPIC;
@@ -143,6 +178,8 @@ extern V3D INIT_VEL_STD;
 extern V3D INIT_ATT_STD;
 extern V3D INIT_ACC_STD;
 extern V3D INIT_GYR_STD;
+extern int BATCH_IMU_PROPAGATION;
+extern double IMU_AGGREGATION_RATE;
 
 // !@INITIAL IMU BIASES
 extern V3D INIT_BA;
@@ -0,0 +1,265 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_PLACE_RECOGNITION_H_
+#define INCLUDE_PLACE_RECOGNITION_H_
+
+#include <fcntl.h>
+#include <keyframe_session.h>
+#include <parallel.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace place_recognition {
+
+// Scan Context style descriptor: the neighbourhood of a position is cut into
+// NUM_RINGS rings and NUM_SECTORS sectors on the ground plane, and each bin
+// keeps the highest point. The ring key (occupancy of every ring) does not
+// change with the heading and is used for the coarse search.
+const int NUM_RINGS = 20;
+const int NUM_SECTORS = 60;
+const float MAX_RADIUS = 80.0;
+const float HEIGHT_OFFSET = 2.0;  // keeps bins of points below the sensor > 0
+const int RING_KEY_CANDIDATES = 50;
+
+struct Descriptor {
+  float position[3];
+  float ringKey[NUM_RINGS];
+  float context[NUM_RINGS * NUM_SECTORS];
+};
+
+struct Match {
+  int keyframe;
+  int shift;  // sectors the query is rotated by against the keyframe
+  float distance;
+};
+
+// Clouds are in the camera-style frame of the mapping node: the ground plane
+// is spanned by z and x, and y points up
+inline void computeDescriptor(const pcl::PointCloud<PointType>& cloud,
+                              const float position[3],
+                              Descriptor& descriptor) {
+  memset(&descriptor, 0, sizeof(Descriptor));
+  memcpy(descriptor.position, position, sizeof(descriptor.position));
+
+  for (const PointType& point : cloud.points) {
+    float dz = point.z - position[2];
+    float dx = point.x - position[0];
+    float height = point.y - position[1] + HEIGHT_OFFSET;
+    float radius = sqrt(dz * dz + dx * dx);
+    if (radius >= MAX_RADIUS || height <= 0) continue;
+
+    float angle = atan2(dx, dz);
+    if (angle < 0) angle += 2 * M_PI;
+    int ring = std::min(int(radius / MAX_RADIUS * NUM_RINGS), NUM_RINGS - 1);
+    int sector =
+        std::min(int(angle / (2 * M_PI) * NUM_SECTORS), NUM_SECTORS - 1);
+    float& bin = descriptor.context[ring * NUM_SECTORS + sector];
+    bin = std::max(bin, height);
+  }
+
+  for (int ring = 0; ring < NUM_RINGS; ++ring) {
+    int occupied = 0;
+    for (int sector = 0; sector < NUM_SECTORS; ++sector)
+      if (descriptor.context[ring * NUM_SECTORS + sector] > 0) ++occupied;
+    descriptor.ringKey[ring] = float(occupied) / NUM_SECTORS;
+  }
+}
+
+// Mean cosine distance between the columns of the query rotated by shift
+// sectors and the columns of the keyframe. Empty columns are skipped.
+inline float contextDistance(const Descriptor& query,
+                             const Descriptor& keyframe, int shift) {
+  float sum = 0;
+  int valid = 0;
+  for (int sector = 0; sector < NUM_SECTORS; ++sector) {
+    int shifted = (sector + shift) % NUM_SECTORS;
+    float dot = 0, normQuery = 0, normKeyframe = 0;
+    for (int ring = 0; ring < NUM_RINGS; ++ring) {
+      float a = query.context[ring * NUM_SECTORS + sector];
+      float b = keyframe.context[ring * NUM_SECTORS + shifted];
+      dot += a * b;
+      normQuery += a * a;
+      normKeyframe += b * b;
+    }
+    if (normQuery == 0 || normKeyframe == 0) continue;
+    sum += 1 - dot / sqrt(normQuery * normKeyframe);
+    ++valid;
+  }
+  return valid > 0 ? sum / valid : 1;
+}
+
+// Descriptors of all keyframes of a session, each built from the keyframe and
+// its neighbours in world orientation around the keyframe position
+inline std::vector<Descriptor> buildDescriptors(
+    const session::KeyframeSession& keyframeSession, int numThreads) {
+  const int neighbours = 2;
+  int numKeyframes = keyframeSession.poses->size();
+  std::vector<Descriptor> descriptors(numKeyframes);
+  parallel::parallelFor(numKeyframes, numThreads, [&](int begin, int end) {
+    pcl::PointCloud<PointType> cloud;
+    for (int i = begin; i < end; ++i) {
+      cloud.clear();
+      for (int j = std::max(0, i - neighbours);
+           j <= std::min(numKeyframes - 1, i + neighbours); ++j) {
+        const PointTypePose& pose = keyframeSession.poses->points[j];
+        cloud += *session::transformPointCloud(
+            keyframeSession.cornerClouds[j], pose);
+        cloud += *session::transformPointCloud(keyframeSession.surfClouds[j],
+                                               pose);
+        cloud += *session::transformPointCloud(
+            keyframeSession.outlierClouds[j], pose);
+      }
+      const PointTypePose& pose = keyframeSession.poses->points[i];
+      float position[3] = {pose.x, pose.y, pose.z};
+      computeDescriptor(cloud, position, descriptors[i]);
+    }
+  });
+  return descriptors;
+}
+
+struct DatabaseHeader {
+  char magic[8];
+  uint32_t rings;
+  uint32_t sectors;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+const char DATABASE_MAGIC[8] = {'L', 'I', 'N', 'S', 'P', 'R', 'D', 'B'};
+
+inline bool writeDatabase(const std::string& path,
+                          const std::vector<Descriptor>& descriptors) {
+  DatabaseHeader header;
+  memcpy(header.magic, DATABASE_MAGIC, sizeof(header.magic));
+  header.rings = NUM_RINGS;
+  header.sectors = NUM_SECTORS;
+  header.count = descriptors.size();
+  header.reserved = 0;
+
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(descriptors.data()),
+             descriptors.size() * sizeof(Descriptor));
+  return file.good();
+}
+
+// Read-only view of a descriptor database mapped into memory, so that opening
+// a database of a large map costs no parsing and pages are loaded on demand
+class Database {
+ public:
+  Database() : data_(nullptr), size_(0), descriptors_(nullptr), count_(0) {}
+  ~Database() { close(); }
+
+  bool open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    size_ = lseek(fd, 0, SEEK_END);
+    if (size_ >= sizeof(DatabaseHeader))
+      data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data_ == nullptr || data_ == MAP_FAILED) {
+      data_ = nullptr;
+      return false;
+    }
+
+    const DatabaseHeader* header = static_cast<const DatabaseHeader*>(data_);
+    if (memcmp(header->magic, DATABASE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->rings != NUM_RINGS || header->sectors != NUM_SECTORS ||
+        size_ < sizeof(DatabaseHeader) + header->count * sizeof(Descriptor)) {
+      close();
+      return false;
+    }
+    count_ = header->count;
+    descriptors_ = reinterpret_cast<const Descriptor*>(
+        static_cast<const char*>(data_) + sizeof(DatabaseHeader));
+    return true;
+  }
+
+  void close() {
+    if (data_ != nullptr) munmap(data_, size_);
+    data_ = nullptr;
+    descriptors_ = nullptr;
+    count_ = 0;
+  }
+
+  int size() const { return count_; }
+  const Descriptor& at(int i) const { return descriptors_[i]; }
+
+  // Preselect by ring key distance, then rank the preselection by the context
+  // distance at the best rotation
+  std::vector<Match> query(const Descriptor& query, int numMatches) const {
+    std::vector<std::pair<float, int>> ringKeyDistances(count_);
+    for (int i = 0; i < count_; ++i) {
+      float distance = 0;
+      for (int ring = 0; ring < NUM_RINGS; ++ring) {
+        float diff = query.ringKey[ring] - descriptors_[i].ringKey[ring];
+        distance += diff * diff;
+      }
+      ringKeyDistances[i] = std::make_pair(distance, i);
+    }
+    int numCandidates = std::min(RING_KEY_CANDIDATES, count_);
+    std::partial_sort(ringKeyDistances.begin(),
+                      ringKeyDistances.begin() + numCandidates,
+                      ringKeyDistances.end());
+
+    std::vector<Match> matches;
+    for (int c = 0; c < numCandidates; ++c) {
+      Match match;
+      match.keyframe = ringKeyDistances[c].second;
+      match.shift = 0;
+      match.distance = 1;
+      for (int shift = 0; shift < NUM_SECTORS; ++shift) {
+        float distance =
+            contextDistance(query, descriptors_[match.keyframe], shift);
+        if (distance < match.distance) {
+          match.distance = distance;
+          match.shift = shift;
+        }
+      }
+      matches.push_back(match);
+    }
+    std::sort(matches.begin(), matches.end(),
+              [](const Match& a, const Match& b) {
+                return a.distance < b.distance;
+              });
+    if (matches.size() > numMatches) matches.resize(numMatches);
+    return matches;
+  }
+
+ private:
+  Database(const Database&) = delete;
+  Database& operator=(const Database&) = delete;
+
+  void* data_;
+  size_t size_;
+  const Descriptor* descriptors_;
+  int count_;
+};
+
+}  // namespace place_recognition
+
+#endif  // INCLUDE_PLACE_RECOGNITION_H_
@@ -0,0 +1,248 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_PROJECTIVE_ASSOCIATION_H_
+#define INCLUDE_PROJECTIVE_ASSOCIATION_H_
+
+#include <parameters.h>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <sensor_profiles.h>
+
+#include <algorithm>
+#include <cmath>
+#include <eigen3/Eigen/Dense>
+#include <limits>
+#include <vector>
+
+namespace projective {
+
+// Map points are splatted over at most this many columns to either side, which
+// bounds the cost of points close to the sensor
+const int MAX_SPLAT_COLUMNS = 32;
+// The neighbours of a map point on a distant surface often come from a single
+// scan row, which leaves the plane through them free to tilt about the row.
+// Planes are only fitted to neighbourhoods with at least this standard
+// deviation in metres across their main direction.
+const float MIN_PLANE_SPREAD = 0.1;
+
+// Line or plane fitted to the five map neighbours of a map point, computed the
+// first time a scan point is associated with it
+struct FeatureModel {
+  enum State { UNKNOWN, VALID, INVALID };
+  State state;
+  float params[6];
+};
+
+// Projective association of scan points with one feature map. The scan is
+// laid out in the range image of the lidar, and each cycle the map is rendered
+// into that image from the predicted pose: every map point is splatted over
+// the pixels its footprint covers and offered to the scan points there, which
+// keep the nearest one. Associating a scan point then takes no search. The
+// line or plane of a map point is fitted once per map and reused by every
+// scan.
+class Associator {
+ public:
+  // footprint is the radius in metres a rendered map point covers, lines
+  // selects line models instead of planes
+  Associator(float footprint, bool lines)
+      : footprint_(footprint), lines_(lines) {}
+
+  void setGeometry(const sensor::ProfileGeometry& geometry) {
+    geometry_ = geometry;
+    resX_ = geometry.angResX / 180.0 * M_PI;
+    resY_ = geometry.angResY / 180.0 * M_PI;
+    pixels_.assign(geometry.lines * geometry.columns, -1);
+  }
+
+  // Start using new map contents, in the map frame, together with a KD tree
+  // built on them. Discards the fitted models.
+  void setMap(const pcl::PointCloud<PointType>::Ptr& map,
+              const pcl::KdTreeFLANN<PointType>::Ptr& kdtree) {
+    map_ = map;
+    kdtree_ = kdtree;
+    FeatureModel unknown;
+    unknown.state = FeatureModel::UNKNOWN;
+    models_.assign(map->points.size(), unknown);
+  }
+
+  // Lay out the scan, in the sensor frame, in the range image. Scan points
+  // sharing a pixel are chained.
+  void setScan(const pcl::PointCloud<PointType>& scan) {
+    std::fill(pixels_.begin(), pixels_.end(), -1);
+    int numPoints = scan.points.size();
+    scan_.resize(numPoints);
+    next_.assign(numPoints, -1);
+    for (int i = 0; i < numPoints; ++i) {
+      scan_[i] = scan.points[i];
+      float row, range;
+      int column;
+      if (!project(scan.points[i], &row, &column, &range)) continue;
+      int& head = pixels_[int(row) * geometry_.columns + column];
+      next_[i] = head;
+      head = i;
+    }
+  }
+
+  // Render the map given by its points in the predicted sensor frame, in the
+  // order of the map set last, and associate every scan point with the
+  // nearest map point covering its pixel
+  void render(const pcl::PointCloud<PointType>& sensorMap) {
+    int numScan = scan_.size();
+    nearest_.assign(numScan, -1);
+    nearestSqDis_.assign(numScan, std::numeric_limits<float>::max());
+    int numPoints = sensorMap.points.size();
+    for (int i = 0; i < numPoints; ++i) {
+      const PointType& point = sensorMap.points[i];
+      float row, range;
+      int column;
+      if (!project(point, &row, &column, &range)) continue;
+      // Rows are split where the beams are, so the vertical extent is taken
+      // from the exact row position
+      float halfAngle = std::atan2(footprint_, range);
+      int rowBegin = std::max(int(row - halfAngle / resY_), 0);
+      int rowEnd = std::min(int(row + halfAngle / resY_), geometry_.lines - 1);
+      int columnRadius = std::min(int(halfAngle / resX_), MAX_SPLAT_COLUMNS);
+      for (int r = rowBegin; r <= rowEnd; ++r) {
+        for (int c = column - columnRadius; c <= column + columnRadius; ++c) {
+          int wrapped = (c + geometry_.columns) % geometry_.columns;
+          for (int j = pixels_[r * geometry_.columns + wrapped]; j >= 0;
+               j = next_[j]) {
+            float dx = scan_[j].x - point.x;
+            float dy = scan_[j].y - point.y;
+            float dz = scan_[j].z - point.z;
+            float sqDis = dx * dx + dy * dy + dz * dz;
+            if (sqDis < nearestSqDis_[j]) {
+              nearest_[j] = i;
+              nearestSqDis_[j] = sqDis;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Line points or plane coefficients of the map point rendered nearest to
+  // scan point scanIndex. mapPoint is the scan point in the map frame at the
+  // current estimate; the map point has to lie within maxDistance of it.
+  bool associate(int scanIndex, const PointType& mapPoint, float maxDistance,
+                 float params[6]) {
+    int index = nearest_[scanIndex];
+    if (index < 0) return false;
+
+    const PointType& target = map_->points[index];
+    float dx = target.x - mapPoint.x;
+    float dy = target.y - mapPoint.y;
+    float dz = target.z - mapPoint.z;
+    if (dx * dx + dy * dy + dz * dz > maxDistance * maxDistance) return false;
+
+    FeatureModel& model = models_[index];
+    if (model.state == FeatureModel::UNKNOWN) fit(target, maxDistance, model);
+    if (model.state != FeatureModel::VALID) return false;
+    std::copy(model.params, model.params + 6, params);
+    return true;
+  }
+
+ private:
+  // Pixel of a point given in the camera axes of the mapping node, in which
+  // the lidar x, y and z axes are z, x and y, as ImageProjection computes it.
+  // The row is returned unrounded.
+  bool project(const PointType& point, float* row, int* column,
+               float* range) const {
+    float horizontal = std::sqrt(point.z * point.z + point.x * point.x);
+    *range = std::sqrt(horizontal * horizontal + point.y * point.y);
+    if (*range < 1e-3) return false;
+
+    float verticalAngle = std::atan2(point.y, horizontal) * 180 / M_PI;
+    *row = (verticalAngle + geometry_.angBottom) / geometry_.angResY;
+    if (*row < 0 || *row >= geometry_.lines) return false;
+
+    float horizonAngle = std::atan2(point.z, point.x) * 180 / M_PI;
+    int c = -std::round((horizonAngle - 90.0) / geometry_.angResX) +
+            geometry_.columns / 2;
+    if (c >= geometry_.columns) c -= geometry_.columns;
+    if (c < 0 || c >= geometry_.columns) return false;
+    *column = c;
+    return true;
+  }
+
+  // The fits and acceptance tests of cornerOptimization and surfOptimization,
+  // applied to the neighbourhood of a map point
+  void fit(const PointType& target, float maxDistance, FeatureModel& model) {
+    model.state = FeatureModel::INVALID;
+    kdtree_->nearestKSearch(target, 5, searchInd_, searchSqDis_);
+    if (searchInd_.size() < 5 || searchSqDis_[4] >= maxDistance * maxDistance)
+      return;
+
+    Eigen::Matrix<float, 5, 3> points;
+    for (int j = 0; j < 5; ++j) {
+      const PointType& p = map_->points[searchInd_[j]];
+      points.row(j) << p.x, p.y, p.z;
+    }
+
+    Eigen::RowVector3f mean = points.colwise().mean();
+    Eigen::Matrix<float, 5, 3> centered = points.rowwise() - mean;
+    Eigen::Matrix3f covariance = centered.transpose() * centered / 5;
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver;
+    solver.computeDirect(covariance);
+
+    if (lines_) {
+      if (solver.eigenvalues()[2] <= 3 * solver.eigenvalues()[1]) return;
+      Eigen::Vector3f direction = solver.eigenvectors().col(2);
+      for (int i = 0; i < 3; ++i) {
+        model.params[i] = mean[i] + 0.1 * direction[i];
+        model.params[3 + i] = mean[i] - 0.1 * direction[i];
+      }
+    } else {
+      if (solver.eigenvalues()[1] < MIN_PLANE_SPREAD * MIN_PLANE_SPREAD) return;
+      Eigen::Matrix<float, 5, 1> ones = Eigen::Matrix<float, 5, 1>::Ones();
+      Eigen::Vector3f normal = points.colPivHouseholderQr().solve(-ones);
+      float norm = normal.norm();
+      float d = 1 / norm;
+      normal /= norm;
+      for (int j = 0; j < 5; ++j) {
+        if (std::fabs(points.row(j).dot(normal) + d) > 0.2 * maxDistance)
+          return;
+      }
+      model.params[0] = normal[0];
+      model.params[1] = normal[1];
+      model.params[2] = normal[2];
+      model.params[3] = d;
+    }
+    model.state = FeatureModel::VALID;
+  }
+
+  float footprint_;
+  bool lines_;
+  sensor::ProfileGeometry geometry_;
+  float resX_;
+  float resY_;
+  std::vector<int> pixels_;  // first scan point in the pixel, or -1
+  std::vector<PointType> scan_;
+  std::vector<int> next_;     // next scan point in the same pixel, or -1
+  std::vector<int> nearest_;  // map point associated with a scan point, or -1
+  std::vector<float> nearestSqDis_;
+
+  pcl::PointCloud<PointType>::Ptr map_;
+  pcl::KdTreeFLANN<PointType>::Ptr kdtree_;
+  std::vector<FeatureModel> models_;
+  std::vector<int> searchInd_;
+  std::vector<float> searchSqDis_;
+};
+
+}  // namespace projective
+
+#endif  // INCLUDE_PROJECTIVE_ASSOCIATION_H_
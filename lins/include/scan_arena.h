@@ -0,0 +1,247 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_SCAN_ARENA_H_
+#define INCLUDE_SCAN_ARENA_H_
+
+#include <metrics.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace arena {
+
+// Monotonic memory resource for buffers that live no longer than one scan.
+// Allocation bumps an offset inside the current block, deallocation is a
+// no-op, and reset() releases everything at once. A scan that outgrows the
+// blocks gets a new one from the heap; the next reset() merges all blocks into
+// one, so after the first scans every scan is served from a single block.
+class MonotonicArena {
+ public:
+  // Position to rewind to, e.g. to reuse the memory of one iteration in the
+  // next one
+  struct Marker {
+    size_t block;
+    size_t offset;
+  };
+
+  explicit MonotonicArena(size_t initialSize = 1 << 20)
+      : current_(0),
+        offset_(0),
+        allocations_(0),
+        heapAllocations_(0),
+        used_(0),
+        peak_(0) {
+    addBlock(initialSize);
+  }
+
+  void* allocate(size_t bytes, size_t alignment = 16) {
+    ++allocations_;
+    while (true) {
+      Block& block = blocks_[current_];
+      uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+      size_t aligned =
+          ((base + offset_ + alignment - 1) & ~(alignment - 1)) - base;
+      if (aligned + bytes <= block.size) {
+        used_ += aligned + bytes - offset_;
+        peak_ = std::max(peak_, used_);
+        offset_ = aligned + bytes;
+        return block.data.get() + aligned;
+      }
+      used_ += block.size - offset_;
+      if (current_ + 1 == blocks_.size())
+        addBlock(std::max(bytes + alignment, 2 * block.size));
+      ++current_;
+      offset_ = 0;
+    }
+  }
+
+  template <typename T>
+  T* allocate(size_t n) {
+    return static_cast<T*>(
+        allocate(n * sizeof(T), std::max<size_t>(alignof(T), 16)));
+  }
+
+  Marker mark() const {
+    Marker marker;
+    marker.block = current_;
+    marker.offset = offset_;
+    return marker;
+  }
+
+  // Free everything allocated after the marker was taken. Blocks stay
+  // allocated for reuse.
+  void rewind(const Marker& marker) {
+    for (size_t b = marker.block; b < current_; ++b) used_ -= blocks_[b].size;
+    used_ -= offset_;
+    used_ += marker.offset;
+    current_ = marker.block;
+    offset_ = marker.offset;
+  }
+
+  void reset() {
+    if (blocks_.size() > 1) {
+      size_t total = 0;
+      for (const Block& block : blocks_) total += block.size;
+      blocks_.clear();
+      addBlock(total);
+    }
+    current_ = 0;
+    offset_ = 0;
+    used_ = 0;
+  }
+
+  // Allocations served since construction, and how many of them needed a new
+  // block from the heap
+  uint64_t allocations() const { return allocations_; }
+  uint64_t heapAllocations() const { return heapAllocations_; }
+  size_t peakBytes() const { return peak_; }
+  size_t capacity() const {
+    size_t total = 0;
+    for (const Block& block : blocks_) total += block.size;
+    return total;
+  }
+
+ private:
+  MonotonicArena(const MonotonicArena&) = delete;
+  MonotonicArena& operator=(const MonotonicArena&) = delete;
+
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  void addBlock(size_t size) {
+    Block block;
+    block.data.reset(new char[size]);
+    block.size = size;
+    blocks_.push_back(std::move(block));
+    ++heapAllocations_;
+  }
+
+  std::vector<Block> blocks_;
+  size_t current_;
+  size_t offset_;
+  uint64_t allocations_;
+  uint64_t heapAllocations_;
+  size_t used_;
+  size_t peak_;
+};
+
+// Rewinds the arena to where it was at construction when going out of scope
+class ScopedRewind {
+ public:
+  explicit ScopedRewind(MonotonicArena& arena)
+      : arena_(arena), marker_(arena.mark()) {}
+  ~ScopedRewind() { arena_.rewind(marker_); }
+
+ private:
+  ScopedRewind(const ScopedRewind&) = delete;
+  ScopedRewind& operator=(const ScopedRewind&) = delete;
+
+  MonotonicArena& arena_;
+  const MonotonicArena::Marker marker_;
+};
+
+// Standard allocator drawing from a MonotonicArena. Containers using it must
+// not outlive the next reset() of the arena. A default constructed allocator
+// is not bound to an arena; assigning a container built on an arena binds the
+// target to it.
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  ArenaAllocator() : arena_(nullptr) {}
+  explicit ArenaAllocator(MonotonicArena* arena) : arena_(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+  T* allocate(size_t n) { return arena_->allocate<T>(n); }
+  void deallocate(T*, size_t) {}
+
+  MonotonicArena* arena() const { return arena_; }
+
+ private:
+  MonotonicArena* arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena() != b.arena();
+}
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Vector of n copies of value in the arena
+template <typename T>
+ArenaVector<T> makeVector(MonotonicArena& arena, size_t n,
+                          const T& value = T()) {
+  return ArenaVector<T>(n, value, ArenaAllocator<T>(&arena));
+}
+
+// Exports the allocation counts and the peak size of a per-scan arena,
+// labeled with the stage that owns it. The gauges are registered on
+// construction, so that reporting every scan only stores three values.
+class UsageReporter {
+ public:
+  explicit UsageReporter(const std::string& stage)
+      : allocations_(metrics::Registry::instance().gauge(
+            "lins_scan_arena_allocations",
+            "Buffers served from the per-scan arena since start",
+            label(stage))),
+        heapAllocations_(metrics::Registry::instance().gauge(
+            "lins_scan_arena_heap_allocations",
+            "Heap blocks allocated by the per-scan arena since start",
+            label(stage))),
+        peakBytes_(metrics::Registry::instance().gauge(
+            "lins_scan_arena_peak_bytes",
+            "Largest per-scan arena usage since start", label(stage))) {}
+
+  void report(const MonotonicArena& arena) const {
+    allocations_.set(arena.allocations());
+    heapAllocations_.set(arena.heapAllocations());
+    peakBytes_.set(arena.peakBytes());
+  }
+
+ private:
+  static std::string label(const std::string& stage) {
+    return "stage=\"" + stage + "\"";
+  }
+
+  metrics::Gauge& allocations_;
+  metrics::Gauge& heapAllocations_;
+  metrics::Gauge& peakBytes_;
+};
+
+}  // namespace arena
+
+#endif  // INCLUDE_SCAN_ARENA_H_
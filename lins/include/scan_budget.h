@@ -0,0 +1,144 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_SCAN_BUDGET_H_
+#define INCLUDE_SCAN_BUDGET_H_
+
+#include <parameters.h>
+#include <pcl/filters/voxel_grid.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace budget {
+
+// Move bit b of the low 21 bits of v to bit 3 * b
+inline uint64_t spreadBits(uint32_t v) {
+  uint64_t x = v & 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffffULL;
+  x = (x | x << 16) & 0x1f0000ff0000ffULL;
+  x = (x | x << 8) & 0x100f00f00f00f00fULL;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+  x = (x | x << 2) & 0x1249249249249249ULL;
+  return x;
+}
+
+// Interleave the low 21 bits of x, y and z, so that dropping the lowest three
+// bits of the code gives the code of the voxel twice as large
+inline uint64_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+  return spreadBits(x) | spreadBits(y) << 1 | spreadBits(z) << 2;
+}
+
+// Voxel filter whose leaf size is chosen per scan so that about budget points
+// remain. The leaf is estimated from a histogram of occupied voxels at
+// power-of-two multiples of the smallest leaf, which one sort of Morton codes
+// yields for all sizes at once, and interpolated log-linearly between them.
+// If the filtered cloud still exceeds the budget it is thinned evenly in
+// voxel order, which keeps the points spread over the scan.
+class BudgetFilter {
+ public:
+  BudgetFilter() : budget_(0), minLeaf_(0), levels_(0), leaf_(0) {}
+
+  // Leaf sizes are searched in [minLeaf, minLeaf * 2^levels]
+  void configure(int budget, float minLeaf, int levels) {
+    budget_ = budget;
+    minLeaf_ = minLeaf;
+    levels_ = levels;
+    leaf_ = minLeaf;
+  }
+
+  void filter(const pcl::PointCloud<PointType>::Ptr& input,
+              pcl::PointCloud<PointType>& output) {
+    output.clear();
+    if (input->points.empty()) return;
+
+    leaf_ = estimateLeafSize(*input);
+    voxelGrid_.setLeafSize(leaf_, leaf_, leaf_);
+    voxelGrid_.setInputCloud(input);
+    voxelGrid_.filter(output);
+
+    int numPoints = output.points.size();
+    if (numPoints > budget_) {
+      for (int i = 0; i < budget_; ++i)
+        output.points[i] = output.points[int64_t(i) * numPoints / budget_];
+      output.points.resize(budget_);
+      output.width = budget_;
+      output.height = 1;
+    }
+  }
+
+  // Leaf size used for the last scan
+  float leafSize() const { return leaf_; }
+
+ private:
+  float estimateLeafSize(const pcl::PointCloud<PointType>& cloud) {
+    float minX = cloud.points[0].x, minY = cloud.points[0].y;
+    float minZ = cloud.points[0].z;
+    for (const PointType& point : cloud.points) {
+      minX = std::min(minX, point.x);
+      minY = std::min(minY, point.y);
+      minZ = std::min(minZ, point.z);
+    }
+
+    // Points farther than 2^21 smallest voxels from the minimum corner are
+    // clamped, which only affects the estimate
+    const uint32_t maxIndex = (1u << 21) - 1;
+    float inverseLeaf = 1.0 / minLeaf_;
+    codes_.resize(cloud.points.size());
+    for (size_t i = 0; i < cloud.points.size(); ++i) {
+      const PointType& point = cloud.points[i];
+      codes_[i] = mortonCode(
+          std::min(uint32_t((point.x - minX) * inverseLeaf), maxIndex),
+          std::min(uint32_t((point.y - minY) * inverseLeaf), maxIndex),
+          std::min(uint32_t((point.z - minZ) * inverseLeaf), maxIndex));
+    }
+    std::sort(codes_.begin(), codes_.end());
+
+    // occupied[l]: voxels of size minLeaf * 2^l holding a point
+    occupied_.assign(levels_ + 1, 0);
+    for (size_t i = 0; i < codes_.size(); ++i) {
+      for (int l = 0; l <= levels_; ++l) {
+        if (i > 0 && (codes_[i] >> (3 * l)) == (codes_[i - 1] >> (3 * l)))
+          break;
+        ++occupied_[l];
+      }
+    }
+
+    if (occupied_[0] <= budget_) return minLeaf_;
+    for (int l = 0; l < levels_; ++l) {
+      if (occupied_[l + 1] > budget_) continue;
+      float t = std::log(float(occupied_[l]) / budget_) /
+                std::log(float(occupied_[l]) / occupied_[l + 1]);
+      return minLeaf_ * std::pow(2.0f, l + t);
+    }
+    return minLeaf_ * float(1 << levels_);
+  }
+
+  int budget_;
+  float minLeaf_;
+  int levels_;
+  float leaf_;
+  pcl::VoxelGrid<PointType> voxelGrid_;
+  std::vector<uint64_t> codes_;
+  std::vector<int> occupied_;
+};
+
+}  // namespace budget
+
+#endif  // INCLUDE_SCAN_BUDGET_H_
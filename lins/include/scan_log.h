@@ -0,0 +1,180 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_SCAN_LOG_H_
+#define INCLUDE_SCAN_LOG_H_
+
+#include <parameters.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace scan_log {
+
+// A scan log holds what lins_fusion_node sends to lidar_mapping_node for
+// every scan: the laser odometry and the corner, surface and outlier clouds,
+// all in the YZX (camera) convention. It starts with a FileHeader, followed by
+// one RecordHeader per scan and its clouds as packed x, y, z, intensity
+// floats, in this order.
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct RecordHeader {
+  double stamp;
+  double position[3];
+  double orientation[4];  // x, y, z, w
+  uint32_t corners;
+  uint32_t surfs;
+  uint32_t outliers;
+  uint32_t reserved;
+};
+
+const char LOG_MAGIC[8] = {'L', 'I', 'N', 'S', 'S', 'C', 'A', 'N'};
+const uint32_t LOG_VERSION = 1;
+
+struct ScanRecord {
+  ScanRecord()
+      : corner(new pcl::PointCloud<PointType>()),
+        surf(new pcl::PointCloud<PointType>()),
+        outlier(new pcl::PointCloud<PointType>()) {}
+
+  double stamp;
+  V3D position;
+  Q4D orientation;
+  pcl::PointCloud<PointType>::Ptr corner;
+  pcl::PointCloud<PointType>::Ptr surf;
+  pcl::PointCloud<PointType>::Ptr outlier;
+};
+
+class Writer {
+ public:
+  bool open(const std::string& path) {
+    file_.open(path, std::ios::binary | std::ios::trunc);
+    FileHeader header;
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.version = LOG_VERSION;
+    header.reserved = 0;
+    file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    return file_.good();
+  }
+
+  bool isOpen() const { return file_.is_open(); }
+
+  // Every record is flushed, so that a log stays readable up to the last
+  // scan when the node is killed
+  bool write(double stamp, const V3D& position, const Q4D& orientation,
+             const pcl::PointCloud<PointType>& corner,
+             const pcl::PointCloud<PointType>& surf,
+             const pcl::PointCloud<PointType>& outlier) {
+    RecordHeader header;
+    header.stamp = stamp;
+    for (int i = 0; i < 3; ++i) header.position[i] = position[i];
+    header.orientation[0] = orientation.x();
+    header.orientation[1] = orientation.y();
+    header.orientation[2] = orientation.z();
+    header.orientation[3] = orientation.w();
+    header.corners = corner.points.size();
+    header.surfs = surf.points.size();
+    header.outliers = outlier.points.size();
+    header.reserved = 0;
+    file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writeCloud(corner);
+    writeCloud(surf);
+    writeCloud(outlier);
+    file_.flush();
+    return file_.good();
+  }
+
+ private:
+  void writeCloud(const pcl::PointCloud<PointType>& cloud) {
+    buffer_.resize(4 * cloud.points.size());
+    for (size_t i = 0; i < cloud.points.size(); ++i) {
+      const PointType& point = cloud.points[i];
+      buffer_[4 * i] = point.x;
+      buffer_[4 * i + 1] = point.y;
+      buffer_[4 * i + 2] = point.z;
+      buffer_[4 * i + 3] = point.intensity;
+    }
+    file_.write(reinterpret_cast<const char*>(buffer_.data()),
+                buffer_.size() * sizeof(float));
+  }
+
+  std::ofstream file_;
+  std::vector<float> buffer_;
+};
+
+class Reader {
+ public:
+  bool open(const std::string& path) {
+    file_.open(path, std::ios::binary);
+    FileHeader header;
+    file_.read(reinterpret_cast<char*>(&header), sizeof(header));
+    return file_.good() &&
+           memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) == 0 &&
+           header.version == LOG_VERSION;
+  }
+
+  // Read the next scan into record, reusing its clouds. Returns false at the
+  // end of the log, including a record cut short by a killed writer.
+  bool next(ScanRecord& record) {
+    RecordHeader header;
+    if (!file_.read(reinterpret_cast<char*>(&header), sizeof(header)))
+      return false;
+    record.stamp = header.stamp;
+    record.position = V3D(header.position[0], header.position[1],
+                          header.position[2]);
+    record.orientation =
+        Q4D(header.orientation[3], header.orientation[0],
+            header.orientation[1], header.orientation[2]);
+    return readCloud(header.corners, *record.corner) &&
+           readCloud(header.surfs, *record.surf) &&
+           readCloud(header.outliers, *record.outlier);
+  }
+
+ private:
+  bool readCloud(uint32_t size, pcl::PointCloud<PointType>& cloud) {
+    buffer_.resize(4 * size);
+    if (!file_.read(reinterpret_cast<char*>(buffer_.data()),
+                    buffer_.size() * sizeof(float)))
+      return false;
+    cloud.points.resize(size);
+    for (uint32_t i = 0; i < size; ++i) {
+      PointType& point = cloud.points[i];
+      point.x = buffer_[4 * i];
+      point.y = buffer_[4 * i + 1];
+      point.z = buffer_[4 * i + 2];
+      point.intensity = buffer_[4 * i + 3];
+    }
+    cloud.width = size;
+    cloud.height = 1;
+    cloud.is_dense = true;
+    return true;
+  }
+
+  std::ifstream file_;
+  std::vector<float> buffer_;
+};
+
+}  // namespace scan_log
+
+#endif  // INCLUDE_SCAN_LOG_H_
@@ -0,0 +1,122 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_SCAN_TRACE_H_
+#define INCLUDE_SCAN_TRACE_H_
+
+#include <parameters.h>
+#include <ros/ros.h>
+
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "cloud_msgs/scan_trace.h"
+
+namespace trace {
+
+// Nodes forward the scan stamp through toSec() and fromSec(), which may move
+// it by a fraction of a microsecond, so stamps are matched with a tolerance
+// far below the scan period
+const double STAMP_TOLERANCE = 1e-4;
+
+// Entry of map whose key is within STAMP_TOLERANCE of stamp, or map.end()
+template <typename Map>
+typename Map::iterator findStamp(Map& map, double stamp) {
+  typename Map::iterator it = map.lower_bound(stamp - STAMP_TOLERANCE);
+  if (it != map.end() && std::abs(it->first - stamp) <= STAMP_TOLERANCE)
+    return it;
+  return map.end();
+}
+
+// Per-node recorder of wall-clock checkpoints of scans, keyed by the scan
+// stamp. A node marks the stages a scan passes and flushes the scan once it is
+// done with it, which publishes the checkpoints on /scan_trace for
+// latency_collector_node. Scans a node drops are never flushed and are
+// discarded when a later scan is. Does nothing unless scan_trace is set.
+class Tracer {
+ public:
+  static Tracer& instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  void init(ros::NodeHandle& nh, const std::string& node) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    enabled_ = parameter::SCAN_TRACE != 0;
+    node_ = node;
+    if (enabled_)
+      pubTrace_ = nh.advertise<cloud_msgs::scan_trace>("/scan_trace", 100);
+  }
+
+  bool enabled() const { return enabled_; }
+
+  void mark(const ros::Time& stamp, const char* stage) {
+    if (!enabled_) return;
+    double now = ros::WallTime::now().toSec();
+    double key = stamp.toSec();
+    std::lock_guard<std::mutex> lock(mtx_);
+    Pending::iterator it = findStamp(pending_, key);
+    if (it == pending_.end()) {
+      it = pending_.insert(std::make_pair(key, cloud_msgs::scan_trace())).first;
+      it->second.header.stamp = stamp;
+    }
+    it->second.stages.push_back(stage);
+    it->second.wallTimes.push_back(now);
+    if (pending_.size() > MAX_PENDING) pending_.erase(pending_.begin());
+  }
+
+  // Publish the checkpoints of the scan and discard those of older scans
+  void flush(const ros::Time& stamp) {
+    if (!enabled_) return;
+    cloud_msgs::scan_trace msg;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      Pending::iterator it = findStamp(pending_, stamp.toSec());
+      if (it == pending_.end()) return;
+      msg = it->second;
+      pending_.erase(pending_.begin(), ++it);
+    }
+    msg.node = node_;
+    pubTrace_.publish(msg);
+  }
+
+  // Mark a stage and publish it right away, for nodes that see a scan once
+  void markAndFlush(const ros::Time& stamp, const char* stage) {
+    mark(stamp, stage);
+    flush(stamp);
+  }
+
+ private:
+  typedef std::map<double, cloud_msgs::scan_trace> Pending;
+  static const size_t MAX_PENDING = 64;
+
+  Tracer() : enabled_(false) {}
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  bool enabled_;
+  std::string node_;
+  ros::Publisher pubTrace_;
+  std::mutex mtx_;
+  Pending pending_;
+};
+
+}  // namespace trace
+
+#endif  // INCLUDE_SCAN_TRACE_H_
@@ -0,0 +1,145 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_SENSOR_PROFILES_H_
+#define INCLUDE_SENSOR_PROFILES_H_
+
+#include <parameters.h>
+
+#include <string>
+
+namespace sensor {
+
+// A sensor profile describes the range image of one lidar model: number of
+// rings (lines) and columns, horizontal and vertical angular resolution and
+// lowest beam angle in degrees, and the highest ring that may see the ground.
+// The profiles of known models are compile-time constants, so the projection
+// and feature stages instantiated with them get fixed loop bounds and strides.
+
+struct VLP16 {
+  static const char* name() { return "VLP-16"; }
+  static constexpr int lines() { return 16; }
+  static constexpr int columns() { return 1800; }
+  static constexpr float angResX() { return 0.2; }
+  static constexpr float angResY() { return 2.0; }
+  static constexpr float angBottom() { return 15.0 + 0.1; }
+  static constexpr int groundScanInd() { return 5; }
+};
+
+struct HDL32 {
+  static const char* name() { return "HDL-32"; }
+  static constexpr int lines() { return 32; }
+  static constexpr int columns() { return 1800; }
+  static constexpr float angResX() { return 360.0 / 1800; }
+  static constexpr float angResY() { return 41.33 / (32 - 1); }
+  static constexpr float angBottom() { return 30.67; }
+  static constexpr int groundScanInd() { return 20; }
+};
+
+struct OS1_64 {
+  static const char* name() { return "OS1-64"; }
+  static constexpr int lines() { return 64; }
+  static constexpr int columns() { return 1024; }
+  static constexpr float angResX() { return 360.0 / 1024; }
+  static constexpr float angResY() { return 33.2 / (64 - 1); }
+  static constexpr float angBottom() { return 16.6 + 0.1; }
+  static constexpr int groundScanInd() { return 15; }
+};
+
+struct OS1_128 {
+  static const char* name() { return "OS1-128"; }
+  static constexpr int lines() { return 128; }
+  static constexpr int columns() { return 1024; }
+  static constexpr float angResX() { return 360.0 / 1024; }
+  static constexpr float angResY() { return 45.0 / (128 - 1); }
+  static constexpr float angBottom() { return 22.5 + 0.1; }
+  static constexpr int groundScanInd() { return 39; }
+};
+
+// Runtime profile: line_num and scan_num from the config file and the angle
+// constants of parameters.h. Used when lidar_model names no known profile.
+struct Generic {
+  static const char* name() { return "generic"; }
+  static int lines() { return parameter::LINE_NUM; }
+  static int columns() { return parameter::SCAN_NUM; }
+  static float angResX() { return parameter::ang_res_x; }
+  static float angResY() { return parameter::ang_res_y; }
+  static float angBottom() { return parameter::ang_bottom; }
+  static int groundScanInd() { return parameter::groundScanInd; }
+};
+
+// Call visitor.template apply<Profile>() with the profile called name, or with
+// the generic profile if there is none
+template <typename Visitor>
+void dispatch(const std::string& name, Visitor& visitor) {
+  if (name == VLP16::name())
+    visitor.template apply<VLP16>();
+  else if (name == HDL32::name())
+    visitor.template apply<HDL32>();
+  else if (name == OS1_64::name())
+    visitor.template apply<OS1_64>();
+  else if (name == OS1_128::name())
+    visitor.template apply<OS1_128>();
+  else
+    visitor.template apply<Generic>();
+}
+
+struct ProfileDimensions {
+  template <typename Profile>
+  void apply() {
+    name = Profile::name();
+    lines = Profile::lines();
+    columns = Profile::columns();
+  }
+
+  std::string name;
+  int lines;
+  int columns;
+};
+
+// Angles of the selected profile, for stages that project points into its
+// range image outside the templated pipeline
+struct ProfileGeometry {
+  template <typename Profile>
+  void apply() {
+    lines = Profile::lines();
+    columns = Profile::columns();
+    angResX = Profile::angResX();
+    angResY = Profile::angResY();
+    angBottom = Profile::angBottom();
+  }
+
+  int lines;
+  int columns;
+  float angResX;
+  float angResY;
+  float angBottom;
+};
+
+// Overwrite LINE_NUM and SCAN_NUM with the dimensions of the selected profile,
+// so that buffers sized at runtime agree with the compile-time profile
+inline std::string applyProfile(const std::string& name) {
+  ProfileDimensions dimensions;
+  dispatch(name, dimensions);
+  parameter::LINE_NUM = dimensions.lines;
+  parameter::SCAN_NUM = dimensions.columns;
+  return dimensions.name;
+}
+
+}  // namespace sensor
+
+#endif  // INCLUDE_SENSOR_PROFILES_H_
@@ -46,6 +46,11 @@ class Imu : public Measurement {
   double time;
   V3D acc;  // accelerometer measurement (m^2/sec)
   V3D gyr;  // gyroscope measurement (rad/s)
+  // An aggregated increment (see imu_aggregation.h) of interval > 0 seconds
+  // ending at time, with acc and gyr its mean rates and dPos its position
+  // increment
+  double interval = 0.0;
+  V3D dPos;
 };
 
 class Gps : public Measurement {
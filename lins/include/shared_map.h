@@ -0,0 +1,390 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_SHARED_MAP_H_
+#define INCLUDE_SHARED_MAP_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The local map of lidar_mapping_node in POSIX shared memory, for processes on
+// the same host. The map is cut into square tiles over the horizontal x-z
+// plane of the /camera_init frame, the frame of /laser_cloud_surround. The
+// mapping node is the only writer; any number of readers map the segment
+// read-only and look at tiles in place, without locks, copies or messages.
+//
+// Every tile slot holds two buffers. The writer fills the buffer readers are
+// not directed to and then publishes it by bumping the slot version. Each
+// buffer carries a sequence number that is odd while the writer is inside it,
+// so a reader can tell afterwards whether a buffer it used was overwritten,
+// which takes two updates of the same tile during the read.
+//
+// This header depends on neither ROS nor PCL, so that clients in other
+// packages can include it.
+
+namespace shared_map {
+
+const uint32_t MAGIC = 0x4c4d4150;  // "LMAP"
+const uint32_t LAYOUT_VERSION = 1;
+const float TILE_SIZE = 20.0;  // m
+const uint32_t DEFAULT_SLOTS = 128;
+const uint32_t DEFAULT_TILE_CAPACITY = 16384;
+
+enum PointClass { CORNER = 0, SURF = 1 };
+
+struct SharedPoint {
+  float x, y, z;
+  uint32_t pointClass;
+};
+
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t layoutVersion;
+  uint32_t numSlots;
+  uint32_t tileCapacity;
+  float tileSize;
+  uint32_t reserved;
+  std::atomic<uint64_t> generation;  // bumped after every batch of tiles
+  std::atomic<uint64_t> stampNs;     // scan stamp of the last batch
+};
+
+struct TileBuffer {
+  std::atomic<uint64_t> sequence;  // odd while being written
+  int32_t ix;
+  int32_t iz;
+  uint32_t count;  // 0 for an unused slot
+  uint32_t reserved;
+  // followed by tileCapacity points
+};
+
+struct SlotHeader {
+  std::atomic<uint64_t> version;  // buffer version & 1 is current
+  char padding[56];               // keep slots on separate cache lines
+};
+
+// Points of one tile as a reader sees them, valid until validate() fails
+struct TileView {
+  int32_t ix;
+  int32_t iz;
+  const SharedPoint* points;
+  uint32_t count;
+
+  uint32_t slot;
+  uint32_t buffer;
+  uint64_t sequence;
+};
+
+inline int32_t tileIndex(float coordinate, float tileSize) {
+  return int32_t(std::floor(coordinate / tileSize));
+}
+
+// Byte offsets of the parts of a segment
+class Layout {
+ public:
+  Layout() : numSlots_(0), tileCapacity_(0) {}
+  Layout(uint32_t numSlots, uint32_t tileCapacity)
+      : numSlots_(numSlots), tileCapacity_(tileCapacity) {}
+
+  size_t bufferSize() const {
+    return align(sizeof(TileBuffer) + tileCapacity_ * sizeof(SharedPoint));
+  }
+  size_t slotSize() const { return sizeof(SlotHeader) + 2 * bufferSize(); }
+  size_t slotOffset(uint32_t slot) const {
+    return align(sizeof(SegmentHeader)) + slot * slotSize();
+  }
+  size_t bufferOffset(uint32_t slot, uint32_t buffer) const {
+    return slotOffset(slot) + sizeof(SlotHeader) + buffer * bufferSize();
+  }
+  size_t totalSize() const { return slotOffset(numSlots_); }
+
+ private:
+  static size_t align(size_t size) { return (size + 63) & ~size_t(63); }
+
+  uint32_t numSlots_;
+  uint32_t tileCapacity_;
+};
+
+class Writer {
+ public:
+  Writer() : base_(nullptr), size_(0) {}
+  ~Writer() { close(); }
+
+  // Create the segment, or take over the one of a previous writer so that
+  // attached readers keep working. Readers see all tiles emptied.
+  bool open(const std::string& name, uint32_t numSlots = DEFAULT_SLOTS,
+            uint32_t tileCapacity = DEFAULT_TILE_CAPACITY) {
+    close();
+    layout_ = Layout(numSlots, tileCapacity);
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) return false;
+    size_ = layout_.totalSize();
+    struct stat st;
+    bool reuse = fstat(fd, &st) == 0 && size_t(st.st_size) == size_;
+    // Truncating to zero first clears a segment without touching its pages
+    if (!reuse && (ftruncate(fd, 0) != 0 || ftruncate(fd, size_) != 0)) {
+      ::close(fd);
+      return false;
+    }
+    void* base =
+        mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) return false;
+    base_ = static_cast<char*>(base);
+
+    SegmentHeader* h = header();
+    reuse = reuse && h->magic == MAGIC && h->layoutVersion == LAYOUT_VERSION &&
+            h->numSlots == numSlots && h->tileCapacity == tileCapacity;
+    if (!reuse) {
+      h->numSlots = numSlots;
+      h->tileCapacity = tileCapacity;
+      h->tileSize = TILE_SIZE;
+      h->layoutVersion = LAYOUT_VERSION;
+    }
+    for (uint32_t s = 0; s < numSlots; ++s) publish(s, 0, 0, nullptr, 0);
+    freeSlots_.clear();
+    for (uint32_t s = numSlots; s > 0; --s) freeSlots_.push_back(s - 1);
+    tiles_.clear();
+    h->generation.fetch_add(1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_release);
+    h->magic = MAGIC;
+    return true;
+  }
+
+  void close() {
+    if (base_ != nullptr) munmap(base_, size_);
+    base_ = nullptr;
+  }
+
+  bool isOpen() const { return base_ != nullptr; }
+
+  // Replace the points of a tile. When all slots are taken, the tile
+  // farthest from (centerX, centerZ) gives up its slot. Points beyond the
+  // tile capacity are dropped evenly.
+  void writeTile(int32_t ix, int32_t iz, const SharedPoint* points,
+                 uint32_t count, float centerX, float centerZ) {
+    uint64_t key = tileKey(ix, iz);
+    std::unordered_map<uint64_t, uint32_t>::iterator it = tiles_.find(key);
+    uint32_t slot;
+    if (it != tiles_.end()) {
+      slot = it->second;
+    } else {
+      if (freeSlots_.empty()) evictFarthest(centerX, centerZ);
+      slot = freeSlots_.back();
+      freeSlots_.pop_back();
+      tiles_[key] = slot;
+    }
+    publish(slot, ix, iz, points, count);
+  }
+
+  // Announce the tiles written since the last commit
+  void commit(uint64_t stampNs) {
+    header()->stampNs.store(stampNs, std::memory_order_relaxed);
+    header()->generation.fetch_add(1, std::memory_order_release);
+  }
+
+ private:
+  static uint64_t tileKey(int32_t ix, int32_t iz) {
+    return (uint64_t(uint32_t(ix)) << 32) | uint32_t(iz);
+  }
+
+  SegmentHeader* header() { return reinterpret_cast<SegmentHeader*>(base_); }
+
+  void evictFarthest(float centerX, float centerZ) {
+    float tileSize = header()->tileSize;
+    std::unordered_map<uint64_t, uint32_t>::iterator farthest = tiles_.end();
+    float farthestSqDis = -1;
+    for (std::unordered_map<uint64_t, uint32_t>::iterator it = tiles_.begin();
+         it != tiles_.end(); ++it) {
+      float dx = (int32_t(it->first >> 32) + 0.5) * tileSize - centerX;
+      float dz = (int32_t(uint32_t(it->first)) + 0.5) * tileSize - centerZ;
+      if (dx * dx + dz * dz > farthestSqDis) {
+        farthestSqDis = dx * dx + dz * dz;
+        farthest = it;
+      }
+    }
+    publish(farthest->second, 0, 0, nullptr, 0);
+    freeSlots_.push_back(farthest->second);
+    tiles_.erase(farthest);
+  }
+
+  void publish(uint32_t slot, int32_t ix, int32_t iz,
+               const SharedPoint* points, uint32_t count) {
+    SlotHeader* slotHeader =
+        reinterpret_cast<SlotHeader*>(base_ + layout_.slotOffset(slot));
+    uint64_t version = slotHeader->version.load(std::memory_order_relaxed);
+    uint32_t buffer = (version + 1) & 1;
+    char* data = base_ + layout_.bufferOffset(slot, buffer);
+    TileBuffer* tile = reinterpret_cast<TileBuffer*>(data);
+    SharedPoint* tilePoints =
+        reinterpret_cast<SharedPoint*>(data + sizeof(TileBuffer));
+
+    uint64_t sequence = tile->sequence.load(std::memory_order_relaxed);
+    tile->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    uint32_t capacity = header()->tileCapacity;
+    tile->ix = ix;
+    tile->iz = iz;
+    if (count <= capacity) {
+      // Empty tiles pass no points, and memcpy from nullptr is undefined
+      if (count > 0)
+        std::memcpy(tilePoints, points, count * sizeof(SharedPoint));
+      tile->count = count;
+    } else {
+      for (uint32_t i = 0; i < capacity; ++i)
+        tilePoints[i] = points[uint64_t(i) * count / capacity];
+      tile->count = capacity;
+    }
+    tile->sequence.store(sequence + 2, std::memory_order_release);
+    slotHeader->version.store(version + 1, std::memory_order_release);
+  }
+
+  char* base_;
+  size_t size_;
+  Layout layout_;
+  std::unordered_map<uint64_t, uint32_t> tiles_;  // tile key -> slot
+  std::vector<uint32_t> freeSlots_;
+};
+
+class Reader {
+ public:
+  Reader() : base_(nullptr), size_(0) {}
+  ~Reader() { close(); }
+
+  // Map the segment read-only. Fails until a writer has initialized it.
+  bool open(const std::string& name) {
+    close();
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SegmentHeader)) {
+      ::close(fd);
+      return false;
+    }
+    size_ = st.st_size;
+    void* base = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) return false;
+    base_ = static_cast<const char*>(base);
+
+    const SegmentHeader* h = header();
+    layout_ = Layout(h->numSlots, h->tileCapacity);
+    if (h->magic != MAGIC || h->layoutVersion != LAYOUT_VERSION ||
+        layout_.totalSize() != size_) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (base_ != nullptr) munmap(const_cast<char*>(base_), size_);
+    base_ = nullptr;
+  }
+
+  bool isOpen() const { return base_ != nullptr; }
+
+  uint64_t generation() const {
+    return header()->generation.load(std::memory_order_acquire);
+  }
+  uint64_t stampNs() const {
+    return header()->stampNs.load(std::memory_order_relaxed);
+  }
+  float tileSize() const { return header()->tileSize; }
+
+  // Views of the tiles overlapping the box [minX, maxX] x [minZ, maxZ]. The
+  // points can be used in place; results computed from a view only hold if
+  // validate() succeeds after they were computed.
+  size_t query(float minX, float minZ, float maxX, float maxZ,
+               std::vector<TileView>& views) const {
+    views.clear();
+    float tileSize = header()->tileSize;
+    int32_t minIx = tileIndex(minX, tileSize);
+    int32_t maxIx = tileIndex(maxX, tileSize);
+    int32_t minIz = tileIndex(minZ, tileSize);
+    int32_t maxIz = tileIndex(maxZ, tileSize);
+    uint32_t numSlots = header()->numSlots;
+    for (uint32_t s = 0; s < numSlots; ++s) {
+      TileView view;
+      if (!current(s, &view)) continue;
+      if (view.count == 0 || view.ix < minIx || view.ix > maxIx ||
+          view.iz < minIz || view.iz > maxIz)
+        continue;
+      views.push_back(view);
+    }
+    return views.size();
+  }
+
+  // Whether the tile buffer of the view has not been rewritten since the
+  // view was taken
+  bool validate(const TileView& view) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return tileBuffer(view.slot, view.buffer)
+               ->sequence.load(std::memory_order_relaxed) == view.sequence;
+  }
+
+ private:
+  const SegmentHeader* header() const {
+    return reinterpret_cast<const SegmentHeader*>(base_);
+  }
+
+  const TileBuffer* tileBuffer(uint32_t slot, uint32_t buffer) const {
+    return reinterpret_cast<const TileBuffer*>(
+        base_ + layout_.bufferOffset(slot, buffer));
+  }
+
+  // Current buffer of a slot, retried while the writer is inside it
+  bool current(uint32_t slot, TileView* view) const {
+    const SlotHeader* slotHeader =
+        reinterpret_cast<const SlotHeader*>(base_ + layout_.slotOffset(slot));
+    for (int attempt = 0; attempt < 100; ++attempt) {
+      uint64_t version = slotHeader->version.load(std::memory_order_acquire);
+      uint32_t buffer = version & 1;
+      const TileBuffer* tile = tileBuffer(slot, buffer);
+      uint64_t sequence = tile->sequence.load(std::memory_order_acquire);
+      if (sequence & 1) continue;
+      view->ix = tile->ix;
+      view->iz = tile->iz;
+      view->count = tile->count;
+      view->points = reinterpret_cast<const SharedPoint*>(
+          reinterpret_cast<const char*>(tile) + sizeof(TileBuffer));
+      view->slot = slot;
+      view->buffer = buffer;
+      view->sequence = sequence;
+      if (view->count <= header()->tileCapacity && validate(*view))
+        return true;
+    }
+    return false;
+  }
+
+  const char* base_;
+  size_t size_;
+  Layout layout_;
+};
+
+}  // namespace shared_map
+
+#endif  // INCLUDE_SHARED_MAP_H_
@@ -0,0 +1,45 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_STATIC_INITIALIZATION_H_
+#define INCLUDE_STATIC_INITIALIZATION_H_
+
+#include <Eigen/Dense>
+
+namespace static_initialization {
+
+// Gravity in the body frame of an IMU at rest, from its mean specific force
+// and accelerometer bias over a stationary window. Unlike the navigation
+// frame gravity, it accounts for the roll and pitch the IMU starts with.
+inline Eigen::Vector3d bodyGravity(const Eigen::Vector3d& accMean,
+                                   const Eigen::Vector3d& ba) {
+  return -(accMean - ba);
+}
+
+// Position and velocity after dt seconds from rest, from the preintegrated
+// specific force deltaP and deltaV and gravity in the start frame
+inline void integrateGravity(const Eigen::Vector3d& gravity, double dt,
+                             const Eigen::Vector3d& deltaP,
+                             const Eigen::Vector3d& deltaV,
+                             Eigen::Vector3d& p, Eigen::Vector3d& v) {
+  p = deltaP + 0.5 * gravity * dt * dt;
+  v = deltaV + gravity * dt;
+}
+
+}  // namespace static_initialization
+
+#endif  // INCLUDE_STATIC_INITIALIZATION_H_
@@ -0,0 +1,191 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#ifndef INCLUDE_VOXEL_MAP_H_
+#define INCLUDE_VOXEL_MAP_H_
+
+#include <parameters.h>
+
+#include <cmath>
+#include <cstdint>
+#include <eigen3/Eigen/Dense>
+#include <unordered_map>
+#include <vector>
+
+namespace voxel_map {
+
+// Voxels are as large as the neighbourhood the kNN association accepts
+const float VOXEL_SIZE = 1.0;
+const int MIN_POINTS = 5;
+// A voxel holds a plane if the points spread less than this normal to it
+const float MAX_PLANE_STD = 0.1;
+// and at least this much along both in-plane axes, so that points on a line
+// do not give a plane of arbitrary normal
+const float MIN_PLANE_SPREAD = 0.1;
+// Points farther from the plane are not associated with it, the residual
+// surfOptimization rejects the fit of its five neighbours with
+const float MAX_PLANE_RESIDUAL = 0.2;
+// and a line if the largest eigenvalue exceeds the second one by this factor,
+// the test cornerOptimization applies to its five neighbours
+const float LINE_EIGENVALUE_RATIO = 3.0;
+
+// First and second moments of the points in a voxel and the plane and line
+// models fitted to them. Moments are accumulated in double, so that removing a
+// cloud cancels adding it.
+struct Voxel {
+  Voxel()
+      : count(0),
+        sum(Eigen::Vector3d::Zero()),
+        sumSq(Eigen::Matrix3d::Zero()),
+        dirty(false),
+        planeValid(false),
+        lineValid(false) {}
+
+  int count;
+  Eigen::Vector3d sum;
+  Eigen::Matrix3d sumSq;
+  bool dirty;
+
+  bool planeValid;
+  bool lineValid;
+  float mean[3];
+  float normal[3];     // of the plane, unit length
+  float direction[3];  // of the line, unit length
+};
+
+// Plane and line models of a local map, cached per voxel. Clouds entering or
+// leaving the map update the moments of the voxels they touch; refresh() then
+// refits only those voxels. Scan points are associated by looking up the
+// voxel they fall into, without a neighbour search or a fit.
+class FeatureMap {
+ public:
+  explicit FeatureMap(float voxelSize = VOXEL_SIZE)
+      : inverseSize_(1.0 / voxelSize) {}
+
+  void clear() {
+    voxels_.clear();
+    dirty_.clear();
+  }
+
+  void add(const pcl::PointCloud<PointType>& cloud) { update(cloud, 1); }
+  void remove(const pcl::PointCloud<PointType>& cloud) { update(cloud, -1); }
+
+  void refresh() {
+    for (int64_t key : dirty_) {
+      std::unordered_map<int64_t, Voxel>::iterator it = voxels_.find(key);
+      if (it == voxels_.end()) continue;
+      if (it->second.count <= 0) {
+        voxels_.erase(it);
+        continue;
+      }
+      fit(it->second);
+    }
+    dirty_.clear();
+  }
+
+  // Plane a x + b y + c z + d = 0 of the voxel containing the point, with
+  // (a, b, c) of unit length, if the point lies within MAX_PLANE_RESIDUAL
+  bool plane(const PointType& point, float params[4]) const {
+    const Voxel* voxel = find(point);
+    if (voxel == nullptr || !voxel->planeValid) return false;
+    params[0] = voxel->normal[0];
+    params[1] = voxel->normal[1];
+    params[2] = voxel->normal[2];
+    params[3] = -(voxel->normal[0] * voxel->mean[0] +
+                  voxel->normal[1] * voxel->mean[1] +
+                  voxel->normal[2] * voxel->mean[2]);
+    const float residual = params[0] * point.x + params[1] * point.y +
+                           params[2] * point.z + params[3];
+    return std::fabs(residual) <= MAX_PLANE_RESIDUAL;
+  }
+
+  // Line of the voxel containing the point, given by two points 0.2 m apart
+  // as cornerOptimization expects them
+  bool line(const PointType& point, float params[6]) const {
+    const Voxel* voxel = find(point);
+    if (voxel == nullptr || !voxel->lineValid) return false;
+    for (int i = 0; i < 3; ++i) {
+      params[i] = voxel->mean[i] + 0.1 * voxel->direction[i];
+      params[3 + i] = voxel->mean[i] - 0.1 * voxel->direction[i];
+    }
+    return true;
+  }
+
+  size_t size() const { return voxels_.size(); }
+
+ private:
+  int64_t key(float x, float y, float z) const {
+    // 21 bits per axis cover +-1000 km at 1 m voxels
+    const int64_t offset = 1 << 20;
+    int64_t ix = int64_t(std::floor(x * inverseSize_)) + offset;
+    int64_t iy = int64_t(std::floor(y * inverseSize_)) + offset;
+    int64_t iz = int64_t(std::floor(z * inverseSize_)) + offset;
+    return (ix << 42) | (iy << 21) | iz;
+  }
+
+  const Voxel* find(const PointType& point) const {
+    std::unordered_map<int64_t, Voxel>::const_iterator it =
+        voxels_.find(key(point.x, point.y, point.z));
+    return it == voxels_.end() ? nullptr : &it->second;
+  }
+
+  void update(const pcl::PointCloud<PointType>& cloud, int sign) {
+    for (const PointType& point : cloud.points) {
+      int64_t k = key(point.x, point.y, point.z);
+      Voxel& voxel = voxels_[k];
+      Eigen::Vector3d p(point.x, point.y, point.z);
+      voxel.count += sign;
+      voxel.sum += sign * p;
+      voxel.sumSq += sign * p * p.transpose();
+      if (!voxel.dirty) {
+        voxel.dirty = true;
+        dirty_.push_back(k);
+      }
+    }
+  }
+
+  static void fit(Voxel& voxel) {
+    voxel.dirty = false;
+    voxel.planeValid = false;
+    voxel.lineValid = false;
+    if (voxel.count < MIN_POINTS) return;
+
+    Eigen::Vector3d mean = voxel.sum / voxel.count;
+    Eigen::Matrix3d covariance =
+        voxel.sumSq / voxel.count - mean * mean.transpose();
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+    solver.computeDirect(covariance);
+    // Eigenvalues in increasing order
+    const Eigen::Vector3d& lambda = solver.eigenvalues();
+    for (int i = 0; i < 3; ++i) {
+      voxel.mean[i] = mean[i];
+      voxel.normal[i] = solver.eigenvectors()(i, 0);
+      voxel.direction[i] = solver.eigenvectors()(i, 2);
+    }
+    voxel.planeValid = lambda[0] < MAX_PLANE_STD * MAX_PLANE_STD &&
+                       lambda[1] > MIN_PLANE_SPREAD * MIN_PLANE_SPREAD;
+    voxel.lineValid = lambda[2] > LINE_EIGENVALUE_RATIO * lambda[1];
+  }
+
+  float inverseSize_;
+  std::unordered_map<int64_t, Voxel> voxels_;
+  std::vector<int64_t> dirty_;
+};
+
+}  // namespace voxel_map
+
+#endif  // INCLUDE_VOXEL_MAP_H_
@@ -0,0 +1,447 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// Offline post-processing of a session saved by lidar_mapping_node: search
+// loop closures over all keyframes, optimize the whole pose graph in batch and
+// regenerate the map from the corrected poses.
+
+#include <gtsam/config.h>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/geometry/Rot3.h>
+#include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <keyframe_session.h>
+#include <parallel.h>
+#include <parameters.h>
+#include <place_recognition.h>
+#ifdef GTSAM_USE_TBB
+// global_control is a preview feature in TBB releases before 2019
+#define TBB_PREVIEW_GLOBAL_CONTROL 1
+#include <tbb/global_control.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+
+using namespace gtsam;
+using namespace parameter;
+using namespace std;
+
+struct LoopCandidate {
+  int latestID;
+  int historyID;
+  bool accepted;
+  float fitness;
+  Pose3 relative;
+};
+
+class BatchOptimizer {
+ public:
+  BatchOptimizer(const std::string& directory, int numThreads)
+      : directory_(directory), numThreads_(std::max(numThreads, 1)) {}
+
+  bool run() {
+    TicToc ts_total;
+
+    TicToc ts_load;
+    if (!session::loadSession(directory_, session_)) {
+      ROS_ERROR_STREAM("Failed to load a session from " << directory_);
+      return false;
+    }
+    double timeLoad = ts_load.toc();
+
+    TicToc ts_search;
+    findLoopCandidates();
+    double timeSearch = ts_search.toc();
+
+    TicToc ts_verify;
+    verifyLoopCandidates();
+    double timeVerify = ts_verify.toc();
+
+    TicToc ts_optimize;
+    optimize();
+    double timeOptimize = ts_optimize.toc();
+
+    TicToc ts_map;
+    regenerateMap();
+    double timeMap = ts_map.toc();
+
+    writePlaceDatabase();
+
+    report(timeLoad, timeSearch, timeVerify, timeOptimize, timeMap,
+           ts_total.toc());
+    return true;
+  }
+
+ private:
+  // Keep, for every keyframe, the closest keyframe of each earlier pass through
+  // the same place. Keyframes of one pass are consecutive, so a pass ends where
+  // the indices jump by more than the ICP window.
+  void findLoopCandidates() {
+    int numKeyframes = session_.poses->size();
+
+    pcl::PointCloud<PointType>::Ptr positions(new pcl::PointCloud<PointType>());
+    for (int i = 0; i < numKeyframes; ++i) {
+      PointType position;
+      position.x = session_.poses->points[i].x;
+      position.y = session_.poses->points[i].y;
+      position.z = session_.poses->points[i].z;
+      position.intensity = i;
+      positions->push_back(position);
+    }
+    pcl::KdTreeFLANN<PointType> kdtreePositions;
+    kdtreePositions.setInputCloud(positions);
+
+    std::multimap<int, int> closedLoops;
+    for (const auto& factor : session_.graph) {
+      if (!factor || factor->keys().size() != 2) continue;
+      int a = factor->keys()[0], b = factor->keys()[1];
+      if (std::abs(a - b) > 1)
+        closedLoops.insert(std::make_pair(std::max(a, b), std::min(a, b)));
+    }
+
+    std::vector<int> pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+    for (int j = 0; j < numKeyframes; ++j) {
+      kdtreePositions.radiusSearch(positions->points[j],
+                                   historyKeyframeSearchRadius, pointSearchInd,
+                                   pointSearchSqDis, 0);
+
+      std::vector<std::pair<int, float>> history;
+      for (int k = 0; k < pointSearchInd.size(); ++k) {
+        int i = pointSearchInd[k];
+        if (i < j && session_.poses->points[j].time -
+                             session_.poses->points[i].time >
+                         30.0)
+          history.push_back(std::make_pair(i, pointSearchSqDis[k]));
+      }
+      std::sort(history.begin(), history.end());
+
+      for (int begin = 0; begin < history.size();) {
+        int end = begin + 1;
+        while (end < history.size() &&
+               history[end].first - history[end - 1].first <=
+                   historyKeyframeSearchNum)
+          ++end;
+        int closest = begin;
+        for (int k = begin + 1; k < end; ++k)
+          if (history[k].second < history[closest].second) closest = k;
+        if (!isClosed(closedLoops, j, history[closest].first)) {
+          LoopCandidate candidate;
+          candidate.latestID = j;
+          candidate.historyID = history[closest].first;
+          candidate.accepted = false;
+          candidate.fitness = 0;
+          candidates_.push_back(candidate);
+        }
+        begin = end;
+      }
+    }
+  }
+
+  bool isClosed(const std::multimap<int, int>& closedLoops, int latestID,
+                int historyID) {
+    auto range = closedLoops.equal_range(latestID);
+    for (auto it = range.first; it != range.second; ++it)
+      if (std::abs(it->second - historyID) <= historyKeyframeSearchNum)
+        return true;
+    return false;
+  }
+
+  // Candidates take very different ICP times, so the threads pull them one by
+  // one instead of splitting the list into fixed ranges
+  void verifyLoopCandidates() {
+    std::atomic<int> next(0);
+    int numCandidates = candidates_.size();
+    parallel::parallelFor(numThreads_, numThreads_, [&](int, int) {
+      int c;
+      while ((c = next++) < numCandidates) verifyLoopCandidate(candidates_[c]);
+    });
+  }
+
+  void verifyLoopCandidate(LoopCandidate& candidate) const {
+    int latestID = candidate.latestID;
+    int historyID = candidate.historyID;
+    int numKeyframes = session_.poses->size();
+
+    pcl::PointCloud<PointType>::Ptr latestCloud(
+        new pcl::PointCloud<PointType>());
+    pcl::PointCloud<PointType>::Ptr latestKeyFrame(
+        new pcl::PointCloud<PointType>());
+    *latestKeyFrame += *transformPointCloud(session_.cornerClouds[latestID],
+                                            &session_.poses->points[latestID]);
+    *latestKeyFrame += *transformPointCloud(session_.surfClouds[latestID],
+                                            &session_.poses->points[latestID]);
+    for (int i = 0; i < latestKeyFrame->points.size(); ++i) {
+      if ((int)latestKeyFrame->points[i].intensity >= 0)
+        latestCloud->push_back(latestKeyFrame->points[i]);
+    }
+
+    pcl::PointCloud<PointType>::Ptr nearHistoryCloud(
+        new pcl::PointCloud<PointType>());
+    pcl::PointCloud<PointType>::Ptr nearHistoryCloudDS(
+        new pcl::PointCloud<PointType>());
+    for (int j = -historyKeyframeSearchNum; j <= historyKeyframeSearchNum;
+         ++j) {
+      int id = historyID + j;
+      if (id < 0 || id >= numKeyframes || id >= latestID) continue;
+      *nearHistoryCloud += *transformPointCloud(session_.cornerClouds[id],
+                                                &session_.poses->points[id]);
+      *nearHistoryCloud += *transformPointCloud(session_.surfClouds[id],
+                                                &session_.poses->points[id]);
+    }
+    pcl::VoxelGrid<PointType> downSizeFilterHistoryKeyFrames;
+    downSizeFilterHistoryKeyFrames.setLeafSize(0.4, 0.4, 0.4);
+    downSizeFilterHistoryKeyFrames.setInputCloud(nearHistoryCloud);
+    downSizeFilterHistoryKeyFrames.filter(*nearHistoryCloudDS);
+    if (latestCloud->empty() || nearHistoryCloudDS->empty()) return;
+
+    pcl::IterativeClosestPoint<PointType, PointType> icp;
+    icp.setMaxCorrespondenceDistance(100);
+    icp.setMaximumIterations(100);
+    icp.setTransformationEpsilon(1e-6);
+    icp.setEuclideanFitnessEpsilon(1e-6);
+    icp.setRANSACIterations(0);
+
+    icp.setInputSource(latestCloud);
+    icp.setInputTarget(nearHistoryCloudDS);
+    pcl::PointCloud<PointType>::Ptr unused_result(
+        new pcl::PointCloud<PointType>());
+    icp.align(*unused_result);
+
+    if (icp.hasConverged() == false ||
+        icp.getFitnessScore() > historyKeyframeFitnessScore)
+      return;
+
+    float x, y, z, roll, pitch, yaw;
+    Eigen::Affine3f correctionCameraFrame;
+    correctionCameraFrame = icp.getFinalTransformation();
+    pcl::getTranslationAndEulerAngles(correctionCameraFrame, x, y, z, roll,
+                                      pitch, yaw);
+    Eigen::Affine3f correctionLidarFrame =
+        pcl::getTransformation(z, x, y, yaw, roll, pitch);
+    Eigen::Affine3f tWrong =
+        pclPointToAffine3fCameraToLidar(session_.poses->points[latestID]);
+    Eigen::Affine3f tCorrect = correctionLidarFrame * tWrong;
+    pcl::getTranslationAndEulerAngles(tCorrect, x, y, z, roll, pitch, yaw);
+    Pose3 poseFrom = Pose3(Rot3::RzRyRx(roll, pitch, yaw), Point3(x, y, z));
+    Pose3 poseTo = pclPointTogtsamPose3(session_.poses->points[historyID]);
+
+    candidate.accepted = true;
+    candidate.fitness = icp.getFitnessScore();
+    candidate.relative = poseFrom.between(poseTo);
+  }
+
+  // Levenberg-Marquardt over the full graph, which loadSession has anchored
+  // at the first pose. The multifrontal elimination runs in parallel when
+  // gtsam is built with TBB.
+  void optimize() {
+    NonlinearFactorGraph graph = session_.graph;
+
+    gtsam::Vector Vector6(6);
+    for (const LoopCandidate& candidate : candidates_) {
+      if (!candidate.accepted) continue;
+      float noiseScore = candidate.fitness;
+      Vector6 << noiseScore, noiseScore, noiseScore, noiseScore, noiseScore,
+          noiseScore;
+      graph.add(BetweenFactor<Pose3>(candidate.latestID, candidate.historyID,
+                                     candidate.relative,
+                                     noiseModel::Diagonal::Variances(Vector6)));
+      ++numLoops_;
+    }
+
+    LevenbergMarquardtParams params;
+    params.setLinearSolverType("MULTIFRONTAL_CHOLESKY");
+    params.setMaxIterations(100);
+    LevenbergMarquardtOptimizer optimizer(graph, session_.estimate, params);
+    result_ = optimizer.optimize();
+    numIterations_ = optimizer.iterations();
+
+    int numPoses = result_.size();
+    for (int i = 0; i < numPoses; ++i) {
+      const Pose3& pose = result_.at<Pose3>(i);
+      PointTypePose& thisPose6D = session_.poses->points[i];
+      thisPose6D.x = pose.translation().y();
+      thisPose6D.y = pose.translation().z();
+      thisPose6D.z = pose.translation().x();
+      thisPose6D.roll = pose.rotation().pitch();
+      thisPose6D.pitch = pose.rotation().yaw();
+      thisPose6D.yaw = pose.rotation().roll();
+    }
+
+    session_.graph = graph;
+    gtsam::writeG2o(graph, result_, directory_ + "/optimized_graph.g2o");
+    pcl::io::savePCDFileBinary(directory_ + "/optimized_poses.pcd",
+                               *session_.poses);
+  }
+
+  void regenerateMap() {
+    int numKeyframes = session_.poses->size();
+    std::vector<pcl::PointCloud<PointType>::Ptr> keyFrames(numKeyframes);
+    parallel::parallelFor(numKeyframes, numThreads_, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        PointTypePose* pose = &session_.poses->points[i];
+        keyFrames[i] = transformPointCloud(session_.cornerClouds[i], pose);
+        *keyFrames[i] += *transformPointCloud(session_.surfClouds[i], pose);
+        *keyFrames[i] += *transformPointCloud(session_.outlierClouds[i], pose);
+      }
+    });
+
+    pcl::PointCloud<PointType>::Ptr globalMapKeyFrames(
+        new pcl::PointCloud<PointType>());
+    for (int i = 0; i < numKeyframes; ++i) *globalMapKeyFrames += *keyFrames[i];
+
+    pcl::PointCloud<PointType>::Ptr globalMapKeyFramesDS(
+        new pcl::PointCloud<PointType>());
+    pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyFrames;
+    downSizeFilterGlobalMapKeyFrames.setLeafSize(0.4, 0.4, 0.4);
+    downSizeFilterGlobalMapKeyFrames.setInputCloud(globalMapKeyFrames);
+    downSizeFilterGlobalMapKeyFrames.filter(*globalMapKeyFramesDS);
+    numMapPoints_ = globalMapKeyFramesDS->size();
+
+    if (!globalMapKeyFramesDS->empty())
+      pcl::io::savePCDFileBinary(directory_ + "/optimized_map.pcd",
+                                 *globalMapKeyFramesDS);
+  }
+
+  // Descriptors of the optimized keyframes for relocalization against this
+  // session in lidar_mapping_node
+  void writePlaceDatabase() {
+    TicToc ts_descriptors;
+    std::string databasePath = directory_ + "/place_db.bin";
+    if (!place_recognition::writeDatabase(
+            databasePath,
+            place_recognition::buildDescriptors(session_, numThreads_)))
+      ROS_WARN_STREAM("Failed to write " << databasePath);
+    else
+      ROS_INFO_STREAM("Place recognition database written in "
+                      << ts_descriptors.toc() << " ms");
+  }
+
+  // Log the timing and append it to batch_timing.csv, so that runs with
+  // different sessions and thread counts can be compared
+  void report(double timeLoad, double timeSearch, double timeVerify,
+              double timeOptimize, double timeMap, double timeTotal) {
+    int numKeyframes = session_.poses->size();
+    ROS_INFO_STREAM("Batch optimization of " << numKeyframes
+                                             << " keyframes on " << numThreads_
+                                             << " threads:");
+    ROS_INFO_STREAM("  load: " << timeLoad << " ms");
+    ROS_INFO_STREAM("  loop search: " << timeSearch << " ms, "
+                                      << candidates_.size() << " candidates");
+    ROS_INFO_STREAM("  loop verification: " << timeVerify << " ms, "
+                                            << numLoops_ << " loops");
+    ROS_INFO_STREAM("  optimization: " << timeOptimize << " ms, "
+                                       << numIterations_ << " iterations");
+    ROS_INFO_STREAM("  map: " << timeMap << " ms, " << numMapPoints_
+                              << " points");
+    ROS_INFO_STREAM("  total: " << timeTotal << " ms");
+
+    std::string timingPath = directory_ + "/batch_timing.csv";
+    bool writeHeader = !session::fileExists(timingPath);
+    std::ofstream timing(timingPath, std::ios::app);
+    if (writeHeader)
+      timing << "keyframes,threads,candidates,loops,load_ms,search_ms,"
+                "verify_ms,optimize_ms,map_ms,total_ms\n";
+    timing << numKeyframes << "," << numThreads_ << "," << candidates_.size()
+           << "," << numLoops_ << "," << timeLoad << "," << timeSearch << ","
+           << timeVerify << "," << timeOptimize << "," << timeMap << ","
+           << timeTotal << "\n";
+  }
+
+  Pose3 pclPointTogtsamPose3(PointTypePose thisPoint) const {
+    return Pose3(
+        Rot3::RzRyRx(double(thisPoint.yaw), double(thisPoint.roll),
+                     double(thisPoint.pitch)),
+        Point3(double(thisPoint.z), double(thisPoint.x), double(thisPoint.y)));
+  }
+
+  Eigen::Affine3f pclPointToAffine3fCameraToLidar(
+      PointTypePose thisPoint) const {
+    return pcl::getTransformation(thisPoint.z, thisPoint.x, thisPoint.y,
+                                  thisPoint.yaw, thisPoint.roll,
+                                  thisPoint.pitch);
+  }
+
+  pcl::PointCloud<PointType>::Ptr transformPointCloud(
+      pcl::PointCloud<PointType>::Ptr cloudIn,
+      const PointTypePose* transformIn) const {
+    pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
+
+    PointType* pointFrom;
+    PointType pointTo;
+
+    int cloudSize = cloudIn->points.size();
+    cloudOut->resize(cloudSize);
+
+    float ctRoll = cos(transformIn->roll), stRoll = sin(transformIn->roll);
+    float ctPitch = cos(transformIn->pitch), stPitch = sin(transformIn->pitch);
+    float ctYaw = cos(transformIn->yaw), stYaw = sin(transformIn->yaw);
+
+    for (int i = 0; i < cloudSize; ++i) {
+      pointFrom = &cloudIn->points[i];
+      float x1 = ctYaw * pointFrom->x - stYaw * pointFrom->y;
+      float y1 = stYaw * pointFrom->x + ctYaw * pointFrom->y;
+      float z1 = pointFrom->z;
+
+      float x2 = x1;
+      float y2 = ctRoll * y1 - stRoll * z1;
+      float z2 = stRoll * y1 + ctRoll * z1;
+
+      pointTo.x = ctPitch * x2 + stPitch * z2 + transformIn->x;
+      pointTo.y = y2 + transformIn->y;
+      pointTo.z = -stPitch * x2 + ctPitch * z2 + transformIn->z;
+      pointTo.intensity = pointFrom->intensity;
+
+      cloudOut->points[i] = pointTo;
+    }
+    return cloudOut;
+  }
+
+  std::string directory_;
+  int numThreads_;
+
+  session::KeyframeSession session_;
+  std::vector<LoopCandidate> candidates_;
+  Values result_;
+  int numLoops_ = 0;
+  int numIterations_ = 0;
+  int numMapPoints_ = 0;
+};
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "batch_optimization");
+  ros::NodeHandle pnh("~");
+
+  parameter::readParameters(pnh);
+  if (parameter::SESSION_DIRECTORY.empty()) {
+    ROS_ERROR("Set session_directory to the session to optimize");
+    return 1;
+  }
+
+#ifdef GTSAM_USE_TBB
+  tbb::global_control scheduler(tbb::global_control::max_allowed_parallelism,
+                                std::max(parameter::BATCH_THREADS, 1));
+#endif
+  parallel::Scheduler::instance().start(parameter::BATCH_THREADS);
+
+  BatchOptimizer optimizer(parameter::SESSION_DIRECTORY,
+                           parameter::BATCH_THREADS);
+  return optimizer.run() ? 0 : 1;
+}
@@ -26,10 +26,15 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+#include <metrics.h>
 #include <parameters.h>
+#include <scan_trace.h>
+#include <sensor_profiles.h>
 
 using namespace parameter;
 
+// Range image projection and segmentation, specialised for one sensor profile
+template <typename Profile>
 class ImageProjection {
  private:
   ros::NodeHandle nh;
@@ -58,11 +63,16 @@ class ImageProjection {
 
   PointType nanPoint;
 
-  cv::Mat rangeMat;
-  cv::Mat labelMat;
-  cv::Mat groundMat;
+  // Row-major range images of Profile::lines() x Profile::columns()
+  std::vector<float> rangeMat;
+  std::vector<int> labelMat;
+  std::vector<int8_t> groundMat;
   int labelCount;
 
+  // Sine and cosine of the angle between horizontal and vertical neighbours
+  float sinAlphaX, cosAlphaX;
+  float sinAlphaY, cosAlphaY;
+
   float startOrientation;
   float endOrientation;
 
@@ -119,15 +129,16 @@ class ImageProjection {
     segmentedCloudPure.reset(new pcl::PointCloud<PointType>());
     outlierCloud.reset(new pcl::PointCloud<PointType>());
 
-    fullCloud->points.resize(LINE_NUM * SCAN_NUM);
-    fullInfoCloud->points.resize(LINE_NUM * SCAN_NUM);
+    const int imageSize = Profile::lines() * Profile::columns();
+    fullCloud->points.resize(imageSize);
+    fullInfoCloud->points.resize(imageSize);
 
-    segMsg.startRingIndex.assign(LINE_NUM, 0);
-    segMsg.endRingIndex.assign(LINE_NUM, 0);
+    segMsg.startRingIndex.assign(Profile::lines(), 0);
+    segMsg.endRingIndex.assign(Profile::lines(), 0);
 
-    segMsg.segmentedCloudGroundFlag.assign(LINE_NUM * SCAN_NUM, false);
-    segMsg.segmentedCloudColInd.assign(LINE_NUM * SCAN_NUM, 0);
-    segMsg.segmentedCloudRange.assign(LINE_NUM * SCAN_NUM, 0);
+    segMsg.segmentedCloudGroundFlag.assign(imageSize, false);
+    segMsg.segmentedCloudColInd.assign(imageSize, 0);
+    segMsg.segmentedCloudRange.assign(imageSize, 0);
 
     std::pair<int8_t, int8_t> neighbor;
     neighbor.first = -1;
@@ -143,11 +154,22 @@ class ImageProjection {
     neighbor.second = 0;
     neighborIterator.push_back(neighbor);
 
-    allPushedIndX = new uint16_t[LINE_NUM * SCAN_NUM];
-    allPushedIndY = new uint16_t[LINE_NUM * SCAN_NUM];
+    allPushedIndX = new uint16_t[imageSize];
+    allPushedIndY = new uint16_t[imageSize];
+
+    queueIndX = new uint16_t[imageSize];
+    queueIndY = new uint16_t[imageSize];
+
+    rangeMat.resize(imageSize);
+    labelMat.resize(imageSize);
+    groundMat.resize(imageSize);
 
-    queueIndX = new uint16_t[LINE_NUM * SCAN_NUM];
-    queueIndY = new uint16_t[LINE_NUM * SCAN_NUM];
+    float segmentAlphaX = Profile::angResX() / 180.0 * M_PI;
+    float segmentAlphaY = Profile::angResY() / 180.0 * M_PI;
+    sinAlphaX = sin(segmentAlphaX);
+    cosAlphaX = cos(segmentAlphaX);
+    sinAlphaY = sin(segmentAlphaY);
+    cosAlphaY = cos(segmentAlphaY);
   }
 
   void resetParameters() {
@@ -157,9 +179,9 @@ class ImageProjection {
     segmentedCloudPure->clear();
     outlierCloud->clear();
 
-    rangeMat = cv::Mat(LINE_NUM, SCAN_NUM, CV_32F, cv::Scalar::all(FLT_MAX));
-    groundMat = cv::Mat(LINE_NUM, SCAN_NUM, CV_8S, cv::Scalar::all(0));
-    labelMat = cv::Mat(LINE_NUM, SCAN_NUM, CV_32S, cv::Scalar::all(0));
+    std::fill(rangeMat.begin(), rangeMat.end(), FLT_MAX);
+    std::fill(groundMat.begin(), groundMat.end(), 0);
+    std::fill(labelMat.begin(), labelMat.end(), 0);
     labelCount = 1;
 
     std::fill(fullCloud->points.begin(), fullCloud->points.end(), nanPoint);
@@ -169,6 +191,10 @@ class ImageProjection {
 
   ~ImageProjection() {}
 
+  static inline int index(int row, int col) {
+    return col + row * Profile::columns();
+  }
+
   void copyPointCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg) {
     cloudHeader = laserCloudMsg->header;
     pcl::fromROSMsg(*laserCloudMsg, *laserCloudIn);
@@ -177,6 +203,8 @@ class ImageProjection {
   }
 
   void cloudHandler(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg) {
+    trace::Tracer& tracer = trace::Tracer::instance();
+    tracer.mark(laserCloudMsg->header.stamp, "received");
     TicToc ts_total;
     copyPointCloud(laserCloudMsg);
     findStartEndAngle();
@@ -184,8 +212,15 @@ class ImageProjection {
     groundRemoval();
     cloudSegmentation();
     publishCloud();
+    tracer.mark(laserCloudMsg->header.stamp, "published");
+    tracer.flush(laserCloudMsg->header.stamp);
     resetParameters();
     double time_total = ts_total.toc();
+
+    static metrics::Histogram& segmentationTime =
+        metrics::Registry::instance().histogram(
+            "lins_segmentation_time_ms", "Time to project and segment a scan");
+    segmentationTime.observe(time_total);
   }
 
   void findStartEndAngle() {
@@ -204,7 +239,7 @@ class ImageProjection {
 
   void projectPointCloud() {
     float verticalAngle, horizonAngle, range;
-    size_t rowIdn, columnIdn, index, cloudSize;
+    size_t rowIdn, columnIdn, pointInd, cloudSize;
     PointType thisPoint;
 
     cloudSize = laserCloudIn->points.size();
@@ -217,26 +252,27 @@ class ImageProjection {
       verticalAngle = atan2(thisPoint.z, sqrt(thisPoint.x * thisPoint.x +
                                               thisPoint.y * thisPoint.y)) *
                       180 / M_PI;
-      rowIdn = (verticalAngle + ang_bottom) / ang_res_y;
-      if (rowIdn < 0 || rowIdn >= LINE_NUM) continue;
+      rowIdn = (verticalAngle + Profile::angBottom()) / Profile::angResY();
+      if (rowIdn < 0 || rowIdn >= Profile::lines()) continue;
 
       horizonAngle = atan2(thisPoint.x, thisPoint.y) * 180 / M_PI;
 
-      columnIdn = -round((horizonAngle - 90.0) / ang_res_x) + SCAN_NUM / 2;
-      if (columnIdn >= SCAN_NUM) columnIdn -= SCAN_NUM;
+      columnIdn = -round((horizonAngle - 90.0) / Profile::angResX()) +
+                  Profile::columns() / 2;
+      if (columnIdn >= Profile::columns()) columnIdn -= Profile::columns();
 
-      if (columnIdn < 0 || columnIdn >= SCAN_NUM) continue;
+      if (columnIdn < 0 || columnIdn >= Profile::columns()) continue;
 
       range = sqrt(thisPoint.x * thisPoint.x + thisPoint.y * thisPoint.y +
                    thisPoint.z * thisPoint.z);
-      rangeMat.at<float>(rowIdn, columnIdn) = range;
+      rangeMat[index(rowIdn, columnIdn)] = range;
 
       thisPoint.intensity = (float)rowIdn + (float)columnIdn / 10000.0;
 
-      index = columnIdn + rowIdn * SCAN_NUM;
-      fullCloud->points[index] = thisPoint;
+      pointInd = index(rowIdn, columnIdn);
+      fullCloud->points[pointInd] = thisPoint;
 
-      fullInfoCloud->points[index].intensity = range;
+      fullInfoCloud->points[pointInd].intensity = range;
     }
   }
 
@@ -244,14 +280,14 @@ class ImageProjection {
     size_t lowerInd, upperInd;
     float diffX, diffY, diffZ, angle;
 
-    for (size_t j = 0; j < SCAN_NUM; ++j) {
-      for (size_t i = 0; i < groundScanInd; ++i) {
-        lowerInd = j + (i)*SCAN_NUM;
-        upperInd = j + (i + 1) * SCAN_NUM;
+    for (size_t j = 0; j < Profile::columns(); ++j) {
+      for (size_t i = 0; i < Profile::groundScanInd(); ++i) {
+        lowerInd = index(i, j);
+        upperInd = index(i + 1, j);
 
         if (fullCloud->points[lowerInd].intensity == -1 ||
             fullCloud->points[upperInd].intensity == -1) {
-          groundMat.at<int8_t>(i, j) = -1;
+          groundMat[index(i, j)] = -1;
           continue;
         }
 
@@ -262,57 +298,56 @@ class ImageProjection {
         angle = atan2(diffZ, sqrt(diffX * diffX + diffY * diffY)) * 180 / M_PI;
 
         if (abs(angle - sensorMountAngle) <= 10) {
-          groundMat.at<int8_t>(i, j) = 1;
-          groundMat.at<int8_t>(i + 1, j) = 1;
+          groundMat[index(i, j)] = 1;
+          groundMat[index(i + 1, j)] = 1;
         }
       }
     }
 
-    for (size_t i = 0; i < LINE_NUM; ++i) {
-      for (size_t j = 0; j < SCAN_NUM; ++j) {
-        if (groundMat.at<int8_t>(i, j) == 1 ||
-            rangeMat.at<float>(i, j) == FLT_MAX) {
-          labelMat.at<int>(i, j) = -1;
+    for (size_t i = 0; i < Profile::lines(); ++i) {
+      for (size_t j = 0; j < Profile::columns(); ++j) {
+        if (groundMat[index(i, j)] == 1 || rangeMat[index(i, j)] == FLT_MAX) {
+          labelMat[index(i, j)] = -1;
         }
       }
     }
     if (pubGroundCloud.getNumSubscribers() != 0) {
-      for (size_t i = 0; i <= groundScanInd; ++i) {
-        for (size_t j = 0; j < SCAN_NUM; ++j) {
-          if (groundMat.at<int8_t>(i, j) == 1)
-            groundCloud->push_back(fullCloud->points[j + i * SCAN_NUM]);
+      for (size_t i = 0; i <= Profile::groundScanInd(); ++i) {
+        for (size_t j = 0; j < Profile::columns(); ++j) {
+          if (groundMat[index(i, j)] == 1)
+            groundCloud->push_back(fullCloud->points[index(i, j)]);
         }
       }
     }
   }
 
   void cloudSegmentation() {
-    for (size_t i = 0; i < LINE_NUM; ++i)
-      for (size_t j = 0; j < SCAN_NUM; ++j)
-        if (labelMat.at<int>(i, j) == 0) labelComponents(i, j);
+    for (size_t i = 0; i < Profile::lines(); ++i)
+      for (size_t j = 0; j < Profile::columns(); ++j)
+        if (labelMat[index(i, j)] == 0) labelComponents(i, j);
 
     int sizeOfSegCloud = 0;
-    for (size_t i = 0; i < LINE_NUM; ++i) {
+    for (size_t i = 0; i < Profile::lines(); ++i) {
       segMsg.startRingIndex[i] = sizeOfSegCloud - 1 + 5;
 
-      for (size_t j = 0; j < SCAN_NUM; ++j) {
-        if (labelMat.at<int>(i, j) > 0 || groundMat.at<int8_t>(i, j) == 1) {
-          if (labelMat.at<int>(i, j) == 999999) {
-            if (i > groundScanInd && j % 5 == 0) {
-              outlierCloud->push_back(fullCloud->points[j + i * SCAN_NUM]);
+      for (size_t j = 0; j < Profile::columns(); ++j) {
+        if (labelMat[index(i, j)] > 0 || groundMat[index(i, j)] == 1) {
+          if (labelMat[index(i, j)] == 999999) {
+            if (i > Profile::groundScanInd() && j % 5 == 0) {
+              outlierCloud->push_back(fullCloud->points[index(i, j)]);
               continue;
             } else {
               continue;
             }
           }
-          if (groundMat.at<int8_t>(i, j) == 1) {
-            if (j % 5 != 0 && j > 5 && j < SCAN_NUM - 5) continue;
+          if (groundMat[index(i, j)] == 1) {
+            if (j % 5 != 0 && j > 5 && j < Profile::columns() - 5) continue;
           }
           segMsg.segmentedCloudGroundFlag[sizeOfSegCloud] =
-              (groundMat.at<int8_t>(i, j) == 1);
+              (groundMat[index(i, j)] == 1);
           segMsg.segmentedCloudColInd[sizeOfSegCloud] = j;
-          segMsg.segmentedCloudRange[sizeOfSegCloud] = rangeMat.at<float>(i, j);
-          segmentedCloud->push_back(fullCloud->points[j + i * SCAN_NUM]);
+          segMsg.segmentedCloudRange[sizeOfSegCloud] = rangeMat[index(i, j)];
+          segmentedCloud->push_back(fullCloud->points[index(i, j)]);
           ++sizeOfSegCloud;
         }
       }
@@ -321,12 +356,12 @@ class ImageProjection {
     }
 
     if (pubSegmentedCloudPure.getNumSubscribers() != 0) {
-      for (size_t i = 0; i < LINE_NUM; ++i) {
-        for (size_t j = 0; j < SCAN_NUM; ++j) {
-          if (labelMat.at<int>(i, j) > 0 && labelMat.at<int>(i, j) != 999999) {
-            segmentedCloudPure->push_back(fullCloud->points[j + i * SCAN_NUM]);
+      for (size_t i = 0; i < Profile::lines(); ++i) {
+        for (size_t j = 0; j < Profile::columns(); ++j) {
+          if (labelMat[index(i, j)] > 0 && labelMat[index(i, j)] != 999999) {
+            segmentedCloudPure->push_back(fullCloud->points[index(i, j)]);
             segmentedCloudPure->points.back().intensity =
-                labelMat.at<int>(i, j);
+                labelMat[index(i, j)];
           }
         }
       }
@@ -334,9 +369,9 @@ class ImageProjection {
   }
 
   void labelComponents(int row, int col) {
-    float d1, d2, alpha, angle;
+    float d1, d2, angle;
     int fromIndX, fromIndY, thisIndX, thisIndY;
-    bool lineCountFlag[LINE_NUM] = {false};
+    bool lineCountFlag[Profile::lines()] = {false};
 
     queueIndX[0] = row;
     queueIndY[0] = col;
@@ -353,31 +388,29 @@ class ImageProjection {
       fromIndY = queueIndY[queueStartInd];
       --queueSize;
       ++queueStartInd;
-      labelMat.at<int>(fromIndX, fromIndY) = labelCount;
+      labelMat[index(fromIndX, fromIndY)] = labelCount;
 
       for (auto iter = neighborIterator.begin(); iter != neighborIterator.end();
            ++iter) {
         thisIndX = fromIndX + (*iter).first;
         thisIndY = fromIndY + (*iter).second;
 
-        if (thisIndX < 0 || thisIndX >= LINE_NUM) continue;
+        if (thisIndX < 0 || thisIndX >= Profile::lines()) continue;
 
-        if (thisIndY < 0) thisIndY = SCAN_NUM - 1;
-        if (thisIndY >= SCAN_NUM) thisIndY = 0;
+        if (thisIndY < 0) thisIndY = Profile::columns() - 1;
+        if (thisIndY >= Profile::columns()) thisIndY = 0;
 
-        if (labelMat.at<int>(thisIndX, thisIndY) != 0) continue;
+        if (labelMat[index(thisIndX, thisIndY)] != 0) continue;
 
-        d1 = std::max(rangeMat.at<float>(fromIndX, fromIndY),
-                      rangeMat.at<float>(thisIndX, thisIndY));
-        d2 = std::min(rangeMat.at<float>(fromIndX, fromIndY),
-                      rangeMat.at<float>(thisIndX, thisIndY));
+        d1 = std::max(rangeMat[index(fromIndX, fromIndY)],
+                      rangeMat[index(thisIndX, thisIndY)]);
+        d2 = std::min(rangeMat[index(fromIndX, fromIndY)],
+                      rangeMat[index(thisIndX, thisIndY)]);
 
         if ((*iter).first == 0)
-          alpha = segmentAlphaX;
+          angle = atan2(d2 * sinAlphaX, (d1 - d2 * cosAlphaX));
         else
-          alpha = segmentAlphaY;
-
-        angle = atan2(d2 * sin(alpha), (d1 - d2 * cos(alpha)));
+          angle = atan2(d2 * sinAlphaY, (d1 - d2 * cosAlphaY));
 
         if (angle > segmentTheta) {
           queueIndX[queueEndInd] = thisIndX;
@@ -385,7 +418,7 @@ class ImageProjection {
           ++queueSize;
           ++queueEndInd;
 
-          labelMat.at<int>(thisIndX, thisIndY) = labelCount;
+          labelMat[index(thisIndX, thisIndY)] = labelCount;
           lineCountFlag[thisIndX] = true;
 
           allPushedIndX[allPushedIndSize] = thisIndX;
@@ -400,7 +433,7 @@ class ImageProjection {
       feasibleSegment = true;
     else if (allPushedIndSize >= segmentValidPointNum) {
       int lineCount = 0;
-      for (size_t i = 0; i < LINE_NUM; ++i)
+      for (size_t i = 0; i < Profile::lines(); ++i)
         if (lineCountFlag[i] == true) ++lineCount;
       if (lineCount >= segmentValidLineNum) feasibleSegment = true;
     }
@@ -409,7 +442,7 @@ class ImageProjection {
       ++labelCount;
     } else {
       for (size_t i = 0; i < allPushedIndSize; ++i) {
-        labelMat.at<int>(allPushedIndX[i], allPushedIndY[i]) = 999999;
+        labelMat[index(allPushedIndX[i], allPushedIndY[i])] = 999999;
       }
     }
   }
@@ -460,6 +493,25 @@ class ImageProjection {
   }
 };
 
+// Run the projection instantiated for the configured sensor profile
+struct ImageProjectionStarter {
+  ImageProjectionStarter(ros::NodeHandle& nh, ros::NodeHandle& pnh)
+      : nh(nh), pnh(pnh) {}
+
+  template <typename Profile>
+  void apply() {
+    ImageProjection<Profile> featureHandler(nh, pnh);
+
+    ROS_INFO_STREAM("\033[1;32m---->\033[0m Feature Extraction Module Started ("
+                    << Profile::name() << ").");
+
+    ros::spin();
+  }
+
+  ros::NodeHandle& nh;
+  ros::NodeHandle& pnh;
+};
+
 int main(int argc, char** argv) {
   ros::init(argc, argv, "image_projection_node");
   ros::NodeHandle nh;
@@ -467,12 +519,12 @@ int main(int argc, char** argv) {
 
 
   parameter::readParameters(pnh);
+  metrics::startExporter(
+      "image_projection_node",
+      parameter::METRICS_PORT > 0 ? parameter::METRICS_PORT + 1 : 0);
+  trace::Tracer::instance().init(nh, "image_projection_node");
 
-
-  ImageProjection featureHandler(nh, pnh);
-
-  ROS_INFO("\033[1;32m---->\033[0m Feature Extraction Module Started.");
-
-  ros::spin();
+  ImageProjectionStarter starter(nh, pnh);
+  sensor::dispatch(parameter::LIDAR_MODEL, starter);
   return 0;
 }
@@ -0,0 +1,211 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// Joins the /scan_trace checkpoints that the nodes publish with scan_trace set
+// into per-scan latency breakdowns, exports them as histograms and logs their
+// percentiles. Checkpoints of different nodes are compared by wall time, so
+// all nodes have to run on the host of the collector.
+
+#include <metrics.h>
+#include <parameters.h>
+#include <scan_trace.h>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+// Time between two checkpoints of a scan. Checkpoints are named
+// <node>/<stage>; "stamp" is the scan stamp itself.
+struct Segment {
+  const char* name;
+  const char* from;
+  const char* to;
+};
+
+const Segment SEGMENTS[] = {
+    {"sensor", "stamp", "image_projection_node/received"},
+    {"projection", "image_projection_node/received",
+     "image_projection_node/published"},
+    {"projection_to_odometry", "image_projection_node/published",
+     "lins_fusion_node/received"},
+    {"odometry_wait", "lins_fusion_node/received", "lins_fusion_node/start"},
+    {"odometry", "lins_fusion_node/start", "lins_fusion_node/published"},
+    {"odometry_to_fusion", "lins_fusion_node/published",
+     "transform_fusion_node/odometry_received"},
+    {"fusion", "transform_fusion_node/odometry_received",
+     "transform_fusion_node/odometry_published"},
+    {"odometry_total", "image_projection_node/received",
+     "transform_fusion_node/odometry_published"},
+    {"odometry_to_mapping", "lins_fusion_node/published",
+     "lidar_mapping_node/received"},
+    {"mapping_wait", "lidar_mapping_node/received", "lidar_mapping_node/start"},
+    {"mapping", "lidar_mapping_node/start", "lidar_mapping_node/published"},
+    {"mapping_to_fusion", "lidar_mapping_node/published",
+     "transform_fusion_node/mapping_received"},
+    {"mapping_total", "image_projection_node/received",
+     "transform_fusion_node/mapping_received"},
+};
+
+const int NUM_SEGMENTS = sizeof(SEGMENTS) / sizeof(SEGMENTS[0]);
+
+// A scan is assembled this long after its first checkpoint arrived, which
+// leaves time for mapping to finish it
+const double COMPLETION_DELAY = 2.0;
+// How long an assembled scan is remembered to drop checkpoints arriving late
+const double FLUSHED_RETENTION = 30.0;
+// Percentiles are taken over the last WINDOW_SIZE scans of a segment
+const size_t WINDOW_SIZE = 1000;
+const double REPORT_INTERVAL = 10.0;
+
+class LatencyCollector {
+ public:
+  explicit LatencyCollector(ros::NodeHandle& nh) : lastReport_(0) {
+    subTrace_ = nh.subscribe<cloud_msgs::scan_trace>(
+        "/scan_trace", 100, &LatencyCollector::traceHandler, this);
+    timer_ = nh.createWallTimer(ros::WallDuration(1.0),
+                                &LatencyCollector::assemble, this);
+
+    metrics::Registry& registry = metrics::Registry::instance();
+    for (int i = 0; i < NUM_SEGMENTS; ++i) {
+      histograms_.push_back(&registry.histogram(
+          "lins_scan_latency_ms", "Latency of a scan between two checkpoints",
+          std::string("segment=\"") + SEGMENTS[i].name + "\""));
+    }
+    windows_.resize(NUM_SEGMENTS);
+  }
+
+ private:
+  struct Scan {
+    double firstSeen;
+    std::map<std::string, double> checkpoints;
+  };
+  typedef std::map<double, Scan> Scans;
+  // Wall time at which each recently assembled scan was recorded
+  typedef std::map<double, double> Flushed;
+
+  void traceHandler(const cloud_msgs::scan_trace::ConstPtr& msg) {
+    static metrics::Counter& late = metrics::Registry::instance().counter(
+        "lins_scan_traces_late_total",
+        "Checkpoints dropped because their scan was already assembled");
+
+    double stamp = msg->header.stamp.toSec();
+    Scans::iterator it = trace::findStamp(scans_, stamp);
+    if (it == scans_.end()) {
+      // A node slower than COMPLETION_DELAY would otherwise start a second,
+      // partial record of the scan
+      if (trace::findStamp(flushed_, stamp) != flushed_.end()) {
+        late.inc();
+        return;
+      }
+      it = scans_.insert(std::make_pair(stamp, Scan())).first;
+      it->second.firstSeen = ros::WallTime::now().toSec();
+      it->second.checkpoints["stamp"] = stamp;
+    }
+    size_t n = std::min(msg->stages.size(), msg->wallTimes.size());
+    for (size_t i = 0; i < n; ++i)
+      it->second.checkpoints[msg->node + "/" + msg->stages[i]] =
+          msg->wallTimes[i];
+  }
+
+  void assemble(const ros::WallTimerEvent&) {
+    double now = ros::WallTime::now().toSec();
+    while (!scans_.empty() &&
+           now - scans_.begin()->second.firstSeen > COMPLETION_DELAY) {
+      record(scans_.begin()->second);
+      flushed_[scans_.begin()->first] = now;
+      scans_.erase(scans_.begin());
+    }
+    while (!flushed_.empty() &&
+           now - flushed_.begin()->second > FLUSHED_RETENTION)
+      flushed_.erase(flushed_.begin());
+    if (now - lastReport_ >= REPORT_INTERVAL) {
+      report();
+      lastReport_ = now;
+    }
+  }
+
+  void record(const Scan& scan) {
+    static metrics::Counter& traced = metrics::Registry::instance().counter(
+        "lins_scan_traces_total", "Scans assembled from checkpoints");
+    traced.inc();
+
+    // The stamp is sensor time, which is only comparable to wall time when
+    // running live
+    bool simTime = ros::Time::isSimTime();
+    for (int i = 0; i < NUM_SEGMENTS; ++i) {
+      if (simTime && std::string(SEGMENTS[i].from) == "stamp") continue;
+      std::map<std::string, double>::const_iterator from =
+          scan.checkpoints.find(SEGMENTS[i].from);
+      std::map<std::string, double>::const_iterator to =
+          scan.checkpoints.find(SEGMENTS[i].to);
+      if (from == scan.checkpoints.end() || to == scan.checkpoints.end())
+        continue;
+      double latency = (to->second - from->second) * 1000.0;
+      histograms_[i]->observe(latency);
+      windows_[i].push_back(latency);
+      if (windows_[i].size() > WINDOW_SIZE) windows_[i].pop_front();
+    }
+  }
+
+  static double percentile(const std::vector<double>& sorted, double p) {
+    int rank = std::ceil(p * sorted.size()) - 1;
+    return sorted[std::max(rank, 0)];
+  }
+
+  void report() {
+    std::vector<double> sorted;
+    for (int i = 0; i < NUM_SEGMENTS; ++i) {
+      if (windows_[i].empty()) continue;
+      sorted.assign(windows_[i].begin(), windows_[i].end());
+      std::sort(sorted.begin(), sorted.end());
+      ROS_INFO("%-22s p50 %8.2f  p90 %8.2f  p99 %8.2f ms  (%zu scans)",
+               SEGMENTS[i].name, percentile(sorted, 0.5),
+               percentile(sorted, 0.9), percentile(sorted, 0.99),
+               sorted.size());
+    }
+  }
+
+  ros::Subscriber subTrace_;
+  ros::WallTimer timer_;
+  Scans scans_;
+  Flushed flushed_;
+  std::vector<metrics::Histogram*> histograms_;
+  std::vector<std::deque<double>> windows_;
+  double lastReport_;
+};
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "latency_collector_node");
+  ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+
+  parameter::readParameters(pnh);
+  metrics::startExporter(
+      "latency_collector_node",
+      parameter::METRICS_PORT > 0 ? parameter::METRICS_PORT + 3 : 0);
+  if (!parameter::SCAN_TRACE)
+    ROS_WARN("scan_trace is not set, the nodes publish no checkpoints");
+
+  LatencyCollector collector(nh);
+  ROS_INFO("\033[1;32m---->\033[0m Latency Collector Started.");
+
+  ros::spin();
+  return 0;
+}
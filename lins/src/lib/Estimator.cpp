@@ -72,12 +72,29 @@ void LinsFusion::initialization() {
 
   // Allocate measurement buffers for sensors
   imuBuf_.allocate(500);
+  if (IMU_AGGREGATION_RATE > 0)
+    imuAggregator_.configure(1.0 / IMU_AGGREGATION_RATE);
   pclBuf_.allocate(3);
   outlierBuf_.allocate(3);
   cloudInfoBuf_.allocate(3);
 
+  // Export buffer overflows, which silently drop measurements
+  metrics::Registry& registry = metrics::Registry::instance();
+  const std::string help = "Measurements dropped because the buffer was full";
+  imuBuf_.setEvictionCounter(&registry.counter(
+      "lins_buffer_evictions_total", help, "buffer=\"imu\""));
+  pclBuf_.setEvictionCounter(&registry.counter(
+      "lins_buffer_evictions_total", help, "buffer=\"cloud\""));
+  outlierBuf_.setEvictionCounter(&registry.counter(
+      "lins_buffer_evictions_total", help, "buffer=\"outlier\""));
+  cloudInfoBuf_.setEvictionCounter(&registry.counter(
+      "lins_buffer_evictions_total", help, "buffer=\"cloud_info\""));
+
+  if (!SCAN_LOG.empty() && !scanLog_.open(SCAN_LOG))
+    ROS_ERROR_STREAM("Failed to open the scan log " << SCAN_LOG);
+
   // Initialize IMU propagation parameters
-  isImuCalibrated = CALIBARTE_IMU;
+  isImuCalibrated = !CALIBARTE_IMU;
   ba_init_ = INIT_BA;
   bw_init_ = INIT_BW;
   ba_tmp_.setZero();
@@ -85,7 +102,10 @@ void LinsFusion::initialization() {
   sample_counter_ = 0;
 
   duration_ = 0.0;
+  duration_imu_ = 0.0;
   scan_counter_ = 0;
+  first_imu_time_ = -1.0;
+  hasFirstValidPose_ = false;
 
   ROS_INFO_STREAM("Subscribe to \033[1;32m---->\033[0m " << IMU_TOPIC);
   ROS_INFO_STREAM("Subscribe to \033[1;32m---->\033[0m " << LIDAR_TOPIC);
@@ -94,6 +114,7 @@ void LinsFusion::initialization() {
 void LinsFusion::laserCloudCallback(
     const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg) {
   // Add a new segmented point cloud
+  trace::Tracer::instance().mark(laserCloudMsg->header.stamp, "received");
   pclBuf_.addMeas(laserCloudMsg, laserCloudMsg->header.stamp.toSec());
 }
 void LinsFusion::laserCloudInfoCallback(
@@ -134,9 +155,23 @@ void LinsFusion::imuCallback(const sensor_msgs::Imu::ConstPtr& imuMsg) {
   alignIMUtoVehicle(misalign_euler_angles_, acc_raw_, gyr_raw_, acc_aligned_,
                     gyr_aligned_);
 
-  // Add a new IMU measurement
+  // Add a new IMU measurement, or the increment it completes when samples
+  // are aggregated
   Imu imu(imuMsg->header.stamp.toSec(), acc_aligned_, gyr_aligned_);
-  imuBuf_.addMeas(imu, imuMsg->header.stamp.toSec());
+  if (!imuAggregator_.enabled()) {
+    imuBuf_.addMeas(imu, imu.time);
+  } else if (imuAggregator_.add(imu.time, imu.acc, imu.gyr)) {
+    const imu_aggregation::Increment& increment = imuAggregator_.increment();
+    Imu aggregated(increment.time, increment.meanAcc(), increment.meanGyr());
+    aggregated.interval = increment.dt;
+    aggregated.dPos = increment.dPos;
+    imuBuf_.addMeas(aggregated, aggregated.time);
+  }
+  if (first_imu_time_ < 0) first_imu_time_ = imu.time;
+
+  // Estimate IMU biases from a stationary window while the first scans are
+  // still arriving
+  if (!isImuCalibrated) performImuBiasEstimation(imu);
 
   // Trigger the Kalman filter
   performStateEstimation();
@@ -199,6 +234,13 @@ void LinsFusion::publishTopics() {
   // transforme the odometry from XYZ-convention to YZX-convention to meet the
   // mapping module's requirement.
   publishOdometryYZX(scan_time_);
+
+  if (scanLog_.isOpen())
+    scanLog_.write(scan_time_, estimator->globalStateYZX_.rn_,
+                   estimator->globalStateYZX_.qbn_,
+                   *estimator->scan_last_->cornerPointsLessSharpYZX_,
+                   *estimator->scan_last_->surfPointsLessFlatYZX_,
+                   *estimator->scan_last_->outlierPointCloudYZX_);
 }
 
 bool LinsFusion::processPointClouds() {
@@ -218,13 +260,17 @@ bool LinsFusion::processPointClouds() {
       cloudInfoBuf_.measMap_.upper_bound(estimator->getTime());
   cloud_msgs::cloud_info cloudInfoMsg = cloudInfoBuf_.itMeas_->second;
 
+  // With IMU aggregation this waits for the increment covering the scan to
+  // close, up to 1 / IMU_AGGREGATION_RATE after scan_time_
   imuBuf_.getLastTime(last_imu_time_);
   if (last_imu_time_ < scan_time_) {
     // ROS_WARN("Wait for more IMU measurement!");
     return false;
   }
+  trace::Tracer::instance().mark(ros::Time().fromSec(scan_time_), "start");
 
   // Propagate IMU measurements between two consecutive scans
+  TicToc ts_imu;
   int imu_couter = 0;
   while (estimator->getTime() < scan_time_ &&
          (imuBuf_.itMeas_ = imuBuf_.measMap_.upper_bound(
@@ -232,7 +278,27 @@ bool LinsFusion::processPointClouds() {
     double dt =
         std::min(imuBuf_.itMeas_->first, scan_time_) - estimator->getTime();
     Imu imu = imuBuf_.itMeas_->second;
-    estimator->processImu(dt, imu.acc, imu.gyr);
+    // An aggregated increment cut by the scan is scaled as if its rates were
+    // constant
+    if (imu.interval > 0.0) {
+      const double scale = dt / imu.interval;
+      estimator->processImuIncrement(dt, imu.gyr * dt, imu.acc * dt,
+                                     imu.dPos * scale * scale);
+    } else {
+      estimator->processImu(dt, imu.acc, imu.gyr);
+    }
+    imu_couter++;
+  }
+  if (VERBOSE) {
+    // Include the deferred covariance update so that both propagation modes
+    // are timed over the same work
+    estimator->filter_->propagateCovariance();
+    double time_imu = ts_imu.toc();
+    duration_imu_ =
+        (duration_imu_ * scan_counter_ + time_imu) / (scan_counter_ + 1);
+    ROS_INFO_STREAM("IMU propagation: " << imu_couter
+                                        << " samples, average time per scan: "
+                                        << duration_imu_ << " ms");
   }
 
   Imu imu;
@@ -267,10 +333,26 @@ void LinsFusion::performStateEstimation() {
     TicToc ts_total;
     if (!processPointClouds()) break;
     double time_total = ts_total.toc();
+    static metrics::Histogram& odometryTime =
+        metrics::Registry::instance().histogram(
+            "lins_odometry_time_ms", "Time to process one scan in the IESKF");
+    odometryTime.observe(time_total);
     duration_ = (duration_ * scan_counter_ + time_total) / (scan_counter_ + 1);
     scan_counter_++;
-    // ROS_INFO_STREAM("Pure-odometry processing time: " << duration_);
+    if (VERBOSE) {
+      ROS_INFO_STREAM("Odometry: average time per scan: " << duration_
+                                                          << " ms");
+    }
     publishTopics();
+    trace::Tracer& tracer = trace::Tracer::instance();
+    tracer.mark(ros::Time().fromSec(scan_time_), "published");
+    tracer.flush(ros::Time().fromSec(scan_time_));
+
+    if (!hasFirstValidPose_ && estimator->isRunning()) {
+      hasFirstValidPose_ = true;
+      ROS_INFO_STREAM("First valid pose after " << scan_time_ - first_imu_time_
+                                                << " s");
+    }
 
     // if (VERBOSE) {
     //   cout << "ba: " << estimator->globalState_.ba_.transpose() << endl;
@@ -319,30 +401,39 @@ void LinsFusion::publishOdometryYZX(double timeStamp) {
   tfBroadcaster.sendTransform(laserOdometryTrans);
 }
 
-// void LinsFusion::performImuBiasEstimation() {
-//   Imu imu;
-//   while (imuBuf_.getSize() != 0) {
-//     imuBuf_.getFirstMeas(imu);
-//     ba_tmp_ += imu.acc - V3D(0, 0, G0);
-//     bw_tmp_ += imu.gyr;
-//     sample_counter_++;
-//     if (sample_counter_ == AVERAGE_NUMS) {
-//       ba_init_ = ba_tmp_ * (1. / sample_counter_);
-//       bw_init_ = bw_tmp_ * (1. / sample_counter_);
-//       isImuCalibrated = true;
-//       ROS_INFO_STREAM("Estimated IMU acceleration bias: \n "
-//                       << ba_init_.transpose() << " and gyroscope bias: \n"
-//                       << bw_init_.transpose());
-//       ba_tmp_.setZero();
-//       bw_tmp_.setZero();
-//       sample_counter_ = 0;
-//       break;
-//     }
-//     imuBuf_.clean(imu.time);
-//     pclBuf_.clean(imu.time);
-//     outlierBuf_.clean(imu.time);
-//     cloudInfoBuf_.clean(imu.time);
-//   }
-// }
+void LinsFusion::performImuBiasEstimation(const Imu& imu) {
+  // Restart the window whenever the vehicle is not stationary
+  if (imu.gyr.norm() > staticGyrThreshold ||
+      std::abs(imu.acc.norm() - G0) > staticAccThreshold) {
+    ba_tmp_.setZero();
+    bw_tmp_.setZero();
+    sample_counter_ = 0;
+    return;
+  }
+
+  ba_tmp_ += imu.acc;
+  bw_tmp_ += imu.gyr;
+  sample_counter_++;
+  if (sample_counter_ < AVERAGE_NUMS) return;
+
+  // The mean specific force points against gravity. Its deviation from G0 is
+  // attributed to the accelerometer bias, the remaining tilt to roll and pitch
+  V3D acc_mean = ba_tmp_ * (1. / sample_counter_);
+  ba_init_ = acc_mean - acc_mean.normalized() * G0;
+  bw_init_ = bw_tmp_ * (1. / sample_counter_);
+  isImuCalibrated = true;
+  ba_tmp_.setZero();
+  bw_tmp_.setZero();
+  sample_counter_ = 0;
+
+  if (estimator->setStaticInitialization(ba_init_, bw_init_, acc_mean)) {
+    ROS_INFO_STREAM("Estimated IMU acceleration bias: \n "
+                    << ba_init_.transpose() << " and gyroscope bias: \n"
+                    << bw_init_.transpose() << " after "
+                    << imu.time - first_imu_time_ << " s");
+  } else {
+    ROS_WARN("Static IMU initialization finished after the filter started");
+  }
+}
 
 }  // namespace fusion
@@ -0,0 +1,147 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+#include <arpa/inet.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <metrics.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <ros/ros.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdlib>
+
+namespace metrics {
+
+namespace {
+
+std::thread exporter;
+std::atomic<bool> exporterStopped(false);
+
+int openServerSocket(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, 4) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Answer every request with the current registry. Scrapers only issue GET
+// requests, so the request itself is not parsed.
+void serveScrape(int serverFd) {
+  int fd = accept(serverFd, nullptr, nullptr);
+  if (fd < 0) return;
+
+  char request[1024];
+  pollfd pfd = {fd, POLLIN, 0};
+  if (poll(&pfd, 1, 100) > 0) recv(fd, request, sizeof(request), 0);
+
+  std::string body = Registry::instance().renderPrometheus();
+  std::ostringstream response;
+  response << "HTTP/1.0 200 OK\r\n"
+           << "Content-Type: text/plain; version=0.0.4\r\n"
+           << "Content-Length: " << body.size() << "\r\n\r\n"
+           << body;
+  std::string data = response.str();
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) break;
+    sent += n;
+  }
+  close(fd);
+}
+
+void publishDiagnostics(ros::Publisher& publisher,
+                        const std::string& nodeName) {
+  diagnostic_msgs::DiagnosticArray array;
+  array.header.stamp = ros::Time::now();
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.name = "lins: " + nodeName;
+  status.hardware_id = nodeName;
+  for (const auto& value : Registry::instance().summaries()) {
+    diagnostic_msgs::KeyValue keyValue;
+    keyValue.key = value.first;
+    keyValue.value = value.second;
+    status.values.push_back(keyValue);
+  }
+  array.status.push_back(status);
+  publisher.publish(array);
+}
+
+void exporterThread(std::string nodeName, int port) {
+  ros::NodeHandle nh;
+  ros::Publisher pubDiagnostics =
+      nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+
+  int serverFd = -1;
+  if (port > 0) {
+    serverFd = openServerSocket(port);
+    if (serverFd < 0)
+      ROS_WARN_STREAM("Failed to serve metrics on 127.0.0.1:" << port);
+    else
+      ROS_INFO_STREAM("Serve metrics on 127.0.0.1:" << port);
+  }
+
+  ros::WallTime lastPublish = ros::WallTime::now();
+  while (ros::ok() && !exporterStopped) {
+    if (serverFd >= 0) {
+      pollfd pfd = {serverFd, POLLIN, 0};
+      if (poll(&pfd, 1, 100) > 0) serveScrape(serverFd);
+    } else {
+      ros::WallDuration(0.1).sleep();
+    }
+
+    if ((ros::WallTime::now() - lastPublish).toSec() >= 1.0) {
+      publishDiagnostics(pubDiagnostics, nodeName);
+      lastPublish = ros::WallTime::now();
+    }
+  }
+
+  if (serverFd >= 0) close(serverFd);
+}
+
+}  // namespace
+
+void startExporter(const std::string& nodeName, int port) {
+  // The registry is constructed before the exit handler is registered, so
+  // that it is destroyed only after the exporter has been joined
+  Registry::instance();
+  exporter = std::thread(exporterThread, nodeName, port);
+  std::atexit(stopExporter);
+}
+
+void stopExporter() {
+  exporterStopped = true;
+  if (exporter.joinable()) exporter.join();
+}
+
+}  // namespace metrics
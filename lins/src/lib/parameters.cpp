@@ -16,6 +16,7 @@
 //    software without specific prior written permission.
 
 #include <parameters.h>
+#include <sensor_profiles.h>
 
 namespace parameter {
 
@@ -29,6 +30,7 @@ double IMU_LIDAR_EXTRINSIC_ANGLE;
 double IMU_MISALIGN_ANGLE;
 
 // !@LIDAR_PARAMETERS
+std::string LIDAR_MODEL;
 int LINE_NUM;
 int SCAN_NUM;
 double SCAN_PERIOD;
@@ -43,6 +45,30 @@ int MAX_LIDAR_NUMS;
 int NUM_ITER;
 double LIDAR_SCALE;
 double LIDAR_STD;
+int DETERMINISTIC_MODE;
+
+// !@MAPPING
+int MAPPING_PYRAMID_LEVELS;
+int TIGHTLY_COUPLED_MAPPING;
+double MAPPING_REQUERY_RATIO;
+int MAPPING_REQUERY_ITERATIONS;
+int MAPPING_VOXEL_MAP;
+int MAPPING_PROJECTIVE_ASSOCIATION;
+int MAPPING_CORNER_BUDGET;
+int MAPPING_SURF_BUDGET;
+int MAPPING_THREADS;
+int LOOP_CLOSURE_THREADS;
+std::string SESSION_DIRECTORY;
+std::string RELOCALIZATION_MAP;
+std::string SHARED_MAP;
+std::string SCAN_LOG;
+std::string REPLAY_SCAN_LOG;
+int BATCH_THREADS;
+int SCHEDULER_THREADS;
+
+// !@METRICS
+int METRICS_PORT;
+int SCAN_TRACE;
 
 // !@SUB_TOPIC_NAME
 std::string IMU_TOPIC;
@@ -62,6 +88,8 @@ V3D INIT_VEL_STD;
 V3D INIT_ATT_STD;
 V3D INIT_ACC_STD;
 V3D INIT_GYR_STD;
+int BATCH_IMU_PROPAGATION;
+double IMU_AGGREGATION_RATE;
 
 // !@INITIAL IMU BIASES
 V3D INIT_BA;
@@ -108,16 +136,41 @@ void readParameters(ros::NodeHandle& n) {
   NUM_ITER = fsSettings["num_iter"];
   LIDAR_SCALE = fsSettings["lidar_scale"];
   LIDAR_STD = fsSettings["lidar_std"];
+  DETERMINISTIC_MODE = fsSettings["deterministic_mode"];
+  METRICS_PORT = fsSettings["metrics_port"];
+  SCAN_TRACE = fsSettings["scan_trace"];
+  MAPPING_PYRAMID_LEVELS = fsSettings["mapping_pyramid_levels"];
+  TIGHTLY_COUPLED_MAPPING = fsSettings["tightly_coupled_mapping"];
+  MAPPING_REQUERY_RATIO = fsSettings["mapping_requery_ratio"];
+  MAPPING_REQUERY_ITERATIONS = fsSettings["mapping_requery_iterations"];
+  MAPPING_VOXEL_MAP = fsSettings["mapping_voxel_map"];
+  MAPPING_PROJECTIVE_ASSOCIATION =
+      fsSettings["mapping_projective_association"];
+  MAPPING_CORNER_BUDGET = fsSettings["mapping_corner_budget"];
+  MAPPING_SURF_BUDGET = fsSettings["mapping_surf_budget"];
+  MAPPING_THREADS = fsSettings["mapping_threads"];
+  LOOP_CLOSURE_THREADS = fsSettings["loop_closure_threads"];
+  BATCH_THREADS = fsSettings["batch_threads"];
+  SCHEDULER_THREADS = fsSettings["scheduler_threads"];
 
   fsSettings["imu_topic"] >> IMU_TOPIC;
   fsSettings["lidar_topic"] >> LIDAR_TOPIC;
   fsSettings["lidar_odometry_topic"] >> LIDAR_ODOMETRY_TOPIC;
   fsSettings["lidar_mapping_topic"] >> LIDAR_MAPPING_TOPIC;
+  fsSettings["session_directory"] >> SESSION_DIRECTORY;
+  fsSettings["relocalization_map"] >> RELOCALIZATION_MAP;
+  fsSettings["shared_map"] >> SHARED_MAP;
+  fsSettings["scan_log"] >> SCAN_LOG;
+  fsSettings["replay_scan_log"] >> REPLAY_SCAN_LOG;
+  fsSettings["lidar_model"] >> LIDAR_MODEL;
+  LIDAR_MODEL = sensor::applyProfile(LIDAR_MODEL);
 
   ACC_N = fsSettings["acc_n"];
   ACC_W = fsSettings["acc_w"];
   GYR_N = fsSettings["gyr_n"];
   GYR_W = fsSettings["gyr_w"];
+  BATCH_IMU_PROPAGATION = fsSettings["batch_imu_propagation"];
+  IMU_AGGREGATION_RATE = fsSettings["imu_aggregation_rate"];
 
   readV3D(&fsSettings, "init_pos_std", INIT_POS_STD);
   readV3D(&fsSettings, "init_vel_std", INIT_VEL_STD);
@@ -43,10 +43,26 @@
 #include <gtsam/nonlinear/Values.h>
 #include <gtsam/slam/BetweenFactor.h>
 #include <gtsam/slam/PriorFactor.h>
+#include <keyframe_session.h>
 #include <math_utils.h>
+#include <metrics.h>
+#include <parallel.h>
 #include <parameters.h>
-
+#include <place_recognition.h>
+#include <projective_association.h>
+#include <scan_arena.h>
+#include <scan_budget.h>
+#include <scan_log.h>
+#include <scan_trace.h>
+#include <shared_map.h>
+#include <voxel_map.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <eigen3/Eigen/Dense>
+#include <map>
+#include <unordered_map>
 
 using namespace gtsam;
 using namespace parameter;
@@ -54,27 +70,66 @@ using namespace std;
 
 const int imuQueLength_ = 200;
 
-struct PointXYZIRPYT {
-  PCL_ADD_POINT4D
-  PCL_ADD_INTENSITY;
-  float roll;
-  float pitch;
-  float yaw;
-  double time;
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-} EIGEN_ALIGN16;
+// Keyframe queued for a loop search
+struct LoopRequest {
+  int keyframe;
+  std::chrono::steady_clock::time_point queued;
+};
 
-POINT_CLOUD_REGISTER_POINT_STRUCT(
-    PointXYZIRPYT,
-    (float, x, x)(float, y, y)(float, z, z)(float, intensity, intensity)(
-        float, roll, roll)(float, pitch, pitch)(float, yaw, yaw)(double, time,
-                                                                 time))
+// History keyframe that may close a loop with the latest keyframe: its pose
+// and the local map around it at search time and, once verified, the ICP
+// result
+struct LoopCandidate {
+  int historyID;
+  PointTypePose historyPose;
+  pcl::PointCloud<PointType>::Ptr target;
+  bool cancelled;
+  bool verified;
+  float fitness;
+  Eigen::Matrix<float, 4, 4, Eigen::DontAlign> correction;
+};
 
-typedef PointXYZIRPYT PointTypePose;
+// Map feature matched to a scan point in the last search: a line through two
+// points (x1, y1, z1, x2, y2, z2) for corners or a plane (a, b, c, d) for
+// surfaces, together with the transformed point position at search time
+struct PointAssociation {
+  float x = 0, y = 0, z = 0;
+  bool valid = false;
+  float params[6];
+};
+
+// History keyframe whose local map failed to align with a latest keyframe.
+// Positions are in the global frame, so that they survive map origin moves.
+struct FailedLoopCandidate {
+  V3D latestPosition;
+  V3D historyPosition;
+  V3D historyAttitude;  // roll, pitch, yaw
+};
+
+// One level of the scan-to-map registration pyramid: a downsampled local map
+// with its KD trees and the matching subsample of the current scan. Distance
+// thresholds of the association are scaled by scale.
+struct MapLevel {
+  pcl::PointCloud<PointType>::Ptr cornerMap;
+  pcl::PointCloud<PointType>::Ptr surfMap;
+  pcl::KdTreeFLANN<PointType>::Ptr kdtreeCorner;
+  pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurf;
+  pcl::PointCloud<PointType>::Ptr cornerScan;
+  pcl::PointCloud<PointType>::Ptr surfScan;
+  pcl::VoxelGrid<PointType> downSizeFilterCorner;
+  pcl::VoxelGrid<PointType> downSizeFilterSurf;
+  std::vector<PointAssociation> cornerAssociations;
+  std::vector<PointAssociation> surfAssociations;
+  float scale;
+  int maxIterations;
+  int mapVersion;
+};
 
 class MappingHandler {
  private:
   NonlinearFactorGraph gtSAMgraph;
+  // Every factor added to isam, kept to save the session
+  NonlinearFactorGraph sessionGraph;
   Values initialEstimate;
   Values optimizedEstimate;
   ISAM2* isam;
@@ -143,6 +198,9 @@ class MappingHandler {
 
   pcl::PointCloud<PointType>::Ptr laserCloudSurfTotalLast;
   pcl::PointCloud<PointType>::Ptr laserCloudSurfTotalLastDS;
+  // Corners registered against the map: laserCloudCornerLastDS unless a
+  // corner budget is set
+  pcl::PointCloud<PointType>::Ptr laserCloudCornerScan;
 
   pcl::PointCloud<PointType>::Ptr laserCloudOri;
   pcl::PointCloud<PointType>::Ptr coeffSel;
@@ -155,18 +213,14 @@ class MappingHandler {
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap;
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap;
 
+  // Plane and line models of the local map, kept in step with the recent and
+  // surrounding keyframe clouds when mapping_voxel_map is set
+  voxel_map::FeatureMap cornerFeatureMap;
+  voxel_map::FeatureMap surfFeatureMap;
+
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurroundingKeyPoses;
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeHistoryKeyPoses;
 
-  pcl::PointCloud<PointType>::Ptr nearHistoryCornerKeyFrameCloud;
-  pcl::PointCloud<PointType>::Ptr nearHistoryCornerKeyFrameCloudDS;
-  pcl::PointCloud<PointType>::Ptr nearHistorySurfKeyFrameCloud;
-  pcl::PointCloud<PointType>::Ptr nearHistorySurfKeyFrameCloudDS;
-
-  pcl::PointCloud<PointType>::Ptr latestCornerKeyFrameCloud;
-  pcl::PointCloud<PointType>::Ptr latestSurfKeyFrameCloud;
-  pcl::PointCloud<PointType>::Ptr latestSurfKeyFrameCloudDS;
-
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeGlobalMap;
   pcl::PointCloud<PointType>::Ptr globalMapKeyPoses;
   pcl::PointCloud<PointType>::Ptr globalMapKeyPosesDS;
@@ -179,6 +233,8 @@ class MappingHandler {
   pcl::VoxelGrid<PointType> downSizeFilterCorner;
   pcl::VoxelGrid<PointType> downSizeFilterSurf;
   pcl::VoxelGrid<PointType> downSizeFilterOutlier;
+  budget::BudgetFilter cornerBudgetFilter;
+  budget::BudgetFilter surfBudgetFilter;
   pcl::VoxelGrid<PointType> downSizeFilterHistoryKeyFrames;
   pcl::VoxelGrid<PointType> downSizeFilterSurroundingKeyPoses;
   pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyPoses;
@@ -202,6 +258,12 @@ class MappingHandler {
   float transformBefMapped[6];
   float transformAftMapped[6];
 
+  // The transforms above, the key poses and the local map are kept in float
+  // relative to mapOrigin, which follows the vehicle, so that they stay
+  // accurate far from where mapping started. mapOrigin and the pose graph are
+  // global and in double.
+  V3D mapOrigin;
+
   int imuPointerFront;
   int imuPointerLast;
 
@@ -212,6 +274,7 @@ class MappingHandler {
   std::mutex mtx;
 
   double timeLastProcessing;
+  bool replaying;  // every scan is mapped, see replay()
 
   PointType pointOri, pointSel, pointProj, coeff;
 
@@ -233,18 +296,59 @@ class MappingHandler {
   int laserCloudOutlierLastDSNum;
   int laserCloudSurfTotalLastDSNum;
 
-  bool potentialLoopFlag;
-  double timeSaveFirstCurrentScanForLoopClosure;
-  int closestHistoryFrameID;
-  int latestFrameIDLoopCloure;
+  // !@Loop closure queue, filled by new keyframes
+  std::deque<LoopRequest> loopQueue;
+  std::mutex loopQueueMtx;
+  bool loopClosureScheduled;  // a task serving the queue is pending
+  // Failed candidates by history keyframe, only used by the loop searches
+  std::map<int, FailedLoopCandidate> failedLoopCandidates;
+
+  // !@Loop closure and map publishing tasks on the scheduler
+  parallel::TaskGroup backgroundTasks;
+  std::atomic<bool> globalMapScheduled;
+  std::chrono::steady_clock::time_point lastGlobalMap;
 
   bool aLoopIsClosed;
 
+  // !@Relocalization against a saved map
+  bool relocalizationPending;
+  int relocalizationScanCount;
+  pcl::PointCloud<PointType>::Ptr relocalizationCloud;  // odometry frame
+  session::KeyframeSession relocalizationMap;
+  place_recognition::Database placeDatabase;
+
+  // !@Per-scan buffers, released at the start of the next scan
+  arena::MonotonicArena scanArena;
+
+  // !@Multi-resolution registration
+  std::vector<MapLevel> mapPyramid;  // level 0 is the full-resolution map
+  int mapVersion;                    // bumped whenever the local map changes
+  int mapDSVersion;  // map version the downsampled local map was built from
+
+  // !@Association caching
+  int associationQueries;  // KD tree searches in the current scan
+  int associationReuses;   // associations reused from an earlier iteration
+
+  // !@Projective association on the finest level
+  projective::Associator cornerProjection;
+  projective::Associator surfProjection;
+  int projectionMapVersion;  // map version the associators were given
+  pcl::PointCloud<PointType>::Ptr mapInSensorFrame;
+
+  // !@Local map shared with localisation clients on this host
+  shared_map::Writer sharedMapWriter;
+  int sharedMapVersion;  // map version last written to the segment
+
   float cRoll, sRoll, cPitch, sPitch, cYaw, sYaw, tX, tY, tZ;
   float ctRoll, stRoll, ctPitch, stPitch, ctYaw, stYaw, tInX, tInY, tInZ;
 
  public:
-  MappingHandler(ros::NodeHandle& nh, ros::NodeHandle& pnh) : nh(nh), pnh(pnh) {
+  // Corner points are rendered larger, since edges are sparse in the map
+  MappingHandler(ros::NodeHandle& nh, ros::NodeHandle& pnh)
+      : nh(nh),
+        pnh(pnh),
+        cornerProjection(0.5, true),
+        surfProjection(0.4, false) {
     ISAM2Params parameters;
     parameters.relinearizeThreshold = 0.01;
     parameters.relinearizeSkip = 1;
@@ -282,6 +386,9 @@ class MappingHandler {
 
     downSizeFilterCorner.setLeafSize(0.2, 0.2, 0.2);
     downSizeFilterSurf.setLeafSize(0.4, 0.4, 0.4);
+    // Budgeted scans may be up to twice as fine and eight times as coarse
+    cornerBudgetFilter.configure(MAPPING_CORNER_BUDGET, 0.1, 4);
+    surfBudgetFilter.configure(MAPPING_SURF_BUDGET, 0.2, 4);
     downSizeFilterOutlier.setLeafSize(0.4, 0.4, 0.4);
 
     downSizeFilterHistoryKeyFrames.setLeafSize(0.4, 0.4, 0.4);
@@ -320,6 +427,10 @@ class MappingHandler {
     laserCloudOutlierLastDS.reset(new pcl::PointCloud<PointType>());
     laserCloudSurfTotalLast.reset(new pcl::PointCloud<PointType>());
     laserCloudSurfTotalLastDS.reset(new pcl::PointCloud<PointType>());
+    if (MAPPING_CORNER_BUDGET > 0)
+      laserCloudCornerScan.reset(new pcl::PointCloud<PointType>());
+    else
+      laserCloudCornerScan = laserCloudCornerLastDS;
 
     laserCloudOri.reset(new pcl::PointCloud<PointType>());
     coeffSel.reset(new pcl::PointCloud<PointType>());
@@ -331,15 +442,7 @@ class MappingHandler {
 
     kdtreeCornerFromMap.reset(new pcl::KdTreeFLANN<PointType>());
     kdtreeSurfFromMap.reset(new pcl::KdTreeFLANN<PointType>());
-
-    nearHistoryCornerKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
-    nearHistoryCornerKeyFrameCloudDS.reset(new pcl::PointCloud<PointType>());
-    nearHistorySurfKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
-    nearHistorySurfKeyFrameCloudDS.reset(new pcl::PointCloud<PointType>());
-
-    latestCornerKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
-    latestSurfKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
-    latestSurfKeyFrameCloudDS.reset(new pcl::PointCloud<PointType>());
+    mapInSensorFrame.reset(new pcl::PointCloud<PointType>());
 
     kdtreeGlobalMap.reset(new pcl::KdTreeFLANN<PointType>());
     globalMapKeyPoses.reset(new pcl::PointCloud<PointType>());
@@ -354,6 +457,7 @@ class MappingHandler {
     timeLastGloalMapPublish = 0;
 
     timeLastProcessing = -1;
+    replaying = false;
 
     newLaserCloudCornerLast = false;
     newLaserCloudSurfLast = false;
@@ -369,6 +473,7 @@ class MappingHandler {
       transformBefMapped[i] = 0;
       transformAftMapped[i] = 0;
     }
+    mapOrigin.setZero();
 
     imuPointerFront = 0;
     imuPointerLast = -1;
@@ -402,10 +507,197 @@ class MappingHandler {
     laserCloudOutlierLastDSNum = 0;
     laserCloudSurfTotalLastDSNum = 0;
 
-    potentialLoopFlag = false;
     aLoopIsClosed = false;
+    loopClosureScheduled = false;
+    globalMapScheduled = false;
+    lastGlobalMap = std::chrono::steady_clock::now();
 
     latestFrameID = 0;
+
+    allocateMapPyramid();
+
+    sensor::ProfileGeometry geometry;
+    sensor::dispatch(LIDAR_MODEL, geometry);
+    cornerProjection.setGeometry(geometry);
+    surfProjection.setGeometry(geometry);
+    projectionMapVersion = -1;
+
+    sharedMapVersion = -1;
+    if (!SHARED_MAP.empty() && !sharedMapWriter.open(SHARED_MAP))
+      ROS_WARN_STREAM("Cannot open shared map " << SHARED_MAP);
+
+    relocalizationCloud.reset(new pcl::PointCloud<PointType>());
+    relocalizationScanCount = 0;
+    relocalizationPending =
+        !RELOCALIZATION_MAP.empty() && loadRelocalizationMap();
+  }
+
+  // Load the poses of the saved session and map its place recognition
+  // database. Keyframe clouds are only read for the matches to verify, unless
+  // the session has no database yet and it has to be built from all of them.
+  bool loadRelocalizationMap() {
+    TicToc ts_load;
+    if (!session::loadSessionPoses(RELOCALIZATION_MAP, relocalizationMap)) {
+      ROS_WARN_STREAM("Failed to load the map in " << RELOCALIZATION_MAP
+                                                   << ", start a new map");
+      return false;
+    }
+    // Prefer the poses of batch_optimization_node, which also built the
+    // database from them
+    std::string optimizedPath = RELOCALIZATION_MAP + "/optimized_poses.pcd";
+    if (session::fileExists(optimizedPath))
+      pcl::io::loadPCDFile(optimizedPath, *relocalizationMap.poses);
+
+    std::string databasePath = RELOCALIZATION_MAP + "/place_db.bin";
+    if (!placeDatabase.open(databasePath)) {
+      int numKeyframes = relocalizationMap.poses->size();
+      parallel::parallelFor(
+          numKeyframes, relocalizationThreads(),
+          [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+              session::loadKeyframeClouds(RELOCALIZATION_MAP,
+                                          relocalizationMap, i);
+          });
+      place_recognition::writeDatabase(
+          databasePath,
+          place_recognition::buildDescriptors(
+              relocalizationMap, relocalizationThreads()));
+      session::releaseKeyframeClouds(relocalizationMap);
+      if (!placeDatabase.open(databasePath)) {
+        ROS_WARN_STREAM("Failed to open " << databasePath
+                                          << ", start a new map");
+        return false;
+      }
+    }
+
+    ROS_INFO_STREAM("Loaded " << placeDatabase.size()
+                              << " keyframes for relocalization in "
+                              << ts_load.toc() << " ms");
+    return true;
+  }
+
+  // Loading the saved map and building its descriptors use every worker of
+  // the scheduler, as set by scheduler_threads
+  int relocalizationThreads() const {
+    return std::max(1, parallel::Scheduler::instance().numThreads());
+  }
+
+  void allocateMapPyramid() {
+    mapVersion = 0;
+    mapDSVersion = -1;
+    int numLevels = std::max(MAPPING_PYRAMID_LEVELS, 1);
+    mapPyramid.resize(numLevels);
+    for (int l = 0; l < numLevels; ++l) {
+      MapLevel& level = mapPyramid[l];
+      level.scale = float(1 << l);
+      // The coarsest level converges from the odometry prior, finer levels
+      // only refine it
+      level.maxIterations = (l == numLevels - 1) ? 10 : 3;
+      level.mapVersion = -1;
+      if (l == 0) {
+        level.cornerMap = laserCloudCornerFromMapDS;
+        level.surfMap = laserCloudSurfFromMapDS;
+        level.kdtreeCorner = kdtreeCornerFromMap;
+        level.kdtreeSurf = kdtreeSurfFromMap;
+        level.cornerScan = laserCloudCornerScan;
+        level.surfScan = laserCloudSurfTotalLastDS;
+        continue;
+      }
+      level.cornerMap.reset(new pcl::PointCloud<PointType>());
+      level.surfMap.reset(new pcl::PointCloud<PointType>());
+      level.kdtreeCorner.reset(new pcl::KdTreeFLANN<PointType>());
+      level.kdtreeSurf.reset(new pcl::KdTreeFLANN<PointType>());
+      level.cornerScan.reset(new pcl::PointCloud<PointType>());
+      level.surfScan.reset(new pcl::PointCloud<PointType>());
+      level.downSizeFilterCorner.setLeafSize(
+          0.2 * level.scale, 0.2 * level.scale, 0.2 * level.scale);
+      level.downSizeFilterSurf.setLeafSize(
+          0.4 * level.scale, 0.4 * level.scale, 0.4 * level.scale);
+    }
+  }
+
+  // Global position of the translation of a local transform
+  V3D globalPosition(const float transform[6]) const {
+    return mapOrigin + V3D(transform[3], transform[4], transform[5]);
+  }
+
+  // Global pose graph pose of a local transform. The camera-frame translation
+  // (x, y, z) is (y, z, x) in the gtsam convention.
+  Pose3 globalPose3(const float transform[6]) const {
+    V3D position = globalPosition(transform);
+    return Pose3(Rot3::RzRyRx(transform[2], transform[0], transform[1]),
+                 Point3(position.z(), position.x(), position.y()));
+  }
+
+  // Local camera-frame position of a pose graph pose
+  V3D localPosition(const Pose3& pose) const {
+    return V3D(pose.translation().y(), pose.translation().z(),
+               pose.translation().x()) -
+           mapOrigin;
+  }
+
+  // Copy of a local cloud in the global frame, for publishing
+  static pcl::PointCloud<PointType>::Ptr toGlobalFrame(
+      const pcl::PointCloud<PointType>& cloudIn, const V3D& origin) {
+    pcl::PointCloud<PointType>::Ptr cloudOut(
+        new pcl::PointCloud<PointType>(cloudIn));
+    for (PointType& point : cloudOut->points) {
+      point.x = point.x + origin.x();
+      point.y = point.y + origin.y();
+      point.z = point.z + origin.z();
+    }
+    return cloudOut;
+  }
+
+  // Move mapOrigin to the vehicle once it is mapOriginRebaseDistance away.
+  // The shift is rounded to whole metres, which keeps shifting the float
+  // positions exact. The local map is rebuilt in the new frame.
+  void rebaseMapOrigin() {
+    V3D position(transformAftMapped[3], transformAftMapped[4],
+                 transformAftMapped[5]);
+    if (position.norm() < mapOriginRebaseDistance) return;
+
+    float shift[3];
+    for (int i = 0; i < 3; ++i) shift[i] = round(position[i]);
+    for (int i = 0; i < 3; ++i) {
+      transformLast[3 + i] -= shift[i];
+      transformSum[3 + i] -= shift[i];
+      transformTobeMapped[3 + i] -= shift[i];
+      transformBefMapped[3 + i] -= shift[i];
+      transformAftMapped[3 + i] -= shift[i];
+    }
+    for (PointType* point : {&currentRobotPosPoint, &previousRobotPosPoint}) {
+      point->x -= shift[0];
+      point->y -= shift[1];
+      point->z -= shift[2];
+    }
+    int numPoses = cloudKeyPoses3D->points.size();
+    for (int i = 0; i < numPoses; ++i) {
+      cloudKeyPoses3D->points[i].x -= shift[0];
+      cloudKeyPoses3D->points[i].y -= shift[1];
+      cloudKeyPoses3D->points[i].z -= shift[2];
+      cloudKeyPoses6D->points[i].x -= shift[0];
+      cloudKeyPoses6D->points[i].y -= shift[1];
+      cloudKeyPoses6D->points[i].z -= shift[2];
+    }
+    mapOrigin += V3D(shift[0], shift[1], shift[2]);
+
+    recentCornerCloudKeyFrames.clear();
+    recentSurfCloudKeyFrames.clear();
+    recentOutlierCloudKeyFrames.clear();
+    surroundingExistingKeyPosesID.clear();
+    surroundingCornerCloudKeyFrames.clear();
+    surroundingSurfCloudKeyFrames.clear();
+    surroundingOutlierCloudKeyFrames.clear();
+    cornerFeatureMap.clear();
+    surfFeatureMap.clear();
+    ++mapVersion;
+
+    static metrics::Counter& rebases = metrics::Registry::instance().counter(
+        "lins_map_origin_rebases_total", "Moves of the local map origin");
+    rebases.inc();
+    if (VERBOSE)
+      ROS_INFO_STREAM("Map origin moved to " << mapOrigin.transpose());
   }
 
   void transformAssociateToMap() {
@@ -591,6 +883,23 @@ class MappingHandler {
     tZ = transformTobeMapped[5];
   }
 
+  // Inverse of pointAssociateToMap
+  void pointAssociateTobeMapped(PointType const* const pi,
+                                PointType* const po) {
+    float x1 = cPitch * (pi->x - tX) - sPitch * (pi->z - tZ);
+    float y1 = pi->y - tY;
+    float z1 = sPitch * (pi->x - tX) + cPitch * (pi->z - tZ);
+
+    float x2 = x1;
+    float y2 = cRoll * y1 + sRoll * z1;
+    float z2 = -sRoll * y1 + cRoll * z1;
+
+    po->x = cYaw * x2 + sYaw * y2;
+    po->y = -sYaw * x2 + cYaw * y2;
+    po->z = z2;
+    po->intensity = pi->intensity;
+  }
+
   void pointAssociateToMap(PointType const* const pi, PointType* const po) {
     float x1 = cYaw * pi->x - sYaw * pi->y;
     float y1 = sYaw * pi->x + cYaw * pi->y;
@@ -710,6 +1019,7 @@ class MappingHandler {
 
   void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr& laserOdometry) {
     timeLaserOdometry = laserOdometry->header.stamp.toSec();
+    trace::Tracer::instance().mark(laserOdometry->header.stamp, "received");
     double roll, pitch, yaw;
     geometry_msgs::Quaternion geoQuat = laserOdometry->pose.pose.orientation;
     tf::Matrix3x3(tf::Quaternion(geoQuat.z, -geoQuat.x, -geoQuat.y, geoQuat.w))
@@ -717,12 +1027,64 @@ class MappingHandler {
     transformSum[0] = -pitch;
     transformSum[1] = -yaw;
     transformSum[2] = roll;
-    transformSum[3] = laserOdometry->pose.pose.position.x;
-    transformSum[4] = laserOdometry->pose.pose.position.y;
-    transformSum[5] = laserOdometry->pose.pose.position.z;
+    // Odometry positions are shifted by the map origin as well. Only their
+    // increments enter the mapping, except for relocalization, which is done
+    // before the origin first moves.
+    transformSum[3] = laserOdometry->pose.pose.position.x - mapOrigin.x();
+    transformSum[4] = laserOdometry->pose.pose.position.y - mapOrigin.y();
+    transformSum[5] = laserOdometry->pose.pose.position.z - mapOrigin.z();
     newLaserOdometry = true;
   }
 
+  // Hand a scan of a scan log to the subscription handlers' state
+  void replayScan(const scan_log::ScanRecord& record) {
+    *laserCloudCornerLast = *record.corner;
+    *laserCloudSurfLast = *record.surf;
+    *laserCloudOutlierLast = *record.outlier;
+    timeLaserCloudCornerLast = record.stamp;
+    timeLaserCloudSurfLast = record.stamp;
+    timeLaserCloudOutlierLast = record.stamp;
+    newLaserCloudCornerLast = true;
+    newLaserCloudSurfLast = true;
+    newLaserCloudOutlierLast = true;
+
+    nav_msgs::Odometry::Ptr odometry(new nav_msgs::Odometry());
+    odometry->header.stamp = ros::Time().fromSec(record.stamp);
+    odometry->pose.pose.position.x = record.position.x();
+    odometry->pose.pose.position.y = record.position.y();
+    odometry->pose.pose.position.z = record.position.z();
+    odometry->pose.pose.orientation.x = record.orientation.x();
+    odometry->pose.pose.orientation.y = record.orientation.y();
+    odometry->pose.pose.orientation.z = record.orientation.z();
+    odometry->pose.pose.orientation.w = record.orientation.w();
+    laserOdometryHandler(odometry);
+  }
+
+  // Run the scans of a log written by lins_fusion_node back to back and in
+  // order, to profile the mapping without the nodes in front of it. Every
+  // scan is mapped, mappingProcessInterval only throttles live input.
+  void replay(const std::string& path) {
+    scan_log::Reader reader;
+    if (!reader.open(path)) {
+      ROS_ERROR_STREAM("Failed to open the scan log " << path);
+      return;
+    }
+    scan_log::ScanRecord record;
+    int numScans = 0;
+    TicToc ts_replay;
+    replaying = true;
+    while (ros::ok() && reader.next(record)) {
+      replayScan(record);
+      run();
+      if (DETERMINISTIC_MODE) scheduleLoopClosure();
+      scheduleGlobalMap();
+      ++numScans;
+    }
+    replaying = false;
+    ROS_INFO_STREAM("Replayed " << numScans << " scans of " << path << " in "
+                                << ts_replay.toc() << " ms");
+  }
+
   void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn) {
     double roll, pitch, yaw;
     tf::Quaternion orientation;
@@ -751,34 +1113,38 @@ class MappingHandler {
 
     geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw(
         transformAftMapped[2], -transformAftMapped[0], -transformAftMapped[1]);
+    V3D aftMapped = globalPosition(transformAftMapped);
+    V3D befMapped = globalPosition(transformBefMapped);
 
     odomAftMapped.header.stamp = ros::Time().fromSec(timeLaserOdometry);
     odomAftMapped.pose.pose.orientation.x = -geoQuat.y;
     odomAftMapped.pose.pose.orientation.y = -geoQuat.z;
     odomAftMapped.pose.pose.orientation.z = geoQuat.x;
     odomAftMapped.pose.pose.orientation.w = geoQuat.w;
-    odomAftMapped.pose.pose.position.x = transformAftMapped[3];
-    odomAftMapped.pose.pose.position.y = transformAftMapped[4];
-    odomAftMapped.pose.pose.position.z = transformAftMapped[5];
+    odomAftMapped.pose.pose.position.x = aftMapped.x();
+    odomAftMapped.pose.pose.position.y = aftMapped.y();
+    odomAftMapped.pose.pose.position.z = aftMapped.z();
     odomAftMapped.twist.twist.angular.x = transformBefMapped[0];
     odomAftMapped.twist.twist.angular.y = transformBefMapped[1];
     odomAftMapped.twist.twist.angular.z = transformBefMapped[2];
-    odomAftMapped.twist.twist.linear.x = transformBefMapped[3];
-    odomAftMapped.twist.twist.linear.y = transformBefMapped[4];
-    odomAftMapped.twist.twist.linear.z = transformBefMapped[5];
+    odomAftMapped.twist.twist.linear.x = befMapped.x();
+    odomAftMapped.twist.twist.linear.y = befMapped.y();
+    odomAftMapped.twist.twist.linear.z = befMapped.z();
     pubOdomAftMapped.publish(odomAftMapped);
 
     aftMappedTrans.stamp_ = ros::Time().fromSec(timeLaserOdometry);
     aftMappedTrans.setRotation(
         tf::Quaternion(-geoQuat.y, -geoQuat.z, geoQuat.x, geoQuat.w));
-    aftMappedTrans.setOrigin(tf::Vector3(
-        transformAftMapped[3], transformAftMapped[4], transformAftMapped[5]));
+    aftMappedTrans.setOrigin(
+        tf::Vector3(aftMapped.x(), aftMapped.y(), aftMapped.z()));
     tfBroadcaster.sendTransform(aftMappedTrans);
   }
 
   void publishXYZTF() {
     geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw(
         transformAftMapped[2], transformAftMapped[0], transformAftMapped[1]);
+    V3D aftMapped = globalPosition(transformAftMapped);
+    V3D befMapped = globalPosition(transformBefMapped);
 
     odomXYZAftMapped.header.frame_id = "/map";
     odomXYZAftMapped.child_frame_id = "/aft_xyz_mapped";
@@ -788,25 +1154,25 @@ class MappingHandler {
     odomXYZAftMapped.pose.pose.orientation.y = geoQuat.y;
     odomXYZAftMapped.pose.pose.orientation.z = geoQuat.z;
     odomXYZAftMapped.pose.pose.orientation.w = geoQuat.w;
-    odomXYZAftMapped.pose.pose.position.x = transformAftMapped[5];
-    odomXYZAftMapped.pose.pose.position.y = transformAftMapped[3];
+    odomXYZAftMapped.pose.pose.position.x = aftMapped.z();
+    odomXYZAftMapped.pose.pose.position.y = aftMapped.x();
     odomXYZAftMapped.pose.pose.position.z =
-        transformAftMapped[4];  //-transformAftMapped[4]
+        aftMapped.y();  //-transformAftMapped[4]
     odomXYZAftMapped.twist.twist.angular.x = transformBefMapped[2];
     odomXYZAftMapped.twist.twist.angular.y = transformBefMapped[0];
     odomXYZAftMapped.twist.twist.angular.z = transformBefMapped[1];
-    odomXYZAftMapped.twist.twist.linear.x = transformBefMapped[5];
-    odomXYZAftMapped.twist.twist.linear.y = transformBefMapped[3];
+    odomXYZAftMapped.twist.twist.linear.x = befMapped.z();
+    odomXYZAftMapped.twist.twist.linear.y = befMapped.x();
     odomXYZAftMapped.twist.twist.linear.z =
-        transformBefMapped[4];  //-transformBefMapped[4]
+        befMapped.y();  //-transformBefMapped[4]
     pubOdomXYZAftMapped.publish(odomXYZAftMapped);
 
     aftMappedXYZTrans.stamp_ = ros::Time().fromSec(timeLaserOdometry);
     aftMappedXYZTrans.setRotation(
         tf::Quaternion(geoQuat.x, geoQuat.y, geoQuat.z, geoQuat.w));
     aftMappedXYZTrans.setOrigin(
-        tf::Vector3(transformAftMapped[5], transformAftMapped[3],
-                    transformAftMapped[4]));  //-transformAftMapped[4]
+        tf::Vector3(aftMapped.z(), aftMapped.x(),
+                    aftMapped.y()));  //-transformAftMapped[4]
     tfXYZBroadcaster.sendTransform(aftMappedXYZTrans);
 
     /*        geometry_msgs::Quaternion geoQuat =
@@ -921,17 +1287,18 @@ class MappingHandler {
 
   void publishXYTF() {
     // std::cout << "publishXYTF "<< std::endl;
+    V3D aftMapped = globalPosition(transformAftMapped);
+    V3D befMapped = globalPosition(transformBefMapped);
 
     odomXYZAftMapped.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-    odomXYZAftMapped.pose.pose.position.x = transformAftMapped[5];
-    odomXYZAftMapped.pose.pose.position.y = transformAftMapped[3];
+    odomXYZAftMapped.pose.pose.position.x = aftMapped.z();
+    odomXYZAftMapped.pose.pose.position.y = aftMapped.x();
     odomXYZAftMapped.pose.pose.position.z = 0.0;
     odomXYZAftMapped.pose.pose.orientation =
         tf::createQuaternionMsgFromYaw(transformAftMapped[1]);
 
-    odomXYZAftMapped.twist.twist.linear.x =
-        transformBefMapped[5];  // linear speed
-    odomXYZAftMapped.twist.twist.linear.y = transformBefMapped[3];
+    odomXYZAftMapped.twist.twist.linear.x = befMapped.z();  // linear speed
+    odomXYZAftMapped.twist.twist.linear.y = befMapped.x();
     odomXYZAftMapped.twist.twist.linear.z = 0.0;
     odomXYZAftMapped.twist.twist.angular.z =
         transformBefMapped[1];  // angular speed
@@ -943,8 +1310,7 @@ class MappingHandler {
     aftMappedXYZTrans.stamp_ = ros::Time().fromSec(timeLaserOdometry);
     aftMappedXYZTrans.setRotation(
         tf::Quaternion(geoQuat.x, geoQuat.y, geoQuat.z, geoQuat.w));
-    aftMappedXYZTrans.setOrigin(
-        tf::Vector3(transformAftMapped[5], transformAftMapped[3], 0.0));
+    aftMappedXYZTrans.setOrigin(tf::Vector3(aftMapped.z(), aftMapped.x(), 0.0));
 
     //         aftMappedXYZTrans.transform.translation.x =
     //         transformAftMapped[5]; aftMappedXYZTrans.transform.translation.y
@@ -958,7 +1324,7 @@ class MappingHandler {
   void publishKeyPosesAndFrames() {
     if (pubKeyPoses.getNumSubscribers() != 0) {
       sensor_msgs::PointCloud2 cloudMsgTemp;
-      pcl::toROSMsg(*cloudKeyPoses3D, cloudMsgTemp);
+      pcl::toROSMsg(*toGlobalFrame(*cloudKeyPoses3D, mapOrigin), cloudMsgTemp);
       cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
       cloudMsgTemp.header.frame_id = "/camera_init";
       pubKeyPoses.publish(cloudMsgTemp);
@@ -966,19 +1332,73 @@ class MappingHandler {
 
     if (pubRecentKeyFrames.getNumSubscribers() != 0) {
       sensor_msgs::PointCloud2 cloudMsgTemp;
-      pcl::toROSMsg(*laserCloudSurfFromMapDS, cloudMsgTemp);
+      pcl::toROSMsg(*toGlobalFrame(*laserCloudSurfFromMapDS, mapOrigin),
+                    cloudMsgTemp);
       cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
       cloudMsgTemp.header.frame_id = "/camera_init";
       pubRecentKeyFrames.publish(cloudMsgTemp);
     }
   }
 
-  void visualizeGlobalMapThread() {
-    ros::Rate rate(0.2);
-    while (ros::ok()) {
-      rate.sleep();
-      publishGlobalMap();
+  // Write the tiles of the local map to the shared segment when it changed.
+  // Tiles the map no longer covers are kept until their slot is needed.
+  void publishSharedMap() {
+    if (!sharedMapWriter.isOpen() || sharedMapVersion == mapVersion) return;
+    sharedMapVersion = mapVersion;
+
+    std::unordered_map<uint64_t, std::vector<shared_map::SharedPoint>> tiles;
+    const pcl::PointCloud<PointType>* clouds[2] = {
+        laserCloudCornerFromMapDS.get(), laserCloudSurfFromMapDS.get()};
+    for (int c = 0; c < 2; ++c) {
+      for (const PointType& point : clouds[c]->points) {
+        shared_map::SharedPoint shared;
+        shared.x = point.x + mapOrigin.x();
+        shared.y = point.y + mapOrigin.y();
+        shared.z = point.z + mapOrigin.z();
+        shared.pointClass =
+            c == 0 ? shared_map::CORNER : shared_map::SURF;
+        int32_t ix = shared_map::tileIndex(shared.x, shared_map::TILE_SIZE);
+        int32_t iz = shared_map::tileIndex(shared.z, shared_map::TILE_SIZE);
+        tiles[(uint64_t(uint32_t(ix)) << 32) | uint32_t(iz)].push_back(
+            shared);
+      }
     }
+
+    V3D position = globalPosition(transformAftMapped);
+    for (const auto& tile : tiles) {
+      sharedMapWriter.writeTile(int32_t(tile.first >> 32),
+                                int32_t(uint32_t(tile.first)),
+                                tile.second.data(), tile.second.size(),
+                                position.x(), position.z());
+    }
+    sharedMapWriter.commit(
+        ros::Time().fromSec(timeLaserOdometry).toNSec());
+  }
+
+  // Publish the global map every 5 s as a VISUALIZATION task
+  void scheduleGlobalMap() {
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (now - lastGlobalMap < std::chrono::seconds(5) ||
+        globalMapScheduled.exchange(true))
+      return;
+    lastGlobalMap = now;
+    static parallel::TaskKind& globalMapTask =
+        parallel::Scheduler::instance().taskKind(parallel::VISUALIZATION,
+                                                 "global_map");
+    parallel::Scheduler::instance().submit(
+        globalMapTask,
+        [this] {
+          publishGlobalMap();
+          globalMapScheduled = false;
+        },
+        &backgroundTasks);
+  }
+
+  // Wait for the loop closure and map publishing tasks, e.g. before saving
+  // the session
+  void waitForBackgroundTasks() {
+    parallel::Scheduler::instance().wait(backgroundTasks);
   }
 
   void publishGlobalMap() {
@@ -994,6 +1414,8 @@ class MappingHandler {
     kdtreeGlobalMap->radiusSearch(
         currentRobotPosPoint, globalMapVisualizationSearchRadius,
         pointSearchIndGlobalMap, pointSearchSqDisGlobalMap, 0);
+    V3D origin = mapOrigin;
+    pcl::PointCloud<PointTypePose> keyPoses = *cloudKeyPoses6D;
     mtx.unlock();
 
     for (int i = 0; i < pointSearchIndGlobalMap.size(); ++i)
@@ -1005,21 +1427,19 @@ class MappingHandler {
 
     for (int i = 0; i < globalMapKeyPosesDS->points.size(); ++i) {
       int thisKeyInd = (int)globalMapKeyPosesDS->points[i].intensity;
-      *globalMapKeyFrames +=
-          *transformPointCloud(cornerCloudKeyFrames[thisKeyInd],
-                               &cloudKeyPoses6D->points[thisKeyInd]);
       *globalMapKeyFrames += *transformPointCloud(
-          surfCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
-      *globalMapKeyFrames +=
-          *transformPointCloud(outlierCloudKeyFrames[thisKeyInd],
-                               &cloudKeyPoses6D->points[thisKeyInd]);
+          cornerCloudKeyFrames[thisKeyInd], &keyPoses.points[thisKeyInd]);
+      *globalMapKeyFrames += *transformPointCloud(
+          surfCloudKeyFrames[thisKeyInd], &keyPoses.points[thisKeyInd]);
+      *globalMapKeyFrames += *transformPointCloud(
+          outlierCloudKeyFrames[thisKeyInd], &keyPoses.points[thisKeyInd]);
     }
 
     downSizeFilterGlobalMapKeyFrames.setInputCloud(globalMapKeyFrames);
     downSizeFilterGlobalMapKeyFrames.filter(*globalMapKeyFramesDS);
 
     sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*globalMapKeyFramesDS, cloudMsgTemp);
+    pcl::toROSMsg(*toGlobalFrame(*globalMapKeyFramesDS, origin), cloudMsgTemp);
     cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
     cloudMsgTemp.header.frame_id = "/camera_init";
     pubLaserCloudSurround.publish(cloudMsgTemp);
@@ -1030,159 +1450,527 @@ class MappingHandler {
     globalMapKeyFramesDS->clear();
   }
 
-  void loopClosureThread() {
+  // Loop closures are searched for every new keyframe. Requests queue up while
+  // a search is running; the next one then takes the newest, since a newer
+  // keyframe sees the same places as the ones it supersedes. At most one
+  // LOOP_CLOSURE task serves the queue at a time.
+  void queueLoopClosure(int keyframe) {
+    LoopRequest request;
+    request.keyframe = keyframe;
+    request.queued = std::chrono::steady_clock::now();
+    bool submit = false;
+    {
+      std::lock_guard<std::mutex> lock(loopQueueMtx);
+      loopQueue.push_back(request);
+      if (!DETERMINISTIC_MODE && !loopClosureScheduled)
+        submit = loopClosureScheduled = true;
+    }
+    static parallel::TaskKind& loopClosureTask =
+        parallel::Scheduler::instance().taskKind(parallel::LOOP_CLOSURE,
+                                                 "loop_closure");
+    if (submit)
+      parallel::Scheduler::instance().submit(
+          loopClosureTask, [this] { serveLoopClosures(); }, &backgroundTasks);
+  }
+
+  LoopRequest takeLoopRequest() {
+    static metrics::Counter& dropped = metrics::Registry::instance().counter(
+        "lins_loop_closure_requests_dropped_total",
+        "Loop closure requests superseded by a newer keyframe");
+    LoopRequest request = loopQueue.back();
+    dropped.inc(loopQueue.size() - 1);
+    loopQueue.clear();
+    return request;
+  }
+
+  void serveLoopClosures() {
+    while (true) {
+      LoopRequest request;
+      {
+        std::lock_guard<std::mutex> lock(loopQueueMtx);
+        if (loopQueue.empty()) {
+          loopClosureScheduled = false;
+          return;
+        }
+        request = takeLoopRequest();
+      }
+      performLoopClosure(request);
+    }
+  }
+
+  // Deterministic counterpart of serveLoopClosures: serve the pending request
+  // synchronously between two processed scans
+  void scheduleLoopClosure() {
     if (loopClosureEnableFlag == false) return;
+    LoopRequest request;
+    {
+      std::lock_guard<std::mutex> lock(loopQueueMtx);
+      if (loopQueue.empty()) return;
+      request = takeLoopRequest();
+    }
+    performLoopClosure(request);
+  }
 
-    ros::Rate rate(1);
-    while (ros::ok()) {
-      rate.sleep();
-      performLoopClosure();
+  // Forget the failed candidates that are worth another try: the vehicle
+  // has moved on since, or a loop closure has corrected the history pose
+  void expireFailedLoopCandidates(const V3D& latestPosition) {
+    auto it = failedLoopCandidates.begin();
+    while (it != failedLoopCandidates.end()) {
+      const PointTypePose& pose = cloudKeyPoses6D->points[it->first];
+      V3D position = V3D(pose.x, pose.y, pose.z) + mapOrigin;
+      V3D attitude(pose.roll, pose.pitch, pose.yaw);
+      const FailedLoopCandidate& failed = it->second;
+      if ((latestPosition - failed.latestPosition).norm() >
+              loopRetryDistance ||
+          (position - failed.historyPosition).norm() > loopRetryCorrection ||
+          (attitude - failed.historyAttitude).cwiseAbs().maxCoeff() >
+              loopRetryCorrection)
+        it = failedLoopCandidates.erase(it);
+      else
+        ++it;
     }
   }
 
-  bool detectLoopClosure() {
-    latestSurfKeyFrameCloud->clear();
-    nearHistorySurfKeyFrameCloud->clear();
-    nearHistorySurfKeyFrameCloudDS->clear();
+  // A candidate is skipped if its local map would largely be that of a
+  // candidate that failed recently
+  bool failedRecently(int historyID) const {
+    auto it = failedLoopCandidates.lower_bound(historyID -
+                                               historyKeyframeSearchNum);
+    return it != failedLoopCandidates.end() &&
+           it->first <= historyID + historyKeyframeSearchNum;
+  }
+
+  void rememberFailedLoopCandidate(const LoopCandidate& candidate,
+                                   const PointTypePose& latestPose,
+                                   const V3D& origin) {
+    const PointTypePose& pose = candidate.historyPose;
+    FailedLoopCandidate failed;
+    failed.latestPosition =
+        V3D(latestPose.x, latestPose.y, latestPose.z) + origin;
+    failed.historyPosition = V3D(pose.x, pose.y, pose.z) + origin;
+    failed.historyAttitude = V3D(pose.roll, pose.pitch, pose.yaw);
+    failedLoopCandidates[candidate.historyID] = failed;
+  }
 
+  // Collect history keyframes near the latest keyframe that are at least 30 s
+  // older, closest first, together with their local maps. Candidates whose
+  // local maps would overlap a closer candidate or a recently failed one are
+  // skipped. Poses are copied along with the clouds, since the map origin may
+  // move during the ICP.
+  bool detectLoopClosure(int latestID,
+                         pcl::PointCloud<PointType>::Ptr latestCloud,
+                         PointTypePose& latestPose, V3D& origin,
+                         std::vector<LoopCandidate>& candidates) {
+    static metrics::Counter& loopSkips = metrics::Registry::instance().counter(
+        "lins_loop_closure_candidates_skipped_total",
+        "Loop closure candidates skipped after a recent failed verification");
     std::lock_guard<std::mutex> lock(mtx);
 
+    const PointTypePose& latest = cloudKeyPoses6D->points[latestID];
+    expireFailedLoopCandidates(V3D(latest.x, latest.y, latest.z) + mapOrigin);
+
     std::vector<int> pointSearchIndLoop;
     std::vector<float> pointSearchSqDisLoop;
     kdtreeHistoryKeyPoses->setInputCloud(cloudKeyPoses3D);
     kdtreeHistoryKeyPoses->radiusSearch(
-        currentRobotPosPoint, historyKeyframeSearchRadius, pointSearchIndLoop,
-        pointSearchSqDisLoop, 0);
-
-    closestHistoryFrameID = -1;
-    for (int i = 0; i < pointSearchIndLoop.size(); ++i) {
+        cloudKeyPoses3D->points[latestID], historyKeyframeSearchRadius,
+        pointSearchIndLoop, pointSearchSqDisLoop, 0);
+
+    double latestTime = cloudKeyPoses6D->points[latestID].time;
+    std::vector<int> skipped;
+    for (int i = 0; i < pointSearchIndLoop.size() &&
+                    candidates.size() < loopClosureCandidateNum;
+         ++i) {
       int id = pointSearchIndLoop[i];
-      if (abs(cloudKeyPoses6D->points[id].time - timeLaserOdometry) > 30.0) {
-        closestHistoryFrameID = id;
-        break;
-      }
-    }
-    if (closestHistoryFrameID == -1) {
-      return false;
-    }
-
-    latestFrameIDLoopCloure = cloudKeyPoses3D->points.size() - 1;
-    *latestSurfKeyFrameCloud +=
-        *transformPointCloud(cornerCloudKeyFrames[latestFrameIDLoopCloure],
-                             &cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
-    *latestSurfKeyFrameCloud +=
-        *transformPointCloud(surfCloudKeyFrames[latestFrameIDLoopCloure],
-                             &cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
-
-    pcl::PointCloud<PointType>::Ptr hahaCloud(new pcl::PointCloud<PointType>());
-    int cloudSize = latestSurfKeyFrameCloud->points.size();
-    for (int i = 0; i < cloudSize; ++i) {
-      if ((int)latestSurfKeyFrameCloud->points[i].intensity >= 0) {
-        hahaCloud->push_back(latestSurfKeyFrameCloud->points[i]);
+      if (abs(cloudKeyPoses6D->points[id].time - latestTime) <= 30.0) continue;
+      bool overlaps = false;
+      for (const LoopCandidate& candidate : candidates)
+        if (abs(candidate.historyID - id) <= historyKeyframeSearchNum)
+          overlaps = true;
+      for (int skip : skipped)
+        if (abs(skip - id) <= historyKeyframeSearchNum) overlaps = true;
+      if (overlaps) continue;
+      if (failedRecently(id)) {
+        skipped.push_back(id);
+        continue;
       }
-    }
-    latestSurfKeyFrameCloud->clear();
-    *latestSurfKeyFrameCloud = *hahaCloud;
 
-    for (int j = -historyKeyframeSearchNum; j <= historyKeyframeSearchNum;
-         ++j) {
-      if (closestHistoryFrameID + j < 0 ||
-          closestHistoryFrameID + j > latestFrameIDLoopCloure)
-        continue;
-      *nearHistorySurfKeyFrameCloud += *transformPointCloud(
-          cornerCloudKeyFrames[closestHistoryFrameID + j],
-          &cloudKeyPoses6D->points[closestHistoryFrameID + j]);
-      *nearHistorySurfKeyFrameCloud += *transformPointCloud(
-          surfCloudKeyFrames[closestHistoryFrameID + j],
-          &cloudKeyPoses6D->points[closestHistoryFrameID + j]);
+      LoopCandidate candidate;
+      candidate.historyID = id;
+      candidate.historyPose = cloudKeyPoses6D->points[id];
+      candidate.cancelled = false;
+      candidate.verified = false;
+      candidate.fitness = FLT_MAX;
+      candidates.push_back(candidate);
     }
+    loopSkips.inc(skipped.size());
+    if (candidates.empty()) return false;
+    latestPose = cloudKeyPoses6D->points[latestID];
+    origin = mapOrigin;
 
-    downSizeFilterHistoryKeyFrames.setInputCloud(nearHistorySurfKeyFrameCloud);
-    downSizeFilterHistoryKeyFrames.filter(*nearHistorySurfKeyFrameCloudDS);
-
-    if (pubHistoryKeyFrames.getNumSubscribers() != 0) {
-      sensor_msgs::PointCloud2 cloudMsgTemp;
-      pcl::toROSMsg(*nearHistorySurfKeyFrameCloudDS, cloudMsgTemp);
-      cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-      cloudMsgTemp.header.frame_id = "/camera_init";
-      pubHistoryKeyFrames.publish(cloudMsgTemp);
+    pcl::PointCloud<PointType>::Ptr latestKeyFrameCloud(
+        new pcl::PointCloud<PointType>());
+    *latestKeyFrameCloud +=
+        *transformPointCloud(cornerCloudKeyFrames[latestID],
+                             &cloudKeyPoses6D->points[latestID]);
+    *latestKeyFrameCloud += *transformPointCloud(
+        surfCloudKeyFrames[latestID], &cloudKeyPoses6D->points[latestID]);
+    for (const PointType& point : latestKeyFrameCloud->points)
+      if ((int)point.intensity >= 0) latestCloud->push_back(point);
+
+    for (LoopCandidate& candidate : candidates) {
+      pcl::PointCloud<PointType>::Ptr nearHistoryKeyFrameCloud(
+          new pcl::PointCloud<PointType>());
+      for (int j = -historyKeyframeSearchNum; j <= historyKeyframeSearchNum;
+           ++j) {
+        int id = candidate.historyID + j;
+        if (id < 0 || id > latestID) continue;
+        *nearHistoryKeyFrameCloud += *transformPointCloud(
+            cornerCloudKeyFrames[id], &cloudKeyPoses6D->points[id]);
+        *nearHistoryKeyFrameCloud += *transformPointCloud(
+            surfCloudKeyFrames[id], &cloudKeyPoses6D->points[id]);
+      }
+      candidate.target.reset(new pcl::PointCloud<PointType>());
+      downSizeFilterHistoryKeyFrames.setInputCloud(nearHistoryKeyFrameCloud);
+      downSizeFilterHistoryKeyFrames.filter(*candidate.target);
     }
-
     return true;
   }
 
-  void performLoopClosure() {
-    if (cloudKeyPoses3D->points.empty() == true) return;
-
-    if (potentialLoopFlag == false) {
-      if (detectLoopClosure() == true) {
-        potentialLoopFlag = true;
-        timeSaveFirstCurrentScanForLoopClosure = timeLaserOdometry;
-      }
-      if (potentialLoopFlag == false) return;
-    }
-
-    potentialLoopFlag = false;
+  // Align the latest keyframe to the local map of a candidate. ICP runs in
+  // rounds of a few iterations, so that the alignment gives up soon after
+  // another candidate has been accepted.
+  bool verifyLoopCandidate(const pcl::PointCloud<PointType>::Ptr& latestCloud,
+                           LoopCandidate& candidate,
+                           const std::atomic<int>& accepted) {
+    const int maxIterations = 100;
+    const int roundIterations = 10;
+    typedef pcl::registration::DefaultConvergenceCriteria<float> Criteria;
 
     pcl::IterativeClosestPoint<PointType, PointType> icp;
     icp.setMaxCorrespondenceDistance(100);
-    icp.setMaximumIterations(100);
+    icp.setMaximumIterations(roundIterations);
     icp.setTransformationEpsilon(1e-6);
     icp.setEuclideanFitnessEpsilon(1e-6);
     icp.setRANSACIterations(0);
 
-    icp.setInputSource(latestSurfKeyFrameCloud);
-    icp.setInputTarget(nearHistorySurfKeyFrameCloudDS);
+    icp.setInputSource(latestCloud);
+    icp.setInputTarget(candidate.target);
     pcl::PointCloud<PointType>::Ptr unused_result(
         new pcl::PointCloud<PointType>());
-    icp.align(*unused_result);
+    Eigen::Matrix4f guess = Eigen::Matrix4f::Identity();
+    for (int iterations = 0; iterations < maxIterations;
+         iterations += roundIterations) {
+      if (accepted >= 0) {
+        candidate.cancelled = true;
+        return false;
+      }
+      icp.align(*unused_result, guess);
+      guess = icp.getFinalTransformation();
+      if (icp.getConvergeCriteria()->getConvergenceState() !=
+          Criteria::CONVERGENCE_CRITERIA_ITERATIONS)
+        break;
+    }
 
-    if (icp.hasConverged() == false ||
-        icp.getFitnessScore() > historyKeyframeFitnessScore)
+    candidate.verified = true;
+    if (icp.hasConverged() == false) return false;
+    candidate.fitness = icp.getFitnessScore();
+    candidate.correction = guess;
+    return candidate.fitness <= historyKeyframeFitnessScore;
+  }
+
+  void performLoopClosure(const LoopRequest& request) {
+    static metrics::Registry& registry = metrics::Registry::instance();
+    static metrics::Histogram& queueDelay = registry.histogram(
+        "lins_loop_closure_queue_delay_ms",
+        "Time from a new keyframe to the start of its loop search");
+    static metrics::Histogram& verificationTime = registry.histogram(
+        "lins_loop_closure_verification_time_ms",
+        "Time to verify the loop candidates of one keyframe");
+    static metrics::Counter& loopCandidates =
+        registry.counter("lins_loop_closure_candidates_total",
+                         "Loop closure candidates verified by ICP");
+    static metrics::Counter& loopCancellations = registry.counter(
+        "lins_loop_closure_cancelled_total",
+        "Candidate verifications cancelled by an accepted loop");
+    static metrics::Counter& loopClosures =
+        registry.counter("lins_loop_closures_total", "Accepted loop closures");
+    queueDelay.observe(std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - request.queued)
+                           .count());
+
+    int latestID = request.keyframe;
+    pcl::PointCloud<PointType>::Ptr latestCloud(
+        new pcl::PointCloud<PointType>());
+    PointTypePose latestPose;
+    V3D origin;
+    std::vector<LoopCandidate> candidates;
+    if (detectLoopClosure(latestID, latestCloud, latestPose, origin,
+                          candidates) == false)
       return;
 
+    // Candidates are taken by the workers in order of distance. The first one
+    // accepted wins; in the deterministic mode a single worker tries them one
+    // after another, so that the winner does not depend on timing.
+    TicToc ts_verify;
+    int numCandidates = candidates.size();
+    int numThreads = DETERMINISTIC_MODE
+                         ? 1
+                         : std::min(std::max(LOOP_CLOSURE_THREADS, 1),
+                                    numCandidates);
+    std::atomic<int> nextCandidate(0);
+    std::atomic<int> accepted(-1);
+    std::atomic<int> started(0);
+    parallel::parallelFor(numThreads, numThreads, [&](int, int) {
+      for (int c = nextCandidate++; c < numCandidates && accepted < 0;
+           c = nextCandidate++) {
+        ++started;
+        if (verifyLoopCandidate(latestCloud, candidates[c], accepted)) {
+          int none = -1;
+          accepted.compare_exchange_strong(none, c);
+        }
+      }
+    });
+    double time_verify = ts_verify.toc();
+    verificationTime.observe(time_verify);
+    loopCandidates.inc(started);
+    int winner = accepted;
+    for (const LoopCandidate& candidate : candidates)
+      if (candidate.cancelled) loopCancellations.inc();
+    for (const LoopCandidate& candidate : candidates)
+      if (candidate.verified && candidate.fitness > historyKeyframeFitnessScore)
+        rememberFailedLoopCandidate(candidate, latestPose, origin);
+    if (VERBOSE)
+      ROS_INFO_STREAM("Loop closure: verified "
+                      << started << " candidates of keyframe " << latestID
+                      << " in " << time_verify << " ms on " << numThreads
+                      << " threads"
+                      << (winner >= 0 ? ", loop closed" : ""));
+    if (winner < 0) return;
+    const LoopCandidate& loop = candidates[winner];
+
+    double stamp = latestPose.time;
+    if (pubHistoryKeyFrames.getNumSubscribers() != 0) {
+      sensor_msgs::PointCloud2 cloudMsgTemp;
+      pcl::toROSMsg(*toGlobalFrame(*loop.target, origin), cloudMsgTemp);
+      cloudMsgTemp.header.stamp = ros::Time().fromSec(stamp);
+      cloudMsgTemp.header.frame_id = "/camera_init";
+      pubHistoryKeyFrames.publish(cloudMsgTemp);
+    }
     if (pubIcpKeyFrames.getNumSubscribers() != 0) {
       pcl::PointCloud<PointType>::Ptr closed_cloud(
           new pcl::PointCloud<PointType>());
-      pcl::transformPointCloud(*latestSurfKeyFrameCloud, *closed_cloud,
-                               icp.getFinalTransformation());
+      pcl::transformPointCloud(*latestCloud, *closed_cloud,
+                               Eigen::Matrix4f(loop.correction));
       sensor_msgs::PointCloud2 cloudMsgTemp;
-      pcl::toROSMsg(*closed_cloud, cloudMsgTemp);
-      cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
+      pcl::toROSMsg(*toGlobalFrame(*closed_cloud, origin), cloudMsgTemp);
+      cloudMsgTemp.header.stamp = ros::Time().fromSec(stamp);
       cloudMsgTemp.header.frame_id = "/camera_init";
       pubIcpKeyFrames.publish(cloudMsgTemp);
     }
 
+    std::lock_guard<std::mutex> lock(mtx);
     float x, y, z, roll, pitch, yaw;
     Eigen::Affine3f correctionCameraFrame;
-    correctionCameraFrame = icp.getFinalTransformation();
+    correctionCameraFrame = Eigen::Matrix4f(loop.correction);
     pcl::getTranslationAndEulerAngles(correctionCameraFrame, x, y, z, roll,
                                       pitch, yaw);
     Eigen::Affine3f correctionLidarFrame =
         pcl::getTransformation(z, x, y, yaw, roll, pitch);
-    Eigen::Affine3f tWrong = pclPointToAffine3fCameraToLidar(
-        cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
+    Eigen::Affine3f tWrong = pclPointToAffine3fCameraToLidar(latestPose);
     Eigen::Affine3f tCorrect = correctionLidarFrame * tWrong;
     pcl::getTranslationAndEulerAngles(tCorrect, x, y, z, roll, pitch, yaw);
     gtsam::Pose3 poseFrom =
         Pose3(Rot3::RzRyRx(roll, pitch, yaw), Point3(x, y, z));
-    gtsam::Pose3 poseTo =
-        pclPointTogtsamPose3(cloudKeyPoses6D->points[closestHistoryFrameID]);
+    gtsam::Pose3 poseTo = pclPointTogtsamPose3(loop.historyPose);
     gtsam::Vector Vector6(6);
-    float noiseScore = icp.getFitnessScore();
+    float noiseScore = loop.fitness;
     Vector6 << noiseScore, noiseScore, noiseScore, noiseScore, noiseScore,
         noiseScore;
     constraintNoise = noiseModel::Diagonal::Variances(Vector6);
 
-    std::lock_guard<std::mutex> lock(mtx);
-    gtSAMgraph.add(
-        BetweenFactor<Pose3>(latestFrameIDLoopCloure, closestHistoryFrameID,
-                             poseFrom.between(poseTo), constraintNoise));
+    gtSAMgraph.add(BetweenFactor<Pose3>(latestID, loop.historyID,
+                                        poseFrom.between(poseTo),
+                                        constraintNoise));
+    sessionGraph.add(gtSAMgraph);
     isam->update(gtSAMgraph);
     isam->update();
     gtSAMgraph.resize(0);
 
     aLoopIsClosed = true;
+    loopClosures.inc();
+  }
+
+  // Collect the first scans in the odometry frame, look them up in the place
+  // recognition database and verify the best matches by ICP in parallel.
+  // On success the mapping continues in the frame of the saved map.
+  void relocalize() {
+    PointTypePose odometryPose;
+    odometryPose.x = transformSum[3];
+    odometryPose.y = transformSum[4];
+    odometryPose.z = transformSum[5];
+    odometryPose.roll = transformSum[0];
+    odometryPose.pitch = transformSum[1];
+    odometryPose.yaw = transformSum[2];
+    *relocalizationCloud +=
+        *session::transformPointCloud(laserCloudCornerLast, odometryPose);
+    *relocalizationCloud +=
+        *session::transformPointCloud(laserCloudSurfLast, odometryPose);
+    *relocalizationCloud +=
+        *session::transformPointCloud(laserCloudOutlierLast, odometryPose);
+    if (++relocalizationScanCount < relocalizationScanNum) return;
+    relocalizationPending = false;
+
+    TicToc ts_relocalization;
+    pcl::PointCloud<PointType>::Ptr queryCloud(
+        new pcl::PointCloud<PointType>());
+    downSizeFilterHistoryKeyFrames.setInputCloud(relocalizationCloud);
+    downSizeFilterHistoryKeyFrames.filter(*queryCloud);
+    relocalizationCloud->clear();
+
+    float position[3] = {transformSum[3], transformSum[4], transformSum[5]};
+    place_recognition::Descriptor descriptor;
+    place_recognition::computeDescriptor(*queryCloud, position, descriptor);
+    std::vector<place_recognition::Match> matches =
+        placeDatabase.query(descriptor, relocalizationCandidateNum);
+
+    loadMatchNeighbourhoods(matches);
+    int numMatches = matches.size();
+    std::vector<float> fitness(numMatches, FLT_MAX);
+    std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>>
+        corrections(numMatches);
+    parallel::parallelFor(numMatches, numMatches, [&](int begin, int end) {
+      for (int m = begin; m < end; ++m)
+        fitness[m] = verifyRelocalization(queryCloud, position, matches[m],
+                                          corrections[m]);
+    });
+
+    session::releaseKeyframeClouds(relocalizationMap);
+
+    int best = -1;
+    for (int m = 0; m < numMatches; ++m)
+      if (best < 0 || fitness[m] < fitness[best]) best = m;
+    if (best < 0 || fitness[best] > historyKeyframeFitnessScore) {
+      ROS_WARN_STREAM("Relocalization failed after "
+                      << ts_relocalization.toc() << " ms, start a new map");
+      return;
+    }
+
+    seedGlobalPose(corrections[best]);
+    ROS_INFO_STREAM("Relocalized at keyframe "
+                    << matches[best].keyframe << " (fitness " << fitness[best]
+                    << ") in " << ts_relocalization.toc() << " ms");
+  }
+
+  // Read the clouds of the saved keyframes that verifyRelocalization uses for
+  // the matches, each keyframe once
+  void loadMatchNeighbourhoods(
+      const std::vector<place_recognition::Match>& matches) {
+    int numKeyframes = relocalizationMap.poses->size();
+    std::vector<int> ids;
+    for (const place_recognition::Match& match : matches)
+      for (int j = -historyKeyframeSearchNum; j <= historyKeyframeSearchNum;
+           ++j) {
+        int id = match.keyframe + j;
+        if (id >= 0 && id < numKeyframes) ids.push_back(id);
+      }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    int numIds = ids.size();
+    parallel::parallelFor(numIds, relocalizationThreads(),
+                          [&](int begin, int end) {
+                            for (int i = begin; i < end; ++i)
+                              session::loadKeyframeClouds(
+                                  RELOCALIZATION_MAP, relocalizationMap,
+                                  ids[i]);
+                          });
+  }
+
+  // Register the query cloud against the saved keyframes around the match,
+  // starting from the heading found by the descriptor. Returns the fitness
+  // score and the correction from the odometry to the map frame.
+  float verifyRelocalization(const pcl::PointCloud<PointType>::Ptr& queryCloud,
+                             const float position[3],
+                             const place_recognition::Match& match,
+                             Eigen::Matrix4f& correction) {
+    const PointTypePose& keyPose =
+        relocalizationMap.poses->points[match.keyframe];
+    float yaw = match.shift * 2 * M_PI / place_recognition::NUM_SECTORS;
+    Eigen::Matrix4f guess = Eigen::Matrix4f::Identity();
+    guess.block<3, 3>(0, 0) =
+        Eigen::AngleAxisf(yaw, Eigen::Vector3f::UnitY()).toRotationMatrix();
+    guess.block<3, 1>(0, 3) =
+        Eigen::Vector3f(keyPose.x, keyPose.y, keyPose.z) -
+        guess.block<3, 3>(0, 0) *
+            Eigen::Vector3f(position[0], position[1], position[2]);
+
+    pcl::PointCloud<PointType>::Ptr mapCloud(new pcl::PointCloud<PointType>());
+    pcl::PointCloud<PointType>::Ptr mapCloudDS(
+        new pcl::PointCloud<PointType>());
+    int numKeyframes = relocalizationMap.poses->size();
+    for (int j = -historyKeyframeSearchNum; j <= historyKeyframeSearchNum;
+         ++j) {
+      int id = match.keyframe + j;
+      if (id < 0 || id >= numKeyframes) continue;
+      const PointTypePose& pose = relocalizationMap.poses->points[id];
+      *mapCloud += *session::transformPointCloud(
+          relocalizationMap.cornerClouds[id], pose);
+      *mapCloud += *session::transformPointCloud(
+          relocalizationMap.surfClouds[id], pose);
+    }
+    pcl::VoxelGrid<PointType> downSizeFilterMap;
+    downSizeFilterMap.setLeafSize(0.4, 0.4, 0.4);
+    downSizeFilterMap.setInputCloud(mapCloud);
+    downSizeFilterMap.filter(*mapCloudDS);
+    if (queryCloud->empty() || mapCloudDS->empty()) return FLT_MAX;
+
+    pcl::IterativeClosestPoint<PointType, PointType> icp;
+    icp.setMaxCorrespondenceDistance(100);
+    icp.setMaximumIterations(100);
+    icp.setTransformationEpsilon(1e-6);
+    icp.setEuclideanFitnessEpsilon(1e-6);
+    icp.setRANSACIterations(0);
+
+    icp.setInputSource(queryCloud);
+    icp.setInputTarget(mapCloudDS);
+    pcl::PointCloud<PointType>::Ptr unused_result(
+        new pcl::PointCloud<PointType>());
+    icp.align(*unused_result, guess);
+    if (icp.hasConverged() == false) return FLT_MAX;
+
+    correction = icp.getFinalTransformation();
+    return icp.getFitnessScore();
+  }
+
+  // Continue mapping in the saved map frame: the current odometry pose maps
+  // to the corrected global pose, which also becomes the prior of the first
+  // keyframe of the pose graph
+  void seedGlobalPose(const Eigen::Matrix4f& correctionCameraFrame) {
+    // Camera axes (x, y, z) are the lidar axes (y, z, x) of the gtsam poses
+    Eigen::Matrix4f axes = Eigen::Matrix4f::Zero();
+    axes(0, 2) = 1;
+    axes(1, 0) = 1;
+    axes(2, 1) = 1;
+    axes(3, 3) = 1;
+    Eigen::Affine3f correctionLidarFrame(axes * correctionCameraFrame *
+                                         axes.transpose());
+    Eigen::Affine3f odometryLidarFrame = pcl::getTransformation(
+        transformSum[5], transformSum[3], transformSum[4], transformSum[2],
+        transformSum[0], transformSum[1]);
+
+    float x, y, z, roll, pitch, yaw;
+    pcl::getTranslationAndEulerAngles(correctionLidarFrame * odometryLidarFrame,
+                                      x, y, z, roll, pitch, yaw);
+    transformAftMapped[0] = pitch;
+    transformAftMapped[1] = yaw;
+    transformAftMapped[2] = roll;
+    transformAftMapped[3] = y;
+    transformAftMapped[4] = z;
+    transformAftMapped[5] = x;
+    for (int i = 0; i < 6; ++i) {
+      transformBefMapped[i] = transformSum[i];
+      transformTobeMapped[i] = transformAftMapped[i];
+    }
   }
 
   Pose3 pclPointTogtsamPose3(PointTypePose thisPoint) {
@@ -1192,6 +1980,23 @@ class MappingHandler {
         Point3(double(thisPoint.z), double(thisPoint.x), double(thisPoint.y)));
   }
 
+  // Add the clouds of a keyframe of the local map to the voxel feature maps,
+  // or remove them
+  void updateFeatureMaps(const pcl::PointCloud<PointType>::Ptr& corner,
+                         const pcl::PointCloud<PointType>::Ptr& surf,
+                         const pcl::PointCloud<PointType>::Ptr& outlier,
+                         bool add) {
+    if (add) {
+      cornerFeatureMap.add(*corner);
+      surfFeatureMap.add(*surf);
+      surfFeatureMap.add(*outlier);
+    } else {
+      cornerFeatureMap.remove(*corner);
+      surfFeatureMap.remove(*surf);
+      surfFeatureMap.remove(*outlier);
+    }
+  }
+
   Eigen::Affine3f pclPointToAffine3fCameraToLidar(PointTypePose thisPoint) {
     return pcl::getTransformation(thisPoint.z, thisPoint.x, thisPoint.y,
                                   thisPoint.yaw, thisPoint.roll,
@@ -1221,8 +2026,20 @@ class MappingHandler {
           if (recentCornerCloudKeyFrames.size() >= surroundingKeyframeSearchNum)
             break;
         }
+        if (MAPPING_VOXEL_MAP) {
+          cornerFeatureMap.clear();
+          surfFeatureMap.clear();
+          for (int i = 0; i < recentCornerCloudKeyFrames.size(); ++i)
+            updateFeatureMaps(recentCornerCloudKeyFrames[i],
+                              recentSurfCloudKeyFrames[i],
+                              recentOutlierCloudKeyFrames[i], true);
+        }
       } else {
         if (latestFrameID != cloudKeyPoses3D->points.size() - 1) {
+          if (MAPPING_VOXEL_MAP)
+            updateFeatureMaps(recentCornerCloudKeyFrames.front(),
+                              recentSurfCloudKeyFrames.front(),
+                              recentOutlierCloudKeyFrames.front(), false);
           recentCornerCloudKeyFrames.pop_front();
           recentSurfCloudKeyFrames.pop_front();
           recentOutlierCloudKeyFrames.pop_front();
@@ -1236,6 +2053,10 @@ class MappingHandler {
               transformPointCloud(surfCloudKeyFrames[latestFrameID]));
           recentOutlierCloudKeyFrames.push_back(
               transformPointCloud(outlierCloudKeyFrames[latestFrameID]));
+          if (MAPPING_VOXEL_MAP)
+            updateFeatureMaps(recentCornerCloudKeyFrames.back(),
+                              recentSurfCloudKeyFrames.back(),
+                              recentOutlierCloudKeyFrames.back(), true);
         }
       }
 
@@ -1269,6 +2090,10 @@ class MappingHandler {
           }
         }
         if (existingFlag == false) {
+          if (MAPPING_VOXEL_MAP)
+            updateFeatureMaps(surroundingCornerCloudKeyFrames[i],
+                              surroundingSurfCloudKeyFrames[i],
+                              surroundingOutlierCloudKeyFrames[i], false);
           surroundingExistingKeyPosesID.erase(
               surroundingExistingKeyPosesID.begin() + i);
           surroundingCornerCloudKeyFrames.erase(
@@ -1278,6 +2103,7 @@ class MappingHandler {
           surroundingOutlierCloudKeyFrames.erase(
               surroundingOutlierCloudKeyFrames.begin() + i);
           --i;
+          ++mapVersion;
         }
       }
 
@@ -1304,6 +2130,11 @@ class MappingHandler {
               transformPointCloud(surfCloudKeyFrames[thisKeyInd]));
           surroundingOutlierCloudKeyFrames.push_back(
               transformPointCloud(outlierCloudKeyFrames[thisKeyInd]));
+          if (MAPPING_VOXEL_MAP)
+            updateFeatureMaps(surroundingCornerCloudKeyFrames.back(),
+                              surroundingSurfCloudKeyFrames.back(),
+                              surroundingOutlierCloudKeyFrames.back(), true);
+          ++mapVersion;
         }
       }
 
@@ -1314,6 +2145,16 @@ class MappingHandler {
       }
     }
 
+    if (MAPPING_VOXEL_MAP) {
+      cornerFeatureMap.refresh();
+      surfFeatureMap.refresh();
+    }
+
+    // The downsampled maps are kept across scans and, like the KD trees built
+    // on them, only rebuilt when the surrounding keyframes have changed
+    if (mapDSVersion == mapVersion) return;
+    mapDSVersion = mapVersion;
+
     downSizeFilterCorner.setInputCloud(laserCloudCornerFromMap);
     downSizeFilterCorner.filter(*laserCloudCornerFromMapDS);
     laserCloudCornerFromMapDSNum = laserCloudCornerFromMapDS->points.size();
@@ -1328,6 +2169,8 @@ class MappingHandler {
     downSizeFilterCorner.setInputCloud(laserCloudCornerLast);
     downSizeFilterCorner.filter(*laserCloudCornerLastDS);
     laserCloudCornerLastDSNum = laserCloudCornerLastDS->points.size();
+    if (MAPPING_CORNER_BUDGET > 0)
+      cornerBudgetFilter.filter(laserCloudCornerLast, *laserCloudCornerScan);
 
     laserCloudSurfLastDS->clear();
     downSizeFilterSurf.setInputCloud(laserCloudSurfLast);
@@ -1341,181 +2184,279 @@ class MappingHandler {
 
     laserCloudSurfTotalLast->clear();
     laserCloudSurfTotalLastDS->clear();
-    *laserCloudSurfTotalLast += *laserCloudSurfLastDS;
-    *laserCloudSurfTotalLast += *laserCloudOutlierLastDS;
-    downSizeFilterSurf.setInputCloud(laserCloudSurfTotalLast);
-    downSizeFilterSurf.filter(*laserCloudSurfTotalLastDS);
+    if (MAPPING_SURF_BUDGET > 0) {
+      // The budget may ask for a finer leaf than the keyframe clouds have
+      *laserCloudSurfTotalLast += *laserCloudSurfLast;
+      *laserCloudSurfTotalLast += *laserCloudOutlierLast;
+      surfBudgetFilter.filter(laserCloudSurfTotalLast,
+                              *laserCloudSurfTotalLastDS);
+    } else {
+      *laserCloudSurfTotalLast += *laserCloudSurfLastDS;
+      *laserCloudSurfTotalLast += *laserCloudOutlierLastDS;
+      downSizeFilterSurf.setInputCloud(laserCloudSurfTotalLast);
+      downSizeFilterSurf.filter(*laserCloudSurfTotalLastDS);
+    }
     laserCloudSurfTotalLastDSNum = laserCloudSurfTotalLastDS->points.size();
+
+    static metrics::Registry& registry = metrics::Registry::instance();
+    static metrics::Gauge& cornerPoints = registry.gauge(
+        "lins_mapping_scan_points", "Scan points registered against the map",
+        "class=\"corner\"");
+    static metrics::Gauge& surfPoints = registry.gauge(
+        "lins_mapping_scan_points", "Scan points registered against the map",
+        "class=\"surf\"");
+    cornerPoints.set(laserCloudCornerScan->points.size());
+    surfPoints.set(laserCloudSurfTotalLastDSNum);
+    if (VERBOSE && (MAPPING_CORNER_BUDGET > 0 || MAPPING_SURF_BUDGET > 0)) {
+      ROS_INFO("Scan leaf size: corner %.2f m, surf %.2f m",
+               MAPPING_CORNER_BUDGET > 0 ? cornerBudgetFilter.leafSize() : 0.2,
+               MAPPING_SURF_BUDGET > 0 ? surfBudgetFilter.leafSize() : 0.4);
+    }
+  }
+
+  // Whether the cached association of a point has to be searched again. The
+  // first iteration always searches, later ones only if the transformed point
+  // moved by more than requeryDist or every MAPPING_REQUERY_ITERATIONS.
+  bool needsRequery(const PointAssociation& assoc, const PointType& point,
+                    int iterCount, float requeryDist) {
+    if (iterCount == 0 || MAPPING_REQUERY_RATIO <= 0) return true;
+    if (MAPPING_REQUERY_ITERATIONS > 0 &&
+        iterCount % MAPPING_REQUERY_ITERATIONS == 0)
+      return true;
+    float dx = point.x - assoc.x;
+    float dy = point.y - assoc.y;
+    float dz = point.z - assoc.z;
+    return dx * dx + dy * dy + dz * dz > requeryDist * requeryDist;
   }
 
-  void cornerOptimization(int iterCount) {
+  void cornerOptimization(int iterCount, MapLevel& level) {
     updatePointAssociateToMapSinCos();
-    for (int i = 0; i < laserCloudCornerLastDSNum; i++) {
-      pointOri = laserCloudCornerLastDS->points[i];
+    int numPoints = level.cornerScan->points.size();
+    if (iterCount == 0)
+      level.cornerAssociations.assign(numPoints, PointAssociation());
+    float requeryDist = MAPPING_REQUERY_RATIO * 0.2 * level.scale;
+    for (int i = 0; i < numPoints; i++) {
+      pointOri = level.cornerScan->points[i];
       pointAssociateToMap(&pointOri, &pointSel);
-      kdtreeCornerFromMap->nearestKSearch(pointSel, 5, pointSearchInd,
-                                          pointSearchSqDis);
-
-      if (pointSearchSqDis[4] < 1.0) {
-        float cx = 0, cy = 0, cz = 0;
-        for (int j = 0; j < 5; j++) {
-          cx += laserCloudCornerFromMapDS->points[pointSearchInd[j]].x;
-          cy += laserCloudCornerFromMapDS->points[pointSearchInd[j]].y;
-          cz += laserCloudCornerFromMapDS->points[pointSearchInd[j]].z;
-        }
-        cx /= 5;
-        cy /= 5;
-        cz /= 5;
-
-        float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
-        for (int j = 0; j < 5; j++) {
-          float ax =
-              laserCloudCornerFromMapDS->points[pointSearchInd[j]].x - cx;
-          float ay =
-              laserCloudCornerFromMapDS->points[pointSearchInd[j]].y - cy;
-          float az =
-              laserCloudCornerFromMapDS->points[pointSearchInd[j]].z - cz;
-
-          a11 += ax * ax;
-          a12 += ax * ay;
-          a13 += ax * az;
-          a22 += ay * ay;
-          a23 += ay * az;
-          a33 += az * az;
-        }
-        a11 /= 5;
-        a12 /= 5;
-        a13 /= 5;
-        a22 /= 5;
-        a23 /= 5;
-        a33 /= 5;
-
-        matA1.at<float>(0, 0) = a11;
-        matA1.at<float>(0, 1) = a12;
-        matA1.at<float>(0, 2) = a13;
-        matA1.at<float>(1, 0) = a12;
-        matA1.at<float>(1, 1) = a22;
-        matA1.at<float>(1, 2) = a23;
-        matA1.at<float>(2, 0) = a13;
-        matA1.at<float>(2, 1) = a23;
-        matA1.at<float>(2, 2) = a33;
-
-        cv::eigen(matA1, matD1, matV1);
-
-        if (matD1.at<float>(0, 0) > 3 * matD1.at<float>(0, 1)) {
-          float x0 = pointSel.x;
-          float y0 = pointSel.y;
-          float z0 = pointSel.z;
-          float x1 = cx + 0.1 * matV1.at<float>(0, 0);
-          float y1 = cy + 0.1 * matV1.at<float>(0, 1);
-          float z1 = cz + 0.1 * matV1.at<float>(0, 2);
-          float x2 = cx - 0.1 * matV1.at<float>(0, 0);
-          float y2 = cy - 0.1 * matV1.at<float>(0, 1);
-          float z2 = cz - 0.1 * matV1.at<float>(0, 2);
-
-          float a012 =
-              sqrt(((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) *
-                       ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) +
-                   ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1)) *
-                       ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1)) +
-                   ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1)) *
-                       ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1)));
-
-          float l12 = sqrt((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) +
-                           (z1 - z2) * (z1 - z2));
-
-          float la =
-              ((y1 - y2) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) +
-               (z1 - z2) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1))) /
-              a012 / l12;
-
-          float lb =
-              -((x1 - x2) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) -
-                (z1 - z2) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1))) /
-              a012 / l12;
-
-          float lc =
-              -((x1 - x2) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1)) +
-                (y1 - y2) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1))) /
-              a012 / l12;
-
-          float ld2 = a012 / l12;
-
-          float s = 1 - 0.9 * fabs(ld2);
-
-          coeff.x = s * la;
-          coeff.y = s * lb;
-          coeff.z = s * lc;
-          coeff.intensity = s * ld2;
-
-          if (s > 0.1) {
-            laserCloudOri->push_back(pointOri);
-            coeffSel->push_back(coeff);
+
+      PointAssociation& assoc = level.cornerAssociations[i];
+      if (MAPPING_VOXEL_MAP) {
+        associationQueries++;
+        assoc.valid = cornerFeatureMap.line(pointSel, assoc.params);
+      } else if (MAPPING_PROJECTIVE_ASSOCIATION && &level == &mapPyramid[0]) {
+        associationQueries++;
+        assoc.valid = cornerProjection.associate(i, pointSel, level.scale,
+                                                 assoc.params);
+      } else if (needsRequery(assoc, pointSel, iterCount, requeryDist)) {
+        associationQueries++;
+        assoc.x = pointSel.x;
+        assoc.y = pointSel.y;
+        assoc.z = pointSel.z;
+        assoc.valid = false;
+        level.kdtreeCorner->nearestKSearch(pointSel, 5, pointSearchInd,
+                                           pointSearchSqDis);
+
+        if (pointSearchSqDis[4] < level.scale * level.scale) {
+          float cx = 0, cy = 0, cz = 0;
+          for (int j = 0; j < 5; j++) {
+            cx += level.cornerMap->points[pointSearchInd[j]].x;
+            cy += level.cornerMap->points[pointSearchInd[j]].y;
+            cz += level.cornerMap->points[pointSearchInd[j]].z;
+          }
+          cx /= 5;
+          cy /= 5;
+          cz /= 5;
+
+          float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
+          for (int j = 0; j < 5; j++) {
+            float ax = level.cornerMap->points[pointSearchInd[j]].x - cx;
+            float ay = level.cornerMap->points[pointSearchInd[j]].y - cy;
+            float az = level.cornerMap->points[pointSearchInd[j]].z - cz;
+
+            a11 += ax * ax;
+            a12 += ax * ay;
+            a13 += ax * az;
+            a22 += ay * ay;
+            a23 += ay * az;
+            a33 += az * az;
+          }
+          a11 /= 5;
+          a12 /= 5;
+          a13 /= 5;
+          a22 /= 5;
+          a23 /= 5;
+          a33 /= 5;
+
+          matA1.at<float>(0, 0) = a11;
+          matA1.at<float>(0, 1) = a12;
+          matA1.at<float>(0, 2) = a13;
+          matA1.at<float>(1, 0) = a12;
+          matA1.at<float>(1, 1) = a22;
+          matA1.at<float>(1, 2) = a23;
+          matA1.at<float>(2, 0) = a13;
+          matA1.at<float>(2, 1) = a23;
+          matA1.at<float>(2, 2) = a33;
+
+          cv::eigen(matA1, matD1, matV1);
+
+          if (matD1.at<float>(0, 0) > 3 * matD1.at<float>(0, 1)) {
+            assoc.valid = true;
+            assoc.params[0] = cx + 0.1 * matV1.at<float>(0, 0);
+            assoc.params[1] = cy + 0.1 * matV1.at<float>(0, 1);
+            assoc.params[2] = cz + 0.1 * matV1.at<float>(0, 2);
+            assoc.params[3] = cx - 0.1 * matV1.at<float>(0, 0);
+            assoc.params[4] = cy - 0.1 * matV1.at<float>(0, 1);
+            assoc.params[5] = cz - 0.1 * matV1.at<float>(0, 2);
           }
         }
+      } else {
+        associationReuses++;
+      }
+
+      if (assoc.valid) {
+        float x0 = pointSel.x;
+        float y0 = pointSel.y;
+        float z0 = pointSel.z;
+        float x1 = assoc.params[0];
+        float y1 = assoc.params[1];
+        float z1 = assoc.params[2];
+        float x2 = assoc.params[3];
+        float y2 = assoc.params[4];
+        float z2 = assoc.params[5];
+
+        float a012 =
+            sqrt(((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) *
+                     ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) +
+                 ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1)) *
+                     ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1)) +
+                 ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1)) *
+                     ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1)));
+
+        float l12 = sqrt((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) +
+                         (z1 - z2) * (z1 - z2));
+
+        float la =
+            ((y1 - y2) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) +
+             (z1 - z2) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1))) /
+            a012 / l12;
+
+        float lb =
+            -((x1 - x2) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) -
+              (z1 - z2) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1))) /
+            a012 / l12;
+
+        float lc =
+            -((x1 - x2) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1)) +
+              (y1 - y2) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1))) /
+            a012 / l12;
+
+        float ld2 = a012 / l12;
+
+        float s = 1 - 0.9 * fabs(ld2);
+
+        coeff.x = s * la;
+        coeff.y = s * lb;
+        coeff.z = s * lc;
+        coeff.intensity = s * ld2;
+
+        if (s > 0.1) {
+          laserCloudOri->push_back(pointOri);
+          coeffSel->push_back(coeff);
+        }
       }
     }
   }
 
-  void surfOptimization(int iterCount) {
+  void surfOptimization(int iterCount, MapLevel& level) {
     updatePointAssociateToMapSinCos();
-    for (int i = 0; i < laserCloudSurfTotalLastDSNum; i++) {
-      pointOri = laserCloudSurfTotalLastDS->points[i];
+    int numPoints = level.surfScan->points.size();
+    if (iterCount == 0)
+      level.surfAssociations.assign(numPoints, PointAssociation());
+    float requeryDist = MAPPING_REQUERY_RATIO * 0.4 * level.scale;
+    for (int i = 0; i < numPoints; i++) {
+      pointOri = level.surfScan->points[i];
       pointAssociateToMap(&pointOri, &pointSel);
-      kdtreeSurfFromMap->nearestKSearch(pointSel, 5, pointSearchInd,
-                                        pointSearchSqDis);
-
-      if (pointSearchSqDis[4] < 1.0) {
-        for (int j = 0; j < 5; j++) {
-          matA0.at<float>(j, 0) =
-              laserCloudSurfFromMapDS->points[pointSearchInd[j]].x;
-          matA0.at<float>(j, 1) =
-              laserCloudSurfFromMapDS->points[pointSearchInd[j]].y;
-          matA0.at<float>(j, 2) =
-              laserCloudSurfFromMapDS->points[pointSearchInd[j]].z;
-        }
-        cv::solve(matA0, matB0, matX0, cv::DECOMP_QR);
-
-        float pa = matX0.at<float>(0, 0);
-        float pb = matX0.at<float>(1, 0);
-        float pc = matX0.at<float>(2, 0);
-        float pd = 1;
-
-        float ps = sqrt(pa * pa + pb * pb + pc * pc);
-        pa /= ps;
-        pb /= ps;
-        pc /= ps;
-        pd /= ps;
-
-        bool planeValid = true;
-        for (int j = 0; j < 5; j++) {
-          if (fabs(pa * laserCloudSurfFromMapDS->points[pointSearchInd[j]].x +
-                   pb * laserCloudSurfFromMapDS->points[pointSearchInd[j]].y +
-                   pc * laserCloudSurfFromMapDS->points[pointSearchInd[j]].z +
-                   pd) > 0.2) {
-            planeValid = false;
-            break;
-          }
-        }
-
-        if (planeValid) {
-          float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
-
-          float s = 1 - 0.9 * fabs(pd2) /
-                            sqrt(sqrt(pointSel.x * pointSel.x +
-                                      pointSel.y * pointSel.y +
-                                      pointSel.z * pointSel.z));
 
-          coeff.x = s * pa;
-          coeff.y = s * pb;
-          coeff.z = s * pc;
-          coeff.intensity = s * pd2;
+      PointAssociation& assoc = level.surfAssociations[i];
+      if (MAPPING_VOXEL_MAP) {
+        associationQueries++;
+        assoc.valid = surfFeatureMap.plane(pointSel, assoc.params);
+      } else if (MAPPING_PROJECTIVE_ASSOCIATION && &level == &mapPyramid[0]) {
+        associationQueries++;
+        assoc.valid =
+            surfProjection.associate(i, pointSel, level.scale, assoc.params);
+      } else if (needsRequery(assoc, pointSel, iterCount, requeryDist)) {
+        associationQueries++;
+        assoc.x = pointSel.x;
+        assoc.y = pointSel.y;
+        assoc.z = pointSel.z;
+        assoc.valid = false;
+        level.kdtreeSurf->nearestKSearch(pointSel, 5, pointSearchInd,
+                                         pointSearchSqDis);
+
+        if (pointSearchSqDis[4] < level.scale * level.scale) {
+          for (int j = 0; j < 5; j++) {
+            matA0.at<float>(j, 0) = level.surfMap->points[pointSearchInd[j]].x;
+            matA0.at<float>(j, 1) = level.surfMap->points[pointSearchInd[j]].y;
+            matA0.at<float>(j, 2) = level.surfMap->points[pointSearchInd[j]].z;
+          }
+          cv::solve(matA0, matB0, matX0, cv::DECOMP_QR);
+
+          float pa = matX0.at<float>(0, 0);
+          float pb = matX0.at<float>(1, 0);
+          float pc = matX0.at<float>(2, 0);
+          float pd = 1;
+
+          float ps = sqrt(pa * pa + pb * pb + pc * pc);
+          pa /= ps;
+          pb /= ps;
+          pc /= ps;
+          pd /= ps;
+
+          bool planeValid = true;
+          for (int j = 0; j < 5; j++) {
+            if (fabs(pa * level.surfMap->points[pointSearchInd[j]].x +
+                     pb * level.surfMap->points[pointSearchInd[j]].y +
+                     pc * level.surfMap->points[pointSearchInd[j]].z +
+                     pd) > 0.2 * level.scale) {
+              planeValid = false;
+              break;
+            }
+          }
 
-          if (s > 0.1) {
-            laserCloudOri->push_back(pointOri);
-            coeffSel->push_back(coeff);
+          if (planeValid) {
+            assoc.valid = true;
+            assoc.params[0] = pa;
+            assoc.params[1] = pb;
+            assoc.params[2] = pc;
+            assoc.params[3] = pd;
           }
         }
+      } else {
+        associationReuses++;
+      }
+
+      if (assoc.valid) {
+        float pa = assoc.params[0];
+        float pb = assoc.params[1];
+        float pc = assoc.params[2];
+        float pd = assoc.params[3];
+        float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
+
+        float s = 1 - 0.9 * fabs(pd2) /
+                          sqrt(sqrt(pointSel.x * pointSel.x +
+                                    pointSel.y * pointSel.y +
+                                    pointSel.z * pointSel.z));
+
+        coeff.x = s * pa;
+        coeff.y = s * pb;
+        coeff.z = s * pc;
+        coeff.intensity = s * pd2;
+
+        if (s > 0.1) {
+          laserCloudOri->push_back(pointOri);
+          coeffSel->push_back(coeff);
+        }
       }
     }
   }
@@ -1533,10 +2474,16 @@ class MappingHandler {
       return false;
     }
 
-    cv::Mat matA(laserCloudSelNum, 6, CV_32F, cv::Scalar::all(0));
-    cv::Mat matAt(6, laserCloudSelNum, CV_32F, cv::Scalar::all(0));
+    // The scan-sized matrices wrap scan arena memory, which is handed back
+    // when this iteration returns
+    arena::ScopedRewind rewind(scanArena);
+    cv::Mat matA(laserCloudSelNum, 6, CV_32F,
+                 scanArena.allocate<float>(laserCloudSelNum * 6));
+    cv::Mat matAt(6, laserCloudSelNum, CV_32F,
+                  scanArena.allocate<float>(6 * laserCloudSelNum));
     cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
-    cv::Mat matB(laserCloudSelNum, 1, CV_32F, cv::Scalar::all(0));
+    cv::Mat matB(laserCloudSelNum, 1, CV_32F,
+                 scanArena.allocate<float>(laserCloudSelNum));
     cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
     cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
     for (int i = 0; i < laserCloudSelNum; i++) {
@@ -1578,9 +2525,32 @@ class MappingHandler {
       matA.at<float>(i, 5) = coeff.z;
       matB.at<float>(i, 0) = -coeff.intensity;
     }
-    cv::transpose(matA, matAt);
-    matAtA = matAt * matA;
-    matAtB = matAt * matB;
+    if (MAPPING_THREADS > 1 || DETERMINISTIC_MODE) {
+      // Accumulate [A^T A | A^T b] in parallel. The deterministic mode fixes
+      // the partitioning and the summation order of the partial sums.
+      typedef Eigen::Matrix<float, 6, 7, Eigen::DontAlign> NormalEquations;
+      NormalEquations normal = parallel::parallelReduce(
+          laserCloudSelNum, std::max(MAPPING_THREADS, 1), DETERMINISTIC_MODE,
+          NormalEquations(NormalEquations::Zero()),
+          [&](int begin, int end, NormalEquations& partial) {
+            for (int i = begin; i < end; i++) {
+              const float* a = matA.ptr<float>(i);
+              float b = matB.at<float>(i, 0);
+              for (int r = 0; r < 6; r++) {
+                for (int c = 0; c < 6; c++) partial(r, c) += a[r] * a[c];
+                partial(r, 6) += a[r] * b;
+              }
+            }
+          });
+      for (int r = 0; r < 6; r++) {
+        for (int c = 0; c < 6; c++) matAtA.at<float>(r, c) = normal(r, c);
+        matAtB.at<float>(r, 0) = normal(r, 6);
+      }
+    } else {
+      cv::transpose(matA, matAt);
+      matAtA = matAt * matA;
+      matAtB = matAt * matB;
+    }
     cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
 
     if (iterCount == 0) {
@@ -1633,21 +2603,136 @@ class MappingHandler {
   }
 
   void scan2MapOptimization() {
+    associationQueries = 0;
+    associationReuses = 0;
+
+    // In the tightly coupled mode the odometry is already registered against a
+    // local map, so the pose is only kept for keyframes and loop closure
+    if (TIGHTLY_COUPLED_MAPPING) {
+      transformUpdate();
+      return;
+    }
+
     if (laserCloudCornerFromMapDSNum > 10 && laserCloudSurfFromMapDSNum > 100) {
+      // The voxel feature maps replace the KD trees of the finest level
+      if (!MAPPING_VOXEL_MAP) {
+        if (MAPPING_PROJECTIVE_ASSOCIATION) {
+          renderLocalMap();
+        } else {
+          kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMapDS);
+          kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMapDS);
+        }
+      }
+
+      if (mapPyramid.size() > 1) {
+        multiResolutionOptimization();
+      } else {
+        for (int iterCount = 0; iterCount < 10; iterCount++) {
+          laserCloudOri->clear();
+          coeffSel->clear();
+
+          cornerOptimization(iterCount, mapPyramid[0]);
+          surfOptimization(iterCount, mapPyramid[0]);
+
+          if (LMOptimization(iterCount) == true) break;
+        }
+      }
+
+      transformUpdate();
+
+      if (VERBOSE) {
+        ROS_INFO_STREAM("Association: queries: " << associationQueries
+                                                 << ", reused: "
+                                                 << associationReuses);
+      }
+    }
+  }
+
+  // Render the local map into the range image of the scan from the predicted
+  // pose for the projective association. The KD trees that the line and plane
+  // models are fitted with only change with the map.
+  void renderLocalMap() {
+    if (projectionMapVersion != mapVersion) {
       kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMapDS);
       kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMapDS);
+      cornerProjection.setMap(laserCloudCornerFromMapDS, kdtreeCornerFromMap);
+      surfProjection.setMap(laserCloudSurfFromMapDS, kdtreeSurfFromMap);
+      projectionMapVersion = mapVersion;
+    }
 
-      for (int iterCount = 0; iterCount < 10; iterCount++) {
+    cornerProjection.setScan(*laserCloudCornerScan);
+    surfProjection.setScan(*laserCloudSurfTotalLastDS);
+    updatePointAssociateToMapSinCos();
+    renderInSensorFrame(*laserCloudCornerFromMapDS, cornerProjection);
+    renderInSensorFrame(*laserCloudSurfFromMapDS, surfProjection);
+  }
+
+  void renderInSensorFrame(const pcl::PointCloud<PointType>& map,
+                           projective::Associator& associator) {
+    int numPoints = map.points.size();
+    mapInSensorFrame->points.resize(numPoints);
+    for (int i = 0; i < numPoints; ++i)
+      pointAssociateTobeMapped(&map.points[i], &mapInSensorFrame->points[i]);
+    associator.render(*mapInSensorFrame);
+  }
+
+  void buildMapLevel(MapLevel& level) {
+    // Coarse maps and their KD trees are only rebuilt when the set of
+    // surrounding keyframes has changed since the last scan
+    if (level.mapVersion != mapVersion) {
+      level.cornerMap->clear();
+      level.downSizeFilterCorner.setInputCloud(laserCloudCornerFromMapDS);
+      level.downSizeFilterCorner.filter(*level.cornerMap);
+      level.surfMap->clear();
+      level.downSizeFilterSurf.setInputCloud(laserCloudSurfFromMapDS);
+      level.downSizeFilterSurf.filter(*level.surfMap);
+      if (!level.cornerMap->points.empty())
+        level.kdtreeCorner->setInputCloud(level.cornerMap);
+      if (!level.surfMap->points.empty())
+        level.kdtreeSurf->setInputCloud(level.surfMap);
+      level.mapVersion = mapVersion;
+    }
+
+    level.cornerScan->clear();
+    level.downSizeFilterCorner.setInputCloud(laserCloudCornerScan);
+    level.downSizeFilterCorner.filter(*level.cornerScan);
+    level.surfScan->clear();
+    level.downSizeFilterSurf.setInputCloud(laserCloudSurfTotalLastDS);
+    level.downSizeFilterSurf.filter(*level.surfScan);
+  }
+
+  void multiResolutionOptimization() {
+    TicToc ts_pyramid;
+    std::vector<int> iterations(mapPyramid.size(), 0);
+    for (int l = mapPyramid.size() - 1; l >= 0; --l) {
+      MapLevel& level = mapPyramid[l];
+      if (l > 0) {
+        buildMapLevel(level);
+        if (level.cornerMap->points.size() <= 10 ||
+            level.surfMap->points.size() <= 100 ||
+            level.cornerScan->points.size() + level.surfScan->points.size() <
+                50)
+          continue;
+      }
+
+      for (int iterCount = 0; iterCount < level.maxIterations; iterCount++) {
         laserCloudOri->clear();
         coeffSel->clear();
 
-        cornerOptimization(iterCount);
-        surfOptimization(iterCount);
+        cornerOptimization(iterCount, level);
+        surfOptimization(iterCount, level);
 
+        iterations[l]++;
         if (LMOptimization(iterCount) == true) break;
       }
+    }
 
-      transformUpdate();
+    if (VERBOSE) {
+      std::stringstream ss;
+      for (int l = mapPyramid.size() - 1; l >= 0; --l)
+        ss << " L" << l << ": " << iterations[l];
+      ROS_INFO_STREAM("Pyramid iterations" << ss.str() << ", time: "
+                                           << ts_pyramid.toc() << " ms");
     }
   }
 
@@ -1671,41 +2756,27 @@ class MappingHandler {
     previousRobotPosPoint = currentRobotPosPoint;
 
     if (cloudKeyPoses3D->points.empty()) {
-      gtSAMgraph.add(PriorFactor<Pose3>(
-          0,
-          Pose3(Rot3::RzRyRx(transformTobeMapped[2], transformTobeMapped[0],
-                             transformTobeMapped[1]),
-                Point3(transformTobeMapped[5], transformTobeMapped[3],
-                       transformTobeMapped[4])),
-          priorNoise));
-      initialEstimate.insert(
-          0, Pose3(Rot3::RzRyRx(transformTobeMapped[2], transformTobeMapped[0],
-                                transformTobeMapped[1]),
-                   Point3(transformTobeMapped[5], transformTobeMapped[3],
-                          transformTobeMapped[4])));
+      gtSAMgraph.add(
+          PriorFactor<Pose3>(0, globalPose3(transformTobeMapped), priorNoise));
+      initialEstimate.insert(0, globalPose3(transformTobeMapped));
       for (int i = 0; i < 6; ++i) transformLast[i] = transformTobeMapped[i];
     } else {
-      gtsam::Pose3 poseFrom = Pose3(
-          Rot3::RzRyRx(transformLast[2], transformLast[0], transformLast[1]),
-          Point3(transformLast[5], transformLast[3], transformLast[4]));
-      gtsam::Pose3 poseTo =
-          Pose3(Rot3::RzRyRx(transformAftMapped[2], transformAftMapped[0],
-                             transformAftMapped[1]),
-                Point3(transformAftMapped[5], transformAftMapped[3],
-                       transformAftMapped[4]));
+      gtsam::Pose3 poseFrom = globalPose3(transformLast);
+      gtsam::Pose3 poseTo = globalPose3(transformAftMapped);
       gtSAMgraph.add(BetweenFactor<Pose3>(
           cloudKeyPoses3D->points.size() - 1, cloudKeyPoses3D->points.size(),
           poseFrom.between(poseTo), odometryNoise));
-      initialEstimate.insert(
-          cloudKeyPoses3D->points.size(),
-          Pose3(Rot3::RzRyRx(transformAftMapped[2], transformAftMapped[0],
-                             transformAftMapped[1]),
-                Point3(transformAftMapped[5], transformAftMapped[3],
-                       transformAftMapped[4])));
+      initialEstimate.insert(cloudKeyPoses3D->points.size(), poseTo);
     }
 
+    sessionGraph.add(gtSAMgraph);
+    TicToc ts_isam;
     isam->update(gtSAMgraph, initialEstimate);
     isam->update();
+    static metrics::Histogram& isamTime =
+        metrics::Registry::instance().histogram(
+            "lins_isam_update_time_ms", "Time of the ISAM2 keyframe update");
+    isamTime.observe(ts_isam.toc());
 
     gtSAMgraph.resize(0);
     initialEstimate.clear();
@@ -1717,10 +2788,11 @@ class MappingHandler {
     isamCurrentEstimate = isam->calculateEstimate();
     latestEstimate =
         isamCurrentEstimate.at<Pose3>(isamCurrentEstimate.size() - 1);
+    V3D latestPosition = localPosition(latestEstimate);
 
-    thisPose3D.x = latestEstimate.translation().y();
-    thisPose3D.y = latestEstimate.translation().z();
-    thisPose3D.z = latestEstimate.translation().x();
+    thisPose3D.x = latestPosition.x();
+    thisPose3D.y = latestPosition.y();
+    thisPose3D.z = latestPosition.z();
     thisPose3D.intensity = cloudKeyPoses3D->points.size();
     cloudKeyPoses3D->push_back(thisPose3D);
 
@@ -1738,9 +2810,9 @@ class MappingHandler {
       transformAftMapped[0] = latestEstimate.rotation().pitch();
       transformAftMapped[1] = latestEstimate.rotation().yaw();
       transformAftMapped[2] = latestEstimate.rotation().roll();
-      transformAftMapped[3] = latestEstimate.translation().y();
-      transformAftMapped[4] = latestEstimate.translation().z();
-      transformAftMapped[5] = latestEstimate.translation().x();
+      transformAftMapped[3] = latestPosition.x();
+      transformAftMapped[4] = latestPosition.y();
+      transformAftMapped[5] = latestPosition.z();
 
       for (int i = 0; i < 6; ++i) {
         transformLast[i] = transformAftMapped[i];
@@ -1762,6 +2834,9 @@ class MappingHandler {
     cornerCloudKeyFrames.push_back(thisCornerKeyFrame);
     surfCloudKeyFrames.push_back(thisSurfKeyFrame);
     outlierCloudKeyFrames.push_back(thisOutlierKeyFrame);
+    ++mapVersion;
+
+    if (loopClosureEnableFlag) queueLoopClosure(cloudKeyPoses3D->size() - 1);
   }
 
   void correctPoses() {
@@ -1772,12 +2847,10 @@ class MappingHandler {
 
       int numPoses = isamCurrentEstimate.size();
       for (int i = 0; i < numPoses; ++i) {
-        cloudKeyPoses3D->points[i].x =
-            isamCurrentEstimate.at<Pose3>(i).translation().y();
-        cloudKeyPoses3D->points[i].y =
-            isamCurrentEstimate.at<Pose3>(i).translation().z();
-        cloudKeyPoses3D->points[i].z =
-            isamCurrentEstimate.at<Pose3>(i).translation().x();
+        V3D position = localPosition(isamCurrentEstimate.at<Pose3>(i));
+        cloudKeyPoses3D->points[i].x = position.x();
+        cloudKeyPoses3D->points[i].y = position.y();
+        cloudKeyPoses3D->points[i].z = position.z();
 
         cloudKeyPoses6D->points[i].x = cloudKeyPoses3D->points[i].x;
         cloudKeyPoses6D->points[i].y = cloudKeyPoses3D->points[i].y;
@@ -1791,14 +2864,40 @@ class MappingHandler {
       }
 
       aLoopIsClosed = false;
+      ++mapVersion;
+    }
+  }
+
+  // Write keyframes and pose graph to SESSION_DIRECTORY for offline batch
+  // optimization, see batch_optimization_node
+  void saveSession() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (cloudKeyPoses6D->points.empty()) return;
+
+    // Sessions are saved in the global frame
+    session::KeyframeSession keyframeSession;
+    *keyframeSession.poses = *cloudKeyPoses6D;
+    for (PointTypePose& pose : keyframeSession.poses->points) {
+      pose.x = pose.x + mapOrigin.x();
+      pose.y = pose.y + mapOrigin.y();
+      pose.z = pose.z + mapOrigin.z();
     }
+    keyframeSession.cornerClouds = cornerCloudKeyFrames;
+    keyframeSession.surfClouds = surfCloudKeyFrames;
+    keyframeSession.outlierClouds = outlierCloudKeyFrames;
+    keyframeSession.graph = sessionGraph;
+    keyframeSession.estimate = isam->calculateEstimate();
+
+    if (session::saveSession(SESSION_DIRECTORY, keyframeSession))
+      ROS_INFO_STREAM("Saved " << cloudKeyPoses6D->points.size()
+                               << " keyframes to " << SESSION_DIRECTORY);
+    else
+      ROS_WARN_STREAM("Failed to save the session to " << SESSION_DIRECTORY);
   }
 
   void clearCloud() {
     laserCloudCornerFromMap->clear();
     laserCloudSurfFromMap->clear();
-    laserCloudCornerFromMapDS->clear();
-    laserCloudSurfFromMapDS->clear();
   }
 
   int lidarCounter = 0;
@@ -1818,10 +2917,23 @@ class MappingHandler {
 
       std::lock_guard<std::mutex> lock(mtx);
 
-      if (timeLaserOdometry - timeLastProcessing >= mappingProcessInterval) {
+      if (replaying ||
+          timeLaserOdometry - timeLastProcessing >= mappingProcessInterval) {
         TicToc ts_total;
+        trace::Tracer& tracer = trace::Tracer::instance();
+        ros::Time stamp = ros::Time().fromSec(timeLaserOdometry);
+        tracer.mark(stamp, "start");
 
         timeLastProcessing = timeLaserOdometry;
+        scanArena.reset();
+
+        if (relocalizationPending) {
+          relocalize();
+          tracer.flush(stamp);
+          return;
+        }
+
+        rebaseMapOrigin();
 
         transformAssociateToMap();
 
@@ -1836,19 +2948,33 @@ class MappingHandler {
         correctPoses();
 
         publishTF();
+        tracer.mark(stamp, "published");
 
         publishXYZTF();
 
         publishKeyPosesAndFrames();
 
+        publishSharedMap();
+
         clearCloud();
+        tracer.flush(stamp);
 
         double time_total = ts_total.toc();
+        static metrics::Histogram& mappingTime =
+            metrics::Registry::instance().histogram(
+                "lins_mapping_time_ms", "Time to process one scan in mapping");
+        static metrics::Gauge& keyFrames = metrics::Registry::instance().gauge(
+            "lins_keyframes", "Keyframes in the pose graph");
+        mappingTime.observe(time_total);
+        keyFrames.set(cloudKeyPoses3D->points.size());
+        static arena::UsageReporter arenaUsage("mapping");
+        arenaUsage.report(scanArena);
         if (VERBOSE) {
           duration_ =
               (duration_ * lidarCounter + time_total) / (lidarCounter + 1);
           lidarCounter++;
-          // std::cout << "Mapping: time: " << duration_ << std::endl;
+          ROS_INFO_STREAM("Mapping: average time per scan: " << duration_
+                                                             << " ms");
         }
       }
     }
@@ -1863,25 +2989,34 @@ int main(int argc, char** argv) {
   ROS_INFO("\033[1;32m---->\033[0m Map Optimization Started.");
 
   parameter::readParameters(pnh);
+  metrics::startExporter(
+      "lidar_mapping_node",
+      parameter::METRICS_PORT > 0 ? parameter::METRICS_PORT + 2 : 0);
+  trace::Tracer::instance().init(nh, "lidar_mapping_node");
+
+  parallel::Scheduler::instance().start(parameter::SCHEDULER_THREADS);
 
   MappingHandler mappingHandler(nh, pnh);
   ;
 
-  std::thread loopthread(&MappingHandler::loopClosureThread, &mappingHandler);
-  std::thread visualizeMapThread(&MappingHandler::visualizeGlobalMapThread,
-                                 &mappingHandler);
-
+  // Loop closures run as scheduler tasks, except in the deterministic mode,
+  // where requests are served from the main loop
   ros::Rate rate(200);
-  while (ros::ok()) {
+  if (!parameter::REPLAY_SCAN_LOG.empty())
+    mappingHandler.replay(parameter::REPLAY_SCAN_LOG);
+  while (parameter::REPLAY_SCAN_LOG.empty() && ros::ok()) {
     ros::spinOnce();
 
     mappingHandler.run();
+    if (parameter::DETERMINISTIC_MODE) mappingHandler.scheduleLoopClosure();
+    mappingHandler.scheduleGlobalMap();
 
     rate.sleep();
   }
 
-  loopthread.join();
-  visualizeMapThread.join();
+  mappingHandler.waitForBackgroundTasks();
+
+  if (!parameter::SESSION_DIRECTORY.empty()) mappingHandler.saveSession();
 
   return 0;
 }
@@ -19,6 +19,8 @@
 
 #include <parameters.h>
 #include <Estimator.h>
+#include <metrics.h>
+#include <scan_trace.h>
 
 int main(int argc, char** argv) {
   ros::init(argc, argv, "lins_fusion_node");
@@ -28,6 +30,8 @@ int main(int argc, char** argv) {
   ROS_INFO("\033[1;32m---->\033[0m LINS Fusion Started.");
 
   parameter::readParameters(pnh);
+  metrics::startExporter("lins_fusion_node", parameter::METRICS_PORT);
+  trace::Tracer::instance().init(nh, "lins_fusion_node");
 
   fusion::LinsFusion lins(nh, pnh);
   lins.run();
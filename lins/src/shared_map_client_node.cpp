@@ -0,0 +1,136 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// Example client of the map that lidar_mapping_node shares with shared_map
+// set. It follows /integrated_to_init, reads the map tiles around the vehicle
+// in place and logs how long the reads take and how many were overwritten
+// while in use. Any number of clients can run on the host of the mapping node.
+
+#include <nav_msgs/Odometry.h>
+#include <parameters.h>
+#include <shared_map.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+const double REPORT_INTERVAL = 10.0;
+
+class SharedMapClient {
+ public:
+  SharedMapClient(ros::NodeHandle& nh, ros::NodeHandle& pnh)
+      : havePose_(false), x_(0), z_(0), rejected_(0), lastReport_(0) {
+    pnh.param("radius", radius_, 40.0);
+    subOdometry_ = nh.subscribe<nav_msgs::Odometry>(
+        "/integrated_to_init", 5, &SharedMapClient::odometryHandler, this);
+    timer_ = nh.createWallTimer(ros::WallDuration(0.1),
+                                &SharedMapClient::query, this);
+  }
+
+ private:
+  void odometryHandler(const nav_msgs::Odometry::ConstPtr& msg) {
+    x_ = msg->pose.pose.position.x;
+    z_ = msg->pose.pose.position.z;
+    havePose_ = true;
+  }
+
+  // Count the map points within radius of the vehicle, as a stand-in for
+  // the work of a localisation client
+  void query(const ros::WallTimerEvent&) {
+    if (!reader_.isOpen() && !reader_.open(parameter::SHARED_MAP)) return;
+    if (!havePose_) return;
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    reader_.query(x_ - radius_, z_ - radius_, x_ + radius_, z_ + radius_,
+                  views_);
+    float sqRadius = radius_ * radius_;
+    int numPoints = 0;
+    bool valid = true;
+    for (const shared_map::TileView& view : views_) {
+      for (uint32_t i = 0; i < view.count; ++i) {
+        float dx = view.points[i].x - x_;
+        float dz = view.points[i].z - z_;
+        if (dx * dx + dz * dz < sqRadius) ++numPoints;
+      }
+      valid = reader_.validate(view) && valid;
+    }
+    double latency = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    if (!valid) {
+      ++rejected_;
+      return;
+    }
+    latencies_.push_back(latency);
+    numTiles_ = views_.size();
+    numPoints_ = numPoints;
+
+    double now = ros::WallTime::now().toSec();
+    if (now - lastReport_ >= REPORT_INTERVAL) {
+      report();
+      lastReport_ = now;
+    }
+  }
+
+  void report() {
+    std::sort(latencies_.begin(), latencies_.end());
+    ROS_INFO(
+        "%d tiles, %d points within %.0f m: p50 %.3f  p99 %.3f ms "
+        "(%zu reads, %d overwritten, map generation %lu)",
+        numTiles_, numPoints_, radius_, latencies_[latencies_.size() / 2],
+        latencies_[latencies_.size() * 99 / 100], latencies_.size(),
+        rejected_, static_cast<unsigned long>(reader_.generation()));
+    latencies_.clear();
+    rejected_ = 0;
+  }
+
+  ros::Subscriber subOdometry_;
+  ros::WallTimer timer_;
+  double radius_;
+  bool havePose_;
+  float x_;
+  float z_;
+
+  shared_map::Reader reader_;
+  std::vector<shared_map::TileView> views_;
+  std::vector<double> latencies_;
+  int numTiles_;
+  int numPoints_;
+  int rejected_;
+  double lastReport_;
+};
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "shared_map_client_node");
+  ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+
+  parameter::readParameters(pnh);
+  if (parameter::SHARED_MAP.empty()) {
+    ROS_ERROR("shared_map is not set, lidar_mapping_node shares no map");
+    return 1;
+  }
+
+  SharedMapClient client(nh, pnh);
+  ROS_INFO("\033[1;32m---->\033[0m Shared Map Client Started.");
+
+  ros::spin();
+  return 0;
+}
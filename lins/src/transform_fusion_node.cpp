@@ -30,6 +30,8 @@
 //   J. Zhang and S. Singh. LOAM: Lidar Odometry and Mapping in Real-time.
 //     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
 
+#include <scan_trace.h>
+
 #include "utility.h"
 
 class TransformFusion {
@@ -230,6 +232,9 @@ class TransformFusion {
     transformSum[4] = laserOdometry->pose.pose.position.y;
     transformSum[5] = laserOdometry->pose.pose.position.z;
 
+    trace::Tracer& tracer = trace::Tracer::instance();
+    tracer.mark(laserOdometry->header.stamp, "odometry_received");
+
     transformAssociateToMap();
 
     geoQuat = tf::createQuaternionMsgFromRollPitchYaw(
@@ -251,9 +256,14 @@ class TransformFusion {
     laserOdometryTrans2.setOrigin(tf::Vector3(
         transformMapped[3], transformMapped[4], transformMapped[5]));
     tfBroadcaster2.sendTransform(laserOdometryTrans2);
+    tracer.mark(laserOdometry->header.stamp, "odometry_published");
+    tracer.flush(laserOdometry->header.stamp);
   }
 
   void odomAftMappedHandler(const nav_msgs::Odometry::ConstPtr& odomAftMapped) {
+    trace::Tracer::instance().markAndFlush(odomAftMapped->header.stamp,
+                                           "mapping_received");
+
     double roll, pitch, yaw;
     geometry_msgs::Quaternion geoQuat = odomAftMapped->pose.pose.orientation;
     tf::Matrix3x3(tf::Quaternion(geoQuat.z, -geoQuat.x, -geoQuat.y, geoQuat.w))
@@ -279,6 +289,11 @@ class TransformFusion {
 
 int main(int argc, char** argv) {
   ros::init(argc, argv, "lego_loam");
+  ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+
+  parameter::readParameters(pnh);
+  trace::Tracer::instance().init(nh, "transform_fusion_node");
 
   TransformFusion TFusion;
 
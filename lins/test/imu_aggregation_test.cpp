@@ -0,0 +1,242 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// Increments of the IMU aggregator against those of an analytic coning and
+// sculling trajectory, and with samples that arrive late or twice.
+
+#include <gtest/gtest.h>
+#include <imu_aggregation.h>
+
+#include <vector>
+
+using namespace imu_aggregation;
+
+namespace {
+
+const double kRate = 1000.0;     // raw IMU rate
+const double kInterval = 0.01;   // aggregation interval
+const Eigen::Vector3d kGravity(0.0, 0.0, -9.81);
+
+// Coning at 10 Hz with a 0.05 rad half angle, on top of a slow yaw, while
+// the body vibrates at 30 Hz along a curved path
+class Trajectory {
+ public:
+  Eigen::Quaterniond attitude(double t) const {
+    const double w = 2.0 * M_PI * 10.0, cone = 0.05;
+    Eigen::Vector3d axis(std::cos(w * t), std::sin(w * t), 0.0);
+    return Eigen::Quaterniond(
+               Eigen::AngleAxisd(0.3 * t, Eigen::Vector3d::UnitZ())) *
+           Eigen::Quaterniond(Eigen::AngleAxisd(cone, axis));
+  }
+
+  Eigen::Vector3d position(double t) const {
+    const double w = 2.0 * M_PI * 30.0;
+    return Eigen::Vector3d(2.0 * t + 1e-4 * std::sin(w * t),
+                           0.5 * t * t + 1e-4 * std::cos(w * t),
+                           1e-4 * std::sin(w * t));
+  }
+
+  // Derivatives by central differences, exact to far below the tolerances
+  Eigen::Vector3d velocity(double t) const {
+    return (position(t + kH) - position(t - kH)) / (2.0 * kH);
+  }
+  Eigen::Vector3d acceleration(double t) const {
+    return (position(t + kH) - 2.0 * position(t) + position(t - kH)) /
+           (kH * kH);
+  }
+
+  Eigen::Vector3d gyr(double t) const {
+    Eigen::Quaterniond dq =
+        attitude(t - kH).conjugate() * attitude(t + kH);
+    return math_utils::Quat2axis(dq) / (2.0 * kH);
+  }
+  Eigen::Vector3d acc(double t) const {
+    return attitude(t).conjugate() * (acceleration(t) - kGravity);
+  }
+
+  // Increment over [t0, t1] in the body frame at t0
+  Increment increment(double t0, double t1) const {
+    const double dt = t1 - t0;
+    const Eigen::Quaterniond q0 = attitude(t0);
+    Increment inc;
+    inc.time = t1;
+    inc.dt = dt;
+    inc.dTheta = math_utils::Quat2axis(q0.conjugate() * attitude(t1));
+    inc.dVel = q0.conjugate() * (velocity(t1) - velocity(t0) - kGravity * dt);
+    inc.dPos = q0.conjugate() * (position(t1) - position(t0) -
+                                 velocity(t0) * dt - 0.5 * kGravity * dt * dt);
+    return inc;
+  }
+
+ private:
+  static constexpr double kH = 1e-5;
+};
+
+constexpr double Trajectory::kH;
+
+struct Sample {
+  double time;
+  Eigen::Vector3d acc, gyr;
+};
+
+std::vector<Sample> samples(const Trajectory& trajectory, double duration) {
+  std::vector<Sample> result;
+  for (int i = 0; i <= int(duration * kRate); ++i) {
+    double t = 0.1 + i / kRate;
+    result.push_back({t, trajectory.acc(t), trajectory.gyr(t)});
+  }
+  return result;
+}
+
+// Navigation state, propagated per raw sample or per increment
+struct State {
+  Eigen::Quaterniond q;
+  Eigen::Vector3d v, p;
+};
+
+// Per-sample propagation as the filter does without aggregation: mean rates
+// over each sample interval, trapezoidal velocity
+State propagateSamples(const std::vector<Sample>& input, const State& start) {
+  State s = start;
+  for (size_t i = 1; i < input.size(); ++i) {
+    const double dt = input[i].time - input[i - 1].time;
+    const Eigen::Quaterniond q =
+        (s.q * math_utils::axis2Quat(0.5 * (input[i - 1].gyr + input[i].gyr) *
+                                     dt))
+            .normalized();
+    const Eigen::Vector3d dv =
+        0.5 * (s.q * input[i - 1].acc + q * input[i].acc) * dt +
+        kGravity * dt;
+    s.p += (s.v + 0.5 * dv) * dt;
+    s.v += dv;
+    s.q = q;
+  }
+  return s;
+}
+
+State propagateIncrements(const std::vector<Increment>& increments,
+                          const State& start) {
+  State s = start;
+  for (const Increment& inc : increments) {
+    const double dt = inc.dt;
+    s.p += s.v * dt + s.q * inc.dPos + 0.5 * kGravity * dt * dt;
+    s.v += s.q * inc.dVel + kGravity * dt;
+    s.q = (s.q * math_utils::axis2Quat(inc.dTheta)).normalized();
+  }
+  return s;
+}
+
+std::vector<Increment> aggregate(const std::vector<Sample>& input) {
+  Aggregator aggregator;
+  aggregator.configure(kInterval);
+  std::vector<Increment> increments;
+  for (const Sample& s : input)
+    if (aggregator.add(s.time, s.acc, s.gyr))
+      increments.push_back(aggregator.increment());
+  return increments;
+}
+
+}  // namespace
+
+TEST(ImuAggregation, MatchesPerSamplePropagation) {
+  Trajectory trajectory;
+  std::vector<Sample> input = samples(trajectory, 1.0);
+  std::vector<Increment> increments = aggregate(input);
+  ASSERT_EQ(100u, increments.size());
+
+  const double t0 = input.front().time;
+  State start = {trajectory.attitude(t0), trajectory.velocity(t0),
+                 trajectory.position(t0)};
+  State direct = propagateSamples(input, start);
+  State aggregated = propagateIncrements(increments, start);
+  EXPECT_LT(direct.q.angularDistance(aggregated.q), 1e-12);
+  EXPECT_LT((direct.v - aggregated.v).norm(), 1e-10);
+  EXPECT_LT((direct.p - aggregated.p).norm(), 1e-10);
+}
+
+TEST(ImuAggregation, CompensatesConingAndSculling) {
+  Trajectory trajectory;
+  std::vector<Sample> input = samples(trajectory, 1.0);
+  std::vector<Increment> increments = aggregate(input);
+  ASSERT_EQ(100u, increments.size());
+
+  size_t first = 0;
+  for (const Increment& inc : increments) {
+    EXPECT_NEAR(kInterval, inc.dt, 1e-9);
+    // Velocity increment of the mean specific force over the interval, which
+    // leaves out the rotation of the body within it
+    Eigen::Vector3d accSum = Eigen::Vector3d::Zero();
+    size_t last = first;
+    for (; input[last].time < inc.time - 0.5 / kRate; ++last)
+      accSum += 0.5 * (input[last].acc + input[last + 1].acc) / kRate;
+
+    // What remains is the error of integrating rates sampled at 1 kHz, which
+    // per-sample propagation has as well and which falls with the square of
+    // the sample interval
+    Increment truth = trajectory.increment(input[first].time, inc.time);
+    const double velError = (inc.dVel - truth.dVel).norm();
+    EXPECT_LT((inc.dTheta - truth.dTheta).norm(), 2e-5) << "at " << inc.time;
+    EXPECT_LT(velError, 3e-4) << "at " << inc.time;
+    EXPECT_LT((inc.dPos - truth.dPos).norm(), 2e-6) << "at " << inc.time;
+    EXPECT_LT(5.0 * velError, (accSum - truth.dVel).norm())
+        << "at " << inc.time;
+    first = last;
+  }
+}
+
+TEST(ImuAggregation, IgnoresStaleSamples) {
+  Trajectory trajectory;
+  std::vector<Sample> input = samples(trajectory, 0.2);
+  std::vector<Increment> expected = aggregate(input);
+
+  // Every tenth sample arrives twice, and every seventh is followed by an
+  // older one that arrives late
+  std::vector<Sample> disordered;
+  for (size_t i = 0; i < input.size(); ++i) {
+    disordered.push_back(input[i]);
+    if (i % 10 == 5) disordered.push_back(input[i]);
+    if (i % 7 == 3 && i >= 2) {
+      Sample late = input[i - 2];
+      late.acc *= 3.0;
+      disordered.push_back(late);
+    }
+  }
+  std::vector<Increment> actual = aggregate(disordered);
+
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(expected[i].time, actual[i].time);
+    EXPECT_EQ(expected[i].dt, actual[i].dt);
+    EXPECT_EQ(expected[i].dTheta, actual[i].dTheta);
+    EXPECT_EQ(expected[i].dVel, actual[i].dVel);
+    EXPECT_EQ(expected[i].dPos, actual[i].dPos);
+  }
+}
+
+TEST(ImuAggregation, FirstSampleOnlyStarts) {
+  Aggregator aggregator;
+  aggregator.configure(kInterval);
+  EXPECT_TRUE(aggregator.enabled());
+  EXPECT_FALSE(aggregator.add(1.0, Eigen::Vector3d(0, 0, 9.81),
+                              Eigen::Vector3d::Zero()));
+  // An older sample neither starts over nor closes an increment
+  EXPECT_FALSE(aggregator.add(0.5, Eigen::Vector3d(0, 0, 9.81),
+                              Eigen::Vector3d::Zero()));
+  EXPECT_TRUE(aggregator.add(1.0 + kInterval, Eigen::Vector3d(0, 0, 9.81),
+                             Eigen::Vector3d::Zero()));
+  EXPECT_NEAR(kInterval, aggregator.increment().dt, 1e-12);
+}
@@ -0,0 +1,184 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// The batched SO(3) operations of math_utils.h against the scalar functions
+// they replace, for angles in the exact, Taylor and trigonometric branches.
+
+#include <gtest/gtest.h>
+#include <math_utils.h>
+
+#include <vector>
+
+using namespace math_utils;
+
+namespace {
+
+const double kTolerance = 1e-12;
+
+// The scalar functions treat rotations under 1e-10 as the identity, where the
+// batched ones keep them, so results may differ by the angle itself there
+double tolerance(const Eigen::Vector3d& phi) {
+  return phi.norm() < 1e-10 ? kTolerance + phi.norm() : kTolerance;
+}
+
+// Zero, under the 1e-10 cut-off, under SMALL_ANGLE and large up to near pi
+const std::vector<double> kSmallAngles = {0.0, 1e-12, 1e-11, 1e-6, 5e-3, 9e-3};
+const std::vector<double> kLargeAngles = {2e-2, 0.3, 1.0, 2.0, 3.0};
+
+// One rotation vector per angle, along directions that vary with the index
+Vectors3d rotationVectors(const std::vector<double>& angles) {
+  Vectors3d phi(angles.size(), 3);
+  for (size_t i = 0; i < angles.size(); ++i) {
+    Eigen::Vector3d axis(1.0 + i, -0.5 * i, 2.0 - i);
+    phi.row(i) = angles[i] * axis.normalized().transpose();
+  }
+  return phi;
+}
+
+std::vector<double> allAngles() {
+  std::vector<double> angles = kSmallAngles;
+  angles.insert(angles.end(), kLargeAngles.begin(), kLargeAngles.end());
+  return angles;
+}
+
+// Batches that take the Taylor-only path and the mixed path
+std::vector<Vectors3d> testBatches() {
+  return {rotationVectors(kSmallAngles), rotationVectors(kLargeAngles),
+          rotationVectors(allAngles())};
+}
+
+Eigen::Vector3d row(const Vectors3d& v, int i) { return v.row(i).transpose(); }
+
+// Scalar point undistortion of StateEstimator::transformToStart
+Eigen::Vector3d transformToStart(const Eigen::Quaterniond& q,
+                                 const Eigen::Vector3d& t, double s,
+                                 const Eigen::Vector3d& p) {
+  Eigen::Quaterniond r = axis2Quat(s * Quat2axis(q));
+  return r * p + s * t;
+}
+
+}  // namespace
+
+TEST(MathUtilsBatch, ExpMatchesAxis2Quat) {
+  for (const Vectors3d& phi : testBatches()) {
+    Quaternions q;
+    expBatch(phi, q);
+    ASSERT_EQ(phi.rows(), q.rows());
+    for (int i = 0; i < phi.rows(); ++i) {
+      const double tol = tolerance(row(phi, i));
+      Eigen::Quaterniond expected = axis2Quat(row(phi, i));
+      EXPECT_NEAR(expected.x(), q(i, 0), tol) << "row " << i;
+      EXPECT_NEAR(expected.y(), q(i, 1), tol) << "row " << i;
+      EXPECT_NEAR(expected.z(), q(i, 2), tol) << "row " << i;
+      EXPECT_NEAR(expected.w(), q(i, 3), tol) << "row " << i;
+    }
+  }
+}
+
+TEST(MathUtilsBatch, LogMatchesQuat2axis) {
+  for (const Vectors3d& phi : testBatches()) {
+    Quaternions q(phi.rows(), 4);
+    for (int i = 0; i < phi.rows(); ++i) {
+      Eigen::Quaterniond qi = axis2Quat(row(phi, i));
+      q.row(i) << qi.x(), qi.y(), qi.z(), qi.w();
+    }
+    Vectors3d log;
+    logBatch(q, log);
+    ASSERT_EQ(phi.rows(), log.rows());
+    for (int i = 0; i < phi.rows(); ++i) {
+      const double tol = tolerance(row(phi, i));
+      Eigen::Quaterniond qi(q(i, 3), q(i, 0), q(i, 1), q(i, 2));
+      EXPECT_LT((row(log, i) - Quat2axis(qi)).norm(), tol) << "row " << i;
+      EXPECT_LT((row(log, i) - row(phi, i)).norm(), tol) << "row " << i;
+    }
+  }
+}
+
+TEST(MathUtilsBatch, LeftJacobianInverseMatchesRinvleft) {
+  for (const Vectors3d& phi : testBatches()) {
+    Matrices3d J;
+    leftJacobianInverseBatch(phi, J);
+    ASSERT_EQ(phi.rows(), J.rows());
+    for (int i = 0; i < phi.rows(); ++i) {
+      Eigen::Matrix3d expected = Rinvleft(row(phi, i));
+      Eigen::Matrix3d actual = matrixAt(J, i);
+      EXPECT_LT((expected - actual).norm(), tolerance(row(phi, i)))
+          << "row " << i;
+    }
+  }
+}
+
+TEST(MathUtilsBatch, JacobiansInvertEachOther) {
+  for (const Vectors3d& phi : testBatches()) {
+    Matrices3d left, leftInverse, right, rightInverse;
+    leftJacobianBatch(phi, left);
+    leftJacobianInverseBatch(phi, leftInverse);
+    rightJacobianBatch(phi, right);
+    rightJacobianInverseBatch(phi, rightInverse);
+    for (int i = 0; i < phi.rows(); ++i) {
+      Eigen::Matrix3d l = matrixAt(left, i), r = matrixAt(right, i);
+      Eigen::Matrix3d li = matrixAt(leftInverse, i);
+      Eigen::Matrix3d ri = matrixAt(rightInverse, i);
+      EXPECT_LT((l * li - Eigen::Matrix3d::Identity()).norm(), kTolerance)
+          << "row " << i;
+      EXPECT_LT((r * ri - Eigen::Matrix3d::Identity()).norm(), kTolerance)
+          << "row " << i;
+      // Jr(phi) = Jl(phi)^T
+      EXPECT_LT((r - l.transpose()).norm(), kTolerance) << "row " << i;
+    }
+  }
+}
+
+TEST(MathUtilsBatch, InterpolateTransformMatchesTransformToStart) {
+  const Eigen::Vector3d t(0.4, -0.2, 0.05);
+  const int points = 64;
+  Vectors3d in(points, 3);
+  Eigen::ArrayXd s(points);
+  for (int i = 0; i < points; ++i) {
+    in.row(i) << 10.0 * std::sin(0.1 * i), -3.0 + 0.2 * i, std::cos(i);
+    s(i) = double(i) / (points - 1);
+  }
+  for (double angle : allAngles()) {
+    const Eigen::Vector3d phi =
+        angle * Eigen::Vector3d(0.3, -0.8, 0.5).normalized();
+    const Eigen::Quaterniond q = axis2Quat(phi);
+    Vectors3d out;
+    interpolateTransformBatch(Quat2axis(q), t, s, in, out);
+    ASSERT_EQ(points, out.rows());
+    for (int i = 0; i < points; ++i) {
+      Eigen::Vector3d expected = transformToStart(q, t, s(i), row(in, i));
+      EXPECT_LT((expected - row(out, i)).norm(), kTolerance)
+          << "angle " << angle << ", point " << i;
+    }
+  }
+}
+
+TEST(MathUtilsBatch, EmptyBatches) {
+  Vectors3d phi(0, 3), log, out;
+  Quaternions q;
+  Matrices3d J;
+  expBatch(phi, q);
+  logBatch(q, log);
+  leftJacobianInverseBatch(phi, J);
+  interpolateTransformBatch(Eigen::Vector3d(0.1, 0.2, 0.3),
+                            Eigen::Vector3d::Zero(), Eigen::ArrayXd(0), phi,
+                            out);
+  EXPECT_EQ(0, q.rows());
+  EXPECT_EQ(0, log.rows());
+  EXPECT_EQ(0, J.rows());
+  EXPECT_EQ(0, out.rows());
+}
@@ -0,0 +1,202 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// The task scheduler behind the parallel stages: tasks start in priority
+// order, background tasks leave a worker free, and parallel loops and
+// reductions give the serial results.
+
+#include <gtest/gtest.h>
+#include <parallel.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace parallel;
+
+namespace {
+
+const int kThreads = 4;
+
+Scheduler& scheduler() {
+  Scheduler& s = Scheduler::instance();
+  s.start(kThreads);
+  return s;
+}
+
+// Spin until done() holds, without helping the scheduler, or time out
+template <typename Done>
+bool waitUntil(Done done) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  return true;
+}
+
+// Tasks that hold a worker each until released
+class Blockers {
+ public:
+  explicit Blockers(Priority priority, const char* name)
+      : kind_(scheduler().taskKind(priority, name)), started_(0) {}
+
+  ~Blockers() {
+    for (std::unique_ptr<std::atomic<bool>>& release : releases_)
+      *release = true;
+    waitUntil([this] { return group_.done(); });
+  }
+
+  // Occupy n more workers and wait until they are held
+  bool hold(int n) {
+    int target = started_ + n;
+    for (int i = 0; i < n; ++i) {
+      releases_.emplace_back(new std::atomic<bool>(false));
+      std::atomic<bool>* release = releases_.back().get();
+      scheduler().submit(kind_, [this, release] {
+        ++started_;
+        while (!*release) std::this_thread::yield();
+      }, &group_);
+    }
+    return waitUntil([this, target] { return started_ >= target; });
+  }
+
+  int started() const { return started_; }
+  void release(int i) { *releases_[i] = true; }
+
+ private:
+  TaskKind& kind_;
+  std::atomic<int> started_;
+  std::vector<std::unique_ptr<std::atomic<bool>>> releases_;
+  TaskGroup group_;
+};
+
+}  // namespace
+
+TEST(Scheduler, StartsTasksInPriorityOrder) {
+  ASSERT_EQ(kThreads, scheduler().numThreads());
+  Blockers blockers(REALTIME, "test_blocker");
+  ASSERT_TRUE(blockers.hold(kThreads));
+
+  // Queued least urgent first while every worker is held
+  std::mutex mtx;
+  std::vector<Priority> order;
+  TaskGroup group;
+  for (int p = NUM_PRIORITIES - 1; p >= 0; --p) {
+    TaskKind& kind = scheduler().taskKind(Priority(p), "test_order");
+    for (int i = 0; i < 2; ++i)
+      scheduler().submit(kind, [&mtx, &order, p] {
+        std::lock_guard<std::mutex> lock(mtx);
+        order.push_back(Priority(p));
+      }, &group);
+  }
+
+  // A single free worker runs them one by one
+  blockers.release(0);
+  ASSERT_TRUE(waitUntil([&group] { return group.done(); }));
+  ASSERT_EQ(2u * NUM_PRIORITIES, order.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    EXPECT_EQ(Priority(i / 2), order[i]) << "task " << i;
+}
+
+TEST(Scheduler, BackgroundTasksLeaveAWorkerFree) {
+  scheduler();
+  std::atomic<int> running(0), maxRunning(0);
+  std::atomic<bool> release(false);
+  TaskGroup background;
+  for (int i = 0; i < 3 * kThreads; ++i) {
+    TaskKind& kind = scheduler().taskKind(
+        i % 2 ? LOOP_CLOSURE : VISUALIZATION, "test_background");
+    scheduler().submit(kind, [&] {
+      int now = ++running;
+      int max = maxRunning;
+      while (now > max && !maxRunning.compare_exchange_weak(max, now)) {
+      }
+      while (!release) std::this_thread::yield();
+      --running;
+    }, &background);
+  }
+  EXPECT_TRUE(waitUntil([&] { return running >= kThreads - 1; }));
+  // Give a worker that should stay free the chance to take one as well
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(kThreads - 1, running.load());
+
+  // The background tasks are all held, yet an urgent task still runs
+  TaskGroup urgent;
+  scheduler().submit(scheduler().taskKind(REALTIME, "test_urgent"), [] {},
+                     &urgent);
+  EXPECT_TRUE(waitUntil([&urgent] { return urgent.done(); }));
+
+  release = true;
+  ASSERT_TRUE(waitUntil([&background] { return background.done(); }));
+  EXPECT_EQ(kThreads - 1, maxRunning.load());
+}
+
+TEST(ParallelFor, MatchesSerialLoop) {
+  scheduler();
+  for (int n : {0, 1, 3, 4, 5, 1000, 4097}) {
+    for (int threads : {1, 2, kThreads, 16}) {
+      std::vector<int> serial(n), parallel(n, -1);
+      for (int i = 0; i < n; ++i) serial[i] = i * i % 97;
+      std::vector<std::atomic<int>> visits(n);
+      for (std::atomic<int>& v : visits) v = 0;
+      parallelFor(n, threads, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+          parallel[i] = i * i % 97;
+          ++visits[i];
+        }
+      });
+      EXPECT_EQ(serial, parallel) << "n " << n << ", threads " << threads;
+      for (int i = 0; i < n; ++i) ASSERT_EQ(1, visits[i]) << "index " << i;
+    }
+  }
+}
+
+TEST(ParallelFor, NestedLoopsComplete) {
+  scheduler();
+  std::atomic<long> sum(0);
+  parallelFor(8, kThreads, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i)
+      parallelFor(100, 3, [&](int b, int e) { sum += e - b; });
+  });
+  EXPECT_EQ(800, sum.load());
+}
+
+TEST(ParallelReduce, MatchesSerialSum) {
+  scheduler();
+  const int n = 10000;
+  std::vector<double> values(n);
+  for (int i = 0; i < n; ++i) values[i] = 1.0 / (1 + i);
+  auto accumulate = [&values](int begin, int end, double& partial) {
+    for (int i = begin; i < end; ++i) partial += values[i];
+  };
+
+  // Deterministic reductions add the same blocks in the same order
+  double serial = 0.0;
+  for (int b = 0; b < n; b += REDUCE_BLOCK_SIZE) {
+    double block = 0.0;
+    accumulate(b, std::min(n, b + REDUCE_BLOCK_SIZE), block);
+    serial += block;
+  }
+  for (int threads : {1, 2, kThreads, 16})
+    EXPECT_EQ(serial, parallelReduce(n, threads, true, 0.0, accumulate))
+        << "threads " << threads;
+  EXPECT_NEAR(serial, parallelReduce(n, kThreads, false, 0.0, accumulate),
+              1e-12);
+}
@@ -0,0 +1,149 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// Readers of the shared map segment must never accept a tile the writer
+// rewrote while it was being read.
+
+#include <gtest/gtest.h>
+#include <shared_map.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace shared_map;
+
+namespace {
+
+const uint32_t kSlots = 4;
+const uint32_t kCapacity = 2048;
+
+std::string segmentName(const char* test) {
+  return std::string("/lins_shared_map_test_") + test + "_" +
+         std::to_string(getpid());
+}
+
+// Round r fills tile ix with points whose coordinates all equal r, in a
+// number that depends on r, so that a torn read shows as mixed values or a
+// count that does not match them
+uint32_t roundCount(uint32_t round) { return 256 + (round % 7) * 256; }
+
+std::vector<SharedPoint> roundPoints(uint32_t round, int32_t ix) {
+  SharedPoint point;
+  point.x = point.y = point.z = float(round);
+  point.pointClass = ix;
+  return std::vector<SharedPoint>(roundCount(round), point);
+}
+
+bool consistent(const TileView& view) {
+  if (view.count == 0) return false;
+  const float round = view.points[0].x;
+  if (view.count != roundCount(uint32_t(round))) return false;
+  for (uint32_t i = 0; i < view.count; ++i) {
+    const SharedPoint& p = view.points[i];
+    if (p.x != round || p.y != round || p.z != round ||
+        p.pointClass != uint32_t(view.ix))
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+TEST(SharedMap, ReadsBackTiles) {
+  const std::string name = segmentName("roundtrip");
+  Writer writer;
+  ASSERT_TRUE(writer.open(name, kSlots, kCapacity));
+  Reader reader;
+  ASSERT_TRUE(reader.open(name));
+
+  std::vector<SharedPoint> points = roundPoints(3, 1);
+  writer.writeTile(1, 0, points.data(), points.size(), 0, 0);
+  writer.commit(42);
+  EXPECT_EQ(42u, reader.stampNs());
+
+  std::vector<TileView> views;
+  float tile = reader.tileSize();
+  ASSERT_EQ(1u, reader.query(tile, 0, 2 * tile - 1, tile - 1, views));
+  EXPECT_EQ(1, views[0].ix);
+  EXPECT_TRUE(consistent(views[0]));
+  EXPECT_TRUE(reader.validate(views[0]));
+  EXPECT_EQ(0u, reader.query(-2 * tile, 0, -tile, tile - 1, views));
+
+  // Two more updates reuse the buffer of the view
+  writer.writeTile(1, 0, points.data(), points.size(), 0, 0);
+  writer.writeTile(1, 0, points.data(), points.size(), 0, 0);
+  EXPECT_FALSE(reader.validate(views[0]));
+
+  // Empty tiles are not reported
+  writer.writeTile(1, 0, nullptr, 0, 0, 0);
+  EXPECT_EQ(0u, reader.query(tile, 0, 2 * tile - 1, tile - 1, views));
+  shm_unlink(name.c_str());
+}
+
+TEST(SharedMap, ValidatedViewsAreNeverTorn) {
+  const std::string name = segmentName("stress");
+  Writer writer;
+  ASSERT_TRUE(writer.open(name, kSlots, kCapacity));
+  const int numTiles = 2;
+  for (int32_t ix = 0; ix < numTiles; ++ix) {
+    std::vector<SharedPoint> points = roundPoints(0, ix);
+    writer.writeTile(ix, 0, points.data(), points.size(), 0, 0);
+  }
+  writer.commit(0);
+
+  std::atomic<bool> done(false);
+  std::atomic<long> validated(0), rejected(0), torn(0);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 2; ++r) {
+    readers.emplace_back([&]() {
+      Reader reader;
+      if (!reader.open(name)) return;
+      std::vector<TileView> views;
+      const float tile = reader.tileSize();
+      while (!done.load()) {
+        reader.query(0, 0, numTiles * tile - 1, tile - 1, views);
+        for (const TileView& view : views) {
+          // Read the whole tile before asking whether it was rewritten
+          const bool ok = consistent(view);
+          if (reader.validate(view)) {
+            ++validated;
+            if (!ok) ++torn;
+          } else {
+            ++rejected;
+          }
+        }
+      }
+    });
+  }
+
+  for (uint32_t round = 1; round <= 20000; ++round) {
+    for (int32_t ix = 0; ix < numTiles; ++ix) {
+      std::vector<SharedPoint> points = roundPoints(round, ix);
+      writer.writeTile(ix, 0, points.data(), points.size(), 0, 0);
+    }
+    writer.commit(round);
+  }
+  done = true;
+  for (std::thread& reader : readers) reader.join();
+  shm_unlink(name.c_str());
+
+  EXPECT_GT(validated.load(), 0);
+  EXPECT_EQ(0, torn.load()) << validated.load() << " views validated, "
+                            << rejected.load() << " rejected";
+}
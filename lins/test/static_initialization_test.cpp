@@ -0,0 +1,113 @@
+// This file is part of LINS.
+//
+// Copyright (C) 2020 Chao Qin <cscharlesqin@gmail.com>,
+// Robotics and Multiperception Lab (RAM-LAB <https://ram-lab.com>),
+// The Hong Kong University of Science and Technology
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+
+// Initialization from a static IMU window: a stationary IMU that starts with
+// some roll and pitch must come out at rest.
+
+#include <gtest/gtest.h>
+#include <static_initialization.h>
+
+#include <random>
+
+using namespace static_initialization;
+
+namespace {
+
+const double kGravity = 9.81;
+const double kRate = 200.0;
+
+// Noisy specific force of an IMU at rest with the given roll and pitch
+class StationaryImu {
+ public:
+  StationaryImu(double roll, double pitch, const Eigen::Vector3d& ba)
+      : ba_(ba), noise_(0.0, 0.02), rng_(7) {
+    Eigen::Matrix3d attitude =
+        (Eigen::AngleAxisd(pitch, Eigen::Vector3d::UnitY()) *
+         Eigen::AngleAxisd(roll, Eigen::Vector3d::UnitX()))
+            .toRotationMatrix();
+    specificForce_ = attitude.transpose() * Eigen::Vector3d(0, 0, kGravity);
+  }
+
+  Eigen::Vector3d sample() {
+    return specificForce_ + ba_ +
+           Eigen::Vector3d(noise_(rng_), noise_(rng_), noise_(rng_));
+  }
+
+ private:
+  Eigen::Vector3d specificForce_, ba_;
+  std::normal_distribution<double> noise_;
+  std::mt19937 rng_;
+};
+
+// Bias and mean specific force as Estimator estimates them from a window
+void staticWindow(StationaryImu& imu, int samples, Eigen::Vector3d& accMean,
+                  Eigen::Vector3d& ba) {
+  accMean.setZero();
+  for (int i = 0; i < samples; ++i) accMean += imu.sample();
+  accMean /= samples;
+  ba = accMean - accMean.normalized() * kGravity;
+}
+
+// Bias-corrected preintegration over dt; the IMU does not rotate
+void preintegrate(StationaryImu& imu, const Eigen::Vector3d& ba, double dt,
+                  Eigen::Vector3d& deltaP, Eigen::Vector3d& deltaV) {
+  deltaP.setZero();
+  deltaV.setZero();
+  const double step = 1.0 / kRate;
+  Eigen::Vector3d last = imu.sample() - ba;
+  for (double t = 0.0; t < dt - 0.5 * step; t += step) {
+    Eigen::Vector3d acc = imu.sample() - ba;
+    Eigen::Vector3d dv = 0.5 * (last + acc) * step;
+    deltaP += (deltaV + 0.5 * dv) * step;
+    deltaV += dv;
+    last = acc;
+  }
+}
+
+}  // namespace
+
+TEST(StaticInitialization, TiltedStartIsAtRest) {
+  const double dt = 0.1;
+  for (double tilt : {0.0, 0.05, 0.2, 0.5}) {
+    StationaryImu imu(tilt, -0.5 * tilt, Eigen::Vector3d(0.05, -0.03, 0.1));
+    Eigen::Vector3d accMean, ba, deltaP, deltaV, p, v;
+    staticWindow(imu, 400, accMean, ba);
+    preintegrate(imu, ba, dt, deltaP, deltaV);
+
+    integrateGravity(bodyGravity(accMean, ba), dt, deltaP, deltaV, p, v);
+    EXPECT_LT(v.norm(), 5e-3) << "tilt " << tilt;
+    EXPECT_LT(p.norm(), 5e-4) << "tilt " << tilt;
+
+    // Gravity of the untilted navigation frame leaves a fake velocity of
+    // g * sin(tilt) * dt
+    Eigen::Vector3d pUntilted, vUntilted;
+    integrateGravity(Eigen::Vector3d(0, 0, -kGravity), dt, deltaP, deltaV,
+                     pUntilted, vUntilted);
+    if (tilt >= 0.2) {
+      EXPECT_GT(vUntilted.norm(), 0.1) << "tilt " << tilt;
+    }
+  }
+}
+
+TEST(StaticInitialization, BodyGravityHasMagnitudeG) {
+  StationaryImu imu(0.3, 0.1, Eigen::Vector3d(0.2, 0.1, -0.1));
+  Eigen::Vector3d accMean, ba;
+  staticWindow(imu, 400, accMean, ba);
+  EXPECT_NEAR(kGravity, bodyGravity(accMean, ba).norm(), 1e-9);
+  // Points down, against the specific force
+  EXPECT_LT(bodyGravity(accMean, ba).dot(accMean), 0.0);
+}